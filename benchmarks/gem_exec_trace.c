@@ -25,6 +25,8 @@
  *
  */
 
+#include "config.h"
+
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -33,15 +35,21 @@
 #include <fcntl.h>
 #include <inttypes.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
 #include <time.h>
 #include <assert.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
 
 #include "drm.h"
 #include "drmtest.h"
 #include "i915/gem_create.h"
+#include "igt_aux.h"
 #include "igt_stats.h"
 #include "intel_io.h"
 #include "ioctl_wrappers.h"
@@ -92,13 +100,44 @@ struct trace_wait {
 	uint32_t handle;
 } __attribute__((packed));
 
+/* Version 2 follows exec and wait records with their timestamps. */
+struct trace_exec_time {
+	uint64_t time;
+} __attribute__((packed));
+
+struct trace_wait_time {
+	uint64_t start, end;
+} __attribute__((packed));
+
+/*
+ * Version 3 stores the records in chunks, and follows the exec timestamp
+ * with the index of the record exporting its in-fence, plus one.
+ */
+struct trace_chunk {
+	uint32_t size;
+	uint32_t stored; /* less than size if LZ4 compressed */
+	uint64_t time;
+} __attribute__((packed));
+
+struct trace_exec_fence {
+	uint32_t in;
+} __attribute__((packed));
+
+#define TRACE_FENCE_FLAGS (I915_EXEC_FENCE_IN | I915_EXEC_FENCE_OUT | \
+			   I915_EXEC_FENCE_ARRAY | I915_EXEC_FENCE_SUBMIT)
+
+static uint32_t hars_petruska_f54_1_random_r(uint32_t *state)
+{
+#define rol(x,k) ((x << k) | (x >> (32-k)))
+	return *state = (*state ^ rol (*state, 5) ^ rol (*state, 24)) + 0x37798849;
+#undef rol
+}
+
 static uint32_t hars_petruska_f54_1_random(void)
 {
 	static uint32_t state = 0x12345678;
 
-#define rol(x,k) ((x << k) | (x >> (32-k)))
-	return state = (state ^ rol (state, 5) ^ rol (state, 24)) + 0x37798849;
-#undef rol
+	return hars_petruska_f54_1_random_r(&state);
 }
 
 static double elapsed(const struct timespec *start, const struct timespec *end)
@@ -113,52 +152,145 @@ static uint32_t __gem_context_create_local(int fd)
 	return arg.ctx_id;
 }
 
-static double replay(const char *filename, long nop, long range)
+static uint8_t *unchunk_trace(const char *filename, uint8_t *ptr,
+			      uint8_t **end)
+{
+	const struct trace_chunk *c;
+	uint8_t *buf, *dst;
+	size_t size = 0;
+
+	/* A truncated final chunk is dropped, as from a killed process. */
+	for (c = (void *)ptr;
+	     (uint8_t *)(c + 1) <= *end &&
+	     (uint8_t *)(c + 1) + c->stored <= *end;
+	     c = (void *)((uint8_t *)(c + 1) + c->stored))
+		size += c->size;
+
+	buf = malloc(size ?: 1);
+	if (!buf)
+		return NULL;
+
+	for (dst = buf, c = (void *)ptr;
+	     dst < buf + size;
+	     c = (void *)((uint8_t *)(c + 1) + c->stored)) {
+		if (c->stored == c->size) {
+			memcpy(dst, c + 1, c->size);
+		} else {
+#ifdef HAVE_LZ4
+			if (LZ4_decompress_safe((const char *)(c + 1),
+						(char *)dst,
+						c->stored, c->size) != c->size) {
+				fprintf(stderr, "%s: corrupt chunk\n", filename);
+				free(buf);
+				return NULL;
+			}
+#else
+			fprintf(stderr, "%s: compressed trace, LZ4 support required\n",
+				filename);
+			free(buf);
+			return NULL;
+#endif
+		}
+		dst += c->size;
+	}
+
+	*end = buf + size;
+	return buf;
+}
+
+struct trace_map {
+	void *map;
+	size_t size;
+	uint8_t *buf; /* records of a chunked trace */
+};
+
+static uint8_t *map_trace(const char *filename, struct trace_map *map,
+			  uint8_t **end, uint32_t *version)
 {
-	struct timespec t_start, t_end;
-	struct drm_i915_gem_execbuffer2 eb = {};
 	const struct trace_version {
 		uint32_t magic;
 		uint32_t version;
 	} *tv;
-	const uint32_t bbe = 0xa << 23;
-	struct drm_i915_gem_exec_object2 *exec_objects = NULL;
-	uint32_t *bo, *ctx;
-	int num_bo, num_ctx;
-	int max_objects = 0;
 	struct stat st;
-	uint8_t *ptr, *end;
+	uint8_t *ptr;
 	int fd;
 
 	fd = open(filename, O_RDONLY);
 	if (fd < 0)
-		return -1;
+		return NULL;
 
 	if (fstat(fd, &st) < 0) {
 		close(fd);
-		return -1;
+		return NULL;
 	}
 
 	ptr = mmap(0, st.st_size, PROT_WRITE, MAP_PRIVATE, fd, 0);
 	close(fd);
 
 	if (ptr == MAP_FAILED)
-		return -1;
+		return NULL;
 
 	madvise(ptr, st.st_size, MADV_SEQUENTIAL);
-	end = ptr + st.st_size;
+	*end = ptr + st.st_size;
+	map->map = ptr;
+	map->size = st.st_size;
+	map->buf = NULL;
 
 	tv = (struct trace_version *)ptr;
 	if (tv->magic != 0xdeadbeef) {
 		fprintf(stderr, "%s: invalid magic\n", filename);
-		return -1;
+		goto err;
 	}
-	if (tv->version != 1) {
+	if (tv->version < 1 || tv->version > 3) {
 		fprintf(stderr, "%s: unhandled version %d\n",
 			filename, tv->version);
-		return -1;
+		goto err;
 	}
+	*version = tv->version;
+
 	ptr = (void *)(tv + 1);
+	if (tv->version >= 3) {
+		ptr = map->buf = unchunk_trace(filename, ptr, end);
+		if (!ptr)
+			goto err;
+	}
+
+	if (ptr == *end) {
+		fprintf(stderr, "%s: empty trace\n", filename);
+		goto err;
+	}
+
+	return ptr;
+
+err:
+	free(map->buf);
+	munmap(map->map, map->size);
+	return NULL;
+}
+
+static void unmap_trace(struct trace_map *map)
+{
+	free(map->buf);
+	munmap(map->map, map->size);
+}
+
+static double replay(const char *filename, long nop, long range)
+{
+	struct timespec t_start, t_end;
+	struct drm_i915_gem_execbuffer2 eb = {};
+	const uint32_t bbe = 0xa << 23;
+	struct drm_i915_gem_exec_object2 *exec_objects = NULL;
+	uint32_t *bo, *ctx;
+	int num_bo, num_ctx;
+	int max_objects = 0;
+	struct trace_map map;
+	uint32_t version;
+	uint8_t *ptr, *end;
+	int fd;
+
+	ptr = map_trace(filename, &map, &end, &version);
+	if (!ptr)
+		return -1;
 
 	ctx = calloc(1024, sizeof(*ctx));
 	num_ctx = 1024;
@@ -234,9 +366,14 @@ static double replay(const char *filename, long nop, long range)
 		{
 			struct trace_exec *t = (void *)ptr;
 			ptr = (void *)(t + 1);
+			if (version >= 2)
+				ptr += sizeof(struct trace_exec_time);
+			if (version >= 3)
+				ptr += sizeof(struct trace_exec_fence);
 
+			/* Fences cannot be replayed, only their execbufs. */
 			eb.buffer_count = t->object_count;
-			eb.flags = t->flags;
+			eb.flags = t->flags & ~TRACE_FENCE_FLAGS;
 			eb.rsvd1 = ctx[t->context];
 
 			if (eb.buffer_count >= max_objects) {
@@ -290,6 +427,8 @@ static double replay(const char *filename, long nop, long range)
 		{
 			struct trace_wait *t = (void *)ptr;
 			ptr = (void *)(t + 1);
+			if (version >= 2)
+				ptr += sizeof(struct trace_wait_time);
 
 			assert(t->handle && t->handle < num_bo && bo[t->handle]);
 			gem_wait(fd, bo[t->handle], NULL);
@@ -297,14 +436,1034 @@ static double replay(const char *filename, long nop, long range)
 		}
 
 	default:
-		fprintf(stderr, "Unknown cmd: %x\n", *ptr);
+		fprintf(stderr, "Unknown cmd: %x\n", ptr[-1]);
+		unmap_trace(&map);
 		return -1;
 	} while (ptr < end);
 	clock_gettime(CLOCK_MONOTONIC, &t_end);
 
+	unmap_trace(&map);
 	return elapsed(&t_start, &t_end);
 }
 
+/*
+ * Timed and parallel replay.
+ *
+ * The trace is first split into clients, one per recorded context with -p,
+ * and each client is replayed by its own thread on its own context. Objects
+ * are created up front, one for every recorded handle, so that the clients
+ * need not agree on their lifetimes. With -t every execbuf is submitted at
+ * its recorded time, scaled by the -s speed factor. With -f the replay runs
+ * against a fake device, on which every batch takes the -d delay.
+ */
+
+struct replay_opts {
+	bool timed;
+	bool parallel;
+	bool fake;
+	double speed;
+	long nop, range;
+	int delay;
+};
+
+struct replay_device {
+	int fd; /* -1 for the fake device */
+
+	pthread_mutex_t mutex;
+	uint32_t next_handle;
+	uint64_t *busy; /* per handle, until the last batch using it ends */
+	unsigned int max_busy;
+	uint64_t engine[I915_EXEC_RING_MASK + 1];
+	uint64_t batch_ns;
+};
+
+struct replay_event {
+	uint64_t time;
+	uint8_t *ptr; /* exec or wait record, after the command */
+	bool wait;
+};
+
+struct replay_client {
+	struct replay *replay;
+	uint32_t context; /* as recorded */
+	struct replay_event *events;
+	unsigned int nr_events, max_events;
+	uint32_t seed;
+	igt_stats_t latency; /* ns spent submitting */
+	igt_stats_t lateness; /* ns submitted after the scaled recorded time */
+	pthread_t thread;
+};
+
+struct replay {
+	const struct replay_opts *opts;
+	struct replay_device dev;
+	uint32_t version;
+	uint64_t *size; /* largest object of each recorded handle */
+	int *handle_client; /* last client using each handle */
+	uint32_t *bo;
+	unsigned int num_bo;
+	int *ctx_client;
+	uint32_t *ctx;
+	unsigned int num_ctx;
+	struct replay_client *clients;
+	unsigned int nr_clients;
+	long range; /* of batch start offsets into the nop batch */
+	uint64_t trace_start, start;
+};
+
+static uint64_t replay_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void replay_sleep_until(uint64_t ns)
+{
+	struct timespec ts = {
+		.tv_sec = ns / NSEC_PER_SEC,
+		.tv_nsec = ns % NSEC_PER_SEC,
+	};
+
+	if (ns <= replay_now())
+		return;
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL))
+		;
+}
+
+static uint32_t device_create(struct replay_device *dev, uint64_t size)
+{
+	uint32_t handle;
+
+	if (dev->fd >= 0)
+		return gem_create(dev->fd, size);
+
+	pthread_mutex_lock(&dev->mutex);
+	handle = ++dev->next_handle;
+	if (handle >= dev->max_busy) {
+		unsigned int n = ALIGN(handle + 1, 4096);
+
+		dev->busy = realloc(dev->busy, n * sizeof(*dev->busy));
+		igt_assert(dev->busy);
+		memset(dev->busy + dev->max_busy, 0,
+		       (n - dev->max_busy) * sizeof(*dev->busy));
+		dev->max_busy = n;
+	}
+	pthread_mutex_unlock(&dev->mutex);
+
+	return handle;
+}
+
+static uint32_t device_context_create(struct replay_device *dev)
+{
+	if (dev->fd >= 0)
+		return __gem_context_create_local(dev->fd);
+
+	return __atomic_add_fetch(&dev->next_handle, 1, __ATOMIC_RELAXED);
+}
+
+static void device_execbuf(struct replay_device *dev,
+			   struct drm_i915_gem_execbuffer2 *eb)
+{
+	struct drm_i915_gem_exec_object2 *obj =
+		from_user_pointer(eb->buffers_ptr);
+	unsigned int ring = eb->flags & I915_EXEC_RING_MASK;
+	uint64_t end;
+
+	if (dev->fd >= 0) {
+		gem_execbuf(dev->fd, eb);
+		return;
+	}
+
+	/* Each ring executes its batches back to back. */
+	pthread_mutex_lock(&dev->mutex);
+	end = max(replay_now(), dev->engine[ring]) + dev->batch_ns;
+	dev->engine[ring] = end;
+	for (unsigned int i = 0; i < eb->buffer_count; i++)
+		dev->busy[obj[i].handle] = end;
+	pthread_mutex_unlock(&dev->mutex);
+}
+
+static void device_wait(struct replay_device *dev, uint32_t handle)
+{
+	uint64_t busy;
+
+	if (dev->fd >= 0) {
+		gem_wait(dev->fd, handle, NULL);
+		return;
+	}
+
+	pthread_mutex_lock(&dev->mutex);
+	busy = dev->busy[handle];
+	pthread_mutex_unlock(&dev->mutex);
+
+	replay_sleep_until(busy);
+}
+
+static void replay_grow(void **ptr, unsigned int *count, unsigned int min,
+			size_t elem, int fill)
+{
+	unsigned int n;
+
+	if (min < *count)
+		return;
+
+	n = ALIGN(min + 1, 4096);
+	*ptr = realloc(*ptr, n * elem);
+	igt_assert(*ptr);
+	memset((char *)*ptr + *count * elem, fill, (n - *count) * elem);
+	*count = n;
+}
+
+static void replay_handle(struct replay *r, uint32_t handle, int client)
+{
+	unsigned int num = r->num_bo;
+
+	replay_grow((void **)&r->size, &num, handle, sizeof(*r->size), 0);
+	num = r->num_bo;
+	replay_grow((void **)&r->handle_client, &num, handle,
+		    sizeof(*r->handle_client), -1);
+	r->num_bo = num;
+
+	if (!r->size[handle])
+		r->size[handle] = 4096;
+	if (client >= 0)
+		r->handle_client[handle] = client;
+}
+
+static int replay_client_for(struct replay *r, uint32_t context)
+{
+	struct replay_client *c;
+	unsigned int num = r->num_ctx;
+
+	replay_grow((void **)&r->ctx_client, &num, context,
+		    sizeof(*r->ctx_client), -1);
+	num = r->num_ctx;
+	replay_grow((void **)&r->ctx, &num, context, sizeof(*r->ctx), 0);
+	r->num_ctx = num;
+
+	if (r->ctx_client[context] >= 0)
+		return r->ctx_client[context];
+
+	if (!r->opts->parallel && r->nr_clients)
+		return r->ctx_client[context] = 0;
+
+	r->clients = realloc(r->clients,
+			     (r->nr_clients + 1) * sizeof(*r->clients));
+	igt_assert(r->clients);
+	c = memset(&r->clients[r->nr_clients], 0, sizeof(*c));
+	c->replay = r;
+	c->context = context;
+	c->seed = 0x12345678 + r->nr_clients;
+
+	return r->ctx_client[context] = r->nr_clients++;
+}
+
+static void replay_add_event(struct replay_client *c, uint64_t time,
+			     uint8_t *ptr, bool wait)
+{
+	if (c->nr_events == c->max_events) {
+		c->max_events = c->max_events ? 2 * c->max_events : 1024;
+		c->events = realloc(c->events,
+				    c->max_events * sizeof(*c->events));
+		igt_assert(c->events);
+	}
+
+	c->events[c->nr_events++] = (struct replay_event){ time, ptr, wait };
+}
+
+/* Splits the trace into clients and collects the objects they use. */
+static int replay_prepare(struct replay *r, uint8_t *ptr, uint8_t *end)
+{
+	bool first = true;
+
+	do switch (*ptr++) {
+	case ADD_BO:
+		{
+			struct trace_add_bo *t = (void *)ptr;
+			ptr = (void *)(t + 1);
+
+			replay_handle(r, t->handle, -1);
+			r->size[t->handle] = max(r->size[t->handle], t->size);
+			break;
+		}
+	case DEL_BO:
+		ptr += sizeof(struct trace_del_bo);
+		break;
+	case ADD_CTX:
+		ptr += sizeof(struct trace_add_ctx);
+		break;
+	case DEL_CTX:
+		ptr += sizeof(struct trace_del_ctx);
+		break;
+	case EXEC:
+		{
+			struct trace_exec *t = (void *)ptr;
+			int client = replay_client_for(r, t->context);
+			uint64_t time = 0;
+
+			ptr = (void *)(t + 1);
+			if (r->version >= 2) {
+				time = ((struct trace_exec_time *)ptr)->time;
+				ptr += sizeof(struct trace_exec_time);
+			}
+			if (r->version >= 3)
+				ptr += sizeof(struct trace_exec_fence);
+
+			if (first) {
+				r->trace_start = time;
+				first = false;
+			}
+			replay_add_event(&r->clients[client], time,
+					 (uint8_t *)t, false);
+
+			for (uint32_t i = 0; i < t->object_count; i++) {
+				struct trace_exec_object *to = (void *)ptr;
+				struct drm_i915_gem_relocation_entry *relocs =
+					(void *)(to + 1);
+
+				replay_handle(r, to->handle, client);
+				if (!(t->flags & I915_EXEC_HANDLE_LUT)) {
+					for (uint32_t j = 0; j < to->relocation_count; j++)
+						replay_handle(r, relocs[j].target_handle, -1);
+				}
+
+				ptr = (void *)(relocs + to->relocation_count);
+			}
+			break;
+		}
+	case WAIT:
+		{
+			struct trace_wait *t = (void *)ptr;
+			uint64_t time = 0;
+			int client;
+
+			ptr = (void *)(t + 1);
+			if (r->version >= 2) {
+				time = ((struct trace_wait_time *)ptr)->start;
+				ptr += sizeof(struct trace_wait_time);
+			}
+
+			/* Waits go to the client which last used the object. */
+			replay_handle(r, t->handle, -1);
+			client = r->handle_client[t->handle];
+			if (client < 0)
+				client = replay_client_for(r, 0);
+
+			replay_add_event(&r->clients[client], time,
+					 (uint8_t *)t, true);
+			break;
+		}
+	default:
+		fprintf(stderr, "Unknown cmd: %x\n", ptr[-1]);
+		return -1;
+	} while (ptr < end);
+
+	return 0;
+}
+
+static void *replay_client(void *data)
+{
+	struct replay_client *c = data;
+	struct replay *r = c->replay;
+	const struct replay_opts *opts = r->opts;
+	struct drm_i915_gem_exec_object2 *exec_objects = NULL;
+	struct drm_i915_gem_execbuffer2 eb = {};
+	unsigned int max_objects = 0;
+
+	for (unsigned int n = 0; n < c->nr_events; n++) {
+		struct replay_event *ev = &c->events[n];
+		struct trace_exec *t = (void *)ev->ptr;
+		uint64_t scheduled = 0, submit;
+		uint8_t *ptr;
+
+		if (opts->timed) {
+			scheduled = r->start +
+				(ev->time - r->trace_start) / opts->speed;
+			replay_sleep_until(scheduled);
+		}
+
+		if (ev->wait) {
+			struct trace_wait *w = (void *)ev->ptr;
+
+			device_wait(&r->dev, r->bo[w->handle]);
+			continue;
+		}
+
+		ptr = (void *)(t + 1);
+		if (r->version >= 2)
+			ptr += sizeof(struct trace_exec_time);
+		if (r->version >= 3)
+			ptr += sizeof(struct trace_exec_fence);
+
+		eb.buffer_count = t->object_count;
+		eb.flags = t->flags & ~TRACE_FENCE_FLAGS;
+		eb.rsvd1 = r->ctx[t->context];
+
+		if (eb.buffer_count >= max_objects) {
+			free(exec_objects);
+
+			max_objects = ALIGN(eb.buffer_count + 1, 4096);
+
+			exec_objects = malloc(max_objects*sizeof(*exec_objects));
+			igt_assert(exec_objects);
+			eb.buffers_ptr = to_user_pointer(exec_objects);
+		}
+
+		for (uint32_t i = 0; i < eb.buffer_count; i++) {
+			struct trace_exec_object *to = (void *)ptr;
+			struct drm_i915_gem_relocation_entry *relocs =
+				(void *)(to + 1);
+
+			exec_objects[i] = (struct drm_i915_gem_exec_object2){
+				.handle = r->bo[to->handle],
+				.relocation_count = to->relocation_count,
+				.relocs_ptr = to_user_pointer(relocs),
+				.alignment = to->alignment,
+				.offset = to->offset,
+				.flags = to->flags,
+				.rsvd1 = to->rsvd1,
+				.rsvd2 = to->rsvd2,
+			};
+
+			/* Each record is only ever submitted once. */
+			if (!(eb.flags & I915_EXEC_HANDLE_LUT)) {
+				for (uint32_t j = 0; j < to->relocation_count; j++)
+					relocs[j].target_handle =
+						r->bo[relocs[j].target_handle];
+			}
+
+			ptr = (void *)(relocs + to->relocation_count);
+		}
+
+		memset(&exec_objects[eb.buffer_count], 0, sizeof(*exec_objects));
+		exec_objects[eb.buffer_count++].handle = r->bo[0];
+
+		if (opts->nop > 0) {
+			eb.batch_start_offset = hars_petruska_f54_1_random_r(&c->seed);
+			eb.batch_start_offset =
+				((uint64_t)eb.batch_start_offset * r->range) >> 32;
+			eb.batch_start_offset = ALIGN(eb.batch_start_offset, 64);
+		}
+
+		submit = replay_now();
+		device_execbuf(&r->dev, &eb);
+		igt_stats_push(&c->latency, replay_now() - submit);
+		if (opts->timed)
+			igt_stats_push(&c->lateness,
+				       submit > scheduled ? submit - scheduled : 0);
+	}
+
+	free(exec_objects);
+	return NULL;
+}
+
+static void replay_report(const char *filename, struct replay_client *c)
+{
+	double q1, median, q3;
+
+	printf("%s: client %u (context %u): %u execbufs",
+	       filename, (unsigned int)(c - c->replay->clients),
+	       c->context, c->latency.n_values);
+
+	if (c->latency.n_values) {
+		igt_stats_get_quartiles(&c->latency, &q1, &median, &q3);
+		printf(", submit %.1f/%.1f/%.1f/%.1f/%.1fus",
+		       igt_stats_get_min(&c->latency) / 1e3,
+		       q1 / 1e3, median / 1e3, q3 / 1e3,
+		       igt_stats_get_max(&c->latency) / 1e3);
+	}
+
+	if (c->lateness.n_values) {
+		igt_stats_get_quartiles(&c->lateness, &q1, &median, &q3);
+		printf(", late %.1f/%.1f/%.1fus",
+		       median / 1e3, q3 / 1e3,
+		       igt_stats_get_max(&c->lateness) / 1e3);
+	}
+
+	printf("\n");
+}
+
+static void replay_fini(struct replay *r)
+{
+	for (unsigned int i = 0; i < r->nr_clients; i++) {
+		free(r->clients[i].events);
+		igt_stats_fini(&r->clients[i].latency);
+		igt_stats_fini(&r->clients[i].lateness);
+	}
+	free(r->clients);
+	free(r->size);
+	free(r->handle_client);
+	free(r->bo);
+	free(r->ctx_client);
+	free(r->ctx);
+	free(r->dev.busy);
+}
+
+static double replay_clients(const char *filename,
+			     const struct replay_opts *opts)
+{
+	struct replay r = { .opts = opts };
+	const uint32_t bbe = 0xa << 23;
+	struct trace_map map;
+	uint8_t *ptr, *end;
+	double ret = -1;
+	uint64_t elapsed;
+	unsigned int i;
+
+	ptr = map_trace(filename, &map, &end, &r.version);
+	if (!ptr)
+		return -1;
+
+	if (opts->timed && r.version < 2) {
+		fprintf(stderr, "%s: no timestamps for a timed replay\n",
+			filename);
+		goto out;
+	}
+
+	if (replay_prepare(&r, ptr, end))
+		goto out;
+
+	r.dev.fd = -1;
+	pthread_mutex_init(&r.dev.mutex, NULL);
+	r.dev.batch_ns = opts->delay * 1000ull;
+	if (!opts->fake)
+		r.dev.fd = drm_open_driver(DRIVER_INTEL);
+
+	/* The replay's own batch takes the place of handle 0. */
+	r.bo = calloc(r.num_bo ?: 1, sizeof(*r.bo));
+	igt_assert(r.bo);
+	if (opts->nop > 0) {
+		r.bo[0] = device_create(&r.dev, opts->nop + opts->range);
+		if (r.dev.fd >= 0)
+			gem_write(r.dev.fd, r.bo[0],
+				  opts->nop + opts->range - sizeof(bbe),
+				  &bbe, sizeof(bbe));
+		r.range = 2 * opts->range - 64;
+	} else {
+		r.bo[0] = device_create(&r.dev, 4096);
+		if (r.dev.fd >= 0)
+			gem_write(r.dev.fd, r.bo[0], 0, &bbe, sizeof(bbe));
+	}
+	for (i = 1; i < r.num_bo; i++) {
+		if (r.size[i])
+			r.bo[i] = device_create(&r.dev, r.size[i]);
+	}
+
+	/* Clients get contexts of their own, as do recorded contexts. */
+	for (i = 0; i < r.num_ctx; i++) {
+		if (r.ctx_client[i] >= 0 && (i || opts->parallel))
+			r.ctx[i] = device_context_create(&r.dev);
+	}
+
+	for (i = 0; i < r.nr_clients; i++) {
+		igt_stats_init_with_size(&r.clients[i].latency,
+					 r.clients[i].nr_events);
+		igt_stats_init_with_size(&r.clients[i].lateness,
+					 r.clients[i].nr_events);
+	}
+
+	r.start = replay_now();
+	for (i = 0; i < r.nr_clients; i++)
+		igt_assert_eq(pthread_create(&r.clients[i].thread, NULL,
+					     replay_client, &r.clients[i]), 0);
+	for (i = 0; i < r.nr_clients; i++)
+		pthread_join(r.clients[i].thread, NULL);
+	elapsed = replay_now() - r.start;
+
+	for (i = 0; i < r.nr_clients; i++)
+		replay_report(filename, &r.clients[i]);
+
+	if (r.dev.fd >= 0)
+		close(r.dev.fd);
+	ret = elapsed / 1e6;
+
+out:
+	replay_fini(&r);
+	unmap_trace(&map);
+	return ret;
+}
+
+/*
+ * Conversion of a trace into a gem_wsim workload descriptor.
+ *
+ * Every execbuf becomes a batch step on the traced context and engine, with
+ * data dependencies on the last batches writing to the objects it uses. Waits
+ * which blocked become syncs and CPU time between submissions becomes delays.
+ * Batch durations are estimated from when blocking waits returned, assuming
+ * each engine executes its batches back to back in submission order.
+ */
+
+#define WSIM_MIN_DELAY_US 50 /* shorter CPU gaps are not recorded as delays */
+#define WSIM_MIN_STALL_US 20 /* shorter waits did not block on the GPU */
+#define WSIM_DEFAULT_DURATION_US 100 /* batches without any timing hints */
+
+enum wsim_engine {
+	WSIM_DEFAULT,
+	WSIM_RCS,
+	WSIM_BCS,
+	WSIM_VCS,
+	WSIM_VCS1,
+	WSIM_VCS2,
+	WSIM_VECS,
+	WSIM_NUM_ENGINES
+};
+
+static const char *wsim_engine_str[WSIM_NUM_ENGINES] = {
+	[WSIM_DEFAULT] = "DEFAULT",
+	[WSIM_RCS] = "RCS",
+	[WSIM_BCS] = "BCS",
+	[WSIM_VCS] = "VCS",
+	[WSIM_VCS1] = "VCS1",
+	[WSIM_VCS2] = "VCS2",
+	[WSIM_VECS] = "VECS",
+};
+
+struct wsim_exec {
+	uint64_t submit;
+	uint64_t done; /* completed by this time, zero if unknown */
+	bool exact; /* done is the completion time rather than a bound */
+	bool wait;
+	unsigned int duration;
+	unsigned int ctx;
+	enum wsim_engine engine;
+	unsigned int step;
+	unsigned int record;
+	unsigned int nr_deps;
+	unsigned int *deps;
+};
+
+struct wsim_step {
+	char type; /* 'b'atch, 'd'elay or 's'ync */
+	unsigned int value; /* exec index, delay in us or sync target step */
+};
+
+struct wsim_handle {
+	int writer; /* last exec writing the object */
+	int user; /* last exec using the object */
+};
+
+struct wsim_conv {
+	struct wsim_exec *exec;
+	unsigned int nr_exec, max_exec;
+	unsigned int nr_record;
+	struct wsim_step *step;
+	unsigned int nr_step, max_step;
+	struct wsim_handle *handle;
+	unsigned int nr_handle;
+	unsigned int *ctx;
+	unsigned int nr_ctx, next_ctx;
+	uint64_t last_event;
+};
+
+static enum wsim_engine wsim_engine(uint64_t flags)
+{
+	switch (flags & I915_EXEC_RING_MASK) {
+	case I915_EXEC_RENDER:
+		return WSIM_RCS;
+	case I915_EXEC_BSD:
+		switch (flags & I915_EXEC_BSD_MASK) {
+		case I915_EXEC_BSD_RING1:
+			return WSIM_VCS1;
+		case I915_EXEC_BSD_RING2:
+			return WSIM_VCS2;
+		default:
+			return WSIM_VCS;
+		}
+	case I915_EXEC_BLT:
+		return WSIM_BCS;
+	case I915_EXEC_VEBOX:
+		return WSIM_VECS;
+	default:
+		return WSIM_DEFAULT;
+	}
+}
+
+static struct wsim_handle *wsim_handle(struct wsim_conv *conv, uint32_t handle)
+{
+	if (handle >= conv->nr_handle) {
+		unsigned int i, n = ALIGN(handle + 1, 4096);
+
+		conv->handle = realloc(conv->handle, n * sizeof(*conv->handle));
+		assert(conv->handle);
+		for (i = conv->nr_handle; i < n; i++)
+			conv->handle[i] = (struct wsim_handle){ -1, -1 };
+		conv->nr_handle = n;
+	}
+
+	return &conv->handle[handle];
+}
+
+static unsigned int wsim_ctx(struct wsim_conv *conv, uint32_t ctx)
+{
+	if (ctx >= conv->nr_ctx) {
+		unsigned int n = ALIGN(ctx + 1, 1024);
+
+		conv->ctx = realloc(conv->ctx, n * sizeof(*conv->ctx));
+		assert(conv->ctx);
+		memset(conv->ctx + conv->nr_ctx, 0,
+		       (n - conv->nr_ctx) * sizeof(*conv->ctx));
+		conv->nr_ctx = n;
+	}
+
+	/* Number contexts in order of first use, from one. */
+	if (!conv->ctx[ctx])
+		conv->ctx[ctx] = ++conv->next_ctx;
+
+	return conv->ctx[ctx];
+}
+
+static void wsim_add_step(struct wsim_conv *conv, char type, unsigned int value)
+{
+	if (conv->nr_step == conv->max_step) {
+		conv->max_step = conv->max_step ? 2 * conv->max_step : 1024;
+		conv->step = realloc(conv->step,
+				     conv->max_step * sizeof(*conv->step));
+		assert(conv->step);
+	}
+
+	conv->step[conv->nr_step++] = (struct wsim_step){ type, value };
+}
+
+static void wsim_add_dep(struct wsim_exec *e, int dep)
+{
+	unsigned int i;
+
+	if (dep < 0)
+		return;
+
+	for (i = 0; i < e->nr_deps; i++) {
+		if (e->deps[i] == dep)
+			return;
+	}
+
+	e->deps = realloc(e->deps, (e->nr_deps + 1) * sizeof(*e->deps));
+	assert(e->deps);
+	e->deps[e->nr_deps++] = dep;
+}
+
+static void wsim_delay(struct wsim_conv *conv, uint64_t time)
+{
+	uint64_t gap = time > conv->last_event ? time - conv->last_event : 0;
+
+	if (conv->last_event && gap / 1000 >= WSIM_MIN_DELAY_US)
+		wsim_add_step(conv, 'd', gap / 1000);
+
+	conv->last_event = time;
+}
+
+/* Find the execbuf of a record, for following fences. */
+static int wsim_exec_by_record(struct wsim_conv *conv, unsigned int record)
+{
+	unsigned int lo = 0, hi = conv->nr_exec;
+
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+
+		if (conv->exec[mid].record < record)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo < conv->nr_exec && conv->exec[lo].record == record ? lo : -1;
+}
+
+static uint8_t *
+wsim_exec(struct wsim_conv *conv, uint8_t *ptr, uint32_t version)
+{
+	struct trace_exec *t = (void *)ptr;
+	uint32_t handles[t->object_count];
+	uint32_t fence_in = 0;
+	struct wsim_exec *e;
+	unsigned int idx;
+	uint8_t *objects;
+	uint64_t time = 0;
+	int signaler = -1;
+
+	ptr = (void *)(t + 1);
+	if (version >= 2) {
+		time = ((struct trace_exec_time *)ptr)->time;
+		ptr += sizeof(struct trace_exec_time);
+	}
+	if (version >= 3) {
+		fence_in = ((struct trace_exec_fence *)ptr)->in;
+		ptr += sizeof(struct trace_exec_fence);
+	}
+	if (fence_in)
+		signaler = wsim_exec_by_record(conv, fence_in - 1);
+
+	wsim_delay(conv, time);
+
+	if (conv->nr_exec == conv->max_exec) {
+		conv->max_exec = conv->max_exec ? 2 * conv->max_exec : 1024;
+		conv->exec = realloc(conv->exec,
+				     conv->max_exec * sizeof(*conv->exec));
+		assert(conv->exec);
+	}
+
+	idx = conv->nr_exec++;
+	e = memset(&conv->exec[idx], 0, sizeof(*e));
+	e->submit = time;
+	e->ctx = wsim_ctx(conv, t->context);
+	e->engine = wsim_engine(t->flags);
+	e->step = conv->nr_step;
+	e->record = conv->nr_record;
+	wsim_add_step(conv, 'b', idx);
+
+	/* A fence from another execbuf is a dependency like any other. */
+	wsim_add_dep(e, signaler);
+
+	/* Objects are interleaved with their relocations. */
+	objects = ptr;
+	for (uint32_t i = 0; i < t->object_count; i++) {
+		struct trace_exec_object *to = (void *)ptr;
+
+		handles[i] = to->handle;
+		wsim_add_dep(e, wsim_handle(conv, to->handle)->writer);
+
+		ptr = (void *)(to + 1);
+		ptr += sizeof(struct drm_i915_gem_relocation_entry) *
+		       to->relocation_count;
+	}
+
+	ptr = objects;
+	for (uint32_t i = 0; i < t->object_count; i++) {
+		struct trace_exec_object *to = (void *)ptr;
+		struct drm_i915_gem_relocation_entry *relocs = (void *)(to + 1);
+
+		wsim_handle(conv, handles[i])->user = idx;
+		if (to->flags & EXEC_OBJECT_WRITE)
+			wsim_handle(conv, handles[i])->writer = idx;
+
+		for (uint32_t j = 0; j < to->relocation_count; j++) {
+			uint32_t target = relocs[j].target_handle;
+
+			if (!relocs[j].write_domain)
+				continue;
+
+			if (t->flags & I915_EXEC_HANDLE_LUT) {
+				if (target >= t->object_count)
+					continue;
+				target = handles[target];
+			}
+
+			wsim_handle(conv, target)->writer = idx;
+		}
+
+		ptr = (void *)(relocs + to->relocation_count);
+	}
+
+	return ptr;
+}
+
+static uint8_t *
+wsim_wait(struct wsim_conv *conv, uint8_t *ptr, uint32_t version)
+{
+	struct trace_wait *t = (void *)ptr;
+	uint64_t start = 0, end = 0;
+	enum wsim_engine engine;
+	struct wsim_exec *e;
+	bool blocked;
+	int idx;
+
+	ptr = (void *)(t + 1);
+	if (version >= 2) {
+		start = ((struct trace_wait_time *)ptr)->start;
+		end = ((struct trace_wait_time *)ptr)->end;
+		ptr += sizeof(struct trace_wait_time);
+	}
+
+	idx = wsim_handle(conv, t->handle)->user;
+	if (idx < 0 || conv->exec[idx].done)
+		return ptr;
+
+	wsim_delay(conv, start);
+	conv->last_event = end;
+
+	/* Without timestamps all waits are assumed to have blocked. */
+	blocked = version < 2 || (end - start) / 1000 >= WSIM_MIN_STALL_US;
+	if (blocked) {
+		e = &conv->exec[idx];
+		if (conv->step[conv->nr_step - 1].type == 'b' &&
+		    conv->step[conv->nr_step - 1].value == idx)
+			e->wait = true;
+		else
+			wsim_add_step(conv, 's', e->step);
+	}
+
+	/* Earlier batches on the same engine have completed as well. */
+	engine = conv->exec[idx].engine;
+	for (; idx >= 0; idx--) {
+		e = &conv->exec[idx];
+		if (e->engine != engine)
+			continue;
+		if (e->done)
+			break;
+
+		e->done = blocked ? end : start;
+		e->exact = blocked && version >= 2;
+		blocked = false;
+	}
+
+	return ptr;
+}
+
+static void wsim_estimate_durations(struct wsim_conv *conv)
+{
+	for (unsigned int engine = 0; engine < WSIM_NUM_ENGINES; engine++) {
+		uint64_t idle = 0; /* engine known to be idle from */
+		unsigned int first = 0, count = 0;
+
+		for (unsigned int i = 0; i < conv->nr_exec; i++) {
+			struct wsim_exec *e = &conv->exec[i];
+			uint64_t start, per;
+
+			if (e->engine != engine)
+				continue;
+
+			if (!count++)
+				first = i;
+
+			if (!e->done)
+				continue;
+
+			/* Spread the run of batches up to here evenly. */
+			start = max(idle, conv->exec[first].submit);
+			per = e->done > start ? (e->done - start) / count : 0;
+			per /= 1000;
+			if (!e->exact)
+				per = min_t(uint64_t, per, WSIM_DEFAULT_DURATION_US);
+			if (!per)
+				per = 1;
+
+			for (unsigned int j = first; j <= i; j++) {
+				if (conv->exec[j].engine == engine)
+					conv->exec[j].duration = per;
+			}
+
+			idle = e->exact ? e->done : start + count * per * 1000;
+			count = 0;
+		}
+
+		for (unsigned int j = first; count && j < conv->nr_exec; j++) {
+			if (conv->exec[j].engine == engine)
+				conv->exec[j].duration = WSIM_DEFAULT_DURATION_US;
+		}
+	}
+}
+
+static void wsim_write(struct wsim_conv *conv, FILE *file)
+{
+	for (unsigned int i = 0; i < conv->nr_step; i++) {
+		struct wsim_step *s = &conv->step[i];
+		struct wsim_exec *e;
+
+		switch (s->type) {
+		case 'd':
+			fprintf(file, "d.%u\n", s->value);
+			break;
+		case 's':
+			fprintf(file, "s.-%u\n", i - s->value);
+			break;
+		case 'b':
+			e = &conv->exec[s->value];
+			fprintf(file, "%u.%s.%u.", e->ctx,
+				wsim_engine_str[e->engine], e->duration);
+			if (!e->nr_deps)
+				fputc('0', file);
+			for (unsigned int j = 0; j < e->nr_deps; j++)
+				fprintf(file, "%s-%u", j ? "/" : "",
+					i - conv->exec[e->deps[j]].step);
+			fprintf(file, ".%u\n", e->wait);
+			break;
+		}
+	}
+}
+
+static void wsim_fini(struct wsim_conv *conv)
+{
+	for (unsigned int i = 0; i < conv->nr_exec; i++)
+		free(conv->exec[i].deps);
+	free(conv->exec);
+	free(conv->step);
+	free(conv->handle);
+	free(conv->ctx);
+}
+
+static int convert(const char *filename)
+{
+	struct wsim_conv conv = {};
+	struct trace_map map;
+	char path[PATH_MAX];
+	uint8_t *ptr, *end;
+	uint32_t version;
+	FILE *file;
+	int ret = -1;
+
+	ptr = map_trace(filename, &map, &end, &version);
+	if (!ptr)
+		return -1;
+
+	for (; ptr < end; conv.nr_record++) switch (*ptr++) {
+	case ADD_BO:
+		{
+			struct trace_add_bo *t = (void *)ptr;
+			ptr = (void *)(t + 1);
+
+			*wsim_handle(&conv, t->handle) =
+				(struct wsim_handle){ -1, -1 };
+			break;
+		}
+	case DEL_BO:
+		{
+			struct trace_del_bo *t = (void *)ptr;
+			ptr = (void *)(t + 1);
+
+			*wsim_handle(&conv, t->handle) =
+				(struct wsim_handle){ -1, -1 };
+			break;
+		}
+	case ADD_CTX:
+		ptr += sizeof(struct trace_add_ctx);
+		break;
+	case DEL_CTX:
+		ptr += sizeof(struct trace_del_ctx);
+		break;
+	case EXEC:
+		ptr = wsim_exec(&conv, ptr, version);
+		break;
+	case WAIT:
+		ptr = wsim_wait(&conv, ptr, version);
+		break;
+	default:
+		fprintf(stderr, "Unknown cmd: %x\n", ptr[-1]);
+		goto out;
+	}
+
+	wsim_estimate_durations(&conv);
+
+	snprintf(path, sizeof(path), "%s.wsim", filename);
+	file = fopen(path, "w");
+	if (!file) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		goto out;
+	}
+	wsim_write(&conv, file);
+	fclose(file);
+
+	printf("%s: %u batches on %u contexts, %u steps written to %s\n",
+	       filename, conv.nr_exec, conv.next_ctx, conv.nr_step, path);
+	ret = 0;
+
+out:
+	wsim_fini(&conv);
+	unmap_trace(&map);
+	return ret;
+}
+
 static long calibrate_nop(int usecs)
 {
 	const uint32_t bbe = 0xa << 23;
@@ -370,12 +1529,14 @@ int main(int argc, char **argv)
 	double *results;
 	long nop = 0;
 	long range = 0;
+	struct replay_opts opts = { .speed = 1 };
+	bool wsim = false;
 	int i, c;
 
 	results = mmap(NULL, ALIGN(argc*sizeof(double), 4096),
 		       PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
 
-	while ((c = getopt(argc, argv, "d:n:r:")) != -1) {
+	while ((c = getopt(argc, argv, "d:fn:pr:s:tw")) != -1) {
 		switch (c) {
 		case 'd':
 			delay = atoi(optarg);
@@ -390,24 +1551,68 @@ int main(int argc, char **argv)
 			if (range > 0)
 				range = ALIGN(range, 4096);
 			break;
+		case 'f':
+			opts.fake = true;
+			break;
+		case 'p':
+			opts.parallel = true;
+			break;
+		case 's':
+			opts.speed = atof(optarg);
+			if (opts.speed <= 0)
+				opts.speed = 1;
+			/* fallthrough */
+		case 't':
+			opts.timed = true;
+			break;
+		case 'w':
+			wsim = true;
+			break;
 		default:
 			break;
 		}
 	}
 
+	/* Write out each trace as a gem_wsim workload instead of replaying. */
+	if (wsim) {
+		int ret = 0;
+
+		for (i = optind; i < argc; i++) {
+			if (convert(argv[i]))
+				ret = 1;
+		}
+
+		return ret;
+	}
+
+	/* Without a GPU there is nothing to calibrate against. */
+	if (opts.fake && !nop)
+		nop = -1;
 	if (!nop)
 		nop = calibrate_nop(delay);
 	if (!range)
 		range = nop / 2;
 	if (nop > 0) {
-		delay = measure_nop(nop);
+		/* The fake device takes the given delay for every batch. */
+		if (!opts.fake)
+			delay = measure_nop(nop);
 		printf("Using %lu nop batch for ~%dus delay, range %lu [%dus]\n",
 		       nop, delay,
 		       range, (int)(delay * range / nop));
 	}
 
-	igt_fork(child, argc-optind)
-		results[child] = replay(argv[child + optind], nop, range);
+	opts.nop = nop;
+	opts.range = range;
+	opts.delay = delay;
+
+	igt_fork(child, argc-optind) {
+		if (opts.timed || opts.parallel || opts.fake)
+			results[child] = replay_clients(argv[child + optind],
+							&opts);
+		else
+			results[child] = replay(argv[child + optind],
+						nop, range);
+	}
 	igt_waitchildren();
 
 	for (i = 0; i < argc - optind; i++) {
@@ -21,10 +21,14 @@
  * IN THE SOFTWARE.
  */
 
+
+#include "config.h"
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stdarg.h>
 #include <fcntl.h>
@@ -37,20 +41,110 @@
 #include <dlfcn.h>
 #include <i915_drm.h>
 #include <pthread.h>
+#include <time.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
 
 #include "intel_aub.h"
 #include "intel_chipset.h"
 
+/*
+ * The traced threads never write to the trace files themselves. Each thread
+ * copies its records into a private ring, without taking any locks, and a
+ * writer thread merges the rings back into per-fd order by their sequence
+ * numbers. The records are written out in chunks, compressed with LZ4 if
+ * available unless GEM_EXEC_TRACER_LZ4=0.
+ *
+ * The writer also opens and closes the trace files. A closed fd is retired
+ * by a final record, and the trace of a reused fd only takes over the file
+ * name once the writer has reached that record.
+ */
+
+#define RING_SIZE (1 << 20)
+#define CHUNK_SIZE (256 << 10)
+#define FLUSH_INTERVAL_NS (100 * 1000 * 1000)
+#define MAX_FENCES 16
+
 static int (*libc_close)(int fd);
 static int (*libc_ioctl)(int fd, unsigned long request, void *argp);
 
+/* Serialises close() unlinking traces, and fini() against ring releases. */
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 
 struct trace {
 	int fd;
+	char filename[80];
+	uint64_t seq; /* records allocated by the traced threads */
+	struct trace *prev; /* closed trace of the same fd, if any */
+
+	/*
+	 * Exported fences, to record which execbuf signals an in-fence. Each
+	 * slot holds the exporting record plus one above the fence fd, so
+	 * that it is updated in a single store.
+	 */
+	uint64_t fences[MAX_FENCES];
+	unsigned int next_fence;
+
+	/* Owned by the writer thread. */
 	FILE *file;
+	uint64_t written; /* records merged so far */
+	uint8_t *chunk;
+	size_t len, complete, max;
+	bool retired; /* file closed, later records are dropped */
+
 	struct trace *next;
-} *traces;
+	struct trace *next_closed;
+} *traces, *closed_traces;
+
+struct ring {
+	uint8_t *data;
+	uint64_t head; /* consumed by the writer */
+	uint64_t tail; /* published by the owning thread */
+	uint64_t reserve; /* written, not yet published */
+	bool active; /* owning thread inside a traced call */
+	bool broken; /* record abandoned as the writer quit */
+	bool dead; /* owning thread exited */
+
+	/* Writer state for a record only partially published. */
+	struct trace *trace;
+	uint32_t remaining;
+	bool discard;
+
+	/* Owning thread statistics. */
+	uint64_t calls, records, bytes;
+	uint64_t overhead_ns, stalls, stall_ns;
+
+	struct ring *next;
+} *rings;
+
+/* Header of each record in the ring, followed by size bytes. */
+struct ring_record {
+	struct trace *trace;
+	uint64_t seq;
+	uint32_t size;
+	uint32_t close; /* final record, nothing to write */
+};
+
+static struct {
+	pthread_t thread;
+	bool started;
+	bool running;
+	bool stop; /* no new records */
+	bool quit; /* exit once the rings are drained */
+	bool compress;
+	uint8_t *scratch;
+	size_t max_scratch;
+
+	/* Totals, including rings of exited threads. */
+	uint64_t calls, records, bytes;
+	uint64_t overhead_ns, stalls, stall_ns;
+	uint64_t chunks, raw, stored;
+	uint64_t cpu_ns;
+} writer;
+
+static __thread struct ring *local_ring;
+static pthread_key_t ring_key;
 
 #define DRM_MAJOR 226
 
@@ -68,9 +162,16 @@ static struct trace_verion {
 	uint32_t version;
 } version = {
 	.magic = 0xdeadbeef,
-	.version = 1
+	.version = 3
 };
 
+/* Since version 3 the records are stored in chunks following the version. */
+struct trace_chunk {
+	uint32_t size; /* of the records */
+	uint32_t stored; /* bytes following, less than size if compressed */
+	uint64_t time; /* CLOCK_MONOTONIC ns when written */
+} __attribute__((packed));
+
 struct trace_add_bo {
 	uint8_t cmd;
 	uint32_t handle;
@@ -95,6 +196,8 @@ struct trace_exec {
 	uint32_t object_count;
 	uint64_t flags;
 	uint32_t context;
+	uint64_t time; /* CLOCK_MONOTONIC ns at submission, since version 2 */
+	uint32_t fence_in; /* record exporting the in-fence plus one, since version 3 */
 }__attribute__((packed));
 
 struct trace_exec_object {
@@ -119,6 +222,7 @@ struct trace_exec_relocation {
 struct trace_wait {
 	uint8_t cmd;
 	uint32_t handle;
+	uint64_t start, end; /* CLOCK_MONOTONIC ns, since version 2 */
 } __attribute__((packed));
 
 static void __attribute__ ((format(__printf__, 2, 3)))
@@ -136,26 +240,199 @@ fail_if(int cond, const char *format, ...)
 	abort();
 }
 
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void ring_publish(struct ring *r)
+{
+	if (!r->broken)
+		__atomic_store_n(&r->tail, r->reserve, __ATOMIC_RELEASE);
+}
+
+static void ring_copy(struct ring *r, const void *data, size_t len)
+{
+	const uint8_t *src = data;
+
+	while (len && !r->broken) {
+		uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		size_t space = RING_SIZE - (r->reserve - head);
+		size_t offset = r->reserve & (RING_SIZE - 1);
+		size_t n;
+
+		if (!space) {
+			struct timespec tv = { .tv_nsec = 10000 };
+			uint64_t start = now_ns();
+
+			/*
+			 * Without a writer the record can never be completed,
+			 * so the rest of it is never published. The part the
+			 * writer has already merged is not written out.
+			 */
+			if (__atomic_load_n(&writer.quit, __ATOMIC_ACQUIRE)) {
+				r->broken = true;
+				return;
+			}
+
+			/* Let the writer drain what we have so far. */
+			ring_publish(r);
+			nanosleep(&tv, NULL);
+			r->stall_ns += now_ns() - start;
+			r->stalls++;
+			continue;
+		}
+
+		n = len;
+		if (n > space)
+			n = space;
+		if (n > RING_SIZE - offset)
+			n = RING_SIZE - offset;
+
+		memcpy(r->data + offset, src, n);
+		r->reserve += n;
+		r->bytes += n;
+		src += n;
+		len -= n;
+	}
+}
+
+static uint64_t
+record_begin(struct ring *r, struct trace *trace, uint32_t size)
+{
+	struct ring_record rec = {
+		.trace = trace,
+		.seq = __atomic_fetch_add(&trace->seq, 1, __ATOMIC_RELAXED),
+		.size = size,
+	};
+
+	ring_copy(r, &rec, sizeof(rec));
+	r->records++;
+
+	return rec.seq;
+}
+
+static void ring_destroy(void *data)
+{
+	struct ring *r = data;
+
+	__atomic_store_n(&r->dead, true, __ATOMIC_RELEASE);
+}
+
+static struct ring *get_ring(void)
+{
+	struct ring *r = local_ring;
+
+	if (r)
+		return r;
+
+	r = calloc(1, sizeof(*r));
+	fail_if(!r, "failed to allocate trace ring\n");
+
+	r->data = mmap(NULL, RING_SIZE, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANON, -1, 0);
+	fail_if(r->data == MAP_FAILED, "failed to allocate trace ring\n");
+
+	pthread_setspecific(ring_key, r);
+
+	r->next = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+	while (!__atomic_compare_exchange_n(&rings, &r->next, r, false,
+					    __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE))
+		;
+
+	return local_ring = r;
+}
+
+/*
+ * Marks the thread as inside a traced call, which fini() waits for before
+ * releasing the traces. Returns NULL once tracing has stopped.
+ */
+static struct ring *record_enter(void)
+{
+	struct ring *r = get_ring();
+
+	__atomic_store_n(&r->active, true, __ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&writer.stop, __ATOMIC_SEQ_CST))
+		return r;
+
+	__atomic_store_n(&r->active, false, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void record_exit(struct ring *r)
+{
+	__atomic_store_n(&r->active, false, __ATOMIC_RELEASE);
+}
+
+static uint32_t fence_lookup(struct trace *trace, int fd)
+{
+	for (unsigned int i = 0; i < MAX_FENCES; i++) {
+		uint64_t f = __atomic_load_n(&trace->fences[i], __ATOMIC_ACQUIRE);
+
+		if (f >> 32 && (uint32_t)f == (uint32_t)fd)
+			return f >> 32;
+	}
+
+	return 0;
+}
+
+static void fence_export(struct trace *trace, int fd, uint64_t seq)
+{
+	unsigned int i = __atomic_fetch_add(&trace->next_fence, 1,
+					    __ATOMIC_RELAXED) % MAX_FENCES;
+
+	__atomic_store_n(&trace->fences[i], (seq + 1) << 32 | (uint32_t)fd,
+			 __ATOMIC_RELEASE);
+}
+
+static void fence_forget(struct trace *trace, int fd)
+{
+	for (unsigned int i = 0; i < MAX_FENCES; i++) {
+		uint64_t f = __atomic_load_n(&trace->fences[i], __ATOMIC_ACQUIRE);
+
+		if (f >> 32 && (uint32_t)f == (uint32_t)fd)
+			__atomic_compare_exchange_n(&trace->fences[i], &f, 0,
+						    false, __ATOMIC_RELEASE,
+						    __ATOMIC_RELAXED);
+	}
+}
+
 static void
-trace_exec(struct trace *trace,
-	   const struct drm_i915_gem_execbuffer2 *execbuffer2)
+trace_exec(struct ring *r, struct trace *trace,
+	   const struct drm_i915_gem_execbuffer2 *execbuffer2,
+	   uint64_t time)
 {
 #define to_ptr(T, x) ((T *)(uintptr_t)(x))
 	const struct drm_i915_gem_exec_object2 *exec_objects =
 		to_ptr(typeof(*exec_objects), execbuffer2->buffers_ptr);
+	uint32_t size = sizeof(struct trace_exec);
+	uint32_t fence_in = 0;
+	uint64_t seq;
+
+	for (uint32_t i = 0; i < execbuffer2->buffer_count; i++)
+		size += sizeof(struct trace_exec_object) +
+			sizeof(struct trace_exec_relocation) *
+			exec_objects[i].relocation_count;
 
-	fail_if(execbuffer2->flags & (I915_EXEC_FENCE_IN | I915_EXEC_FENCE_OUT),
-		"fences not supported yet\n");
+	/* Only fences exported by traced execbufs can be followed. */
+	if (execbuffer2->flags & (I915_EXEC_FENCE_IN | I915_EXEC_FENCE_SUBMIT))
+		fence_in = fence_lookup(trace, execbuffer2->rsvd2 & 0xffffffff);
 
-	flockfile(trace->file);
+	seq = record_begin(r, trace, size);
 	{
 		struct trace_exec t = {
 			EXEC,
 			execbuffer2->buffer_count,
 			execbuffer2->flags,
 			execbuffer2->rsvd1,
+			time,
+			fence_in,
 		};
-		fwrite(&t, sizeof(t), 1, trace->file);
+		ring_copy(r, &t, sizeof(t));
 	}
 
 	for (uint32_t i = 0; i < execbuffer2->buffer_count; i++) {
@@ -172,68 +449,386 @@ trace_exec(struct trace *trace,
 				obj->rsvd1,
 				obj->rsvd2
 			};
-			fwrite(&t, sizeof(t), 1, trace->file);
+			ring_copy(r, &t, sizeof(t));
 		}
-		fwrite(relocs, sizeof(*relocs), obj->relocation_count,
-		       trace->file);
+		ring_copy(r, relocs, sizeof(*relocs) * obj->relocation_count);
 	}
 
-	fflush(trace->file);
-	funlockfile(trace->file);
+	ring_publish(r);
+
+	if (execbuffer2->flags & I915_EXEC_FENCE_OUT)
+		fence_export(trace, execbuffer2->rsvd2 >> 32, seq);
 #undef to_ptr
 }
 
 static void
-trace_wait(struct trace *trace, uint32_t handle)
+trace_record(struct ring *r, struct trace *trace,
+	     const void *data, uint32_t size)
 {
-	struct trace_wait t = { WAIT, handle };
-	fwrite(&t, sizeof(t), 1, trace->file);
+	record_begin(r, trace, size);
+	ring_copy(r, data, size);
+	ring_publish(r);
 }
 
 static void
-trace_add(struct trace *trace, uint32_t handle, uint64_t size)
+trace_wait(struct ring *r, struct trace *trace,
+	   uint32_t handle, uint64_t start, uint64_t end)
+{
+	struct trace_wait t = { WAIT, handle, start, end };
+	trace_record(r, trace, &t, sizeof(t));
+}
+
+static void
+trace_add(struct ring *r, struct trace *trace, uint32_t handle, uint64_t size)
 {
 	struct trace_add_bo t = { ADD_BO, handle, size };
-	fwrite(&t, sizeof(t), 1, trace->file);
+	trace_record(r, trace, &t, sizeof(t));
 }
 
 static void
-trace_del(struct trace *trace, uint32_t handle)
+trace_del(struct ring *r, struct trace *trace, uint32_t handle)
 {
 	struct trace_del_bo t = { DEL_BO, handle };
-	fwrite(&t, sizeof(t), 1, trace->file);
+	trace_record(r, trace, &t, sizeof(t));
 }
 
 static void
-trace_add_context(struct trace *trace, uint32_t handle)
+trace_add_context(struct ring *r, struct trace *trace, uint32_t handle)
 {
 	struct trace_add_ctx t = { ADD_CTX, handle };
-	fwrite(&t, sizeof(t), 1, trace->file);
+	trace_record(r, trace, &t, sizeof(t));
 }
 
 static void
-trace_del_context(struct trace *trace, uint32_t handle)
+trace_del_context(struct ring *r, struct trace *trace, uint32_t handle)
 {
 	struct trace_del_ctx t = { DEL_CTX, handle };
-	fwrite(&t, sizeof(t), 1, trace->file);
+	trace_record(r, trace, &t, sizeof(t));
 }
 
-int
-close(int fd)
+static void
+trace_close(struct ring *r, struct trace *trace)
 {
-	struct trace *t, **p;
+	struct ring_record rec = {
+		.trace = trace,
+		.seq = __atomic_fetch_add(&trace->seq, 1, __ATOMIC_RELAXED),
+		.close = true,
+	};
 
-	pthread_mutex_lock(&mutex);
-	for (p = &traces; (t = *p); p = &t->next) {
-		if (t->fd == fd) {
-			*p = t->next;
+	ring_copy(r, &rec, sizeof(rec));
+	ring_publish(r);
+}
+
+/*
+ * Creates the file of a trace for its first record, once the closed trace
+ * of the same fd, whose file it replaces, has been retired. Returns false
+ * while that is still pending.
+ */
+static bool trace_open(struct trace *t)
+{
+	if (t->file || t->retired)
+		return true;
+
+	if (t->prev && !t->prev->retired)
+		return false;
+
+	unlink(t->filename);
+	t->file = fopen(t->filename, "w+");
+	if (!t->file || !fwrite(&version, sizeof(version), 1, t->file)) {
+		fprintf(stderr, "gem_exec_tracer: failed to create %s\n",
+			t->filename);
+		if (t->file)
 			fclose(t->file);
-			free(t);
+		t->file = NULL;
+		t->retired = true;
+	}
+
+	return true;
+}
+
+static void chunk_flush(struct trace *t)
+{
+	struct trace_chunk c = {
+		.size = t->complete,
+		.stored = t->complete,
+		.time = now_ns(),
+	};
+	const uint8_t *data = t->chunk;
+
+	if (!t->complete || !t->file)
+		return;
+
+#ifdef HAVE_LZ4
+	if (writer.compress) {
+		size_t bound = LZ4_compressBound(t->complete);
+		int n;
+
+		if (bound > writer.max_scratch) {
+			free(writer.scratch);
+			writer.scratch = malloc(bound);
+			writer.max_scratch = writer.scratch ? bound : 0;
+		}
+
+		n = LZ4_compress_default((const char *)t->chunk,
+					 (char *)writer.scratch,
+					 t->complete, writer.max_scratch);
+		if (n > 0 && n < t->complete) {
+			data = writer.scratch;
+			c.stored = n;
+		}
+	}
+#endif
+
+	fwrite(&c, sizeof(c), 1, t->file);
+	fwrite(data, c.stored, 1, t->file);
+	fflush(t->file);
+
+	writer.chunks++;
+	writer.raw += c.size;
+	writer.stored += c.stored;
+
+	/* Keep the start of a record still being merged. */
+	t->len -= t->complete;
+	memmove(t->chunk, t->chunk + t->complete, t->len);
+	t->complete = 0;
+}
+
+static void chunk_append(struct trace *t, const uint8_t *data, size_t len)
+{
+	if (t->len + len > t->max) {
+		t->max = t->len + len > CHUNK_SIZE ? 2 * (t->len + len) : CHUNK_SIZE;
+		t->chunk = realloc(t->chunk, t->max);
+		fail_if(!t->chunk, "failed to allocate trace chunk\n");
+	}
+
+	memcpy(t->chunk + t->len, data, len);
+	t->len += len;
+}
+
+static void ring_read(struct ring *r, uint64_t head, void *dst, size_t len)
+{
+	size_t offset = head & (RING_SIZE - 1);
+	size_t n = len < RING_SIZE - offset ? len : RING_SIZE - offset;
+
+	memcpy(dst, r->data + offset, n);
+	memcpy((uint8_t *)dst + n, r->data, len - n);
+}
+
+static bool ring_drain(struct ring *r)
+{
+	uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	uint64_t head = r->head;
+	bool progress = false;
+
+	while (head != tail) {
+		struct trace *t = r->trace;
+
+		if (!t) {
+			struct ring_record rec;
+
+			if (tail - head < sizeof(rec))
+				break;
+
+			/* Records of each fd are written in sequence. */
+			ring_read(r, head, &rec, sizeof(rec));
+			if (rec.seq != rec.trace->written)
+				break;
+			if (!trace_open(rec.trace))
+				break;
+
+			head += sizeof(rec);
+			progress = true;
+
+			t = rec.trace;
+			if (rec.close) {
+				t->written++;
+				t->complete = t->len;
+				chunk_flush(t);
+				if (t->file)
+					fclose(t->file);
+				t->file = NULL;
+				free(t->chunk);
+				t->chunk = NULL;
+				t->len = t->complete = t->max = 0;
+				t->retired = true;
+				continue;
+			}
+
+			/*
+			 * A thread which found the trace just before its fd
+			 * was closed may still record into it.
+			 */
+			r->trace = t;
+			r->remaining = rec.size;
+			r->discard = t->retired;
+		}
+
+		while (r->remaining && head != tail) {
+			size_t offset = head & (RING_SIZE - 1);
+			size_t n = r->remaining;
+
+			if (n > tail - head)
+				n = tail - head;
+			if (n > RING_SIZE - offset)
+				n = RING_SIZE - offset;
+
+			if (!r->discard)
+				chunk_append(t, r->data + offset, n);
+			head += n;
+			r->remaining -= n;
+			progress = true;
+		}
+		if (r->remaining)
+			break;
+
+		r->trace = NULL;
+		t->written++;
+		if (r->discard)
+			continue;
+
+		t->complete = t->len;
+		if (t->complete >= CHUNK_SIZE)
+			chunk_flush(t);
+	}
+
+	__atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+	return progress;
+}
+
+static void ring_account(struct ring *r)
+{
+	writer.calls += r->calls;
+	writer.records += r->records;
+	writer.bytes += r->bytes;
+	writer.overhead_ns += r->overhead_ns;
+	writer.stalls += r->stalls;
+	writer.stall_ns += r->stall_ns;
+}
+
+static void *writer_thread(void *data)
+{
+	uint64_t last_flush = now_ns();
+	struct timespec ts;
+	struct trace *t;
+
+	for (;;) {
+		struct ring *r, **p;
+		bool progress = false;
+
+		for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next)
+			progress |= ring_drain(r);
+
+		/*
+		 * Release the rings of exited threads once drained, until
+		 * fini() walks them. New rings are pushed in front
+		 * concurrently.
+		 */
+		pthread_mutex_lock(&mutex);
+		for (p = &rings;
+		     !__atomic_load_n(&writer.stop, __ATOMIC_ACQUIRE) &&
+		     (r = __atomic_load_n(p, __ATOMIC_ACQUIRE)); ) {
+			if (__atomic_load_n(&r->dead, __ATOMIC_ACQUIRE) &&
+			    r->head == r->tail) {
+				if (!__atomic_compare_exchange_n(p, &r, r->next,
+								 false,
+								 __ATOMIC_SEQ_CST,
+								 __ATOMIC_ACQUIRE))
+					continue;
+
+				ring_account(r);
+				munmap(r->data, RING_SIZE);
+				free(r);
+			} else {
+				p = &r->next;
+			}
+		}
+		pthread_mutex_unlock(&mutex);
+
+		if (progress)
+			continue;
+
+		/* Keep the files current in case the process dies. */
+		if (now_ns() - last_flush > FLUSH_INTERVAL_NS) {
+			for (t = __atomic_load_n(&traces, __ATOMIC_ACQUIRE);
+			     t; t = t->next) {
+				if (trace_open(t))
+					chunk_flush(t);
+			}
+			last_flush = now_ns();
+		}
+
+		if (__atomic_load_n(&writer.quit, __ATOMIC_ACQUIRE))
 			break;
+
+		ts.tv_sec = 0;
+		ts.tv_nsec = 100000;
+		nanosleep(&ts, NULL);
+	}
+
+	for (t = traces; t; t = t->next) {
+		if (trace_open(t))
+			chunk_flush(t);
+	}
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	writer.cpu_ns = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+
+	return data;
+}
+
+/* Unlinks the live trace of fd, racing with new traces pushed in front. */
+static struct trace *trace_unlink(int fd)
+{
+	struct trace *t, **p;
+
+	do {
+		for (p = &traces; (t = __atomic_load_n(p, __ATOMIC_ACQUIRE));
+		     p = &t->next) {
+			if (t->fd == fd)
+				break;
 		}
+	} while (t && !__atomic_compare_exchange_n(p, &t, t->next, false,
+						   __ATOMIC_RELEASE,
+						   __ATOMIC_ACQUIRE));
+
+	return t;
+}
+
+int
+close(int fd)
+{
+	struct trace *t;
+	struct ring *r;
+
+	if (!__atomic_load_n(&traces, __ATOMIC_ACQUIRE))
+		return libc_close(fd);
+
+	r = record_enter();
+	if (!r)
+		return libc_close(fd);
+
+	/* Forget fences exported through this fd. */
+	for (t = __atomic_load_n(&traces, __ATOMIC_ACQUIRE); t; t = t->next)
+		fence_forget(t, fd);
+
+	/*
+	 * Lookups may still be walking through the trace, so it is kept
+	 * rather than freed. The writer retires it, in order, from its final
+	 * record, and a trace of the reused fd waits for that before
+	 * replacing the file.
+	 */
+	pthread_mutex_lock(&mutex);
+	t = trace_unlink(fd);
+	if (t) {
+		t->next_closed = closed_traces;
+		__atomic_store_n(&closed_traces, t, __ATOMIC_RELEASE);
 	}
 	pthread_mutex_unlock(&mutex);
 
+	if (t)
+		trace_close(r, t);
+	record_exit(r);
+
 	return libc_close(fd);
 }
 
@@ -266,113 +861,140 @@ static int is_i915(int fd)
 	return strcmp(name, "i915") == 0;
 }
 
-int
-ioctl(int fd, unsigned long request, ...)
+static void writer_start(void)
 {
-	struct trace *t, **p;
-	va_list args;
-	void *argp;
-	int ret;
+	bool started = false;
 
-	va_start(args, request);
-	argp = va_arg(args, void *);
-	va_end(args);
+	if (__atomic_load_n(&writer.started, __ATOMIC_ACQUIRE) ||
+	    !__atomic_compare_exchange_n(&writer.started, &started, true, false,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return;
 
-	if (_IOC_TYPE(request) != DRM_IOCTL_BASE)
-		goto untraced;
+#ifdef HAVE_LZ4
+	{
+		const char *env = getenv("GEM_EXEC_TRACER_LZ4");
 
-	pthread_mutex_lock(&mutex);
-	for (p = &traces; (t = *p); p = &t->next) {
-		if (fd == t->fd) {
-			if (traces != t) {
-				*p = t->next;
-				t->next = traces;
-				traces = t;
-			}
+		writer.compress = !env || atoi(env);
+	}
+#endif
+	fail_if(pthread_create(&writer.thread, NULL, writer_thread, NULL),
+		"failed to start trace writer\n");
+	__atomic_store_n(&writer.running, true, __ATOMIC_RELEASE);
+}
+
+static struct trace *create_trace(int fd)
+{
+	struct trace *t, *it, *head;
+
+	if (!is_i915(fd))
+		return NULL;
+
+	t = calloc(1, sizeof(*t));
+	if (!t)
+		return NULL;
+
+	t->fd = fd;
+	sprintf(t->filename, "/tmp/trace-%d.%d", getpid(), fd);
+
+	/* A reused fd replaces the file of the last trace closed on it. */
+	for (it = __atomic_load_n(&closed_traces, __ATOMIC_ACQUIRE);
+	     it; it = it->next_closed) {
+		if (it->fd == fd) {
+			t->prev = it;
 			break;
 		}
 	}
-	if (!t) {
-		char filename[80];
 
-		if (!is_i915(fd)) {
-			pthread_mutex_unlock(&mutex);
-			goto untraced;
-		}
+	writer_start();
 
-		t = malloc(sizeof(*t));
-		if (!t) {
-			pthread_mutex_unlock(&mutex);
-			return -ENOMEM;
+	/* Another thread may be tracing its first call on the fd too. */
+	head = __atomic_load_n(&traces, __ATOMIC_ACQUIRE);
+	do {
+		for (it = head; it; it = it->next) {
+			if (it->fd == fd) {
+				free(t);
+				return it;
+			}
 		}
+		t->next = head;
+	} while (!__atomic_compare_exchange_n(&traces, &head, t, false,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_ACQUIRE));
 
-		sprintf(filename, "/tmp/trace-%d.%d", getpid(), fd);
-		t->file = fopen(filename, "w+");
-		t->fd = fd;
+	return t;
+}
 
-		if (!fwrite(&version, sizeof(version), 1, t->file)) {
-			pthread_mutex_unlock(&mutex);
-			fclose(t->file);
-			free(t);
-			return -ENOMEM;
-		}
+static int
+traced_ioctl(struct ring *r, int fd, unsigned long request, void *argp)
+{
+	uint64_t enter, start, end;
+	struct trace *t;
+	int ret;
 
-		t->next = traces;
-		traces = t;
+	enter = now_ns();
+
+	for (t = __atomic_load_n(&traces, __ATOMIC_ACQUIRE); t; t = t->next) {
+		if (t->fd == fd)
+			break;
 	}
-	pthread_mutex_unlock(&mutex);
+	if (!t)
+		t = create_trace(fd);
+	if (!t)
+		return libc_ioctl(fd, request, argp);
 
 	switch (request) {
-	case DRM_IOCTL_I915_GEM_EXECBUFFER2:
-	case DRM_IOCTL_I915_GEM_EXECBUFFER2_WR:
-		trace_exec(t, argp);
-		break;
-
 	case DRM_IOCTL_GEM_CLOSE: {
 		struct drm_gem_close *close = argp;
-		trace_del(t, close->handle);
+		trace_del(r, t, close->handle);
 		break;
 	}
 
 	case DRM_IOCTL_I915_GEM_CONTEXT_DESTROY: {
 		struct drm_i915_gem_context_destroy *close = argp;
-		trace_del_context(t, close->ctx_id);
+		trace_del_context(r, t, close->ctx_id);
 		break;
 	}
+	}
+
+	start = now_ns();
+	ret = libc_ioctl(fd, request, argp);
+	end = now_ns();
+	if (ret)
+		return ret;
+
+	switch (request) {
+	case DRM_IOCTL_I915_GEM_EXECBUFFER2:
+	case DRM_IOCTL_I915_GEM_EXECBUFFER2_WR:
+		trace_exec(r, t, argp, start);
+		break;
 
 	case DRM_IOCTL_I915_GEM_WAIT: {
 		struct drm_i915_gem_wait *w = argp;
-		trace_wait(t, w->bo_handle);
+		trace_wait(r, t, w->bo_handle, start, end);
 		break;
 	}
 
 	case DRM_IOCTL_I915_GEM_SET_DOMAIN: {
 		struct drm_i915_gem_set_domain *w = argp;
-		trace_wait(t, w->handle);
+		trace_wait(r, t, w->handle, start, end);
 		break;
 	}
-	}
-
-	ret = libc_ioctl(fd, request, argp);
-	if (ret)
-		return ret;
 
-	switch (request) {
 	case DRM_IOCTL_I915_GEM_CREATE: {
 		struct drm_i915_gem_create *create = argp;
-		trace_add(t, create->handle, create->size);
+		trace_add(r, t, create->handle, create->size);
 		break;
 	}
 
 	case DRM_IOCTL_I915_GEM_USERPTR: {
 		struct drm_i915_gem_userptr *userptr = argp;
-		trace_add(t, userptr->handle, userptr->user_size);
+		trace_add(r, t, userptr->handle, userptr->user_size);
 		break;
 	}
 
 	case DRM_IOCTL_GEM_OPEN: {
 		struct drm_gem_open *open = argp;
-		trace_add(t, open->handle, open->size);
+		trace_add(r, t, open->handle, open->size);
 		break;
 	}
 
@@ -380,27 +1002,73 @@ ioctl(int fd, unsigned long request, ...)
 		struct drm_prime_handle *prime = argp;
 		off_t size = lseek(prime->fd, 0, SEEK_END);
 		fail_if(size == -1, "failed to get prime bo size\n");
-		trace_add(t, prime->handle, size);
+		trace_add(r, t, prime->handle, size);
 		break;
 	}
 
 	case DRM_IOCTL_MODE_GETFB: {
 		struct drm_mode_fb_cmd *cmd = argp;
-		trace_add(t, cmd->handle, size_for_fb(cmd));
+		trace_add(r, t, cmd->handle, size_for_fb(cmd));
 		break;
 	}
 
 	case DRM_IOCTL_I915_GEM_CONTEXT_CREATE: {
 		struct drm_i915_gem_context_create *create = argp;
-		trace_add_context(t, create->ctx_id);
+		trace_add_context(r, t, create->ctx_id);
 		break;
 	}
 	}
 
+	r->overhead_ns += now_ns() - end + start - enter;
+	r->calls++;
+
 	return 0;
+}
+
+int
+ioctl(int fd, unsigned long request, ...)
+{
+	struct ring *r;
+	va_list args;
+	void *argp;
+	int ret;
+
+	va_start(args, request);
+	argp = va_arg(args, void *);
+	va_end(args);
+
+	if (_IOC_TYPE(request) != DRM_IOCTL_BASE)
+		return libc_ioctl(fd, request, argp);
+
+	r = record_enter();
+	if (!r)
+		return libc_ioctl(fd, request, argp);
+
+	ret = traced_ioctl(r, fd, request, argp);
+	record_exit(r);
 
-untraced:
-	return libc_ioctl(fd, request, argp);
+	return ret;
+}
+
+static void atfork_prepare(void)
+{
+	pthread_mutex_lock(&mutex);
+}
+
+static void atfork_parent(void)
+{
+	pthread_mutex_unlock(&mutex);
+}
+
+static void atfork_child(void)
+{
+	/* The child traces into its own files, with its own writer. */
+	traces = NULL;
+	closed_traces = NULL;
+	rings = NULL;
+	local_ring = NULL;
+	memset(&writer, 0, sizeof(writer));
+	pthread_mutex_init(&mutex, NULL);
 }
 
 static void __attribute__ ((constructor))
@@ -410,4 +1078,83 @@ init(void)
 	libc_ioctl = dlsym(RTLD_NEXT, "ioctl");
 	fail_if(libc_close == NULL || libc_ioctl == NULL,
 		"failed to get libc ioctl or close\n");
+
+	fail_if(pthread_key_create(&ring_key, ring_destroy),
+		"failed to create trace ring key\n");
+	pthread_atfork(atfork_prepare, atfork_parent, atfork_child);
+}
+
+static void trace_free(struct trace *t)
+{
+	if (t->file)
+		fclose(t->file);
+	free(t->chunk);
+	free(t);
+}
+
+static void __attribute__ ((destructor))
+fini(void)
+{
+	uint64_t deadline = now_ns() + 1000000000ull;
+	bool busy = false;
+	struct trace *t;
+	struct ring *r;
+
+	__atomic_store_n(&writer.stop, true, __ATOMIC_SEQ_CST);
+
+	/* The writer no longer releases rings once it sees the stop. */
+	pthread_mutex_lock(&mutex);
+	pthread_mutex_unlock(&mutex);
+
+	/*
+	 * Let the calls already inside the tracer finish their records, for
+	 * a while in case one is blocked in the kernel.
+	 */
+	for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+		struct timespec tv = { .tv_nsec = 10000 };
+
+		while (__atomic_load_n(&r->active, __ATOMIC_ACQUIRE)) {
+			if (now_ns() > deadline) {
+				busy = true;
+				break;
+			}
+			nanosleep(&tv, NULL);
+		}
+	}
+
+	if (!__atomic_load_n(&writer.running, __ATOMIC_ACQUIRE))
+		return;
+
+	__atomic_store_n(&writer.quit, true, __ATOMIC_RELEASE);
+	pthread_join(writer.thread, NULL);
+
+	for (r = rings; r; r = r->next)
+		ring_account(r);
+
+	fprintf(stderr,
+		"gem_exec_tracer: %"PRIu64" records in %"PRIu64" ioctls, "
+		"%.1f us overhead per ioctl, %"PRIu64" stalls (%.1f ms)\n",
+		writer.records, writer.calls,
+		writer.calls ? writer.overhead_ns / 1e3 / writer.calls : 0.,
+		writer.stalls, writer.stall_ns / 1e6);
+	fprintf(stderr,
+		"gem_exec_tracer: %.1f MiB in %"PRIu64" chunks, %.1f MiB written%s, "
+		"writer %.1f ms cpu\n",
+		writer.raw / 1048576., writer.chunks,
+		writer.stored / 1048576.,
+		writer.compress ? " (lz4)" : "",
+		writer.cpu_ns / 1e6);
+
+	/* A call still inside the tracer may yet look up a trace. */
+	if (busy)
+		return;
+
+	while ((t = traces)) {
+		traces = t->next;
+		trace_free(t);
+	}
+	while ((t = closed_traces)) {
+		closed_traces = t->next_closed;
+		trace_free(t);
+	}
 }
@@ -42,6 +42,7 @@
 #include <limits.h>
 #include <pthread.h>
 #include <math.h>
+#include <getopt.h>
 
 #include "drm.h"
 #include "drmtest.h"
@@ -126,15 +127,20 @@ struct work_buffer_size {
 	unsigned long max;
 };
 
+struct sim_request;
+
 struct working_set {
 	int id;
 	bool shared;
 	unsigned int nr;
 	uint32_t *handles;
 	struct work_buffer_size *sizes;
+	struct sim_request **sim_writers;
 };
 
 struct workload;
+struct workload_balancer;
+struct sim_client;
 
 struct w_step
 {
@@ -226,11 +232,25 @@ struct workload
 
 	struct igt_list_head requests[NUM_ENGINES];
 	unsigned int nrequest[NUM_ENGINES];
+
+	const struct workload_balancer *balancer;
+	unsigned int rr;
+	uint64_t busy[NUM_ENGINES];
+
+	struct sim_client *sim;
+
+	/* Scheduling metrics */
+	double elapsed;
+	unsigned int cycles;
+	unsigned int missed;
+	unsigned int nr_latency;
+	unsigned int *latency_us; /* cycle start until period or cycle end */
 };
 
 static unsigned int master_prng;
 
 static int verbose = 1;
+static bool simulate;
 static int fd;
 static struct drm_i915_gem_context_param_sseu device_sseu = {
 	.slice_mask = -1 /* Force read on first use. */
@@ -509,7 +529,21 @@ static void query_engines(void)
 
 	__engines_queried = true;
 
-	if (!has_engine_query(fd)) {
+	if (simulate) {
+		/* Gen11-like topology with two VCS engines. */
+		static const struct i915_engine_class_instance sim_topology[] = {
+			{ I915_ENGINE_CLASS_RENDER, 0 },
+			{ I915_ENGINE_CLASS_COPY, 0 },
+			{ I915_ENGINE_CLASS_VIDEO, 0 },
+			{ I915_ENGINE_CLASS_VIDEO, 2 },
+			{ I915_ENGINE_CLASS_VIDEO_ENHANCE, 0 },
+		};
+
+		num = ARRAY_SIZE(sim_topology);
+		engines = calloc(num, sizeof(*engines));
+		igt_assert(engines);
+		memcpy(engines, sim_topology, sizeof(sim_topology));
+	} else if (!has_engine_query(fd)) {
 		unsigned int num_bsd = gem_has_bsd(fd) + gem_has_bsd2(fd);
 		unsigned int i = 0;
 
@@ -1127,7 +1161,8 @@ parse_workload(struct w_arg *arg, unsigned int flags, double scale_dur,
 			fstart = NULL;
 
 			if (field[0] == '*') {
-				check_arg(intel_gen(intel_get_drm_devid(fd)) < 8,
+				check_arg(!simulate &&
+					  intel_gen(intel_get_drm_devid(fd)) < 8,
 					  "Infinite batch at step %u needs Gen8+!\n",
 					  nr_steps);
 				step.unbound_duration = true;
@@ -1211,7 +1246,7 @@ add_step:
 		nr_steps += app_w->nr_steps;
 	}
 
-	wrk = malloc(sizeof(*wrk));
+	wrk = calloc(1, sizeof(*wrk));
 	igt_assert(wrk);
 
 	wrk->nr_steps = nr_steps;
@@ -1334,7 +1369,7 @@ clone_workload(struct workload *_wrk)
 	}
 
 	/* Check if we need a sw sync timeline. */
-	for (i = 0; i < wrk->nr_steps; i++) {
+	for (i = 0; !simulate && i < wrk->nr_steps; i++) {
 		if (wrk->steps[i].type == SW_FENCE) {
 			wrk->sync_timeline = sw_sync_timeline_create();
 			igt_assert(wrk->sync_timeline >= 0);
@@ -1765,9 +1800,15 @@ allocate_working_set(struct workload *wrk, struct working_set *set)
 	set->handles = calloc(set->nr, sizeof(*set->handles));
 	igt_assert(set->handles);
 
+	if (simulate) {
+		set->sim_writers = calloc(set->nr, sizeof(*set->sim_writers));
+		igt_assert(set->sim_writers);
+	}
+
 	for (i = 0; i < set->nr; i++) {
 		set->sizes[i].size = get_buffer_size(wrk, &set->sizes[i]);
-		set->handles[i] = alloc_bo(fd, set->sizes[i].size);
+		if (!simulate)
+			set->handles[i] = alloc_bo(fd, set->sizes[i].size);
 		total += set->sizes[i].size;
 	}
 
@@ -1903,7 +1944,8 @@ static int prepare_workload(unsigned int id, struct workload *wrk)
 					wsim_err("Load balancing needs an engine map!\n");
 					return 1;
 				}
-				if (intel_gen(intel_get_drm_devid(fd)) < 11) {
+				if (!simulate &&
+				    intel_gen(intel_get_drm_devid(fd)) < 11) {
 					wsim_err("Load balancing needs relative mmio support, gen11+!\n");
 					return 1;
 				}
@@ -1940,6 +1982,11 @@ static int prepare_workload(unsigned int id, struct workload *wrk)
 
 		igt_assert(!ctx->id);
 
+		if (simulate) {
+			ctx->priority = wrk->prio;
+			continue;
+		}
+
 		/* Find existing context to share ppgtt with. */
 		for (j = 0; !share_vm && j < wrk->nr_ctxs; j++) {
 			struct drm_i915_gem_context_param param = {
@@ -2084,7 +2131,7 @@ static int prepare_workload(unsigned int id, struct workload *wrk)
 	/*
 	 * Scan for SSEU control steps.
 	 */
-	for (i = 0, w = wrk->steps; i < wrk->nr_steps; i++, w++) {
+	for (i = 0, w = wrk->steps; !simulate && i < wrk->nr_steps; i++, w++) {
 		if (w->type == SSEU) {
 			get_device_sseu();
 			break;
@@ -2139,6 +2186,10 @@ static int prepare_workload(unsigned int id, struct workload *wrk)
 	if (sets)
 		free(sets);
 
+	/* Simulated clients do not need any GPU objects. */
+	if (simulate)
+		return 0;
+
 	/*
 	 * Allocate batch buffers.
 	 */
@@ -2256,6 +2307,285 @@ static void sync_deps(struct workload *wrk, struct w_step *w)
 	}
 }
 
+/*
+ * Balancers pick the physical engine for batches submitted to the VCS class
+ * from contexts without an engine map. All of them work from the same view of
+ * the engines, whether running on the GPU or simulated.
+ */
+struct workload_balancer {
+	const char *name;
+	const char *desc;
+	int (*init)(const struct workload_balancer *balancer,
+		    struct workload *wrk);
+	enum intel_engine_id (*balance)(const struct workload_balancer *balancer,
+					struct workload *wrk, struct w_step *w);
+};
+
+static int pmu_busy[NUM_ENGINES] = { [0 ... NUM_ENGINES - 1] = -1 };
+
+static bool sim_step_busy(struct workload *wrk, struct w_step *w);
+static uint64_t sim_engine_busy(struct workload *wrk,
+				enum intel_engine_id engine);
+
+static bool has_engine(enum intel_engine_id engine)
+{
+	unsigned int i;
+
+	query_engines();
+
+	if (engine == VCS1 || engine == VCS2)
+		return engine - VCS1 < num_engines_in_class(VCS);
+
+	for (i = 0; i < __num_engines; i++) {
+		if (engine == RCS &&
+		    __engines[i].engine_class == I915_ENGINE_CLASS_RENDER)
+			return true;
+		if (engine == BCS &&
+		    __engines[i].engine_class == I915_ENGINE_CLASS_COPY)
+			return true;
+		if (engine == VECS &&
+		    __engines[i].engine_class == I915_ENGINE_CLASS_VIDEO_ENHANCE)
+			return true;
+	}
+
+	return false;
+}
+
+static int pmu_open_engine(enum intel_engine_id engine)
+{
+	struct i915_engine_class_instance ci;
+
+	if (pmu_busy[engine] >= 0)
+		return 0;
+
+	ci = get_engine(engine);
+	pmu_busy[engine] =
+		perf_i915_open(fd, I915_PMU_ENGINE_BUSY(ci.engine_class,
+							ci.engine_instance));
+
+	return pmu_busy[engine] >= 0 ? 0 : -errno;
+}
+
+static uint64_t pmu_read_engine(enum intel_engine_id engine)
+{
+	uint64_t buf[2];
+
+	igt_assert(pmu_busy[engine] >= 0);
+	igt_assert_eq(read(pmu_busy[engine], buf, sizeof(buf)), sizeof(buf));
+
+	return buf[0];
+}
+
+/* Whether the last submission of a step is still executing. */
+static bool step_busy(struct workload *wrk, struct w_step *w)
+{
+	if (simulate)
+		return sim_step_busy(wrk, w);
+
+	return gem_bo_busy(fd, w->obj[0].handle);
+}
+
+/* Total time the engine has spent executing batches, in nanoseconds. */
+static uint64_t engine_busy(struct workload *wrk, enum intel_engine_id engine)
+{
+	if (simulate)
+		return sim_engine_busy(wrk, engine);
+
+	return pmu_read_engine(engine);
+}
+
+/* Drop completed batches from the per-engine lists of outstanding ones. */
+static void retire_requests(struct workload *wrk, enum intel_engine_id engine)
+{
+	struct w_step *w, *tmp;
+
+	igt_list_for_each_entry_safe(w, tmp, &wrk->requests[engine], rq_link) {
+		if (step_busy(wrk, w))
+			continue;
+
+		w->request = -1;
+		igt_list_del(&w->rq_link);
+		wrk->nrequest[engine]--;
+	}
+}
+
+static unsigned int
+balance_candidates(struct workload *wrk, enum intel_engine_id *engines)
+{
+	unsigned int count = num_engines_in_class(VCS);
+	enum intel_engine_id first;
+	unsigned int i;
+
+	fill_engines_id_class(engines, VCS);
+
+	/* Rotate the starting engine so ties do not always pick VCS1. */
+	first = engines[wrk->rr++ % count];
+	for (i = 0; i < count; i++)
+		engines[i] = first + i < VCS1 + count ?
+			     first + i : first + i - count;
+
+	return count;
+}
+
+static enum intel_engine_id
+rr_balance(const struct workload_balancer *balancer,
+	   struct workload *wrk, struct w_step *w)
+{
+	enum intel_engine_id engines[2];
+
+	balance_candidates(wrk, engines);
+
+	return engines[0];
+}
+
+static enum intel_engine_id
+qd_balance(const struct workload_balancer *balancer,
+	   struct workload *wrk, struct w_step *w)
+{
+	enum intel_engine_id engines[2], engine;
+	unsigned int count, i;
+
+	count = balance_candidates(wrk, engines);
+
+	engine = engines[0];
+	for (i = 0; i < count; i++) {
+		retire_requests(wrk, engines[i]);
+		if (wrk->nrequest[engines[i]] < wrk->nrequest[engine])
+			engine = engines[i];
+	}
+
+	return engine;
+}
+
+static int busy_init(const struct workload_balancer *balancer,
+		     struct workload *wrk)
+{
+	enum intel_engine_id engines[2];
+	unsigned int count, i;
+	int ret;
+
+	count = balance_candidates(wrk, engines);
+
+	for (i = 0; !simulate && i < count; i++) {
+		ret = pmu_open_engine(engines[i]);
+		if (ret) {
+			wsim_err("Busy balancer needs i915 PMU engine busyness! (%s)\n",
+				 strerror(-ret));
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+static enum intel_engine_id
+busy_balance(const struct workload_balancer *balancer,
+	     struct workload *wrk, struct w_step *w)
+{
+	enum intel_engine_id engines[2], engine = DEFAULT;
+	uint64_t busy, delta, min = UINT64_MAX;
+	unsigned int count, i;
+
+	count = balance_candidates(wrk, engines);
+
+	/* Least busy engine since the previous balancing decision. */
+	for (i = 0; i < count; i++) {
+		busy = engine_busy(wrk, engines[i]);
+		delta = busy - wrk->busy[engines[i]];
+		wrk->busy[engines[i]] = busy;
+
+		if (delta < min) {
+			min = delta;
+			engine = engines[i];
+		}
+	}
+
+	return engine;
+}
+
+static uint64_t expected_duration(const struct w_step *w)
+{
+	return (w->duration.min + w->duration.max) / 2;
+}
+
+static enum intel_engine_id
+edf_balance(const struct workload_balancer *balancer,
+	    struct workload *wrk, struct w_step *w)
+{
+	enum intel_engine_id engines[2], engine = DEFAULT;
+	uint64_t finish, min = UINT64_MAX;
+	unsigned int count, i;
+
+	count = balance_candidates(wrk, engines);
+
+	/*
+	 * Estimate when the batch would complete on each engine from the
+	 * expected durations of the batches still queued there.
+	 */
+	for (i = 0; i < count; i++) {
+		struct w_step *s;
+
+		retire_requests(wrk, engines[i]);
+
+		finish = expected_duration(w);
+		igt_list_for_each_entry(s, &wrk->requests[engines[i]], rq_link)
+			finish += expected_duration(s);
+
+		if (finish < min) {
+			min = finish;
+			engine = engines[i];
+		}
+	}
+
+	return engine;
+}
+
+static const struct workload_balancer all_balancers[] = {
+	{
+		.name = "rr",
+		.desc = "Simple round-robin.",
+		.balance = rr_balance,
+	},
+	{
+		.name = "qd",
+		.desc = "Queue depth estimation based on the number of outstanding batches.",
+		.balance = qd_balance,
+	},
+	{
+		.name = "busy",
+		.desc = "Least busy engine since the previous submission, from engine busyness.",
+		.init = busy_init,
+		.balance = busy_balance,
+	},
+	{
+		.name = "edf",
+		.desc = "Earliest deadline first, by the expected completion of outstanding batches.",
+		.balance = edf_balance,
+	},
+};
+
+static enum intel_engine_id balance_engine(struct workload *wrk,
+					   struct w_step *w)
+{
+	if (w->engine != VCS || !wrk->balancer ||
+	    __get_ctx(wrk, w)->engine_map)
+		return w->engine;
+
+	return wrk->balancer->balance(wrk->balancer, wrk, w);
+}
+
+static void record_latency(struct workload *wrk, unsigned int us)
+{
+	if (!(wrk->nr_latency & (wrk->nr_latency - 1))) {
+		wrk->latency_us = realloc(wrk->latency_us,
+					  max(wrk->nr_latency * 2, 16u) *
+					  sizeof(*wrk->latency_us));
+		igt_assert(wrk->latency_us);
+	}
+
+	wrk->latency_us[wrk->nr_latency++] = us;
+}
+
 static void *run_workload(void *data)
 {
 	struct workload *wrk = (struct workload *)data;
@@ -2272,6 +2602,7 @@ static void *run_workload(void *data)
 	for (count = 0; wrk->run && (wrk->background || count < wrk->repeat);
 	     count++) {
 		unsigned int cur_seqno = wrk->sync_seqno;
+		bool period = false;
 
 		clock_gettime(CLOCK_MONOTONIC, &wrk->repeat_start);
 
@@ -2288,6 +2619,8 @@ static void *run_workload(void *data)
 
 				clock_gettime(CLOCK_MONOTONIC, &now);
 				elapsed = elapsed_us(&wrk->repeat_start, &now);
+				record_latency(wrk, elapsed);
+				period = true;
 				do_sleep = w->period - elapsed;
 				time_tot += elapsed;
 				if (elapsed < time_min)
@@ -2377,6 +2710,8 @@ static void *run_workload(void *data)
 
 			igt_assert(w->type == BATCH);
 
+			engine = balance_engine(wrk, w);
+
 			if (wrk->flags & DEPSYNC)
 				sync_deps(wrk, w);
 
@@ -2415,6 +2750,13 @@ static void *run_workload(void *data)
 			}
 		}
 
+		if (!period && wrk->run) {
+			struct timespec now;
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			record_latency(wrk, elapsed_us(&wrk->repeat_start, &now));
+		}
+
 		if (wrk->sync_timeline) {
 			int inc;
 
@@ -2443,12 +2785,16 @@ static void *run_workload(void *data)
 
 	clock_gettime(CLOCK_MONOTONIC, &t_end);
 
+	wrk->elapsed = elapsed(&t_start, &t_end);
+	wrk->cycles = count;
+	wrk->missed = missed;
+
 	if (wrk->print_stats) {
-		double t = elapsed(&t_start, &t_end);
+		double t = wrk->elapsed;
 
 		printf("%c%u: %.3fs elapsed (%d cycles, %.3f workloads/s).",
 		       wrk->background ? ' ' : '*', wrk->id,
-		       t, count, count / t);
+		       t, count, t > 0 ? count / t : 0);
 		if (time_tot)
 			printf(" Time avg/min/max=%lu/%lu/%luus; %u missed.",
 			       time_tot / count, time_min, time_max, missed);
@@ -2458,117 +2804,1108 @@ static void *run_workload(void *data)
 	return NULL;
 }
 
-static void fini_workload(struct workload *wrk)
+/*
+ * Discrete-event simulation of a workload (--simulate).
+ *
+ * Instead of submitting batches to the GPU, clients step through their
+ * workloads against a model of the GPU engines, with a virtual clock jumping
+ * from one event (client wakeup or batch completion) to the next. Batches run
+ * for exactly their descriptor duration and every engine picks the highest
+ * priority ready request, oldest first. Running batches are never preempted.
+ */
+
+#define SIM_UNBOUND UINT64_MAX
+#define SIM_EXECBUF_NS (5000) /* CPU cost of a batch submission */
+
+enum sim_rq_state {
+	SIM_QUEUED,
+	SIM_RUNNING,
+	SIM_DONE,
+};
+
+struct sim_dep {
+	struct sim_request *rq;
+	bool submit;
+};
+
+struct sim_request {
+	unsigned int ref;
+	enum sim_rq_state state;
+	struct sim_client *client; /* NULL for sw fences */
+	int prio;
+	uint64_t mask; /* engines the request can execute on */
+	enum intel_engine_id engine;
+	uint64_t duration;
+	struct ctx *bond_ctx;
+	unsigned int nr_deps;
+	struct sim_dep *deps;
+	struct igt_list_head link;
+};
+
+struct sim_engine {
+	struct sim_request *rq;
+	uint64_t start, end;
+	uint64_t busy;
+	unsigned long count;
+};
+
+struct sim_client {
+	struct sim *sim;
+	struct workload *wrk;
+	unsigned int step;
+	unsigned int phase; /* progress within a step which had to wait */
+	enum intel_engine_id engine; /* of the batch being submitted */
+	unsigned int count;
+	bool done;
+	bool period;
+	uint64_t repeat_start, t_end;
+	int throttle, qd_throttle;
+	unsigned int outstanding;
+	struct sim_request *wait;
+	struct sim_request **last; /* last request per step */
+	struct sim_request **ctx_last; /* last load balanced request per ctx */
+	unsigned long time_tot, time_min, time_max;
+	int missed;
+};
+
+struct sim_event {
+	uint64_t t, seq;
+	struct sim_client *client; /* NULL for engine completion */
+	enum intel_engine_id engine;
+};
+
+struct sim {
+	uint64_t now, seq;
+	unsigned int nr_events, max_events;
+	struct sim_event *events;
+	struct igt_list_head pending;
+	struct sim_engine engines[NUM_ENGINES];
+	unsigned int vcs_rr;
+	unsigned int nr_clients;
+	struct sim_client *clients;
+};
+
+static const enum intel_engine_id sim_engines[] = {
+	RCS, BCS, VCS1, VCS2, VECS
+};
+
+static bool sim_step_busy(struct workload *wrk, struct w_step *w)
 {
-	free(wrk->steps);
-	free(wrk);
+	struct sim_request *rq = wrk->sim->last[w->idx];
+
+	return rq && rq->state != SIM_DONE;
 }
 
-static void print_help(void)
+static uint64_t sim_engine_busy(struct workload *wrk,
+				enum intel_engine_id engine)
 {
-	puts(
-"Usage: gem_wsim [OPTIONS]\n"
-"\n"
-"Runs a simulated workload on the GPU.\n"
-"Options:\n"
-"  -h                This text.\n"
-"  -q                Be quiet - do not output anything to stdout.\n"
-"  -I <n>            Initial randomness seed.\n"
-"  -p <n>            Context priority to use for the following workload on the\n"
-"                    command line.\n"
-"  -w <desc|path>    Filename or a workload descriptor.\n"
-"                    Can be given multiple times.\n"
-"  -W <desc|path>    Filename or a master workload descriptor.\n"
-"                    Only one master workload can be optinally specified in which\n"
-"                    case all other workloads become background ones and run as\n"
-"                    long as the master.\n"
-"  -a <desc|path>    Append a workload to all other workloads.\n"
-"  -r <n>            How many times to emit the workload.\n"
-"  -c <n>            Fork N clients emitting the workload simultaneously.\n"
-"  -s                Turn on small SSEU config for the next workload on the\n"
-"                    command line. Subsequent -s switches it off.\n"
-"  -S                Synchronize the sequence of random batch durations between\n"
-"                    clients.\n"
-"  -d                Sync between data dependencies in userspace.\n"
-"  -f <scale>        Scale factor for batch durations.\n"
-"  -F <scale>        Scale factor for delays.\n"
-"  -L                List GPUs.\n"
-"  -D <gpu>          One of the GPUs from -L.\n"
-	);
+	struct sim *sim = wrk->sim->sim;
+	struct sim_engine *e = &sim->engines[engine];
+
+	return e->busy + (e->rq ? sim->now - e->start : 0);
 }
 
-static char *load_workload_descriptor(char *filename)
+static bool sim_event_before(const struct sim_event *a,
+			     const struct sim_event *b)
 {
-	struct stat sbuf;
-	char *buf;
-	int infd, ret, i;
-	ssize_t len;
+	return a->t < b->t || (a->t == b->t && a->seq < b->seq);
+}
 
-	ret = stat(filename, &sbuf);
-	if (ret || !S_ISREG(sbuf.st_mode))
-		return filename;
+static void sim_push(struct sim *sim, uint64_t t, struct sim_client *client,
+		     enum intel_engine_id engine)
+{
+	struct sim_event ev = { t, sim->seq++, client, engine };
+	unsigned int i;
 
-	igt_assert(sbuf.st_size < 1024 * 1024); /* Just so. */
-	buf = malloc(sbuf.st_size);
-	igt_assert(buf);
+	if (sim->nr_events == sim->max_events) {
+		sim->max_events = sim->max_events ? 2 * sim->max_events : 64;
+		sim->events = realloc(sim->events,
+				      sim->max_events * sizeof(*sim->events));
+		igt_assert(sim->events);
+	}
 
-	infd = open(filename, O_RDONLY);
-	igt_assert(infd >= 0);
-	len = read(infd, buf, sbuf.st_size);
-	igt_assert(len == sbuf.st_size);
-	close(infd);
+	/* Binary min-heap ordered by time, ties broken in insertion order. */
+	for (i = sim->nr_events++; i; i = (i - 1) / 2) {
+		struct sim_event *parent = &sim->events[(i - 1) / 2];
 
-	for (i = 0; i < len; i++) {
-		if (buf[i] == '\n')
-			buf[i] = ',';
+		if (!sim_event_before(&ev, parent))
+			break;
+
+		sim->events[i] = *parent;
 	}
+	sim->events[i] = ev;
+}
 
-	len--;
-	while (buf[len] == ',')
-		buf[len--] = 0;
+static bool sim_pop(struct sim *sim, struct sim_event *ev)
+{
+	struct sim_event last;
+	unsigned int i, child;
 
-	return buf;
+	if (!sim->nr_events)
+		return false;
+
+	*ev = sim->events[0];
+	last = sim->events[--sim->nr_events];
+
+	for (i = 0; (child = 2 * i + 1) < sim->nr_events; i = child) {
+		if (child + 1 < sim->nr_events &&
+		    sim_event_before(&sim->events[child + 1],
+				     &sim->events[child]))
+			child++;
+
+		if (!sim_event_before(&sim->events[child], &last))
+			break;
+
+		sim->events[i] = sim->events[child];
+	}
+	sim->events[i] = last;
+
+	return true;
 }
 
-static struct w_arg *
-add_workload_arg(struct w_arg *w_args, unsigned int nr_args, char *w_arg,
-		 int prio, bool sseu)
+static struct sim_request *sim_rq_get(struct sim_request *rq)
 {
-	w_args = realloc(w_args, sizeof(*w_args) * nr_args);
-	igt_assert(w_args);
-	w_args[nr_args - 1] = (struct w_arg) { w_arg, NULL, prio, sseu };
+	if (rq)
+		rq->ref++;
 
-	return w_args;
+	return rq;
 }
 
-int main(int argc, char **argv)
+static void sim_rq_put(struct sim_request *rq)
 {
-	struct igt_device_card card = { };
-	bool list_devices_arg = false;
-	unsigned int repeat = 1;
-	unsigned int clients = 1;
-	unsigned int flags = 0;
-	struct timespec t_start, t_end;
-	struct workload **w, **wrk = NULL;
-	struct workload *app_w = NULL;
-	unsigned int nr_w_args = 0;
-	int master_workload = -1;
-	char *append_workload_arg = NULL;
-	struct w_arg *w_args = NULL;
-	int exitcode = EXIT_FAILURE;
-	char *device_arg = NULL;
-	double scale_time = 1.0f;
-	double scale_dur = 1.0f;
-	int prio = 0;
+	unsigned int i;
+
+	if (!rq || --rq->ref)
+		return;
+
+	for (i = 0; i < rq->nr_deps; i++)
+		sim_rq_put(rq->deps[i].rq);
+	free(rq->deps);
+	free(rq);
+}
+
+static struct sim_request *sim_rq_create(struct sim_client *client)
+{
+	struct sim_request *rq = calloc(1, sizeof(*rq));
+
+	igt_assert(rq);
+	rq->ref = 1;
+	rq->client = client;
+
+	return rq;
+}
+
+static void
+sim_rq_add_dep(struct sim_request *rq, struct sim_request *dep, bool submit)
+{
+	if (!dep || dep->state == SIM_DONE)
+		return;
+
+	rq->deps = realloc(rq->deps, (rq->nr_deps + 1) * sizeof(*rq->deps));
+	igt_assert(rq->deps);
+	rq->deps[rq->nr_deps++] = (struct sim_dep) { sim_rq_get(dep), submit };
+}
+
+static bool sim_rq_ready(const struct sim_request *rq)
+{
+	unsigned int i;
+
+	for (i = 0; i < rq->nr_deps; i++) {
+		const struct sim_request *dep = rq->deps[i].rq;
+
+		if (dep->state == SIM_DONE ||
+		    (rq->deps[i].submit && dep->state == SIM_RUNNING))
+			continue;
+
+		return false;
+	}
+
+	return true;
+}
+
+/* Apply engine bonds once the submit fence master has picked its engine. */
+static uint64_t sim_rq_mask(const struct sim_request *rq)
+{
+	unsigned int i, j;
+
+	if (!rq->bond_ctx)
+		return rq->mask;
+
+	for (i = 0; i < rq->nr_deps; i++) {
+		const struct sim_request *master = rq->deps[i].rq;
+
+		if (!rq->deps[i].submit || master->state == SIM_QUEUED ||
+		    !master->client)
+			continue;
+
+		for (j = 0; j < rq->bond_ctx->bond_count; j++) {
+			const struct bond *bond = &rq->bond_ctx->bonds[j];
+
+			if (bond->master == master->engine)
+				return rq->mask & bond->mask;
+		}
+	}
+
+	return rq->mask;
+}
+
+static bool sim_wait(struct sim_client *c, struct sim_request *rq)
+{
+	if (!rq || rq->state == SIM_DONE)
+		return false;
+
+	c->wait = rq;
+	return true;
+}
+
+static void sim_sleep(struct sim *sim, struct sim_client *c, uint64_t ns)
+{
+	sim_push(sim, sim->now + ns, c, DEFAULT);
+}
+
+static void sim_complete(struct sim *sim, struct sim_request *rq)
+{
+	unsigned int i;
+
+	rq->state = SIM_DONE;
+
+	for (i = 0; i < sim->nr_clients; i++) {
+		struct sim_client *c = &sim->clients[i];
+
+		if (c->wait == rq) {
+			c->wait = NULL;
+			sim_push(sim, sim->now, c, DEFAULT);
+		}
+	}
+}
+
+static void sim_start(struct sim *sim, enum intel_engine_id id,
+		      struct sim_request *rq)
+{
+	struct sim_engine *engine = &sim->engines[id];
+
+	igt_list_del(&rq->link);
+	rq->state = SIM_RUNNING;
+	rq->engine = id;
+
+	engine->rq = rq;
+	engine->start = sim->now;
+	engine->count++;
+
+	if (rq->duration == SIM_UNBOUND) {
+		engine->end = SIM_UNBOUND;
+	} else {
+		engine->end = sim->now + rq->duration;
+		sim_push(sim, engine->end, NULL, id);
+	}
+}
+
+static void sim_dispatch(struct sim *sim)
+{
+	bool progress;
+
+	/* Starting a request may release submit fences for other engines. */
+	do {
+		unsigned int i;
+
+		progress = false;
+
+		for (i = 0; i < ARRAY_SIZE(sim_engines); i++) {
+			enum intel_engine_id id = sim_engines[i];
+			struct sim_request *rq, *best = NULL;
+
+			if (sim->engines[id].rq)
+				continue;
+
+			igt_list_for_each_entry(rq, &sim->pending, link) {
+				if (best && rq->prio <= best->prio)
+					continue;
+
+				if ((sim_rq_mask(rq) & BIT(id)) &&
+				    sim_rq_ready(rq))
+					best = rq;
+			}
+
+			if (best) {
+				sim_start(sim, id, best);
+				progress = true;
+			}
+		}
+	} while (progress);
+}
+
+static void sim_client_finish(struct sim *sim, struct sim_client *c)
+{
+	c->done = true;
+	if (!c->outstanding)
+		c->t_end = sim->now;
+}
+
+static void sim_retire(struct sim *sim, enum intel_engine_id id)
+{
+	struct sim_engine *engine = &sim->engines[id];
+	struct sim_request *rq = engine->rq;
+	struct sim_client *c = rq->client;
+
+	engine->rq = NULL;
+	engine->busy += sim->now - engine->start;
+
+	sim_complete(sim, rq);
+
+	if (!--c->outstanding && c->done)
+		c->t_end = sim->now;
+
+	sim_rq_put(rq);
+}
+
+static void
+sim_signal_fences(struct sim *sim, struct sim_client *c, unsigned int idx)
+{
+	struct workload *wrk = c->wrk;
+	unsigned int i;
+
+	for (i = 0; i <= idx && i < wrk->nr_steps; i++) {
+		struct sim_request *rq = c->last[i];
+
+		if (wrk->steps[i].type == SW_FENCE && rq &&
+		    rq->state != SIM_DONE)
+			sim_complete(sim, rq);
+	}
+}
+
+static uint64_t sim_engine_mask(struct sim *sim, struct ctx *ctx,
+				enum intel_engine_id engine)
+{
+	uint64_t mask = 0;
+	unsigned int i;
+
+	if (ctx->engine_map) {
+		for (i = 0; i < ctx->engine_map_count; i++) {
+			if (ctx->engine_map[i] == engine)
+				return BIT(engine);
+			mask |= BIT(ctx->engine_map[i]);
+		}
+
+		igt_assert(ctx->load_balance);
+		return mask;
+	}
+
+	if (engine == DEFAULT)
+		engine = RCS;
+	else if (engine == VCS) /* Legacy BSD round-robin selection. */
+		engine = sim->vcs_rr++ & 1 ? VCS2 : VCS1;
+
+	return BIT(engine);
+}
+
+static int sim_sync_target(struct workload *wrk, int target)
+{
+	if (target < 0)
+		target = wrk->nr_steps + target;
+
+	while (wrk->steps[target].type != BATCH) {
+		if (--target < 0)
+			target = wrk->nr_steps + target;
+	}
+
+	return target;
+}
+
+static void sim_submit(struct sim *sim, struct sim_client *c, struct w_step *w,
+		       enum intel_engine_id engine)
+{
+	struct workload *wrk = c->wrk;
+	struct ctx *ctx = __get_ctx(wrk, w);
+	struct sim_request *rq = sim_rq_create(c);
+	unsigned int i;
+
+	rq->prio = ctx->priority;
+	rq->mask = sim_engine_mask(sim, ctx, engine);
+	rq->duration = w->unbound_duration ?
+		       SIM_UNBOUND : 1000ull * get_duration(wrk, w);
+
+	for (i = 0; i < w->data_deps.nr; i++) {
+		struct dep_entry *dep = &w->data_deps.list[i];
+		struct sim_request **writer;
+
+		if (dep->working_set == -1) {
+			if (dep->target)
+				sim_rq_add_dep(rq, c->last[w->idx + dep->target],
+					       false);
+			continue;
+		}
+
+		igt_assert(dep->working_set <= wrk->max_working_set_id);
+		writer = &wrk->working_sets[dep->working_set]->sim_writers[dep->target];
+		sim_rq_add_dep(rq, *writer, false);
+		if (dep->write) {
+			sim_rq_put(*writer);
+			*writer = sim_rq_get(rq);
+		}
+	}
+
+	for (i = 0; i < w->fence_deps.nr; i++)
+		sim_rq_add_dep(rq, c->last[w->idx + w->fence_deps.list[i].target],
+			       w->fence_deps.submit_fence);
+
+	if (w->fence_deps.submit_fence && ctx->bond_count)
+		rq->bond_ctx = ctx;
+
+	/* A context can only execute on one engine at a time. */
+	if (__builtin_popcountll(rq->mask) > 1) {
+		sim_rq_add_dep(rq, c->ctx_last[w->context], false);
+		sim_rq_put(c->ctx_last[w->context]);
+		c->ctx_last[w->context] = sim_rq_get(rq);
+	}
+
+	sim_rq_put(c->last[w->idx]);
+	c->last[w->idx] = sim_rq_get(rq);
+
+	igt_list_add_tail(&rq->link, &sim->pending);
+	c->outstanding++;
+}
+
+/* Returns true if the client has to wait before completing the step. */
+static bool sim_step(struct sim *sim, struct sim_client *c, struct w_step *w)
+{
+	struct workload *wrk = c->wrk;
+	struct sim_request *rq;
+	unsigned int i;
+	int elapsed;
+
+	switch (w->type) {
+	case DELAY:
+		if (c->phase++)
+			return false;
+
+		sim_sleep(sim, c, 1000ull * w->delay);
+		return true;
+	case PERIOD:
+		if (c->phase++)
+			return false;
+
+		elapsed = (sim->now - c->repeat_start) / 1000;
+		record_latency(wrk, elapsed);
+		c->period = true;
+		c->time_tot += elapsed;
+		if (elapsed < c->time_min)
+			c->time_min = elapsed;
+		if (elapsed > c->time_max)
+			c->time_max = elapsed;
+		if (w->period < elapsed) {
+			c->missed++;
+			return false;
+		}
+
+		sim_sleep(sim, c, 1000ull * (w->period - elapsed));
+		return true;
+	case SYNC:
+		return sim_wait(c, c->last[w->idx + w->target]);
+	case THROTTLE:
+		c->throttle = w->throttle;
+		return false;
+	case QD_THROTTLE:
+		c->qd_throttle = w->throttle;
+		return false;
+	case SW_FENCE:
+		sim_rq_put(c->last[w->idx]);
+		c->last[w->idx] = sim_rq_create(NULL);
+		return false;
+	case SW_FENCE_SIGNAL:
+		sim_signal_fences(sim, c, w->idx + w->target);
+		return false;
+	case CTX_PRIORITY:
+		wrk->ctx_list[w->context].priority = w->priority;
+		return false;
+	case TERMINATE:
+		rq = c->last[w->idx + w->target];
+		if (rq && rq->duration == SIM_UNBOUND) {
+			rq->duration = 0;
+			if (rq->state == SIM_RUNNING) {
+				sim->engines[rq->engine].end = sim->now;
+				sim_push(sim, sim->now, NULL, rq->engine);
+			}
+		}
+		return false;
+	case BATCH:
+		break;
+	default:
+		/* No action for these at execution time. */
+		return false;
+	}
+
+	if (!c->phase) {
+		if (wrk->flags & DEPSYNC) {
+			for (i = 0; i < w->data_deps.nr; i++) {
+				struct dep_entry *dep = &w->data_deps.list[i];
+
+				if (dep->working_set == -1 && dep->target &&
+				    sim_wait(c, c->last[w->idx + dep->target]))
+					return true;
+			}
+		}
+
+		if (c->throttle > 0 &&
+		    sim_wait(c, c->last[sim_sync_target(wrk, w->idx - c->throttle)]))
+			return true;
+
+		c->engine = balance_engine(wrk, w);
+		sim_submit(sim, c, w, c->engine);
+
+		if (w->request != -1) {
+			igt_list_del(&w->rq_link);
+			wrk->nrequest[w->request]--;
+		}
+		w->request = c->engine;
+		igt_list_add_tail(&w->rq_link, &wrk->requests[c->engine]);
+		wrk->nrequest[c->engine]++;
+
+		c->phase++;
+		sim_sleep(sim, c, SIM_EXECBUF_NS);
+		return true;
+	}
+
+	if (w->sync && sim_wait(c, c->last[w->idx]))
+		return true;
+
+	while (c->qd_throttle > 0 &&
+	       wrk->nrequest[c->engine] > c->qd_throttle) {
+		struct w_step *s;
+
+		s = igt_list_first_entry(&wrk->requests[c->engine], s, rq_link);
+		if (sim_wait(c, c->last[s->idx]))
+			return true;
+
+		s->request = -1;
+		igt_list_del(&s->rq_link);
+		wrk->nrequest[c->engine]--;
+	}
+
+	return false;
+}
+
+static void sim_client_run(struct sim *sim, struct sim_client *c)
+{
+	struct workload *wrk = c->wrk;
+
+	while (!c->done) {
+		if (!wrk->run) {
+			sim_client_finish(sim, c);
+			break;
+		}
+
+		if (sim_step(sim, c, &wrk->steps[c->step]))
+			return;
+
+		c->phase = 0;
+		if (++c->step < wrk->nr_steps)
+			continue;
+
+		/* End of an iteration signals all fences created in it. */
+		sim_signal_fences(sim, c, wrk->nr_steps);
+		if (!c->period)
+			record_latency(wrk, (sim->now - c->repeat_start) / 1000);
+		c->period = false;
+		c->step = 0;
+		c->repeat_start = sim->now;
+
+		if (++c->count == wrk->repeat && !wrk->background)
+			sim_client_finish(sim, c);
+	}
+}
+
+/*
+ * Runs all clients to completion on the simulated GPU and returns the
+ * simulated elapsed time in seconds, or a negative value if the workloads
+ * cannot make progress. Time each engine spent busy is stored in @busy.
+ */
+static double sim_run(struct workload **w, unsigned int clients, int master,
+		      uint64_t *busy)
+{
+	struct sim sim = { .nr_clients = clients };
+	struct timespec t_start, t_end;
+	struct sim_event ev;
+	double t, wall;
+	bool stuck = false;
+	unsigned int i, j;
+
+	IGT_INIT_LIST_HEAD(&sim.pending);
+	sim.clients = calloc(clients, sizeof(*sim.clients));
+	igt_assert(sim.clients);
+
+	for (i = 0; i < clients; i++) {
+		struct sim_client *c = &sim.clients[i];
+
+		c->sim = &sim;
+		c->wrk = w[i];
+		c->time_min = ULONG_MAX;
+		w[i]->sim = c;
+		c->last = calloc(w[i]->nr_steps, sizeof(*c->last));
+		c->ctx_last = calloc(w[i]->nr_ctxs, sizeof(*c->ctx_last));
+		igt_assert(c->last && c->ctx_last);
+
+		if (!w[i]->repeat && !w[i]->background)
+			sim_client_finish(&sim, c);
+		else
+			sim_push(&sim, 0, c, DEFAULT);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t_start);
+
+	while (sim_pop(&sim, &ev)) {
+		sim.now = ev.t;
+
+		if (ev.client) {
+			sim_client_run(&sim, ev.client);
+		} else {
+			struct sim_engine *engine = &sim.engines[ev.engine];
+
+			/* Skip completions superseded by batch termination. */
+			if (!engine->rq || engine->end != ev.t)
+				continue;
+
+			sim_retire(&sim, ev.engine);
+		}
+
+		if (master >= 0 && sim.clients[master].done) {
+			for (i = 0; i < clients; i++)
+				w[i]->run = false;
+		}
+
+		sim_dispatch(&sim);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t_end);
+
+	t = sim.now / 1e9;
+	wall = elapsed(&t_start, &t_end);
+
+	for (i = 0; i < clients; i++) {
+		struct sim_client *c = &sim.clients[i];
+
+		if (!c->done || c->outstanding) {
+			wsim_err("%u: Simulation stuck at step %u of cycle %u!\n",
+				 i, c->step, c->count);
+			stuck = true;
+			continue;
+		}
+
+		c->wrk->elapsed = c->t_end / 1e9;
+		c->wrk->cycles = c->count;
+		c->wrk->missed = c->missed;
+
+		if (c->wrk->print_stats) {
+			double ct = c->t_end / 1e9;
+
+			printf("%c%u: %.3fs elapsed (%d cycles, %.3f workloads/s).",
+			       c->wrk->background ? ' ' : '*', c->wrk->id,
+			       ct, c->count, c->count / ct);
+			if (c->time_tot)
+				printf(" Time avg/min/max=%lu/%lu/%luus; %u missed.",
+				       c->time_tot / c->count, c->time_min,
+				       c->time_max, c->missed);
+			putchar('\n');
+		}
+	}
+
+	for (i = 0; i < ARRAY_SIZE(sim_engines); i++)
+		busy[sim_engines[i]] = sim.engines[sim_engines[i]].busy;
+
+	if (verbose > 1) {
+		for (i = 0; i < ARRAY_SIZE(sim_engines); i++) {
+			struct sim_engine *engine = &sim.engines[sim_engines[i]];
+
+			printf("%s: %.2f%% busy, %lu batches.\n",
+			       ring_str_map[sim_engines[i]],
+			       t > 0 ? 100.0 * engine->busy / sim.now : 0,
+			       engine->count);
+		}
+
+		printf("Simulated %.3fs in %.3fs (%.0fx).\n",
+		       t, wall, wall > 0 ? t / wall : 0);
+	}
+
+	for (i = 0; i < clients; i++) {
+		struct sim_client *c = &sim.clients[i];
+		struct workload *wrk = c->wrk;
+
+		for (j = 0; j < wrk->nr_steps; j++)
+			sim_rq_put(c->last[j]);
+		for (j = 0; j < wrk->nr_ctxs; j++)
+			sim_rq_put(c->ctx_last[j]);
+		free(c->last);
+		free(c->ctx_last);
+		wrk->sim = NULL;
+	}
+	free(sim.clients);
+	free(sim.events);
+
+	return stuck ? -1 : t;
+}
+
+static void free_working_set(struct working_set *set)
+{
+	unsigned int i;
+
+	for (i = 0; set->sim_writers && i < set->nr; i++)
+		sim_rq_put(set->sim_writers[i]);
+
+	free(set->handles);
+	free(set->sim_writers);
+}
+
+static void fini_workload(struct workload *wrk)
+{
+	struct w_step *w;
+	unsigned int i;
+
+	/* Shared working sets belong to the workload they were parsed in. */
+	for (i = 0, w = wrk->steps; i < wrk->nr_steps; i++, w++) {
+		if (w->type == WORKINGSET &&
+		    (!w->working_set.shared ||
+		     wrk->working_sets[w->working_set.id] == &w->working_set))
+			free_working_set(&w->working_set);
+	}
+
+	free(wrk->latency_us);
+	free(wrk->steps);
+	free(wrk);
+}
+
+static int cmp_uint(const void *_a, const void *_b)
+{
+	const unsigned int *a = _a, *b = _b;
+
+	return *a < *b ? -1 : *a > *b;
+}
+
+static unsigned int percentile(const unsigned int *sorted, unsigned int nr,
+			       unsigned int pct)
+{
+	return sorted[DIV_ROUND_UP(nr * pct, 100) - 1];
+}
+
+static void write_json_latency(FILE *f, struct workload *wrk)
+{
+	unsigned long long total = 0;
+	unsigned int *sorted, nr = wrk->nr_latency, i;
+
+	if (!nr) {
+		fprintf(f, "null");
+		return;
+	}
+
+	sorted = malloc(nr * sizeof(*sorted));
+	igt_assert(sorted);
+	memcpy(sorted, wrk->latency_us, nr * sizeof(*sorted));
+	qsort(sorted, nr, sizeof(*sorted), cmp_uint);
+
+	for (i = 0; i < nr; i++)
+		total += sorted[i];
+
+	fprintf(f, "{ \"avg\": %llu, \"min\": %u, \"p50\": %u, \"p90\": %u, \"p99\": %u, \"max\": %u }",
+		total / nr, sorted[0],
+		percentile(sorted, nr, 50), percentile(sorted, nr, 90),
+		percentile(sorted, nr, 99), sorted[nr - 1]);
+
+	free(sorted);
+}
+
+/*
+ * Scheduling metrics in JSON format. Engine busyness is given as a percentage
+ * of the total elapsed time, or null when not available.
+ */
+static int write_json(const char *path, struct workload **w,
+		      unsigned int clients, int master, const char *balancer,
+		      double t, const uint64_t *busy)
+{
+	static const enum intel_engine_id engines[] = {
+		RCS, BCS, VCS1, VCS2, VECS
+	};
+	unsigned long total = 0;
+	unsigned int i, n;
+	FILE *f;
+
+	f = strcmp(path, "-") ? fopen(path, "w") : stdout;
+	if (!f) {
+		wsim_err("Failed to open '%s'! (%s)\n", path, strerror(errno));
+		return -errno;
+	}
+
+	for (i = 0; i < clients; i++)
+		total += w[i]->cycles;
+
+	fprintf(f, "{\n");
+	fprintf(f, "\t\"simulated\": %s,\n", simulate ? "true" : "false");
+	fprintf(f, "\t\"balancer\": ");
+	if (balancer)
+		fprintf(f, "\"%s\",\n", balancer);
+	else
+		fprintf(f, "null,\n");
+	fprintf(f, "\t\"elapsed\": %.6f,\n", t);
+	fprintf(f, "\t\"throughput\": %.3f,\n", t > 0 ? total / t : 0);
+
+	fprintf(f, "\t\"engines\": {");
+	for (i = 0, n = 0; i < ARRAY_SIZE(engines); i++) {
+		if (!has_engine(engines[i]))
+			continue;
+
+		fprintf(f, "%s\n\t\t\"%s\": { \"busy\": ", n++ ? "," : "",
+			ring_str_map[engines[i]]);
+		if (busy[engines[i]] == UINT64_MAX || t <= 0)
+			fprintf(f, "null }");
+		else
+			fprintf(f, "%.2f }", 100.0 * busy[engines[i]] / (t * 1e9));
+	}
+	fprintf(f, "\n\t},\n");
+
+	fprintf(f, "\t\"workloads\": [");
+	for (i = 0; i < clients; i++) {
+		struct workload *wrk = w[i];
+
+		fprintf(f, "%s\n\t\t{\n", i ? "," : "");
+		fprintf(f, "\t\t\t\"id\": %u,\n", wrk->id);
+		fprintf(f, "\t\t\t\"master\": %s,\n",
+			master == i ? "true" : "false");
+		fprintf(f, "\t\t\t\"background\": %s,\n",
+			wrk->background ? "true" : "false");
+		fprintf(f, "\t\t\t\"elapsed\": %.6f,\n", wrk->elapsed);
+		fprintf(f, "\t\t\t\"cycles\": %u,\n", wrk->cycles);
+		fprintf(f, "\t\t\t\"throughput\": %.3f,\n",
+			wrk->elapsed > 0 ? wrk->cycles / wrk->elapsed : 0);
+		fprintf(f, "\t\t\t\"missed_periods\": %u,\n", wrk->missed);
+		fprintf(f, "\t\t\t\"latency_us\": ");
+		write_json_latency(f, wrk);
+		fprintf(f, "\n\t\t}");
+	}
+	fprintf(f, "\n\t]\n}\n");
+
+	if (f != stdout)
+		fclose(f);
+
+	return 0;
+}
+
+static void print_help(void)
+{
+	puts(
+"Usage: gem_wsim [OPTIONS]\n"
+"\n"
+"Runs a simulated workload on the GPU.\n"
+"Options:\n"
+"  -h                This text.\n"
+"  -q                Be quiet - do not output anything to stdout.\n"
+"  -I <n>            Initial randomness seed.\n"
+"  -p <n>            Context priority to use for the following workload on the\n"
+"                    command line.\n"
+"  -w <desc|path>    Filename or a workload descriptor.\n"
+"                    Can be given multiple times.\n"
+"  -W <desc|path>    Filename or a master workload descriptor.\n"
+"                    Only one master workload can be optinally specified in which\n"
+"                    case all other workloads become background ones and run as\n"
+"                    long as the master.\n"
+"  -a <desc|path>    Append a workload to all other workloads.\n"
+"  -r <n>            How many times to emit the workload.\n"
+"  -c <n>            Fork N clients emitting the workload simultaneously.\n"
+"  -s                Turn on small SSEU config for the next workload on the\n"
+"                    command line. Subsequent -s switches it off.\n"
+"  -S                Synchronize the sequence of random batch durations between\n"
+"                    clients.\n"
+"  -d                Sync between data dependencies in userspace.\n"
+"  -f <scale>        Scale factor for batch durations.\n"
+"  -F <scale>        Scale factor for delays.\n"
+"  -L                List GPUs.\n"
+"  -D <gpu>          One of the GPUs from -L.\n"
+"  --simulate        Run the workloads on a discrete-event model of the GPU\n"
+"                    engines instead of real hardware.\n"
+"  -b <balancer>     Engine balancer for VCS batches from contexts without an\n"
+"                    engine map. (See -l.)\n"
+"  -l                List available balancers.\n"
+"  --json <path|->   Write scheduling metrics in JSON format to a file or to\n"
+"                    standard output.\n"
+	);
+}
+
+static void list_balancers(void)
+{
+	unsigned int i;
+
+	printf("Available balancers:\n");
+	for (i = 0; i < ARRAY_SIZE(all_balancers); i++)
+		printf("  %-6s %s\n",
+		       all_balancers[i].name, all_balancers[i].desc);
+}
+
+static const struct workload_balancer *find_balancer(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(all_balancers); i++) {
+		if (!strcasecmp(name, all_balancers[i].name))
+			return &all_balancers[i];
+	}
+
+	return NULL;
+}
+
+/* Engine busyness from the PMU, or UINT64_MAX if not available. */
+static void read_engines_busy(uint64_t *busy)
+{
+	unsigned int i;
+
+	for (i = 0; i < NUM_ENGINES; i++) {
+		busy[i] = UINT64_MAX;
+		if (i != DEFAULT && i != VCS && has_engine(i) &&
+		    !pmu_open_engine(i))
+			busy[i] = pmu_read_engine(i);
+	}
+}
+
+static char *load_workload_descriptor(char *filename)
+{
+	struct stat sbuf;
+	char *buf;
+	int infd, ret, i;
+	ssize_t len;
+
+	ret = stat(filename, &sbuf);
+	if (ret || !S_ISREG(sbuf.st_mode))
+		return filename;
+
+	igt_assert(sbuf.st_size < 1024 * 1024); /* Just so. */
+	buf = malloc(sbuf.st_size);
+	igt_assert(buf);
+
+	infd = open(filename, O_RDONLY);
+	igt_assert(infd >= 0);
+	len = read(infd, buf, sbuf.st_size);
+	igt_assert(len == sbuf.st_size);
+	close(infd);
+
+	for (i = 0; i < len; i++) {
+		if (buf[i] == '\n')
+			buf[i] = ',';
+	}
+
+	len--;
+	while (buf[len] == ',')
+		buf[len--] = 0;
+
+	return buf;
+}
+
+static struct w_arg *
+add_workload_arg(struct w_arg *w_args, unsigned int nr_args, char *w_arg,
+		 int prio, bool sseu)
+{
+	w_args = realloc(w_args, sizeof(*w_args) * nr_args);
+	igt_assert(w_args);
+	w_args[nr_args - 1] = (struct w_arg) { w_arg, NULL, prio, sseu };
+
+	return w_args;
+}
+
+static int open_device(char *device_arg)
+{
+	struct igt_device_card card = { };
+	char *drm_dev;
+	int i915, ret;
+
+	if (device_arg) {
+		ret = igt_device_card_match(device_arg, &card);
+		if (!ret) {
+			wsim_err("Requested device %s not found!\n",
+				 device_arg);
+			free(device_arg);
+			return -1;
+		}
+		free(device_arg);
+	} else {
+		ret = igt_device_find_first_i915_discrete_card(&card);
+		if (!ret)
+			ret = igt_device_find_integrated_card(&card);
+		if (!ret) {
+			wsim_err("No device filter specified and no i915 devices found!\n");
+			return -1;
+		}
+	}
+
+	if (strlen(card.card)) {
+		drm_dev = card.card;
+	} else if (strlen(card.render)) {
+		drm_dev = card.render;
+	} else {
+		wsim_err("Failed to detect device!\n");
+		return -1;
+	}
+
+	i915 = open(drm_dev, O_RDWR);
+	if (i915 < 0) {
+		wsim_err("Failed to open '%s'! (%s)\n",
+			 drm_dev, strerror(errno));
+		return -1;
+	}
+	if (verbose > 1)
+		printf("Using device %s\n", drm_dev);
+
+	return i915;
+}
+
+enum {
+	OPT_SIMULATE = 256,
+	OPT_JSON,
+};
+
+int main(int argc, char **argv)
+{
+	static const struct option long_options[] = {
+		{ "simulate", no_argument, NULL, OPT_SIMULATE },
+		{ "json", required_argument, NULL, OPT_JSON },
+		{ }
+	};
+	const struct workload_balancer *balancer = NULL;
+	uint64_t busy[NUM_ENGINES], busy_start[NUM_ENGINES];
+	char *json_path = NULL;
+	bool list_devices_arg = false;
+	unsigned int repeat = 1;
+	unsigned int clients = 1;
+	unsigned int flags = 0;
+	struct timespec t_start, t_end;
+	struct workload **w, **wrk = NULL;
+	struct workload *app_w = NULL;
+	unsigned int nr_w_args = 0;
+	int master_workload = -1;
+	char *append_workload_arg = NULL;
+	struct w_arg *w_args = NULL;
+	int exitcode = EXIT_FAILURE;
+	char *device_arg = NULL;
+	double scale_time = 1.0f;
+	double scale_dur = 1.0f;
+	int prio = 0;
 	double t;
 	int i, c, ret;
-	char *drm_dev;
 
 	master_prng = time(NULL);
 
-	while ((c = getopt(argc, argv,
-			   "LhqvsSdc:r:w:W:a:p:I:f:F:D:")) != -1) {
+	while ((c = getopt_long(argc, argv, "LhqvsSdlc:r:w:W:a:p:I:f:F:D:b:",
+				long_options, NULL)) != -1) {
 		switch (c) {
+		case OPT_SIMULATE:
+			simulate = true;
+			break;
+		case OPT_JSON:
+			json_path = optarg;
+			break;
+		case 'b':
+			balancer = find_balancer(optarg);
+			if (!balancer) {
+				wsim_err("Unknown balancing mode '%s'!\n", optarg);
+				goto err;
+			}
+			break;
+		case 'l':
+			list_balancers();
+			goto out;
 		case 'L':
 			list_devices_arg = true;
 			break;
@@ -2647,43 +3984,14 @@ int main(int argc, char **argv)
 		return EXIT_SUCCESS;
 	}
 
-	if (device_arg) {
-		ret = igt_device_card_match(device_arg, &card);
-		if (!ret) {
-			wsim_err("Requested device %s not found!\n",
-				 device_arg);
-			free(device_arg);
-			return EXIT_FAILURE;
-		}
+	if (simulate) {
 		free(device_arg);
 	} else {
-		ret = igt_device_find_first_i915_discrete_card(&card);
-		if (!ret)
-			ret = igt_device_find_integrated_card(&card);
-		if (!ret) {
-			wsim_err("No device filter specified and no i915 devices found!\n");
+		fd = open_device(device_arg);
+		if (fd < 0)
 			return EXIT_FAILURE;
-		}
-	}
-
-	if (strlen(card.card)) {
-		drm_dev = card.card;
-	} else if (strlen(card.render)) {
-		drm_dev = card.render;
-	} else {
-		wsim_err("Failed to detect device!\n");
-		return EXIT_FAILURE;
 	}
 
-	fd = open(drm_dev, O_RDWR);
-	if (fd < 0) {
-		wsim_err("Failed to open '%s'! (%s)\n",
-			 drm_dev, strerror(errno));
-		return EXIT_FAILURE;
-	}
-	if (verbose > 1)
-		printf("Using device %s\n", drm_dev);
-
 	if (!nr_w_args) {
 		wsim_err("No workload descriptor(s)!\n");
 		goto err;
@@ -2761,36 +4069,70 @@ int main(int argc, char **argv)
 			wsim_err("Failed to prepare workload %u!\n", i);
 			goto err;
 		}
-	}
-
-	clock_gettime(CLOCK_MONOTONIC, &t_start);
 
-	for (i = 0; i < clients; i++) {
-		ret = pthread_create(&w[i]->thread, NULL, run_workload, w[i]);
-		igt_assert_eq(ret, 0);
+		w[i]->balancer = balancer;
+		if (balancer && balancer->init &&
+		    balancer->init(balancer, w[i])) {
+			wsim_err("Failed to initialize balancing for workload %u!\n",
+				 i);
+			goto err;
+		}
 	}
 
-	if (master_workload >= 0) {
-		ret = pthread_join(w[master_workload]->thread, NULL);
-		igt_assert_eq(ret, 0);
+	if (simulate) {
+		t = sim_run(w, clients, master_workload, busy);
+		if (t < 0)
+			goto err;
+	} else {
+		if (json_path)
+			read_engines_busy(busy_start);
 
-		for (i = 0; i < clients; i++)
-			w[i]->run = false;
-	}
+		clock_gettime(CLOCK_MONOTONIC, &t_start);
 
-	for (i = 0; i < clients; i++) {
-		if (master_workload != i) {
-			ret = pthread_join(w[i]->thread, NULL);
+		for (i = 0; i < clients; i++) {
+			ret = pthread_create(&w[i]->thread, NULL,
+					     run_workload, w[i]);
 			igt_assert_eq(ret, 0);
 		}
-	}
 
-	clock_gettime(CLOCK_MONOTONIC, &t_end);
+		if (master_workload >= 0) {
+			ret = pthread_join(w[master_workload]->thread, NULL);
+			igt_assert_eq(ret, 0);
+
+			for (i = 0; i < clients; i++)
+				w[i]->run = false;
+		}
+
+		for (i = 0; i < clients; i++) {
+			if (master_workload != i) {
+				ret = pthread_join(w[i]->thread, NULL);
+				igt_assert_eq(ret, 0);
+			}
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &t_end);
+
+		t = elapsed(&t_start, &t_end);
+
+		if (json_path) {
+			read_engines_busy(busy);
+			for (i = 0; i < NUM_ENGINES; i++) {
+				if (busy_start[i] == UINT64_MAX)
+					busy[i] = UINT64_MAX;
+				else if (busy[i] != UINT64_MAX)
+					busy[i] -= busy_start[i];
+			}
+		}
+	}
 
-	t = elapsed(&t_start, &t_end);
 	if (verbose)
 		printf("%.3fs elapsed (%.3f workloads/s)\n",
-		       t, clients * repeat / t);
+		       t, t > 0 ? clients * repeat / t : 0);
+
+	if (json_path &&
+	    write_json(json_path, w, clients, master_workload,
+		       balancer ? balancer->name : NULL, t, busy))
+		goto err;
 
 	for (i = 0; i < clients; i++)
 		fini_workload(w[i]);
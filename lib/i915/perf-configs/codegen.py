@@ -100,6 +100,14 @@ class Set:
         for counter in self.counters:
             counter.compute_hashes()
 
+        self.evaluate_sym = "{0}__{1}__evaluate".format(self.gen.chipset,
+                                                        self.underscore_name)
+        self.evaluate_hash = ' | '.join(map(lambda c: "{0} {1} {2} {3}".format(c.get('symbol_name'),
+                                                                              c.get('data_type'),
+                                                                              c.read_hash,
+                                                                              c.get('availability')),
+                                            sorted(self.counters, key=lambda k: k.get('symbol_name'))))
+
     @property
     def hw_config_guid(self):
         return self.xml.get('hw_config_guid')
@@ -305,6 +313,57 @@ class Gen:
 
         self.c("\nreturn " + value + ";")
 
+    # Same as output_rpn_equation_code() for the counters of a set evaluated
+    # in a single function. Other counters are read from the variables they
+    # were evaluated into, and operations already emitted for a previous
+    # counter are reused. Returns the expression of the counter value.
+    def output_rpn_equation_cse(self, set, counter, equation, state):
+        tokens = equation.split()
+        stack = []
+
+        for token in tokens:
+            stack.append(token)
+            while stack and stack[-1] in self.ops:
+                op = stack.pop()
+                argc, callback = self.ops[op]
+                args = []
+                for i in range(0, argc):
+                    operand = stack.pop()
+                    if operand[0] == "$":
+                        resolved_variable = self.resolve_cse_variable(operand, set, state)
+                        if resolved_variable == None:
+                            raise Exception("Failed to resolve variable " + operand + " in equation " + equation + " for " + set.name + " :: " + counter.get('name'));
+                        operand = resolved_variable
+                    args.append(operand)
+
+                key = (op,) + tuple(args)
+                if key not in state['ops']:
+                    state['tmp_id'] = callback(state['tmp_id'], args)
+                    state['ops'][key] = "tmp{0}".format(state['tmp_id'] - 1)
+                stack.append(state['ops'][key])
+
+        if len(stack) != 1:
+            raise Exception("Spurious empty rpn code for " + set.name + " :: " +
+                    counter.get('name') + ".\nThis is probably due to some unhandled RPN function, in the equation \"" +
+                    equation + "\"")
+
+        value = stack[-1]
+
+        if value[0] == "$":
+            resolved_variable = self.resolve_cse_variable(value, set, state)
+            if resolved_variable == None:
+                raise Exception("Failed to resolve variable " + value + " in equation " + equation + " for " + set.name + " :: " + counter.get('name'))
+            value = resolved_variable
+
+        return value
+
+    def resolve_cse_variable(self, name, set, state):
+        if name in self.hw_vars:
+            return self.hw_vars[name]['c']
+        if name in state['vars']:
+            return state['vars'][name]
+        return None
+
     def splice_rpn_expression(self, set, counter_name, expression):
         tokens = expression.split()
         stack = []
@@ -153,6 +153,98 @@ def output_counter_max_definition(gen, set, counter):
         hashed_funcs[counter.max_hash] = counter.max_sym
 
 
+def output_set_evaluate(gen, set):
+    if set.evaluate_hash in hashed_funcs:
+        return
+
+    counters = sorted(set.counters, key=lambda k: k.get('symbol_name'))
+    state = { 'tmp_id': 0, 'ops': {}, 'vars': {} }
+
+    c("\n")
+    c("/* {0} */".format(set.name))
+    c("void")
+    c(set.evaluate_sym + "(const struct intel_perf *perf,\n")
+    c.indent(len(set.evaluate_sym) + 1)
+    c("const struct intel_perf_metric_set *metric_set,\n")
+    c("const struct intel_perf_accumulator *accumulators,\n")
+    c("uint32_t n_accumulators,\n")
+    c("union intel_perf_logical_counter_value *values)\n")
+    c.outdent(len(set.evaluate_sym) + 1)
+    c("{")
+    c.indent(4)
+
+    # Availability does not change from one accumulator to the next.
+    available = [counter for counter in counters if counter.get('availability')]
+    for counter in available:
+        c("const bool available_{0} = {1};".format(counter.get('underscore_name'),
+                                                 gen.splice_rpn_expression(set, counter.get('name'),
+                                                                           counter.get('availability'))))
+    if available:
+        c("\n")
+
+    c("for (uint32_t i = 0; i < n_accumulators; i++) {")
+    c.indent(4)
+    c("const uint64_t *accumulator = accumulators[i].deltas;")
+    c("union intel_perf_logical_counter_value *value = values + i * metric_set->n_counters;")
+    c("\n")
+
+    # Counters are evaluated after the counters their equation reads.
+    def output_counter(counter):
+        var = "$" + counter.get('symbol_name')
+        if var in state['vars']:
+            return
+        for token in counter.get('equation').split():
+            if token in set.counter_vars and token != var:
+                output_counter(set.counter_vars[token])
+
+        value = gen.output_rpn_equation_cse(set, counter, counter.get('equation'), state)
+        c("{0} {1} = {2};".format(data_type_to_ctype(counter.get('data_type')),
+                                  counter.get('underscore_name'), value))
+        state['vars'][var] = counter.get('underscore_name')
+
+    for counter in counters:
+        output_counter(counter)
+
+    # Stored in the order the metric set has its counters.
+    c("\n")
+    for counter in counters:
+        member = "u64" if counter.get('data_type') == "uint64" else "f"
+        store = "(value++)->{0} = {1};".format(member, counter.get('underscore_name'))
+        if counter.get('availability'):
+            c("if (available_{0})".format(counter.get('underscore_name')))
+            c.indent(4)
+            c(store)
+            c.outdent(4)
+        else:
+            c(store)
+
+    c.outdent(4)
+    c("}")
+    c.outdent(4)
+    c("}")
+
+    hashed_funcs[set.evaluate_hash] = set.evaluate_sym
+
+
+def output_set_evaluate_definition(gen, set):
+    if set.evaluate_hash in hashed_funcs:
+        h("#define %s \\" % set.evaluate_sym)
+        h.indent(4)
+        h("%s" % hashed_funcs[set.evaluate_hash])
+        h.outdent(4)
+    else:
+        h("void")
+        h(set.evaluate_sym + "(const struct intel_perf *perf,\n")
+        h.indent(len(set.evaluate_sym) + 1)
+        h("const struct intel_perf_metric_set *metric_set,\n")
+        h("const struct intel_perf_accumulator *accumulators,\n")
+        h("uint32_t n_accumulators,\n")
+        h("union intel_perf_logical_counter_value *values);\n")
+        h.outdent(len(set.evaluate_sym) + 1)
+
+        hashed_funcs[set.evaluate_hash] = set.evaluate_sym
+
+
 def generate_equations(args, gens):
     global hashed_funcs
 
@@ -196,6 +288,7 @@ def generate_equations(args, gens):
             for counter in set.counters:
                 output_counter_read(gen, set, counter)
                 output_counter_max(gen, set, counter)
+            output_set_evaluate(gen, set)
 
     hashed_funcs = {}
     h(textwrap.dedent("""\
@@ -208,6 +301,8 @@ def generate_equations(args, gens):
 
         struct intel_perf;
         struct intel_perf_metric_set;
+        struct intel_perf_accumulator;
+        union intel_perf_logical_counter_value;
 
         double
         percentage_max_callback_float(const struct intel_perf *perf,
@@ -226,6 +321,7 @@ def generate_equations(args, gens):
             for counter in set.counters:
                 output_counter_read_definition(gen, set, counter)
                 output_counter_max_definition(gen, set, counter)
+            output_set_evaluate_definition(gen, set)
 
     h(textwrap.dedent("""\
 
@@ -97,7 +97,7 @@ def generate_metric_sets(args, gen):
     # Print out all set registration functions for each set in each
     # generation.
     for set in gen.sets:
-        c("\nstatic void\n")
+        c("\nstatic struct intel_perf_metric_set *\n")
         c(gen.chipset + "_add_" + set.underscore_name + "_metric_set(struct intel_perf *perf)")
         c("{\n")
         c.indent(4)
@@ -114,6 +114,7 @@ def generate_metric_sets(args, gen):
         c("metric_set->counters = calloc({0}, sizeof(struct intel_perf_logical_counter));\n".format(str(len(counters))))
         c("metric_set->n_counters = 0;\n")
         c("metric_set->perf_oa_metrics_set = 0; // determined at runtime\n")
+        c("metric_set->evaluate = " + set.evaluate_sym + ";\n")
 
         if gen.chipset == "hsw":
             c(textwrap.dedent("""\
@@ -150,20 +151,27 @@ def generate_metric_sets(args, gen):
             output_counter_report(set, counter)
 
         c("\nassert(metric_set->n_counters <= {0});\n".format(len(counters)));
+        c("\nreturn metric_set;\n")
 
         c.outdent(4)
         c("}\n")
 
-    c("\nvoid")
-    c("intel_perf_load_metrics_" + gen.chipset + "(struct intel_perf *perf)")
-    c("{")
+    # Index of the sets, for them to be registered on first use.
+    c("\nconst struct intel_perf_metric_set_desc intel_perf_metric_sets_{0}[{1}] = {{".format(gen.chipset, len(gen.sets)))
     c.indent(4)
 
     for set in gen.sets:
-        c("{0}_add_{1}_metric_set(perf);".format(gen.chipset, set.underscore_name))
+        c("{")
+        c.indent(4)
+        c(".name = \"{0}\",".format(set.name))
+        c(".symbol_name = \"{0}\",".format(set.symbol_name))
+        c(".hw_config_guid = \"{0}\",".format(set.hw_config_guid))
+        c(".add = {0}_add_{1}_metric_set,".format(gen.chipset, set.underscore_name))
+        c.outdent(4)
+        c("},")
 
     c.outdent(4)
-    c("}")
+    c("};")
 
 
 
@@ -225,8 +233,8 @@ def main():
 
         """ % (header_define, header_define)))
 
-    # Print out all set registration functions for each generation.
-    h("void intel_perf_load_metrics_" + gen.chipset + "(struct intel_perf *perf);\n\n")
+    # Print out the index of the sets of each generation.
+    h("extern const struct intel_perf_metric_set_desc intel_perf_metric_sets_{0}[{1}];\n\n".format(gen.chipset, len(gen.sets)))
 
     h(textwrap.dedent("""\
         #endif /* %s */
@@ -33,6 +33,12 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include <i915_drm.h>
 
 #include "intel_chipset.h"
@@ -59,6 +65,8 @@
 #include "i915_perf_metrics_dg1.h"
 #include "i915_perf_metrics_adl.h"
 
+#define ARRAY_SIZE(arr) (sizeof(arr)/sizeof(arr[0]))
+
 static int
 perf_ioctl(int fd, unsigned long request, void *arg)
 {
@@ -143,13 +151,44 @@ unsupported_i915_perf_platform(struct intel_perf *perf)
 	return NULL;
 }
 
+static void
+__set_metric_set_descs(struct intel_perf *perf,
+		       const struct intel_perf_metric_set_desc *descs,
+		       uint32_t n_descs)
+{
+	perf->metric_set_descs = descs;
+	perf->n_metric_set_descs = n_descs;
+	perf->loaded_metric_sets = calloc(n_descs, sizeof(*perf->loaded_metric_sets));
+	assert(perf->loaded_metric_sets);
+}
+
+#define set_metric_set_descs(perf, descs) \
+	__set_metric_set_descs(perf, descs, ARRAY_SIZE(descs))
+
+/**
+ * intel_perf_for_devinfo_lazy:
+ * @device_id: PCI ID of the device
+ * @revision: stepping of the device
+ * @timestamp_frequency: frequency of the OA report timestamps
+ * @gt_min_freq: minimum GT frequency, in Hz
+ * @gt_max_freq: maximum GT frequency, in Hz
+ * @topology: slices, subslices and EUs of the device
+ *
+ * Like intel_perf_for_devinfo(), but without registering any metric set
+ * up front. Each metric set, with its counters, only gets registered into
+ * #intel_perf.metric_sets on its first lookup with
+ * intel_perf_find_metric_set() or intel_perf_load_metric_set(), or with all
+ * the others by intel_perf_load_metric_sets().
+ *
+ * Returns: the perf, NULL if the device is not supported.
+ */
 struct intel_perf *
-intel_perf_for_devinfo(uint32_t device_id,
-		       uint32_t revision,
-		       uint64_t timestamp_frequency,
-		       uint64_t gt_min_freq,
-		       uint64_t gt_max_freq,
-		       const struct drm_i915_query_topology_info *topology)
+intel_perf_for_devinfo_lazy(uint32_t device_id,
+			    uint32_t revision,
+			    uint64_t timestamp_frequency,
+			    uint64_t gt_min_freq,
+			    uint64_t gt_max_freq,
+			    const struct drm_i915_query_topology_info *topology)
 {
 	const struct intel_device_info *devinfo = intel_get_device_info(device_id);
 	struct intel_perf *perf;
@@ -209,77 +248,77 @@ intel_perf_for_devinfo(uint32_t device_id,
 	perf->devinfo.eu_threads_count = 7;
 
 	if (devinfo->is_haswell) {
-		intel_perf_load_metrics_hsw(perf);
+		set_metric_set_descs(perf, intel_perf_metric_sets_hsw);
 	} else if (devinfo->is_broadwell) {
-		intel_perf_load_metrics_bdw(perf);
+		set_metric_set_descs(perf, intel_perf_metric_sets_bdw);
 	} else if (devinfo->is_cherryview) {
-		intel_perf_load_metrics_chv(perf);
+		set_metric_set_descs(perf, intel_perf_metric_sets_chv);
 	} else if (devinfo->is_skylake) {
 		switch (devinfo->gt) {
 		case 2:
-			intel_perf_load_metrics_sklgt2(perf);
+			set_metric_set_descs(perf, intel_perf_metric_sets_sklgt2);
 			break;
 		case 3:
-			intel_perf_load_metrics_sklgt3(perf);
+			set_metric_set_descs(perf, intel_perf_metric_sets_sklgt3);
 			break;
 		case 4:
-			intel_perf_load_metrics_sklgt4(perf);
+			set_metric_set_descs(perf, intel_perf_metric_sets_sklgt4);
 			break;
 		default:
 			return unsupported_i915_perf_platform(perf);
 		}
 	} else if (devinfo->is_broxton) {
 		perf->devinfo.eu_threads_count = 6;
-		intel_perf_load_metrics_bxt(perf);
+		set_metric_set_descs(perf, intel_perf_metric_sets_bxt);
 	} else if (devinfo->is_kabylake) {
 		switch (devinfo->gt) {
 		case 2:
-			intel_perf_load_metrics_kblgt2(perf);
+			set_metric_set_descs(perf, intel_perf_metric_sets_kblgt2);
 			break;
 		case 3:
-			intel_perf_load_metrics_kblgt3(perf);
+			set_metric_set_descs(perf, intel_perf_metric_sets_kblgt3);
 			break;
 		default:
 			return unsupported_i915_perf_platform(perf);
 		}
 	} else if (devinfo->is_geminilake) {
 		perf->devinfo.eu_threads_count = 6;
-		intel_perf_load_metrics_glk(perf);
+		set_metric_set_descs(perf, intel_perf_metric_sets_glk);
 	} else if (devinfo->is_coffeelake || devinfo->is_cometlake) {
 		switch (devinfo->gt) {
 		case 2:
-			intel_perf_load_metrics_cflgt2(perf);
+			set_metric_set_descs(perf, intel_perf_metric_sets_cflgt2);
 			break;
 		case 3:
-			intel_perf_load_metrics_cflgt3(perf);
+			set_metric_set_descs(perf, intel_perf_metric_sets_cflgt3);
 			break;
 		default:
 			return unsupported_i915_perf_platform(perf);
 		}
 	} else if (devinfo->is_cannonlake) {
-		intel_perf_load_metrics_cnl(perf);
+		set_metric_set_descs(perf, intel_perf_metric_sets_cnl);
 	} else if (devinfo->is_icelake) {
-		intel_perf_load_metrics_icl(perf);
+		set_metric_set_descs(perf, intel_perf_metric_sets_icl);
 	} else if (devinfo->is_elkhartlake || devinfo->is_jasperlake) {
-		intel_perf_load_metrics_ehl(perf);
+		set_metric_set_descs(perf, intel_perf_metric_sets_ehl);
 	} else if (devinfo->is_tigerlake) {
 		switch (devinfo->gt) {
 		case 1:
-			intel_perf_load_metrics_tglgt1(perf);
+			set_metric_set_descs(perf, intel_perf_metric_sets_tglgt1);
 			break;
 		case 2:
-			intel_perf_load_metrics_tglgt2(perf);
+			set_metric_set_descs(perf, intel_perf_metric_sets_tglgt2);
 			break;
 		default:
-			unsupported_i915_perf_platform(perf);
+			return unsupported_i915_perf_platform(perf);
 		}
 	} else if (devinfo->is_rocketlake) {
-		intel_perf_load_metrics_rkl(perf);
+		set_metric_set_descs(perf, intel_perf_metric_sets_rkl);
 	} else if (devinfo->is_dg1) {
-		intel_perf_load_metrics_dg1(perf);
+		set_metric_set_descs(perf, intel_perf_metric_sets_dg1);
 	} else if (devinfo->is_alderlake_s || devinfo->is_alderlake_p ||
 		   devinfo->is_raptorlake_s || devinfo->is_alderlake_n) {
-		intel_perf_load_metrics_adl(perf);
+		set_metric_set_descs(perf, intel_perf_metric_sets_adl);
 	} else {
 		return unsupported_i915_perf_platform(perf);
 	}
@@ -287,6 +326,26 @@ intel_perf_for_devinfo(uint32_t device_id,
 	return perf;
 }
 
+struct intel_perf *
+intel_perf_for_devinfo(uint32_t device_id,
+		       uint32_t revision,
+		       uint64_t timestamp_frequency,
+		       uint64_t gt_min_freq,
+		       uint64_t gt_max_freq,
+		       const struct drm_i915_query_topology_info *topology)
+{
+	struct intel_perf *perf =
+		intel_perf_for_devinfo_lazy(device_id, revision,
+					    timestamp_frequency,
+					    gt_min_freq, gt_max_freq,
+					    topology);
+
+	if (perf)
+		intel_perf_load_metric_sets(perf);
+
+	return perf;
+}
+
 static uint32_t
 getparam(int drm_fd, uint32_t param)
 {
@@ -412,8 +471,17 @@ open_master_sysfs_dir(int drm_fd)
 	return sysfs;
 }
 
+/**
+ * intel_perf_for_fd_lazy:
+ * @drm_fd: i915 device file descriptor
+ *
+ * Like intel_perf_for_fd(), with metric sets registered on first lookup as
+ * for intel_perf_for_devinfo_lazy().
+ *
+ * Returns: the perf, NULL if the device is not supported.
+ */
 struct intel_perf *
-intel_perf_for_fd(int drm_fd)
+intel_perf_for_fd_lazy(int drm_fd)
 {
 	uint32_t device_id = getparam(drm_fd, I915_PARAM_CHIPSET_ID);
 	uint32_t device_revision = getparam(drm_fd, I915_PARAM_REVISION);
@@ -438,17 +506,28 @@ intel_perf_for_fd(int drm_fd)
 	if (!topology)
 		return NULL;
 
-	ret = intel_perf_for_devinfo(device_id,
-				     device_revision,
-				     timestamp_frequency,
-				     gt_min_freq * 1000000,
-				     gt_max_freq * 1000000,
-				     topology);
+	ret = intel_perf_for_devinfo_lazy(device_id,
+					  device_revision,
+					  timestamp_frequency,
+					  gt_min_freq * 1000000,
+					  gt_max_freq * 1000000,
+					  topology);
 	free(topology);
 
 	return ret;
 }
 
+struct intel_perf *
+intel_perf_for_fd(int drm_fd)
+{
+	struct intel_perf *perf = intel_perf_for_fd_lazy(drm_fd);
+
+	if (perf)
+		intel_perf_load_metric_sets(perf);
+
+	return perf;
+}
+
 void
 intel_perf_free(struct intel_perf *perf)
 {
@@ -461,9 +540,67 @@ intel_perf_free(struct intel_perf *perf)
 		intel_perf_metric_set_free(metric_set);
 	}
 
+	free(perf->loaded_metric_sets);
 	free(perf);
 }
 
+/**
+ * intel_perf_load_metric_set:
+ * @perf: perf of the device
+ * @index: index of the metric set in #intel_perf.metric_set_descs
+ *
+ * Registers a metric set and its counters, unless already done.
+ *
+ * Returns: the metric set, NULL if @index is out of range.
+ */
+struct intel_perf_metric_set *
+intel_perf_load_metric_set(struct intel_perf *perf, uint32_t index)
+{
+	if (index >= perf->n_metric_set_descs)
+		return NULL;
+
+	if (!perf->loaded_metric_sets[index])
+		perf->loaded_metric_sets[index] =
+			perf->metric_set_descs[index].add(perf);
+
+	return perf->loaded_metric_sets[index];
+}
+
+/**
+ * intel_perf_find_metric_set:
+ * @perf: perf of the device
+ * @symbol_name: symbol name of the metric set
+ *
+ * Looks a metric set up in the index of the device, registering it and its
+ * counters on first lookup.
+ *
+ * Returns: the metric set, NULL if the device has none of that name.
+ */
+struct intel_perf_metric_set *
+intel_perf_find_metric_set(struct intel_perf *perf, const char *symbol_name)
+{
+	for (uint32_t i = 0; i < perf->n_metric_set_descs; i++) {
+		if (!strcmp(perf->metric_set_descs[i].symbol_name, symbol_name))
+			return intel_perf_load_metric_set(perf, i);
+	}
+
+	return NULL;
+}
+
+/**
+ * intel_perf_load_metric_sets:
+ * @perf: perf of the device
+ *
+ * Registers all the metric sets of the device not registered yet, in the
+ * order of the index.
+ */
+void
+intel_perf_load_metric_sets(struct intel_perf *perf)
+{
+	for (uint32_t i = 0; i < perf->n_metric_set_descs; i++)
+		intel_perf_load_metric_set(perf, i);
+}
+
 void
 intel_perf_add_logical_counter(struct intel_perf *perf,
 			       struct intel_perf_logical_counter *counter,
@@ -532,6 +669,11 @@ load_metric_set_config(struct intel_perf_metric_set *metric_set, int drm_fd)
 		metric_set->perf_oa_metrics_set = ret;
 }
 
+/*
+ * Finds the configuration ids of the registered metric sets, adding the
+ * configurations missing from i915. Metric sets of lazily created perfs
+ * registered after the call have none.
+ */
 void
 intel_perf_load_perf_configs(struct intel_perf *perf, int drm_fd)
 {
@@ -594,34 +736,335 @@ intel_perf_load_perf_configs(struct intel_perf *perf, int drm_fd)
 	}
 }
 
+/*
+ * Layout of the counters in an OA report, offsets in bytes. The deltas are
+ * accumulated in the order the metric equations read them: timestamp, GPU
+ * clock (Gen8+), 40bit A counters, then the 32bit A, B and C counters.
+ */
+struct oa_format_layout {
+	uint8_t n_a40;
+	uint8_t a40_low_off;
+	uint8_t a40_high_off;
+	uint8_t a_off, n_a;
+	uint8_t b_off, n_b;
+	uint8_t c_off, n_c;
+};
+
+static const struct oa_format_layout hsw_oa_formats[I915_OA_FORMAT_MAX] = {
+	[I915_OA_FORMAT_A13] = {
+		.a_off = 12, .n_a = 13, },
+	[I915_OA_FORMAT_A29] = {
+		.a_off = 12, .n_a = 29, },
+	[I915_OA_FORMAT_A13_B8_C8] = {
+		.a_off = 12, .n_a = 13,
+		.b_off = 64, .n_b = 8,
+		.c_off = 96, .n_c = 8, },
+	[I915_OA_FORMAT_A45_B8_C8] = {
+		.a_off = 12,  .n_a = 45,
+		.b_off = 192, .n_b = 8,
+		.c_off = 224, .n_c = 8, },
+	[I915_OA_FORMAT_B4_C8] = {
+		.b_off = 16, .n_b = 4,
+		.c_off = 32, .n_c = 8, },
+	[I915_OA_FORMAT_B4_C8_A16] = {
+		.b_off = 16, .n_b = 4,
+		.c_off = 32, .n_c = 8,
+		.a_off = 60, .n_a = 16, },
+	[I915_OA_FORMAT_C4_B8] = {
+		.c_off = 16, .n_c = 4,
+		.b_off = 28, .n_b = 8, },
+};
+
+static const struct oa_format_layout gen8_oa_formats[I915_OA_FORMAT_MAX] = {
+	[I915_OA_FORMAT_A12] = {
+		.a_off = 12, .n_a = 12, },
+	[I915_OA_FORMAT_A12_B8_C8] = {
+		.a_off = 12, .n_a = 12,
+		.b_off = 64, .n_b = 8,
+		.c_off = 96, .n_c = 8, },
+	[I915_OA_FORMAT_A32u40_A4u32_B8_C8] = {
+		.a40_high_off = 160, .a40_low_off = 16, .n_a40 = 32,
+		.a_off = 144, .n_a = 4,
+		.b_off = 192, .n_b = 8,
+		.c_off = 224, .n_c = 8, },
+	[I915_OA_FORMAT_C4_B8] = {
+		.c_off = 16, .n_c = 4,
+		.b_off = 32, .n_b = 8, },
+};
+
+static const struct oa_format_layout gen12_oa_formats[I915_OA_FORMAT_MAX] = {
+	[I915_OA_FORMAT_A32u40_A4u32_B8_C8] = {
+		.a40_high_off = 160, .a40_low_off = 16, .n_a40 = 32,
+		.a_off = 144, .n_a = 4,
+		.b_off = 192, .n_b = 8,
+		.c_off = 224, .n_c = 8, },
+};
+
+static const struct oa_format_layout *
+oa_format_layout(const struct intel_perf_devinfo *devinfo, int oa_format)
+{
+	const struct oa_format_layout *formats;
+
+	if (oa_format <= 0 || oa_format >= I915_OA_FORMAT_MAX)
+		return NULL;
+
+	if (devinfo->graphics_ver >= 12)
+		formats = gen12_oa_formats;
+	else if (devinfo->graphics_ver >= 8)
+		formats = gen8_oa_formats;
+	else
+		formats = hsw_oa_formats;
+
+	if (!formats[oa_format].n_a40 && !formats[oa_format].n_a &&
+	    !formats[oa_format].n_b && !formats[oa_format].n_c)
+		return NULL;
+
+	return &formats[oa_format];
+}
+
+static unsigned int
+oa_format_n_deltas(const struct intel_perf_devinfo *devinfo,
+		   const struct oa_format_layout *layout)
+{
+	return (devinfo->graphics_ver >= 8 ? 2 : 1) +
+		layout->n_a40 + layout->n_a + layout->n_b + layout->n_c;
+}
+
+/* Reports per block, small enough for a block to stay in the L1 cache. */
+#define ACCUMULATE_BLOCK 64
+
+static inline const uint8_t *
+record_report(const struct drm_i915_perf_record_header *record, unsigned int offset)
+{
+	return (const uint8_t *)(record + 1) + offset;
+}
+
+/*
+ * Each group of counters is accumulated over the whole block of reports,
+ * keeping the sums in registers.
+ */
 static void
-accumulate_uint32(const uint32_t *report0,
-                  const uint32_t *report1,
-                  uint64_t *deltas)
+accumulate_uint32(const struct drm_i915_perf_record_header *const *records,
+		  uint32_t n_records, unsigned int offset, unsigned int count,
+		  uint64_t *deltas)
 {
-	*deltas += (uint32_t)(*report1 - *report0);
+	unsigned int i = 0;
+
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+
+	for (; i + 4 <= count; i += 4) {
+		unsigned int off = offset + 4 * i;
+		__m128i prev = _mm_loadu_si128((const __m128i *)record_report(records[0], off));
+		__m128i acc_lo = zero, acc_hi = zero;
+
+		for (uint32_t r = 1; r < n_records; r++) {
+			__m128i value = _mm_loadu_si128((const __m128i *)record_report(records[r], off));
+			__m128i delta = _mm_sub_epi32(value, prev);
+
+			acc_lo = _mm_add_epi64(acc_lo, _mm_unpacklo_epi32(delta, zero));
+			acc_hi = _mm_add_epi64(acc_hi, _mm_unpackhi_epi32(delta, zero));
+			prev = value;
+		}
+
+		_mm_storeu_si128((__m128i *)(deltas + i),
+				 _mm_add_epi64(_mm_loadu_si128((const __m128i *)(deltas + i)),
+					       acc_lo));
+		_mm_storeu_si128((__m128i *)(deltas + i + 2),
+				 _mm_add_epi64(_mm_loadu_si128((const __m128i *)(deltas + i + 2)),
+					       acc_hi));
+	}
+#elif defined(__ARM_NEON)
+	for (; i + 4 <= count; i += 4) {
+		unsigned int off = offset + 4 * i;
+		uint32x4_t prev = vld1q_u32((const uint32_t *)record_report(records[0], off));
+		uint64x2_t acc_lo = vdupq_n_u64(0), acc_hi = vdupq_n_u64(0);
+
+		for (uint32_t r = 1; r < n_records; r++) {
+			uint32x4_t value = vld1q_u32((const uint32_t *)record_report(records[r], off));
+			uint32x4_t delta = vsubq_u32(value, prev);
+
+			acc_lo = vaddw_u32(acc_lo, vget_low_u32(delta));
+			acc_hi = vaddw_u32(acc_hi, vget_high_u32(delta));
+			prev = value;
+		}
+
+		vst1q_u64(deltas + i, vaddq_u64(vld1q_u64(deltas + i), acc_lo));
+		vst1q_u64(deltas + i + 2, vaddq_u64(vld1q_u64(deltas + i + 2), acc_hi));
+	}
+#endif
+
+	for (; i < count; i++) {
+		unsigned int off = offset + 4 * i;
+		uint32_t prev = *(const uint32_t *)record_report(records[0], off);
+		uint64_t acc = 0;
+
+		for (uint32_t r = 1; r < n_records; r++) {
+			uint32_t value = *(const uint32_t *)record_report(records[r], off);
+
+			acc += (uint32_t)(value - prev);
+			prev = value;
+		}
+
+		deltas[i] += acc;
+	}
 }
 
+/*
+ * The 40bit A counters have their low 32bits in one array and their high
+ * 8bits in another. The delta of the low dwords borrows from the delta of
+ * the high bytes, and the two halves of each 40bit delta are interleaved
+ * into 64bit lanes.
+ */
 static void
-accumulate_uint40(int a_index,
-                  const uint32_t *report0,
-                  const uint32_t *report1,
-                  uint64_t *deltas)
-{
-	const uint8_t *high_bytes0 = (uint8_t *)(report0 + 40);
-	const uint8_t *high_bytes1 = (uint8_t *)(report1 + 40);
-	uint64_t high0 = (uint64_t)(high_bytes0[a_index]) << 32;
-	uint64_t high1 = (uint64_t)(high_bytes1[a_index]) << 32;
-	uint64_t value0 = report0[a_index + 4] | high0;
-	uint64_t value1 = report1[a_index + 4] | high1;
-	uint64_t delta;
-
-	if (value0 > value1)
-		delta = (1ULL << 40) + value1 - value0;
-	else
-		delta = value1 - value0;
+accumulate_uint40(const struct drm_i915_perf_record_header *const *records,
+		  uint32_t n_records, const struct oa_format_layout *layout,
+		  uint64_t *deltas)
+{
+	unsigned int i = 0;
+
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i sign = _mm_set1_epi32(0x80000000);
+	const __m128i mask = _mm_set1_epi32(0xff);
+
+	for (; i + 4 <= layout->n_a40; i += 4) {
+		unsigned int low_off = layout->a40_low_off + 4 * i;
+		unsigned int high_off = layout->a40_high_off + i;
+		__m128i prev_low, prev_high, acc_lo = zero, acc_hi = zero;
+		uint32_t bytes;
+
+		prev_low = _mm_loadu_si128((const __m128i *)record_report(records[0], low_off));
+		memcpy(&bytes, record_report(records[0], high_off), sizeof(bytes));
+		prev_high = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero), zero);
+
+		for (uint32_t r = 1; r < n_records; r++) {
+			__m128i low, high, borrow, delta_low, delta_high;
+
+			low = _mm_loadu_si128((const __m128i *)record_report(records[r], low_off));
+			memcpy(&bytes, record_report(records[r], high_off), sizeof(bytes));
+			high = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero), zero);
+
+			/* All ones where low < prev_low, unsigned. */
+			borrow = _mm_cmpgt_epi32(_mm_xor_si128(prev_low, sign),
+						 _mm_xor_si128(low, sign));
+			delta_low = _mm_sub_epi32(low, prev_low);
+			delta_high = _mm_and_si128(_mm_add_epi32(_mm_sub_epi32(high, prev_high),
+								 borrow), mask);
+
+			acc_lo = _mm_add_epi64(acc_lo, _mm_unpacklo_epi32(delta_low, delta_high));
+			acc_hi = _mm_add_epi64(acc_hi, _mm_unpackhi_epi32(delta_low, delta_high));
+			prev_low = low;
+			prev_high = high;
+		}
 
-	*deltas += delta;
+		_mm_storeu_si128((__m128i *)(deltas + i),
+				 _mm_add_epi64(_mm_loadu_si128((const __m128i *)(deltas + i)),
+					       acc_lo));
+		_mm_storeu_si128((__m128i *)(deltas + i + 2),
+				 _mm_add_epi64(_mm_loadu_si128((const __m128i *)(deltas + i + 2)),
+					       acc_hi));
+	}
+#elif defined(__ARM_NEON)
+	for (; i + 4 <= layout->n_a40; i += 4) {
+		unsigned int low_off = layout->a40_low_off + 4 * i;
+		unsigned int high_off = layout->a40_high_off + i;
+		uint64x2_t acc_lo = vdupq_n_u64(0), acc_hi = vdupq_n_u64(0);
+		uint32x4_t prev_low, prev_high;
+		uint32_t bytes;
+
+		prev_low = vld1q_u32((const uint32_t *)record_report(records[0], low_off));
+		memcpy(&bytes, record_report(records[0], high_off), sizeof(bytes));
+		prev_high = vmovl_u16(vget_low_u16(vmovl_u8(vcreate_u8(bytes))));
+
+		for (uint32_t r = 1; r < n_records; r++) {
+			uint32x4_t low, high, borrow;
+			uint32x4x2_t delta;
+
+			low = vld1q_u32((const uint32_t *)record_report(records[r], low_off));
+			memcpy(&bytes, record_report(records[r], high_off), sizeof(bytes));
+			high = vmovl_u16(vget_low_u16(vmovl_u8(vcreate_u8(bytes))));
+
+			borrow = vcltq_u32(low, prev_low);
+			delta = vzipq_u32(vsubq_u32(low, prev_low),
+					  vandq_u32(vaddq_u32(vsubq_u32(high, prev_high), borrow),
+						    vdupq_n_u32(0xff)));
+
+			acc_lo = vaddq_u64(acc_lo, vreinterpretq_u64_u32(delta.val[0]));
+			acc_hi = vaddq_u64(acc_hi, vreinterpretq_u64_u32(delta.val[1]));
+			prev_low = low;
+			prev_high = high;
+		}
+
+		vst1q_u64(deltas + i, vaddq_u64(vld1q_u64(deltas + i), acc_lo));
+		vst1q_u64(deltas + i + 2, vaddq_u64(vld1q_u64(deltas + i + 2), acc_hi));
+	}
+#endif
+
+	for (; i < layout->n_a40; i++) {
+		unsigned int low_off = layout->a40_low_off + 4 * i;
+		unsigned int high_off = layout->a40_high_off + i;
+		uint64_t prev = 0, acc = 0;
+
+		for (uint32_t r = 0; r < n_records; r++) {
+			uint64_t value = *(const uint32_t *)record_report(records[r], low_off) |
+				(uint64_t)*record_report(records[r], high_off) << 32;
+
+			if (r)
+				acc += (value - prev) & ((1ull << 40) - 1);
+			prev = value;
+		}
+
+		deltas[i] += acc;
+	}
+}
+
+static void
+accumulate_layout(uint64_t *deltas,
+		  const struct intel_perf_devinfo *devinfo,
+		  const struct oa_format_layout *layout,
+		  const struct drm_i915_perf_record_header *const *records,
+		  uint32_t n_records)
+{
+	/* Blocks overlap by one report, for the pair across them. */
+	for (uint32_t first = 0; first + 1 < n_records; first += ACCUMULATE_BLOCK) {
+		uint32_t n = n_records - first > ACCUMULATE_BLOCK ?
+			ACCUMULATE_BLOCK + 1 : n_records - first;
+		const struct drm_i915_perf_record_header *const *block = records + first;
+		uint64_t *d = deltas;
+
+		accumulate_uint32(block, n, 4, 1, d++); /* timestamp */
+		if (devinfo->graphics_ver >= 8)
+			accumulate_uint32(block, n, 12, 1, d++); /* clock */
+
+		accumulate_uint40(block, n, layout, d);
+		d += layout->n_a40;
+		accumulate_uint32(block, n, layout->a_off, layout->n_a, d);
+		d += layout->n_a;
+		accumulate_uint32(block, n, layout->b_off, layout->n_b, d);
+		d += layout->n_b;
+		accumulate_uint32(block, n, layout->c_off, layout->n_c, d);
+	}
+}
+
+/*
+ * Accumulates the counter deltas between each consecutive pair of a run of
+ * reports into @acc. Counters wrapping several times over the run are
+ * accounted for, unlike with a delta between the first and last reports.
+ */
+void intel_perf_accumulate_records(struct intel_perf_accumulator *acc,
+				   const struct intel_perf_devinfo *devinfo,
+				   int oa_format,
+				   const struct drm_i915_perf_record_header *const *records,
+				   uint32_t n_records)
+{
+	const struct oa_format_layout *layout =
+		oa_format_layout(devinfo, oa_format);
+
+	assert(layout);
+	assert(oa_format_n_deltas(devinfo, layout) <= INTEL_PERF_MAX_RAW_OA_COUNTERS);
+
+	accumulate_layout(acc->deltas, devinfo, layout, records, n_records);
 }
 
 void intel_perf_accumulate_reports(struct intel_perf_accumulator *acc,
@@ -629,40 +1072,86 @@ void intel_perf_accumulate_reports(struct intel_perf_accumulator *acc,
 				   const struct drm_i915_perf_record_header *record0,
 				   const struct drm_i915_perf_record_header *record1)
 {
-	const uint32_t *start = (const uint32_t *)(record0 + 1);
-	const uint32_t *end = (const uint32_t *)(record1 + 1);
-	uint64_t *deltas = acc->deltas;
-	int idx = 0;
-	int i;
+	const struct drm_i915_perf_record_header *records[] = { record0, record1 };
+	/* A45_B8_C8 is the only Haswell format metric sets use. */
+	const struct intel_perf_devinfo devinfo = {
+		.graphics_ver = oa_format == I915_OA_FORMAT_A45_B8_C8 ? 7 : 8,
+	};
 
 	memset(acc, 0, sizeof(*acc));
+	intel_perf_accumulate_records(acc, &devinfo, oa_format, records, 2);
+}
 
-	switch (oa_format) {
-	case I915_OA_FORMAT_A32u40_A4u32_B8_C8:
-		accumulate_uint32(start + 1, end + 1, deltas + idx++); /* timestamp */
-		accumulate_uint32(start + 3, end + 3, deltas + idx++); /* clock */
+/**
+ * intel_perf_oa_format_n_counters:
+ * @devinfo: device the reports come from
+ * @oa_format: format of the reports
+ *
+ * Returns: the number of raw counters in reports of @oa_format, in the order
+ * of #intel_perf_accumulator.deltas, 0 if the format is not supported.
+ */
+uint32_t intel_perf_oa_format_n_counters(const struct intel_perf_devinfo *devinfo,
+					 int oa_format)
+{
+	const struct oa_format_layout *layout =
+		oa_format_layout(devinfo, oa_format);
 
-		/* 32x 40bit A counters... */
-		for (i = 0; i < 32; i++)
-			accumulate_uint40(i, start, end, deltas + idx++);
+	return layout ? oa_format_n_deltas(devinfo, layout) : 0;
+}
 
-		/* 4x 32bit A counters... */
-		for (i = 0; i < 4; i++)
-			accumulate_uint32(start + 36 + i, end + 36 + i, deltas + idx++);
+/**
+ * intel_perf_write_report_counters:
+ * @devinfo: device the reports come from
+ * @oa_format: format of the report
+ * @record: OA report record to write into
+ * @counters: raw counter values, in the order of the accumulator deltas
+ *
+ * Writes the timestamp, GPU clock and A/B/C counters of an OA report, the
+ * values being truncated to the width of their fields. Accumulating the
+ * reports gives back the deltas of @counters, as long as none of them
+ * wraps between two reports. The other fields of the report are left
+ * untouched.
+ */
+void intel_perf_write_report_counters(const struct intel_perf_devinfo *devinfo,
+				      int oa_format,
+				      struct drm_i915_perf_record_header *record,
+				      const uint64_t *counters)
+{
+	const struct oa_format_layout *layout =
+		oa_format_layout(devinfo, oa_format);
+	uint8_t *report = (uint8_t *)(record + 1);
+	uint32_t value;
+
+	assert(layout);
+
+	value = *counters++;
+	memcpy(report + 4, &value, sizeof(value));
+	if (devinfo->graphics_ver >= 8) {
+		value = *counters++;
+		memcpy(report + 12, &value, sizeof(value));
+	}
 
-		/* 8x 32bit B counters + 8x 32bit C counters... */
-		for (i = 0; i < 16; i++)
-			accumulate_uint32(start + 48 + i, end + 48 + i, deltas + idx++);
-		break;
+	for (unsigned int i = 0; i < layout->n_a40; i++) {
+		value = counters[i];
+		memcpy(report + layout->a40_low_off + 4 * i, &value, sizeof(value));
+		report[layout->a40_high_off + i] = counters[i] >> 32;
+	}
+	counters += layout->n_a40;
 
-	case I915_OA_FORMAT_A45_B8_C8:
-		accumulate_uint32(start + 1, end + 1, deltas); /* timestamp */
+	for (unsigned int i = 0; i < layout->n_a; i++) {
+		value = counters[i];
+		memcpy(report + layout->a_off + 4 * i, &value, sizeof(value));
+	}
+	counters += layout->n_a;
 
-		for (i = 0; i < 61; i++)
-			accumulate_uint32(start + 3 + i, end + 3 + i, deltas + 1 + i);
-		break;
-	default:
-		assert(0);
+	for (unsigned int i = 0; i < layout->n_b; i++) {
+		value = counters[i];
+		memcpy(report + layout->b_off + 4 * i, &value, sizeof(value));
 	}
+	counters += layout->n_b;
 
+	for (unsigned int i = 0; i < layout->n_c; i++) {
+		value = counters[i];
+		memcpy(report + layout->c_off + 4 * i, &value, sizeof(value));
+	}
 }
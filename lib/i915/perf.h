@@ -126,6 +126,12 @@ struct intel_perf_accumulator {
 	uint64_t deltas[INTEL_PERF_MAX_RAW_OA_COUNTERS];
 };
 
+/* Value of a logical counter, as its storage says. */
+union intel_perf_logical_counter_value {
+	uint64_t u64;
+	double f;
+};
+
 struct intel_perf;
 struct intel_perf_metric_set;
 struct intel_perf_logical_counter {
@@ -182,6 +188,16 @@ struct intel_perf_metric_set {
 	int c_offset;
 	int perfcnt_offset;
 
+	/* Evaluates all the counters over a batch of accumulators at once,
+	 * values[i * n_counters + j] being the value of counters[j] for
+	 * accumulators[i].
+	 */
+	void (*evaluate)(const struct intel_perf *perf,
+			 const struct intel_perf_metric_set *metric_set,
+			 const struct intel_perf_accumulator *accumulators,
+			 uint32_t n_accumulators,
+			 union intel_perf_logical_counter_value *values);
+
 	struct intel_perf_register_prog *b_counter_regs;
 	uint32_t n_b_counter_regs;
 
@@ -204,6 +220,16 @@ struct intel_perf_logical_counter_group {
 	struct igt_list_head link;  /* link for intel_perf_logical_counter_group.groups */
 };
 
+/* Entry of the generated index of the metric sets of a platform. */
+struct intel_perf_metric_set_desc {
+	const char *name;
+	const char *symbol_name;
+	const char *hw_config_guid;
+
+	/* Builds the metric set and registers it with its counters. */
+	struct intel_perf_metric_set *(*add)(struct intel_perf *perf);
+};
+
 struct intel_perf {
 	const char *name;
 
@@ -212,6 +238,13 @@ struct intel_perf {
 	struct igt_list_head metric_sets;
 
 	struct intel_perf_devinfo devinfo;
+
+	/* All the metric sets of the device, only registered into
+	 * metric_sets once looked up for perfs created lazily.
+	 */
+	const struct intel_perf_metric_set_desc *metric_set_descs;
+	struct intel_perf_metric_set **loaded_metric_sets;
+	uint32_t n_metric_set_descs;
 };
 
 struct drm_i915_perf_record_header;
@@ -224,8 +257,21 @@ struct intel_perf *intel_perf_for_devinfo(uint32_t device_id,
 					  uint64_t gt_min_freq,
 					  uint64_t gt_max_freq,
 					  const struct drm_i915_query_topology_info *topology);
+struct intel_perf *intel_perf_for_fd_lazy(int drm_fd);
+struct intel_perf *intel_perf_for_devinfo_lazy(uint32_t device_id,
+					       uint32_t revision,
+					       uint64_t timestamp_frequency,
+					       uint64_t gt_min_freq,
+					       uint64_t gt_max_freq,
+					       const struct drm_i915_query_topology_info *topology);
 void intel_perf_free(struct intel_perf *perf);
 
+struct intel_perf_metric_set *intel_perf_load_metric_set(struct intel_perf *perf,
+							 uint32_t index);
+struct intel_perf_metric_set *intel_perf_find_metric_set(struct intel_perf *perf,
+							 const char *symbol_name);
+void intel_perf_load_metric_sets(struct intel_perf *perf);
+
 void intel_perf_add_logical_counter(struct intel_perf *perf,
 				    struct intel_perf_logical_counter *counter,
 				    const char *group);
@@ -239,6 +285,18 @@ void intel_perf_accumulate_reports(struct intel_perf_accumulator *acc,
 				   int oa_format,
 				   const struct drm_i915_perf_record_header *record0,
 				   const struct drm_i915_perf_record_header *record1);
+void intel_perf_accumulate_records(struct intel_perf_accumulator *acc,
+				   const struct intel_perf_devinfo *devinfo,
+				   int oa_format,
+				   const struct drm_i915_perf_record_header *const *records,
+				   uint32_t n_records);
+
+uint32_t intel_perf_oa_format_n_counters(const struct intel_perf_devinfo *devinfo,
+					 int oa_format);
+void intel_perf_write_report_counters(const struct intel_perf_devinfo *devinfo,
+				      int oa_format,
+				      struct drm_i915_perf_record_header *record,
+				      const uint64_t *counters);
 
 #ifdef __cplusplus
 };
@@ -52,6 +52,15 @@ enum intel_perf_record_type {
 
 	/* intel_perf_record_timestamp_correlation */
 	INTEL_PERF_RECORD_TYPE_TIMESTAMP_CORRELATION,
+
+	/* intel_perf_record_chunk, followed by the chunk data (version 2) */
+	INTEL_PERF_RECORD_TYPE_CHUNK,
+
+	/* intel_perf_record_index, followed by the index arrays (version 2) */
+	INTEL_PERF_RECORD_TYPE_INDEX,
+
+	/* intel_perf_record_footer, last record of the file (version 2) */
+	INTEL_PERF_RECORD_TYPE_FOOTER,
 };
 
 /* This structure cannot ever change. */
@@ -62,6 +71,7 @@ struct intel_perf_record_version {
 	uint32_t version;
 
 #define INTEL_PERF_RECORD_VERSION (1)
+#define INTEL_PERF_RECORD_VERSION_INDEXED (2)
 
 	uint32_t pad;
 } __attribute__((packed));
@@ -93,7 +103,10 @@ struct intel_perf_record_device_info {
 	/* Configuration identifier */
 	char metric_set_uuid[40];
 
-	uint32_t pad;
+	/* OA reports the recorder could not keep up with, written once the
+	 * recording is complete.
+	 */
+	uint32_t dropped_reports;
  } __attribute__((packed));
 
 /* Topology as reported by i915 (variable length, aligned by the
@@ -111,6 +124,86 @@ struct intel_perf_record_timestamp_correlation {
 	uint64_t gpu_timestamp;
 } __attribute__((packed));
 
+/*
+ * Version 2 recordings start with the same version, device info and topology
+ * records as version 1. All the other records (OA reports, lost reports and
+ * timestamp correlations) follow grouped into chunks of up to
+ * INTEL_PERF_RECORD_CHUNK_SIZE bytes, each optionally compressed with LZ4.
+ *
+ * The drm_i915_perf_record_header.size of chunk and index records only covers
+ * their fixed size part, the variable size data which follows is described
+ * by the record itself.
+ *
+ * Recordings closed cleanly end with an index of the chunks and a footer
+ * pointing to it, so a reader can decode only the chunks covering a time
+ * range. Without them the chunks can still be walked linearly.
+ *
+ * Timestamps of the chunks and context switches are OA report timestamps
+ * extended to 64bits, in the timebase of the gpu_timestamp of the first
+ * timestamp correlation.
+ */
+
+#define INTEL_PERF_RECORD_CHUNK_SIZE (1024 * 1024)
+
+enum intel_perf_record_compression {
+	INTEL_PERF_RECORD_COMPRESSION_NONE,
+	INTEL_PERF_RECORD_COMPRESSION_LZ4,
+};
+
+struct intel_perf_record_chunk {
+	/* Extended timestamps of the first and last OA reports */
+	uint64_t gpu_ts_begin;
+	uint64_t gpu_ts_end;
+
+	/* Size of the records once decompressed */
+	uint32_t size;
+
+	/* Size of the chunk data in the file */
+	uint32_t stored;
+
+	/* enum intel_perf_record_compression */
+	uint32_t compression;
+
+	uint32_t n_records;
+} __attribute__((packed));
+
+struct intel_perf_record_chunk_index {
+	/* File offset of the chunk record */
+	uint64_t offset;
+
+	struct intel_perf_record_chunk chunk;
+} __attribute__((packed));
+
+struct intel_perf_record_context_switch {
+	/* Extended timestamp of the first OA report of the new context */
+	uint64_t gpu_ts;
+
+	/* Hardware context id, 0xffffffff when idle */
+	uint32_t hw_id;
+
+	/* Index of the chunk holding the report */
+	uint32_t chunk;
+} __attribute__((packed));
+
+/* Followed by n_chunks intel_perf_record_chunk_index, n_context_switches
+ * intel_perf_record_context_switch and n_correlations
+ * intel_perf_record_timestamp_correlation.
+ */
+struct intel_perf_record_index {
+	uint32_t n_chunks;
+	uint32_t n_context_switches;
+	uint32_t n_correlations;
+	uint32_t pad;
+} __attribute__((packed));
+
+struct intel_perf_record_footer {
+	/* File offset of the index record */
+	uint64_t index_offset;
+
+#define INTEL_PERF_RECORD_FOOTER_MAGIC (0x6672657035313969ull) /* "i915perf" */
+	uint64_t magic;
+} __attribute__((packed));
+
 #ifdef __cplusplus
 };
 #endif
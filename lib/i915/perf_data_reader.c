@@ -32,12 +32,16 @@
 
 #include <i915_drm.h>
 
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
 #include "intel_chipset.h"
 #include "perf.h"
 #include "perf_data_reader.h"
+#include "perf_math.h"
 
 #define MAX(a,b) ((a) > (b) ? (a) : (b))
-#define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
 
 static inline bool
 oa_report_ctx_is_valid(const struct intel_perf_devinfo *devinfo,
@@ -104,73 +108,414 @@ append_timestamp_correlation(struct intel_perf_data_reader *reader,
 	reader->correlations[reader->n_correlations++] = corr;
 }
 
-static struct intel_perf_metric_set *
-find_metric_set(struct intel_perf *perf, const char *symbol_name)
+static bool
+parse_record(struct intel_perf_data_reader *reader,
+	     const struct drm_i915_perf_record_header *header,
+	     bool correlations)
 {
-	struct intel_perf_metric_set *metric_set;
+	switch (header->type) {
+	case DRM_I915_PERF_RECORD_SAMPLE:
+		append_record(reader, header);
+		break;
+
+	case DRM_I915_PERF_RECORD_OA_REPORT_LOST:
+	case DRM_I915_PERF_RECORD_OA_BUFFER_LOST:
+		assert(header->size == sizeof(*header));
+		break;
+
+	case INTEL_PERF_RECORD_TYPE_VERSION: {
+		struct intel_perf_record_version *version =
+			(struct intel_perf_record_version*) (header + 1);
+		if (version->version != INTEL_PERF_RECORD_VERSION &&
+		    version->version != INTEL_PERF_RECORD_VERSION_INDEXED) {
+			snprintf(reader->error_msg, sizeof(reader->error_msg),
+				 "Unsupported recording version (%u, expected %u or %u)",
+				 version->version, INTEL_PERF_RECORD_VERSION,
+				 INTEL_PERF_RECORD_VERSION_INDEXED);
+			return false;
+		}
+		reader->version = version->version;
+		break;
+	}
 
-	igt_list_for_each_entry(metric_set, &perf->metric_sets, link) {
-		if (!strcmp(symbol_name, metric_set->symbol_name))
-			return metric_set;
+	case INTEL_PERF_RECORD_TYPE_DEVICE_INFO: {
+		reader->record_info = header + 1;
+		assert(header->size == (sizeof(struct intel_perf_record_device_info) +
+					sizeof(*header)));
+		break;
 	}
 
-	return NULL;
+	case INTEL_PERF_RECORD_TYPE_DEVICE_TOPOLOGY: {
+		reader->record_topology = header + 1;
+		break;
+	}
+
+	case INTEL_PERF_RECORD_TYPE_TIMESTAMP_CORRELATION: {
+		/* Taken from the index of indexed recordings. */
+		if (correlations)
+			append_timestamp_correlation(reader,
+						     (const struct intel_perf_record_timestamp_correlation *) (header + 1));
+		break;
+	}
+	}
+
+	return true;
 }
 
-static bool
-parse_data(struct intel_perf_data_reader *reader)
+/* Walks the records in [iter, end), stopping at the first chunk if asked. */
+static const uint8_t *
+parse_records(struct intel_perf_data_reader *reader,
+	      const uint8_t *iter, const uint8_t *end,
+	      bool correlations, bool stop_at_chunk)
 {
-	const struct intel_perf_record_device_info *record_info;
-	const struct intel_perf_record_device_topology *record_topology;
-	const uint8_t *end = reader->mmap_data + reader->mmap_size;
-	const uint8_t *iter = reader->mmap_data;
-
 	while (iter < end) {
 		const struct drm_i915_perf_record_header *header =
 			(const struct drm_i915_perf_record_header *) iter;
 
-		switch (header->type) {
-		case DRM_I915_PERF_RECORD_SAMPLE:
-			append_record(reader, header);
-			break;
+		if (end - iter < sizeof(*header) ||
+		    header->size < sizeof(*header) ||
+		    header->size > end - iter) {
+			snprintf(reader->error_msg, sizeof(reader->error_msg),
+				 "Invalid file, truncated record");
+			return NULL;
+		}
 
-		case DRM_I915_PERF_RECORD_OA_REPORT_LOST:
-		case DRM_I915_PERF_RECORD_OA_BUFFER_LOST:
-			assert(header->size == sizeof(*header));
+		if (header->type == INTEL_PERF_RECORD_TYPE_CHUNK && stop_at_chunk)
 			break;
 
-		case INTEL_PERF_RECORD_TYPE_VERSION: {
-			struct intel_perf_record_version *version =
-				(struct intel_perf_record_version*) (header + 1);
-			if (version->version != INTEL_PERF_RECORD_VERSION) {
-				snprintf(reader->error_msg, sizeof(reader->error_msg),
-					 "Unsupported recording version (%u, expected %u)",
-					 version->version, INTEL_PERF_RECORD_VERSION);
-				return false;
-			}
+		if (!parse_record(reader, header, correlations))
+			return NULL;
+
+		iter += header->size;
+	}
+
+	return iter;
+}
+
+static const struct intel_perf_record_chunk *
+chunk_at(struct intel_perf_data_reader *reader, uint64_t offset)
+{
+	const struct drm_i915_perf_record_header *header =
+		(const struct drm_i915_perf_record_header *) (reader->mmap_data + offset);
+	const struct intel_perf_record_chunk *chunk =
+		(const struct intel_perf_record_chunk *) (header + 1);
+
+	if (offset + sizeof(*header) + sizeof(*chunk) > reader->mmap_size ||
+	    header->type != INTEL_PERF_RECORD_TYPE_CHUNK ||
+	    header->size != sizeof(*header) + sizeof(*chunk) ||
+	    chunk->stored > reader->mmap_size - offset - header->size)
+		return NULL;
+
+	return chunk;
+}
+
+static bool
+parse_chunk(struct intel_perf_data_reader *reader,
+	    const struct intel_perf_record_chunk *chunk,
+	    uint8_t **chunk_data, bool correlations)
+{
+	const uint8_t *data = (const uint8_t *) (chunk + 1);
+
+	switch (chunk->compression) {
+	case INTEL_PERF_RECORD_COMPRESSION_NONE:
+		if (chunk->stored != chunk->size)
+			goto corrupt;
+		break;
+
+	case INTEL_PERF_RECORD_COMPRESSION_LZ4:
+#ifdef HAVE_LZ4
+		/* Sized from the index, which could disagree with the file. */
+		if (chunk->size > reader->chunk_data + reader->chunk_data_size -
+				  *chunk_data)
+			goto corrupt;
+		if (LZ4_decompress_safe((const char *) data, (char *) *chunk_data,
+					chunk->stored, chunk->size) != chunk->size)
+			goto corrupt;
+		data = *chunk_data;
+		*chunk_data += chunk->size;
+		break;
+#else
+		snprintf(reader->error_msg, sizeof(reader->error_msg),
+			 "Compressed recording, LZ4 support required");
+		return false;
+#endif
+
+	default:
+		goto corrupt;
+	}
+
+	return parse_records(reader, data, data + chunk->size,
+			     correlations, false);
+
+corrupt:
+	snprintf(reader->error_msg, sizeof(reader->error_msg),
+		 "Invalid file, corrupt chunk");
+	return false;
+}
+
+static void
+alloc_chunk_data(struct intel_perf_data_reader *reader, size_t size)
+{
+	reader->chunk_data_size = size;
+	reader->chunk_data = malloc(size ?: 1);
+	assert(reader->chunk_data);
+}
+
+/* Decodes all the chunks following iter, for recordings without index. */
+static bool
+parse_chunks(struct intel_perf_data_reader *reader, const uint8_t *iter)
+{
+	const uint8_t *start = iter, *end = reader->mmap_data + reader->mmap_size;
+	const struct intel_perf_record_chunk *chunk;
+	uint8_t *chunk_data;
+	size_t size = 0;
+
+	/* Chunk data can not move once records point into it. */
+	while (iter < end &&
+	       (chunk = chunk_at(reader, iter - reader->mmap_data))) {
+		if (chunk->compression != INTEL_PERF_RECORD_COMPRESSION_NONE)
+			size += chunk->size;
+		iter = (const uint8_t *) (chunk + 1) + chunk->stored;
+	}
+
+	alloc_chunk_data(reader, size);
+	chunk_data = reader->chunk_data;
+
+	/* Up to the index, or the partial chunk of a crashed recorder. */
+	for (iter = start; iter < end; ) {
+		chunk = chunk_at(reader, iter - reader->mmap_data);
+		if (!chunk)
 			break;
-		}
 
-		case INTEL_PERF_RECORD_TYPE_DEVICE_INFO: {
-			reader->record_info = header + 1;
-			assert(header->size == (sizeof(struct intel_perf_record_device_info) +
-						sizeof(*header)));
+		if (!parse_chunk(reader, chunk, &chunk_data, true))
+			return false;
+
+		iter = (const uint8_t *) (chunk + 1) + chunk->stored;
+	}
+
+	return true;
+}
+
+static const struct intel_perf_record_index *
+find_index(struct intel_perf_data_reader *reader)
+{
+	const struct drm_i915_perf_record_header *header;
+	const struct intel_perf_record_footer *footer;
+	const struct intel_perf_record_index *index;
+	size_t size;
+
+	if (reader->mmap_size < sizeof(*header) + sizeof(*footer))
+		return NULL;
+
+	header = (const struct drm_i915_perf_record_header *)
+		(reader->mmap_data + reader->mmap_size -
+		 sizeof(*header) - sizeof(*footer));
+	footer = (const struct intel_perf_record_footer *) (header + 1);
+	if (header->type != INTEL_PERF_RECORD_TYPE_FOOTER ||
+	    footer->magic != INTEL_PERF_RECORD_FOOTER_MAGIC ||
+	    footer->index_offset > reader->mmap_size - sizeof(*header) -
+				   sizeof(*index))
+		return NULL;
+
+	header = (const struct drm_i915_perf_record_header *)
+		(reader->mmap_data + footer->index_offset);
+	index = (const struct intel_perf_record_index *) (header + 1);
+	if (header->type != INTEL_PERF_RECORD_TYPE_INDEX)
+		return NULL;
+
+	size = (size_t) index->n_chunks * sizeof(*reader->chunks) +
+	       (size_t) index->n_context_switches * sizeof(*reader->context_switches) +
+	       (size_t) index->n_correlations *
+	       sizeof(struct intel_perf_record_timestamp_correlation);
+	if (size > reader->mmap_size - footer->index_offset -
+		   sizeof(*header) - sizeof(*index))
+		return NULL;
+
+	return index;
+}
+
+static void
+compute_correlations(struct intel_perf_data_reader *reader)
+{
+	uint32_t n = reader->n_correlations;
+	uint64_t wraps = 0;
+
+	reader->correlation_gpu_ts = malloc(n * sizeof(uint64_t));
+	reader->correlation_ratio = malloc(n * sizeof(uint64_t));
+	assert(reader->correlation_gpu_ts && reader->correlation_ratio);
+
+	/* The timestamp register is 36bits wide. */
+	for (uint32_t i = 0; i < n; i++) {
+		if (i && reader->correlations[i]->gpu_timestamp <
+			 reader->correlations[i - 1]->gpu_timestamp)
+			wraps += 1ull << 36;
+		reader->correlation_gpu_ts[i] =
+			reader->correlations[i]->gpu_timestamp + wraps;
+	}
+
+	for (uint32_t i = 0; i + 1 < n; i++) {
+		uint64_t cpu_delta = reader->correlations[i + 1]->cpu_timestamp -
+				     reader->correlations[i]->cpu_timestamp;
+		uint64_t gpu_delta = reader->correlation_gpu_ts[i + 1] -
+				     reader->correlation_gpu_ts[i];
+
+		if (!gpu_delta || (int64_t) cpu_delta < 0)
+			reader->correlation_ratio[i] = i ? reader->correlation_ratio[i - 1] : 0;
+		else
+			reader->correlation_ratio[i] =
+				intel_perf_mul_div_u64(cpu_delta, 1ull << 32,
+						       gpu_delta);
+	}
+	reader->correlation_ratio[n - 1] = reader->correlation_ratio[n - 2];
+
+	reader->correlation_cursor = 0;
+	reader->last_gpu_ts = reader->correlation_gpu_ts[0];
+}
+
+/*
+ * Finds the GPU timestamps bracketing a CPU time range, from the correlation
+ * points on either side of it.
+ */
+static void
+gpu_range(struct intel_perf_data_reader *reader,
+	  uint64_t cpu_ts_begin, uint64_t cpu_ts_end,
+	  uint64_t *gpu_ts_begin, uint64_t *gpu_ts_end)
+{
+	*gpu_ts_begin = 0;
+	*gpu_ts_end = UINT64_MAX;
+
+	for (uint32_t i = 0; i < reader->n_correlations; i++) {
+		uint64_t cpu_ts = reader->correlations[i]->cpu_timestamp;
+
+		if (cpu_ts <= cpu_ts_begin)
+			*gpu_ts_begin = reader->correlation_gpu_ts[i];
+		if (cpu_ts >= cpu_ts_end) {
+			*gpu_ts_end = reader->correlation_gpu_ts[i];
 			break;
 		}
+	}
+}
 
-		case INTEL_PERF_RECORD_TYPE_DEVICE_TOPOLOGY: {
-			reader->record_topology = header + 1;
-			break;
+/* Sets up the index and the timestamp correlations of an indexed recording. */
+static void
+parse_index(struct intel_perf_data_reader *reader,
+	    const struct intel_perf_record_index *index)
+{
+	const struct intel_perf_record_timestamp_correlation *corr;
+
+	reader->chunks = (const struct intel_perf_record_chunk_index *) (index + 1);
+	reader->n_chunks = index->n_chunks;
+	reader->context_switches =
+		(const struct intel_perf_record_context_switch *)
+		(reader->chunks + reader->n_chunks);
+	reader->n_context_switches = index->n_context_switches;
+	corr = (const struct intel_perf_record_timestamp_correlation *)
+		(reader->context_switches + reader->n_context_switches);
+
+	for (uint32_t i = 0; i < index->n_correlations; i++)
+		append_timestamp_correlation(reader, &corr[i]);
+	if (reader->n_correlations >= 2)
+		compute_correlations(reader);
+}
+
+/* Decodes the chunks [first, last) of an indexed recording. */
+static bool
+load_chunks(struct intel_perf_data_reader *reader,
+	    uint32_t first, uint32_t last)
+{
+	uint8_t *chunk_data;
+	size_t size = 0;
+
+	for (uint32_t i = first; i < last; i++) {
+		const struct intel_perf_record_chunk *chunk =
+			&reader->chunks[i].chunk;
+
+		if (chunk->compression != INTEL_PERF_RECORD_COMPRESSION_NONE)
+			size += chunk->size;
+	}
+
+	free(reader->chunk_data);
+	alloc_chunk_data(reader, size);
+	chunk_data = reader->chunk_data;
+
+	/* Where the 32bits report timestamps get extended from. */
+	if (first < last && reader->n_records == 0)
+		reader->last_gpu_ts = reader->chunks[first].chunk.gpu_ts_begin;
+
+	for (uint32_t i = first; i < last; i++) {
+		const struct intel_perf_record_chunk *chunk =
+			chunk_at(reader, reader->chunks[i].offset);
+
+		if (!chunk || memcmp(chunk, &reader->chunks[i].chunk,
+				     sizeof(*chunk))) {
+			snprintf(reader->error_msg, sizeof(reader->error_msg),
+				 "Invalid file, corrupt index");
+			return false;
 		}
 
-		case INTEL_PERF_RECORD_TYPE_TIMESTAMP_CORRELATION: {
-			append_timestamp_correlation(reader,
-						     (const struct intel_perf_record_timestamp_correlation *) (header + 1));
+		if (!parse_chunk(reader, chunk, &chunk_data, false))
+			return false;
+	}
+
+	return true;
+}
+
+/* Decodes the chunks of an indexed recording overlapping the time range. */
+static bool
+parse_indexed_chunks(struct intel_perf_data_reader *reader,
+		     const struct intel_perf_record_index *index,
+		     uint64_t cpu_ts_begin, uint64_t cpu_ts_end)
+{
+	uint64_t gpu_ts_begin, gpu_ts_end;
+	uint32_t first = 0, last = 0;
+
+	parse_index(reader, index);
+	if (reader->n_correlations < 2)
+		return true; /* Reported by the caller. */
+
+	/* Chunks get decoded one window at a time. */
+	if (reader->streaming)
+		return true;
+
+	gpu_range(reader, cpu_ts_begin, cpu_ts_end, &gpu_ts_begin, &gpu_ts_end);
+
+	/* Chunks are in timestamp order. */
+	while (first < reader->n_chunks &&
+	       reader->chunks[first].chunk.gpu_ts_end < gpu_ts_begin)
+		first++;
+	for (last = first; last < reader->n_chunks; last++) {
+		if (reader->chunks[last].chunk.gpu_ts_begin > gpu_ts_end)
 			break;
-		}
-		}
+	}
 
-		iter += header->size;
+	return load_chunks(reader, first, last);
+}
+
+static bool
+parse_data(struct intel_perf_data_reader *reader,
+	   uint64_t cpu_ts_begin, uint64_t cpu_ts_end)
+{
+	const struct intel_perf_record_device_info *record_info;
+	const struct intel_perf_record_device_topology *record_topology;
+	const uint8_t *end = reader->mmap_data + reader->mmap_size;
+	const struct intel_perf_record_index *index = NULL;
+	const uint8_t *iter;
+
+	iter = parse_records(reader, reader->mmap_data, end, true,
+			     true /* metadata is never in chunks */);
+	if (!iter)
+		return false;
+
+	if (reader->version == INTEL_PERF_RECORD_VERSION_INDEXED)
+		index = find_index(reader);
+
+	if (index) {
+		if (!parse_indexed_chunks(reader, index,
+					  cpu_ts_begin, cpu_ts_end))
+			return false;
+	} else if (iter < end) {
+		if (!parse_chunks(reader, iter))
+			return false;
 	}
 
 	if (!reader->record_info ||
@@ -180,15 +525,22 @@ parse_data(struct intel_perf_data_reader *reader)
 		return false;
 	}
 
+	if (reader->n_correlations < 2) {
+		snprintf(reader->error_msg, sizeof(reader->error_msg),
+			 "Invalid file, missing timestamp correlations");
+		return false;
+	}
+
 	record_info = reader->record_info;
 	record_topology = reader->record_topology;
 
-	reader->perf = intel_perf_for_devinfo(record_info->device_id,
-					      record_info->device_revision,
-					      record_info->timestamp_frequency,
-					      record_info->gt_min_frequency,
-					      record_info->gt_max_frequency,
-					      &record_topology->topology);
+	/* Only the metric set of the recording gets registered. */
+	reader->perf = intel_perf_for_devinfo_lazy(record_info->device_id,
+						   record_info->device_revision,
+						   record_info->timestamp_frequency,
+						   record_info->gt_min_frequency,
+						   record_info->gt_max_frequency,
+						   &record_topology->topology);
 	if (!reader->perf) {
 		snprintf(reader->error_msg, sizeof(reader->error_msg),
 			 "Recording occured on unsupported device (0x%x)",
@@ -200,54 +552,68 @@ parse_data(struct intel_perf_data_reader *reader)
 
 	reader->metric_set_name = record_info->metric_set_name;
 	reader->metric_set_uuid = record_info->metric_set_uuid;
-	reader->metric_set = find_metric_set(reader->perf, record_info->metric_set_name);
+	reader->metric_set = intel_perf_find_metric_set(reader->perf,
+							record_info->metric_set_name);
 
 	return true;
 }
 
+/* Last correlation at or before gpu_ts in [lo, hi), lo if there is none. */
+static uint32_t
+find_correlation(const uint64_t *corr_ts, uint32_t lo, uint32_t hi,
+		 uint64_t gpu_ts)
+{
+	while (hi - lo > 1) {
+		uint32_t mid = lo + (hi - lo) / 2;
+
+		if (corr_ts[mid] <= gpu_ts)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
 static uint64_t
 correlate_gpu_timestamp(struct intel_perf_data_reader *reader,
 			uint64_t gpu_ts)
 {
-	/* OA reports only have the lower 32bits of the timestamp
-	 * register, while our correlation data has the whole 36bits.
-	 * Try to figure what portion of the correlation data the
-	 * 32bit timestamp belongs to.
-	 */
-	uint64_t mask = 0xffffffff;
-	int corr_idx = -1;
-
-	for (uint32_t i = 0; i < reader->n_correlation_chunks; i++) {
-		if (gpu_ts >= (reader->correlation_chunks[i].gpu_ts_begin & mask) &&
-		    gpu_ts <= (reader->correlation_chunks[i].gpu_ts_end & mask)) {
-			corr_idx = reader->correlation_chunks[i].idx;
-			break;
-		}
-	}
+	const uint64_t *corr_ts = reader->correlation_gpu_ts;
+	uint32_t n = reader->n_correlations;
+	uint32_t i = reader->correlation_cursor;
+	uint64_t cpu_ts, delta;
 
-	/* Not found? Assume prior to the first timestamp correlation.
+	/* OA reports only have the lower 32bits of the timestamp register,
+	 * take the extended timestamp closest to the previous lookup.
 	 */
-	if (corr_idx < 0) {
-		return reader->correlations[0]->cpu_timestamp -
-			((reader->correlations[0]->gpu_timestamp & mask) - gpu_ts) *
-			(reader->correlations[1]->cpu_timestamp - reader->correlations[0]->cpu_timestamp) /
-			(reader->correlations[1]->gpu_timestamp - reader->correlations[0]->gpu_timestamp);
-	}
-
-	for (uint32_t i = corr_idx; i < (reader->n_correlations - 1); i++) {
-		if (gpu_ts >= (reader->correlations[i]->gpu_timestamp & mask) &&
-		    gpu_ts < (reader->correlations[i + 1]->gpu_timestamp & mask)) {
-			return reader->correlations[i]->cpu_timestamp +
-				(gpu_ts - (reader->correlations[i]->gpu_timestamp & mask)) *
-				(reader->correlations[i + 1]->cpu_timestamp - reader->correlations[i]->cpu_timestamp) /
-				(reader->correlations[i + 1]->gpu_timestamp - reader->correlations[i]->gpu_timestamp);
+	gpu_ts = reader->last_gpu_ts +
+		 (int32_t) ((uint32_t) gpu_ts - (uint32_t) reader->last_gpu_ts);
+	reader->last_gpu_ts = gpu_ts;
+
+	/* Lookups mostly move forward by less than a correlation period. */
+	if (gpu_ts >= corr_ts[i]) {
+		if (i + 1 < n && gpu_ts >= corr_ts[i + 1]) {
+			i++;
+			if (i + 1 < n && gpu_ts >= corr_ts[i + 1])
+				i = find_correlation(corr_ts, i + 1, n, gpu_ts);
 		}
+	} else {
+		i = find_correlation(corr_ts, 0, i, gpu_ts);
+	}
+	reader->correlation_cursor = i;
+
+	/* Extrapolates before the first and after the last correlation. */
+	cpu_ts = reader->correlations[i]->cpu_timestamp;
+	if (gpu_ts >= corr_ts[i]) {
+		delta = gpu_ts - corr_ts[i];
+		return cpu_ts + intel_perf_mul_shr_u64(delta,
+						       reader->correlation_ratio[i], 32);
+	} else {
+		delta = corr_ts[i] - gpu_ts;
+		return cpu_ts - intel_perf_mul_shr_u64(delta,
+						       reader->correlation_ratio[i], 32);
 	}
-
-	/* This is a bit harsh, but the recording tool should ensure we have
-	 * sampling points on either side of the bag of OA reports.
-	 */
-	assert(0);
 }
 
 static void
@@ -313,30 +679,9 @@ generate_cpu_events(struct intel_perf_data_reader *reader)
 		append_timeline_event(reader, gpu_ts_start, gpu_ts_end, last_header_idx, reader->n_records - 1, last_ctx_id);
 }
 
-static void
-compute_correlation_chunks(struct intel_perf_data_reader *reader)
-{
-	uint64_t mask = ~(0xffffffff);
-	uint32_t last_idx = 0;
-	uint64_t last_ts = reader->correlations[last_idx]->gpu_timestamp;
-
-	for (uint32_t i = 0; i < reader->n_correlations; i++) {
-		if (!reader->n_correlation_chunks ||
-		    (last_ts & mask) != (reader->correlations[i]->gpu_timestamp & mask)) {
-			assert(reader->n_correlation_chunks < ARRAY_SIZE(reader->correlation_chunks));
-			reader->correlation_chunks[reader->n_correlation_chunks].gpu_ts_begin = last_ts;
-			reader->correlation_chunks[reader->n_correlation_chunks].gpu_ts_end = last_ts | ~mask;
-			reader->correlation_chunks[reader->n_correlation_chunks].idx = last_idx;
-			last_ts = reader->correlation_chunks[reader->n_correlation_chunks].gpu_ts_end + 1;
-			last_idx = i;
-			reader->n_correlation_chunks++;
-		}
-	}
-}
-
-bool
-intel_perf_data_reader_init(struct intel_perf_data_reader *reader,
-			    int perf_file_fd)
+static bool
+init(struct intel_perf_data_reader *reader, int perf_file_fd,
+     bool streaming, uint64_t cpu_ts_begin, uint64_t cpu_ts_end)
 {
         struct stat st;
         if (fstat(perf_file_fd, &st) != 0) {
@@ -346,6 +691,7 @@ intel_perf_data_reader_init(struct intel_perf_data_reader *reader,
 	}
 
 	memset(reader, 0, sizeof(*reader));
+	reader->streaming = streaming;
 
 	reader->mmap_size = st.st_size;
 	reader->mmap_data = (const uint8_t *) mmap(NULL, st.st_size,
@@ -357,11 +703,124 @@ intel_perf_data_reader_init(struct intel_perf_data_reader *reader,
 		return false;
 	}
 
-	if (!parse_data(reader))
+	if (!parse_data(reader, cpu_ts_begin, cpu_ts_end))
+		return false;
+
+	if (!reader->correlation_gpu_ts)
+		compute_correlations(reader);
+	if (reader->n_records)
+		generate_cpu_events(reader);
+
+	return true;
+}
+
+/**
+ * intel_perf_data_reader_init_range:
+ * @reader: reader to initialize
+ * @perf_file_fd: file descriptor of the recording
+ * @cpu_ts_begin: start of the time range, in the CPU clock of the recording
+ * @cpu_ts_end: end of the time range
+ *
+ * Reads the OA reports of an i915-perf recording covering a time range. Only
+ * the chunks of indexed recordings around the range are decoded, other
+ * recordings are read in full.
+ *
+ * Returns: true on success, false with @reader.error_msg set otherwise.
+ */
+bool
+intel_perf_data_reader_init_range(struct intel_perf_data_reader *reader,
+				  int perf_file_fd,
+				  uint64_t cpu_ts_begin,
+				  uint64_t cpu_ts_end)
+{
+	return init(reader, perf_file_fd, false, cpu_ts_begin, cpu_ts_end);
+}
+
+bool
+intel_perf_data_reader_init(struct intel_perf_data_reader *reader,
+			    int perf_file_fd)
+{
+	return intel_perf_data_reader_init_range(reader, perf_file_fd,
+						 0, UINT64_MAX);
+}
+
+/**
+ * intel_perf_data_reader_init_stream:
+ * @reader: reader to initialize
+ * @perf_file_fd: file descriptor of the recording
+ *
+ * Reads the metadata of an i915-perf recording, for its OA reports to be
+ * read one window at a time with intel_perf_data_reader_next().
+ *
+ * Returns: true on success, false with @reader.error_msg set otherwise.
+ */
+bool
+intel_perf_data_reader_init_stream(struct intel_perf_data_reader *reader,
+				   int perf_file_fd)
+{
+	return init(reader, perf_file_fd, true, 0, UINT64_MAX);
+}
+
+/**
+ * intel_perf_data_reader_next:
+ * @reader: reader initialized with intel_perf_data_reader_init_stream()
+ * @max_size: size of decoded data to hold at once
+ *
+ * Replaces the records and timeline items of @reader with those of the next
+ * window of the recording. Indexed recordings are decoded a few chunks at a
+ * time, up to @max_size bytes of OA data (at least one chunk). Other
+ * recordings are read in full by intel_perf_data_reader_init_stream() and
+ * come as a single window.
+ *
+ * The last record of a window is also the first record of the next one, so
+ * that no delta is lost between windows, the timeline item across the two
+ * windows being split in two.
+ *
+ * Returns: true if a window was read, false at the end of the recording or
+ * on error, with @reader.error_msg set.
+ */
+bool
+intel_perf_data_reader_next(struct intel_perf_data_reader *reader,
+			    size_t max_size)
+{
+	uint32_t first = reader->stream_chunk, last = first;
+	size_t size = 0;
+
+	reader->error_msg[0] = '\0';
+
+	if (!reader->chunks)
+		return reader->stream_chunk++ == 0;
+
+	if (first >= reader->n_chunks || reader->n_correlations < 2)
+		return false;
+
+	do {
+		size += reader->chunks[last++].chunk.size;
+	} while (last < reader->n_chunks &&
+		 size + reader->chunks[last].chunk.size <= max_size);
+
+	/* The chunk data of the last record is about to be freed. */
+	if (reader->n_records) {
+		const struct drm_i915_perf_record_header *header =
+			reader->records[reader->n_records - 1];
+
+		reader->stream_carry = realloc(reader->stream_carry, header->size);
+		assert(reader->stream_carry);
+		memcpy(reader->stream_carry, header, header->size);
+	}
+
+	reader->n_records = 0;
+	reader->n_timelines = 0;
+	if (reader->stream_carry)
+		append_record(reader, (const struct drm_i915_perf_record_header *)
+			      reader->stream_carry);
+
+	if (!load_chunks(reader, first, last))
 		return false;
+	reader->stream_chunk = last;
 
-	compute_correlation_chunks(reader);
-	generate_cpu_events(reader);
+	if (reader->n_records)
+		generate_cpu_events(reader);
 
 	return true;
 }
@@ -373,5 +832,9 @@ intel_perf_data_reader_fini(struct intel_perf_data_reader *reader)
 	free(reader->records);
 	free(reader->timelines);
 	free(reader->correlations);
+	free(reader->chunk_data);
+	free(reader->stream_carry);
+	free(reader->correlation_gpu_ts);
+	free(reader->correlation_ratio);
 	munmap((void *)reader->mmap_data, reader->mmap_size);
 }
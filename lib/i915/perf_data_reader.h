@@ -69,12 +69,15 @@ struct intel_perf_data_reader {
 	uint32_t n_correlations;
 	uint32_t n_allocated_correlations;
 
-	struct {
-		uint64_t gpu_ts_begin;
-		uint64_t gpu_ts_end;
-		uint32_t idx;
-	} correlation_chunks[4];
-	uint32_t n_correlation_chunks;
+	/* GPU timestamps of the correlations extended to 64bits, and the
+	 * CPU/GPU time ratio up to the next correlation in 32.32 fixed point.
+	 */
+	uint64_t *correlation_gpu_ts;
+	uint64_t *correlation_ratio;
+
+	/* Correlation and extended GPU timestamp of the last lookup. */
+	uint32_t correlation_cursor;
+	uint64_t last_gpu_ts;
 
 	const char *metric_set_uuid;
 	const char *metric_set_name;
@@ -92,10 +95,38 @@ struct intel_perf_data_reader {
 
 	const uint8_t *mmap_data;
 	size_t mmap_size;
+
+	/* Version of the recording format. */
+	uint32_t version;
+
+	/* Index of indexed recordings, pointing into the mmapped file. */
+	const struct intel_perf_record_chunk_index *chunks;
+	uint32_t n_chunks;
+	const struct intel_perf_record_context_switch *context_switches;
+	uint32_t n_context_switches;
+
+	/* Decompressed chunks, records point into it. */
+	uint8_t *chunk_data;
+	size_t chunk_data_size;
+
+	/* Streaming, next chunk to decode and copy of the last record of the
+	 * previous window.
+	 */
+	bool streaming;
+	uint32_t stream_chunk;
+	uint8_t *stream_carry;
 };
 
 bool intel_perf_data_reader_init(struct intel_perf_data_reader *reader,
 				 int perf_file_fd);
+bool intel_perf_data_reader_init_range(struct intel_perf_data_reader *reader,
+				       int perf_file_fd,
+				       uint64_t cpu_ts_begin,
+				       uint64_t cpu_ts_end);
+bool intel_perf_data_reader_init_stream(struct intel_perf_data_reader *reader,
+					int perf_file_fd);
+bool intel_perf_data_reader_next(struct intel_perf_data_reader *reader,
+				 size_t max_size);
 void intel_perf_data_reader_fini(struct intel_perf_data_reader *reader);
 
 #ifdef __cplusplus
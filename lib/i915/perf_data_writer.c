@@ -0,0 +1,386 @@
+/*
+ * Copyright (C) 2022 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include <i915_drm.h>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#include "perf_data.h"
+#include "perf_data_writer.h"
+
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+
+/* Splits the stream of records into chunks and indexes them (version 2). */
+struct indexed_output {
+	FILE *file;
+	uint32_t graphics_ver;
+
+	/* Records of the current chunk, followed by a partially written one. */
+	uint8_t *data;
+	size_t size;
+	size_t partial;
+
+	char *compressed;
+	size_t compressed_size;
+
+	struct intel_perf_record_chunk chunk;
+	uint64_t last_ts;
+	uint32_t last_hw_id;
+	bool have_ts;
+
+	struct intel_perf_record_chunk_index *chunks;
+	uint32_t n_chunks, n_allocated_chunks;
+
+	struct intel_perf_record_context_switch *context_switches;
+	uint32_t n_context_switches, n_allocated_context_switches;
+
+	struct intel_perf_record_timestamp_correlation *correlations;
+	uint32_t n_correlations, n_allocated_correlations;
+};
+
+/* Room for the largest record after a full chunk. */
+#define INDEXED_OUTPUT_SIZE (INTEL_PERF_RECORD_CHUNK_SIZE + UINT16_MAX)
+
+#define append_item(array, n, n_allocated, item) do { \
+	if ((n) >= (n_allocated)) { \
+		(n_allocated) = MAX(64, 2 * (n_allocated)); \
+		(array) = realloc((array), (n_allocated) * sizeof(*(array))); \
+		assert(array); \
+	} \
+	(array)[(n)++] = (item); \
+} while (0)
+
+static uint32_t
+report_hw_id(uint32_t graphics_ver, const uint32_t *report)
+{
+	bool valid = graphics_ver == 8 ? report[0] & (1ul << 25) :
+				       report[0] & (1ul << 16);
+
+	return valid ? report[2] : 0xffffffff;
+}
+
+static bool
+indexed_output_flush(struct indexed_output *out)
+{
+	struct drm_i915_perf_record_header header = {
+		.type = INTEL_PERF_RECORD_TYPE_CHUNK,
+		.size = sizeof(header) + sizeof(out->chunk),
+	};
+	struct intel_perf_record_chunk_index entry;
+	const void *data = out->data;
+	off_t offset;
+
+	if (!out->size)
+		return true;
+
+	out->chunk.size = out->size;
+	out->chunk.stored = out->size;
+	out->chunk.compression = INTEL_PERF_RECORD_COMPRESSION_NONE;
+	if (!out->chunk.n_records)
+		out->chunk.gpu_ts_begin = out->chunk.gpu_ts_end = out->last_ts;
+
+#ifdef HAVE_LZ4
+	{
+		int ret = LZ4_compress_default((const char *) out->data,
+					       out->compressed, out->size,
+					       out->compressed_size);
+
+		if (ret > 0 && ret < out->size) {
+			out->chunk.stored = ret;
+			out->chunk.compression = INTEL_PERF_RECORD_COMPRESSION_LZ4;
+			data = out->compressed;
+		}
+	}
+#endif
+
+	offset = ftello(out->file);
+	if (offset < 0 ||
+	    fwrite(&header, sizeof(header), 1, out->file) != 1 ||
+	    fwrite(&out->chunk, sizeof(out->chunk), 1, out->file) != 1 ||
+	    fwrite(data, out->chunk.stored, 1, out->file) != 1)
+		return false;
+
+	entry.offset = offset;
+	entry.chunk = out->chunk;
+	append_item(out->chunks, out->n_chunks, out->n_allocated_chunks, entry);
+
+	memset(&out->chunk, 0, sizeof(out->chunk));
+	memmove(out->data, out->data + out->size, out->partial);
+	out->size = 0;
+
+	return true;
+}
+
+static void
+indexed_output_sample(struct indexed_output *out,
+		      const struct drm_i915_perf_record_header *header)
+{
+	const uint32_t *report = (const uint32_t *) (header + 1);
+	uint64_t ts = (out->last_ts & ~0xffffffffull) | report[1];
+	uint32_t hw_id = report_hw_id(out->graphics_ver, report);
+
+	/* Reports only have the lower 32bits of the timestamp. */
+	if (ts < out->last_ts)
+		ts += 1ull << 32;
+	out->last_ts = ts;
+
+	if (!out->chunk.n_records)
+		out->chunk.gpu_ts_begin = ts;
+	out->chunk.gpu_ts_end = ts;
+	out->chunk.n_records++;
+
+	if (!out->n_context_switches || hw_id != out->last_hw_id) {
+		struct intel_perf_record_context_switch cs = {
+			.gpu_ts = ts,
+			.hw_id = hw_id,
+			.chunk = out->n_chunks,
+		};
+
+		append_item(out->context_switches, out->n_context_switches,
+			    out->n_allocated_context_switches, cs);
+		out->last_hw_id = hw_id;
+	}
+}
+
+/* Moves the complete records at the end of the chunk into it. */
+static bool
+indexed_output_records(struct indexed_output *out)
+{
+	struct drm_i915_perf_record_header header;
+
+	while (out->partial >= sizeof(header)) {
+		memcpy(&header, out->data + out->size, sizeof(header));
+		if (header.size < sizeof(header))
+			return false;
+		if (out->partial < header.size)
+			break;
+
+		switch (header.type) {
+		case INTEL_PERF_RECORD_TYPE_VERSION:
+		case INTEL_PERF_RECORD_TYPE_DEVICE_INFO:
+		case INTEL_PERF_RECORD_TYPE_DEVICE_TOPOLOGY:
+			/* Metadata stays in front of the chunks. */
+			if (out->n_chunks)
+				return false;
+			if (fwrite(out->data + out->size, header.size, 1,
+				   out->file) != 1)
+				return false;
+			out->partial -= header.size;
+			memmove(out->data + out->size,
+				out->data + out->size + header.size,
+				out->partial);
+			continue;
+
+		case DRM_I915_PERF_RECORD_SAMPLE:
+			if (out->size + header.size > INTEL_PERF_RECORD_CHUNK_SIZE &&
+			    !indexed_output_flush(out))
+				return false;
+			indexed_output_sample(out, (const void *) (out->data + out->size));
+			break;
+
+		case INTEL_PERF_RECORD_TYPE_TIMESTAMP_CORRELATION: {
+			struct intel_perf_record_timestamp_correlation corr;
+
+			if (out->size + header.size > INTEL_PERF_RECORD_CHUNK_SIZE &&
+			    !indexed_output_flush(out))
+				return false;
+			memcpy(&corr, out->data + out->size + sizeof(header),
+			       sizeof(corr));
+			append_item(out->correlations, out->n_correlations,
+				    out->n_allocated_correlations, corr);
+
+			/* Timebase of the extended report timestamps. */
+			if (!out->have_ts) {
+				out->last_ts = corr.gpu_timestamp;
+				out->have_ts = true;
+			}
+			break;
+		}
+
+		default:
+			if (out->size + header.size > INTEL_PERF_RECORD_CHUNK_SIZE &&
+			    !indexed_output_flush(out))
+				return false;
+			break;
+		}
+
+		out->size += header.size;
+		out->partial -= header.size;
+	}
+
+	return true;
+}
+
+static ssize_t
+indexed_output_write(void *c, const char *buf, size_t size)
+{
+	struct indexed_output *out = c;
+	size_t written = 0;
+
+	while (written < size) {
+		size_t len = MIN(size - written,
+				 INDEXED_OUTPUT_SIZE - out->size - out->partial);
+
+		memcpy(out->data + out->size + out->partial, buf + written, len);
+		out->partial += len;
+		written += len;
+
+		if (!indexed_output_records(out))
+			return -1;
+
+		/* A full chunk followed by the largest possible record. */
+		if (written < size && out->size + out->partial == INDEXED_OUTPUT_SIZE &&
+		    !indexed_output_flush(out))
+			return -1;
+	}
+
+	return size;
+}
+
+static int
+indexed_output_seek(void *c, off64_t *offset, int whence)
+{
+	return -1;
+}
+
+static bool
+indexed_output_write_index(struct indexed_output *out)
+{
+	struct intel_perf_record_index index = {
+		.n_chunks = out->n_chunks,
+		.n_context_switches = out->n_context_switches,
+		.n_correlations = out->n_correlations,
+	};
+	struct drm_i915_perf_record_header header = {
+		.type = INTEL_PERF_RECORD_TYPE_INDEX,
+		.size = sizeof(header) + sizeof(index),
+	};
+	struct intel_perf_record_footer footer = {
+		.magic = INTEL_PERF_RECORD_FOOTER_MAGIC,
+	};
+	off_t offset;
+
+	offset = ftello(out->file);
+	if (offset < 0)
+		return false;
+	footer.index_offset = offset;
+
+	if (fwrite(&header, sizeof(header), 1, out->file) != 1 ||
+	    fwrite(&index, sizeof(index), 1, out->file) != 1 ||
+	    fwrite(out->chunks, sizeof(*out->chunks),
+		   out->n_chunks, out->file) != out->n_chunks ||
+	    fwrite(out->context_switches, sizeof(*out->context_switches),
+		   out->n_context_switches, out->file) != out->n_context_switches ||
+	    fwrite(out->correlations, sizeof(*out->correlations),
+		   out->n_correlations, out->file) != out->n_correlations)
+		return false;
+
+	header.type = INTEL_PERF_RECORD_TYPE_FOOTER;
+	header.size = sizeof(header) + sizeof(footer);
+	if (fwrite(&header, sizeof(header), 1, out->file) != 1 ||
+	    fwrite(&footer, sizeof(footer), 1, out->file) != 1)
+		return false;
+
+	return true;
+}
+
+static int
+indexed_output_close(void *c)
+{
+	struct indexed_output *out = c;
+	bool ok;
+
+	/* A partial record can only come from a failed write. */
+	ok = !out->partial &&
+	     indexed_output_flush(out) &&
+	     indexed_output_write_index(out);
+
+	if (fclose(out->file))
+		ok = false;
+
+	free(out->data);
+	free(out->compressed);
+	free(out->chunks);
+	free(out->context_switches);
+	free(out->correlations);
+	free(out);
+
+	return ok ? 0 : -1;
+}
+
+static cookie_io_functions_t indexed_output_functions = {
+	.write = indexed_output_write,
+	.seek  = indexed_output_seek,
+	.close = indexed_output_close,
+};
+
+/**
+ * intel_perf_data_writer_open:
+ * @file: file to write the recording into
+ * @graphics_ver: graphics version of the device the OA reports come from
+ *
+ * Opens a stream turning the records written into it (version, device info
+ * and topology first, then OA reports, lost reports and timestamp
+ * correlations, as read from i915 perf) into an indexed recording (version
+ * 2) in @file. The index and footer are written when the stream is closed,
+ * which also closes @file.
+ *
+ * Returns: the stream, NULL on allocation failure.
+ */
+FILE *
+intel_perf_data_writer_open(FILE *file, uint32_t graphics_ver)
+{
+	struct indexed_output *out = calloc(1, sizeof(*out));
+	FILE *stream;
+
+	if (!out)
+		return NULL;
+
+	out->file = file;
+	out->graphics_ver = graphics_ver;
+	out->data = malloc(INDEXED_OUTPUT_SIZE);
+#ifdef HAVE_LZ4
+	out->compressed_size = LZ4_compressBound(INTEL_PERF_RECORD_CHUNK_SIZE);
+	out->compressed = malloc(out->compressed_size);
+#endif
+
+	stream = fopencookie(out, "w", indexed_output_functions);
+	if (!out->data || !stream) {
+		free(out->data);
+		free(out->compressed);
+		free(out);
+		return NULL;
+	}
+
+	return stream;
+}
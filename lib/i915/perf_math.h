@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2019 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef PERF_MATH_H
+#define PERF_MATH_H
+
+#include <stdint.h>
+
+/*
+ * 64x64 bit products with a 128bit intermediate. Not every target has
+ * __int128 (32bit ones don't), so these fall back to 32bit halves.
+ */
+
+static inline void
+intel_perf_mul_u64(uint64_t a, uint64_t b, uint64_t *hi, uint64_t *lo)
+{
+#ifdef __SIZEOF_INT128__
+	unsigned __int128 p = (unsigned __int128) a * b;
+
+	*hi = p >> 64;
+	*lo = p;
+#else
+	uint64_t ll = (a & 0xffffffff) * (b & 0xffffffff);
+	uint64_t lh = (a & 0xffffffff) * (b >> 32);
+	uint64_t hl = (a >> 32) * (b & 0xffffffff);
+	uint64_t hh = (a >> 32) * (b >> 32);
+	uint64_t mid = (ll >> 32) + (lh & 0xffffffff) + (hl & 0xffffffff);
+
+	*lo = (mid << 32) | (ll & 0xffffffff);
+	*hi = hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+#endif
+}
+
+/* (a * b) >> shift, for shift in [1, 63], truncated to 64bits. */
+static inline uint64_t
+intel_perf_mul_shr_u64(uint64_t a, uint64_t b, unsigned int shift)
+{
+	uint64_t hi, lo;
+
+	intel_perf_mul_u64(a, b, &hi, &lo);
+
+	return hi << (64 - shift) | lo >> shift;
+}
+
+/* a * b / c, truncated to 64bits. */
+static inline uint64_t
+intel_perf_mul_div_u64(uint64_t a, uint64_t b, uint64_t c)
+{
+#ifdef __SIZEOF_INT128__
+	return ((unsigned __int128) a * b) / c;
+#else
+	uint64_t hi, lo, q = 0;
+
+	intel_perf_mul_u64(a, b, &hi, &lo);
+
+	/* Bits of the quotient above 64 are dropped, as with the cast. */
+	hi %= c;
+
+	for (int i = 0; i < 64; i++) {
+		uint64_t carry = hi >> 63;
+
+		hi = hi << 1 | lo >> 63;
+		lo <<= 1;
+		q <<= 1;
+		if (carry || hi >= c) {
+			hi -= c;
+			q |= 1;
+		}
+	}
+
+	return q;
+#endif
+}
+
+#endif /* PERF_MATH_H */
@@ -0,0 +1,504 @@
+/*
+ * Copyright (C) 2022 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <i915_drm.h>
+
+#include "intel_chipset.h"
+#include "perf.h"
+#include "perf_data.h"
+#include "perf_data_writer.h"
+#include "perf_math.h"
+#include "perf_synth.h"
+
+#define ALIGN(v, a) (((v) + (a) - 1) & ~((a) - 1))
+
+/* CLOCK_MONOTONIC of the first report, an hour after boot. */
+#define CPU_TS_BASE (3600ull * 1000000000ull)
+
+#define HW_ID_IDLE 0xffffffff
+
+/* 1 slice of 8 subslices of 8 EUs, all enabled. */
+static const struct {
+	struct drm_i915_query_topology_info info;
+	uint8_t data[16];
+} default_topology = {
+	.info = {
+		.max_slices = 1,
+		.max_subslices = 8,
+		.max_eus_per_subslice = 8,
+		.subslice_offset = 1,
+		.subslice_stride = 1,
+		.eu_offset = 2,
+		.eu_stride = 1,
+	},
+	.data = { 0x01, 0xff,
+		  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, },
+};
+
+struct synth {
+	const struct intel_perf_synth_params *params;
+	const struct intel_perf_devinfo *devinfo;
+	const struct intel_perf_metric_set *metric_set;
+	FILE *output;
+
+	uint64_t rand;
+
+	/* Extended timestamp of the first report, and between reports. */
+	uint64_t gpu_ts_base;
+	uint64_t period;
+	uint64_t gpu_ts;
+	uint64_t gpu_clock;
+
+	uint32_t context;
+	uint32_t hw_id;
+	uint32_t run_left;
+
+	uint32_t n_counters;
+	uint64_t counters[INTEL_PERF_MAX_RAW_OA_COUNTERS];
+
+	struct drm_i915_perf_record_header *record;
+};
+
+/* splitmix64, reproducible for a given seed. */
+static uint64_t
+synth_rand(struct synth *s)
+{
+	uint64_t z = (s->rand += 0x9e3779b97f4a7c15ull);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	return z ^ (z >> 31);
+}
+
+static uint64_t
+default_timestamp_frequency(const struct intel_device_info *devinfo)
+{
+	if (devinfo->graphics_ver <= 8)
+		return 12500000;
+	if (devinfo->is_broxton || devinfo->graphics_ver >= 12)
+		return 19200000;
+	return 12000000;
+}
+
+static uint64_t
+cpu_timestamp(const struct synth *s, uint64_t gpu_ts)
+{
+	return CPU_TS_BASE +
+		intel_perf_mul_div_u64(gpu_ts - s->gpu_ts_base, 1000000000ull,
+				       s->devinfo->timestamp_frequency);
+}
+
+static bool
+write_record(struct synth *s, uint32_t type, const void *data, size_t size)
+{
+	struct drm_i915_perf_record_header header = {
+		.type = type,
+		.size = sizeof(header) + size,
+	};
+
+	return fwrite(&header, sizeof(header), 1, s->output) == 1 &&
+		(!size || fwrite(data, size, 1, s->output) == 1);
+}
+
+static bool
+write_metadata(struct synth *s)
+{
+	const struct intel_perf_synth_params *params = s->params;
+	const struct drm_i915_query_topology_info *topology =
+		params->topology ?: &default_topology.info;
+	struct intel_perf_record_version version = {
+		.version = params->flat ? INTEL_PERF_RECORD_VERSION :
+					  INTEL_PERF_RECORD_VERSION_INDEXED,
+	};
+	struct intel_perf_record_device_info info = {
+		.timestamp_frequency = s->devinfo->timestamp_frequency,
+		.device_id = s->devinfo->devid,
+		.device_revision = s->devinfo->revision,
+		.gt_min_frequency = s->devinfo->gt_min_freq,
+		.gt_max_frequency = s->devinfo->gt_max_freq,
+		.engine_class = I915_ENGINE_CLASS_RENDER,
+		.engine_instance = 0,
+		.oa_format = s->metric_set->perf_oa_format,
+	};
+	size_t topology_size = sizeof(*topology) + topology->eu_offset +
+		topology->max_slices * topology->max_subslices * topology->eu_stride;
+	uint8_t *topology_data;
+	bool ok;
+
+	snprintf(info.metric_set_name, sizeof(info.metric_set_name),
+		 "%s", s->metric_set->symbol_name);
+	snprintf(info.metric_set_uuid, sizeof(info.metric_set_uuid),
+		 "%s", s->metric_set->hw_config_guid);
+
+	/* Padded like the recorder does. */
+	topology_data = calloc(1, ALIGN(topology_size, 8));
+	if (!topology_data)
+		return false;
+	memcpy(topology_data, topology, topology_size);
+
+	ok = write_record(s, INTEL_PERF_RECORD_TYPE_VERSION,
+			  &version, sizeof(version)) &&
+	     write_record(s, INTEL_PERF_RECORD_TYPE_DEVICE_INFO,
+			  &info, sizeof(info)) &&
+	     write_record(s, INTEL_PERF_RECORD_TYPE_DEVICE_TOPOLOGY,
+			  topology_data, ALIGN(topology_size, 8));
+	free(topology_data);
+
+	return ok;
+}
+
+static bool
+write_correlation(struct synth *s)
+{
+	struct intel_perf_record_timestamp_correlation corr = {
+		.cpu_timestamp = cpu_timestamp(s, s->gpu_ts),
+		/* The timestamp register is 36bits wide. */
+		.gpu_timestamp = s->gpu_ts & ((1ull << 36) - 1),
+	};
+
+	return write_record(s, INTEL_PERF_RECORD_TYPE_TIMESTAMP_CORRELATION,
+			    &corr, sizeof(corr));
+}
+
+static void
+next_context(struct synth *s)
+{
+	const struct intel_perf_synth_params *params = s->params;
+
+	switch (params->contexts) {
+	case INTEL_PERF_SYNTH_CONTEXTS_SINGLE:
+		s->hw_id = 1;
+		s->run_left = UINT32_MAX;
+		break;
+
+	case INTEL_PERF_SYNTH_CONTEXTS_ROUND_ROBIN:
+		s->context = (s->context + 1) % params->n_contexts;
+		s->hw_id = s->context + 1;
+		s->run_left = params->context_run;
+		break;
+
+	case INTEL_PERF_SYNTH_CONTEXTS_RANDOM:
+		/* One more choice for idle. */
+		s->context = synth_rand(s) % (params->n_contexts + 1);
+		s->hw_id = s->context < params->n_contexts ?
+			s->context + 1 : HW_ID_IDLE;
+		s->run_left = 1 + synth_rand(s) % (2 * params->context_run - 1);
+		break;
+	}
+}
+
+/* Moves the counters forward by one report period. */
+static void
+advance(struct synth *s)
+{
+	const struct intel_perf_devinfo *devinfo = s->devinfo;
+	unsigned int first = devinfo->graphics_ver >= 8 ? 2 : 1;
+	uint64_t gpu_clock, clock_delta;
+
+	if (!--s->run_left)
+		next_context(s);
+
+	/* Running at the maximum frequency all along. */
+	s->gpu_ts += s->period;
+	gpu_clock = intel_perf_mul_div_u64(s->gpu_ts - s->gpu_ts_base,
+					   devinfo->gt_max_freq,
+					   devinfo->timestamp_frequency);
+	clock_delta = gpu_clock - s->gpu_clock;
+	s->gpu_clock = gpu_clock;
+
+	s->counters[0] = s->gpu_ts;
+	if (first > 1)
+		s->counters[1] += clock_delta;
+
+	switch (s->params->counters) {
+	case INTEL_PERF_SYNTH_COUNTERS_IDLE:
+		break;
+
+	case INTEL_PERF_SYNTH_COUNTERS_LINEAR:
+		if (s->hw_id == HW_ID_IDLE)
+			break;
+		for (unsigned int i = first; i < s->n_counters; i++)
+			s->counters[i] += clock_delta * (i % 8 + 1) / 8;
+		break;
+
+	case INTEL_PERF_SYNTH_COUNTERS_RANDOM:
+		/* Never more than a 32bits counter can hold over two
+		 * periods, the ones around a lost report.
+		 */
+		for (unsigned int i = first; i < s->n_counters; i++)
+			s->counters[i] += synth_rand(s) & ((1u << 30) - 1);
+		break;
+	}
+}
+
+static uint32_t
+report_hw_id(const struct synth *s)
+{
+	/* Haswell reports have no valid context id bit. */
+	return s->devinfo->graphics_ver >= 8 ? s->hw_id : HW_ID_IDLE;
+}
+
+static bool
+write_report(struct synth *s)
+{
+	const struct intel_perf_devinfo *devinfo = s->devinfo;
+	uint32_t *report = (uint32_t *) (s->record + 1);
+
+	memset(report, 0, s->metric_set->perf_raw_size);
+
+	if (devinfo->graphics_ver >= 8)
+		report[0] = 1 << 19; /* Timer reason */
+	if (s->hw_id != HW_ID_IDLE) {
+		if (devinfo->graphics_ver == 8)
+			report[0] |= 1 << 25;
+		else if (devinfo->graphics_ver > 8)
+			report[0] |= 1 << 16;
+		report[2] = s->hw_id;
+	}
+
+	intel_perf_write_report_counters(devinfo, s->metric_set->perf_oa_format,
+					 s->record, s->counters);
+
+	return fwrite(s->record, s->record->size, 1, s->output) == 1;
+}
+
+static bool
+write_reports(struct synth *s, struct intel_perf_synth_result *result)
+{
+	const struct intel_perf_synth_params *params = s->params;
+	uint64_t first_counters[INTEL_PERF_MAX_RAW_OA_COUNTERS];
+	uint32_t last_hw_id = 0;
+	bool lost = false;
+
+	for (uint32_t i = 0; i < params->n_reports; i++) {
+		if (i && params->correlation_every &&
+		    i % params->correlation_every == 0) {
+			if (!write_correlation(s))
+				return false;
+			result->n_correlations++;
+		}
+
+		if (i)
+			advance(s);
+
+		/* Never two reports in a row, nor the first or last one. */
+		if (i && i + 1 < params->n_reports && !lost &&
+		    params->lost_every && synth_rand(s) % params->lost_every == 0) {
+			if (!write_record(s, DRM_I915_PERF_RECORD_OA_REPORT_LOST,
+					  NULL, 0))
+				return false;
+			result->n_lost++;
+			lost = true;
+			continue;
+		}
+		lost = false;
+
+		if (!write_report(s))
+			return false;
+
+		if (result->n_reports == 0) {
+			memcpy(first_counters, s->counters, sizeof(first_counters));
+			result->gpu_ts_begin = s->gpu_ts;
+			result->cpu_ts_begin = cpu_timestamp(s, s->gpu_ts);
+		} else if (report_hw_id(s) != last_hw_id) {
+			result->n_context_switches++;
+		}
+		last_hw_id = report_hw_id(s);
+		result->n_reports++;
+	}
+
+	result->gpu_ts_end = s->gpu_ts;
+	result->cpu_ts_end = cpu_timestamp(s, s->gpu_ts);
+	result->n_counters = s->n_counters;
+	for (uint32_t i = 0; i < s->n_counters; i++)
+		result->deltas.deltas[i] = s->counters[i] - first_counters[i];
+
+	return true;
+}
+
+static int
+synthesize(struct synth *s, struct intel_perf_synth_result *result)
+{
+	const struct intel_perf_synth_params *params = s->params;
+	uint64_t half;
+
+	s->n_counters = intel_perf_oa_format_n_counters(s->devinfo,
+							s->metric_set->perf_oa_format);
+	if (!s->n_counters)
+		return ENOTSUP;
+
+	s->period = s->devinfo->timestamp_frequency / params->report_rate;
+	if (!s->period)
+		return EINVAL;
+
+	/* The 32bits report timestamps wrap halfway through. */
+	half = (uint64_t) (params->n_reports / 2) * s->period;
+	s->gpu_ts_base = (3ull << 32) - (half < (2ull << 32) ? half : (2ull << 32));
+	s->gpu_ts = s->gpu_ts_base;
+
+	s->rand = params->seed;
+	for (uint32_t i = 0; i < s->n_counters; i++)
+		s->counters[i] = synth_rand(s) & ((1ull << 40) - 1);
+	s->counters[0] = s->gpu_ts;
+	s->context = params->n_contexts - 1;
+	next_context(s);
+
+	s->record = calloc(1, sizeof(*s->record) + s->metric_set->perf_raw_size);
+	if (!s->record)
+		return ENOMEM;
+	s->record->type = DRM_I915_PERF_RECORD_SAMPLE;
+	s->record->size = sizeof(*s->record) + s->metric_set->perf_raw_size;
+
+	if (!write_metadata(s) || !write_correlation(s) ||
+	    !write_reports(s, result) || !write_correlation(s))
+		return errno ?: EIO;
+	result->n_correlations += 2;
+
+	return 0;
+}
+
+/**
+ * intel_perf_synth_params_init:
+ * @params: parameters to initialize
+ * @device_id: PCI ID of the device to synthesize a recording of
+ *
+ * Sets up parameters for 10000 reports at 100000 reports per second of the
+ * first metric set of the device, from 4 contexts taking turns every 100
+ * reports, with counters running at a fraction of the GPU clock.
+ */
+void
+intel_perf_synth_params_init(struct intel_perf_synth_params *params,
+			     uint32_t device_id)
+{
+	memset(params, 0, sizeof(*params));
+
+	params->device_id = device_id;
+	params->gt_min_frequency = 300000000;
+	params->gt_max_frequency = 1100000000;
+	params->report_rate = 100000;
+	params->n_reports = 10000;
+	params->contexts = INTEL_PERF_SYNTH_CONTEXTS_ROUND_ROBIN;
+	params->n_contexts = 4;
+	params->context_run = 100;
+	params->counters = INTEL_PERF_SYNTH_COUNTERS_LINEAR;
+	params->correlation_every = 1000;
+	params->seed = 1;
+}
+
+/**
+ * intel_perf_synth_write:
+ * @fd: file descriptor to write the recording at
+ * @params: recording to synthesize
+ * @result: where to store what went into the recording, can be NULL
+ *
+ * Writes a recording as i915-perf-recorder would make it, from the OA
+ * reports of a model of the counters. The timestamps of the first report
+ * are 1 hour of CLOCK_MONOTONIC and 3 * 2^32 timestamp ticks, minus half
+ * the length of the recording. The same parameters always give the same
+ * recording.
+ *
+ * Returns: true on success, false with errno set otherwise.
+ */
+bool
+intel_perf_synth_write(int fd,
+		       const struct intel_perf_synth_params *params,
+		       struct intel_perf_synth_result *result)
+{
+	struct intel_perf_synth_result local_result;
+	const struct intel_device_info *devinfo;
+	struct synth s = { .params = params };
+	struct intel_perf *perf = NULL;
+	FILE *file = NULL;
+	int err = 0, dup_fd;
+
+	if (!result)
+		result = &local_result;
+	memset(result, 0, sizeof(*result));
+
+	if (params->n_reports < 2 || !params->report_rate ||
+	    (params->contexts != INTEL_PERF_SYNTH_CONTEXTS_SINGLE &&
+	     (!params->n_contexts || !params->context_run))) {
+		errno = EINVAL;
+		return false;
+	}
+
+	devinfo = intel_get_device_info(params->device_id);
+	if (devinfo)
+		perf = intel_perf_for_devinfo_lazy(params->device_id,
+						   params->revision,
+						   params->timestamp_frequency ?:
+						   default_timestamp_frequency(devinfo),
+						   params->gt_min_frequency,
+						   params->gt_max_frequency,
+						   params->topology ?: &default_topology.info);
+	if (!perf) {
+		errno = ENODEV;
+		return false;
+	}
+
+	s.devinfo = &perf->devinfo;
+	s.metric_set = params->metric_set ?
+		intel_perf_find_metric_set(perf, params->metric_set) :
+		intel_perf_load_metric_set(perf, 0);
+	if (!s.metric_set) {
+		err = ENOENT;
+		goto out;
+	}
+
+	/* Closing the indexed output closes the file under it. */
+	dup_fd = dup(fd);
+	if (dup_fd < 0 || !(file = fdopen(dup_fd, "w"))) {
+		err = errno;
+		if (dup_fd >= 0)
+			close(dup_fd);
+		goto out;
+	}
+
+	if (params->flat) {
+		s.output = file;
+	} else {
+		s.output = intel_perf_data_writer_open(file, s.devinfo->graphics_ver);
+		if (!s.output) {
+			fclose(file);
+			err = ENOMEM;
+			goto out;
+		}
+	}
+
+	errno = 0;
+	err = synthesize(&s, result);
+	if (fclose(s.output) && !err)
+		err = errno ?: EIO;
+
+out:
+	free(s.record);
+	intel_perf_free(perf);
+
+	errno = err;
+	return err == 0;
+}
@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2022 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef PERF_SYNTH_H
+#define PERF_SYNTH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Synthesizes i915-perf recordings, without a GPU. */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "perf.h"
+
+enum intel_perf_synth_contexts {
+	/* All the reports come from a single context. */
+	INTEL_PERF_SYNTH_CONTEXTS_SINGLE,
+
+	/* n_contexts contexts taking turns, context_run reports each. */
+	INTEL_PERF_SYNTH_CONTEXTS_ROUND_ROBIN,
+
+	/* Random contexts and idle periods, context_run reports long on
+	 * average.
+	 */
+	INTEL_PERF_SYNTH_CONTEXTS_RANDOM,
+};
+
+enum intel_perf_synth_counters {
+	/* Only the timestamp and GPU clock move. */
+	INTEL_PERF_SYNTH_COUNTERS_IDLE,
+
+	/* Each counter runs at a fixed fraction of the GPU clock while a
+	 * context runs.
+	 */
+	INTEL_PERF_SYNTH_COUNTERS_LINEAR,
+
+	/* Random increments of up to 2^30 per report, the 32bits counters
+	 * wrapping every few reports.
+	 */
+	INTEL_PERF_SYNTH_COUNTERS_RANDOM,
+};
+
+struct intel_perf_synth_params {
+	/* Device, as given to intel_perf_for_devinfo(). A 0 frequency picks
+	 * the usual one of the device, a NULL topology a single slice of 8
+	 * subslices of 8 EUs.
+	 */
+	uint32_t device_id;
+	uint32_t revision;
+	uint64_t timestamp_frequency;
+	uint64_t gt_min_frequency;
+	uint64_t gt_max_frequency;
+	const struct drm_i915_query_topology_info *topology;
+
+	/* Symbol name of the metric set, NULL for the first one. */
+	const char *metric_set;
+
+	/* OA reports per second of GPU time. */
+	uint64_t report_rate;
+	uint32_t n_reports;
+
+	enum intel_perf_synth_contexts contexts;
+	uint32_t n_contexts;
+	uint32_t context_run;
+
+	enum intel_perf_synth_counters counters;
+
+	/* Drops one report in that many on average, in its place goes a
+	 * lost report record. 0 drops none.
+	 */
+	uint32_t lost_every;
+
+	/* Timestamp correlation every that many reports, besides the ones
+	 * at the start and the end.
+	 */
+	uint32_t correlation_every;
+
+	/* Version 1 recording rather than an indexed one. */
+	bool flat;
+
+	uint64_t seed;
+};
+
+/* What went into a recording, for it to be checked against a reader. */
+struct intel_perf_synth_result {
+	/* OA reports and lost report records written. */
+	uint32_t n_reports;
+	uint32_t n_lost;
+
+	/* Changes of context id between two consecutive reports, as read on
+	 * the device (Haswell reports having none).
+	 */
+	uint32_t n_context_switches;
+	uint32_t n_correlations;
+
+	/* Extended GPU timestamps and CPU timestamps of the first and last
+	 * reports.
+	 */
+	uint64_t gpu_ts_begin;
+	uint64_t gpu_ts_end;
+	uint64_t cpu_ts_begin;
+	uint64_t cpu_ts_end;
+
+	/* Counter deltas between the first and the last report. */
+	uint32_t n_counters;
+	struct intel_perf_accumulator deltas;
+};
+
+void intel_perf_synth_params_init(struct intel_perf_synth_params *params,
+				  uint32_t device_id);
+bool intel_perf_synth_write(int fd,
+			    const struct intel_perf_synth_params *params,
+			    struct intel_perf_synth_result *result);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* PERF_SYNTH_H */
@@ -33,6 +33,7 @@
 #include <unistd.h>
 
 #include "igt_audio.h"
+#include "igt_aux.h"
 #include "igt_core.h"
 
 #define FREQS_MAX 64
@@ -316,71 +317,169 @@ void audio_signal_fill(struct audio_signal *signal, double *buffer,
 	audio_sanity_check(buffer, signal->channels * samples);
 }
 
-/* See https://en.wikipedia.org/wiki/Window_function#Hann_and_Hamming_windows */
-static double hann_window(double v, size_t i, size_t N)
+struct audio_detector {
+	struct audio_signal *signal;
+	int sampling_rate;
+	int channel;
+
+	/* Samples analyzed at once, and new samples between two analyses */
+	size_t window_len;
+	size_t hop_len;
+
+	/* Hann window coefficients and FFT plan, computed once */
+	double *window;
+	gsl_fft_real_wavetable *wavetable;
+	gsl_fft_real_workspace *workspace;
+
+	/* Scratch buffers for a single analysis */
+	double *data;
+	double *bin_power;
+	size_t bin_power_len;
+
+	/* Last window_len samples fed to the detector */
+	double *ring;
+	size_t ring_pos;
+	size_t ring_filled;
+	size_t pending;
+
+	unsigned int streak;
+};
+
+/**
+ * audio_detector_init:
+ * @signal: The signal to look for
+ * @sampling_rate: The sampling rate of the analyzed samples, in Hz
+ * @channel: The channel of @signal to look for
+ * @window_len: The number of samples to analyze at once
+ * @hop_len: The number of new samples between two analyses when streaming,
+ * at most @window_len
+ *
+ * Allocate a detector checking that the frequencies of @signal for @channel,
+ * and only those, are present in the analyzed samples. The Hann window, the
+ * FFT plan and every buffer needed to analyze @window_len samples are set up
+ * once here, so that the detector can then be used on consecutive capture
+ * chunks without further allocations.
+ *
+ * A @hop_len smaller than @window_len makes consecutive windows overlap
+ * when streaming samples through audio_detector_feed().
+ *
+ * Returns: A newly-allocated audio detector
+ */
+struct audio_detector *audio_detector_init(struct audio_signal *signal,
+					   int sampling_rate, int channel,
+					   size_t window_len, size_t hop_len)
 {
-	return v * 0.5 * (1 - cos(2.0 * M_PI * (double) i / (double) N));
+	struct audio_detector *detector;
+	size_t i;
+
+	igt_assert(window_len >= 2);
+	igt_assert(hop_len > 0 && hop_len <= window_len);
+
+	detector = calloc(1, sizeof(*detector));
+	igt_assert(detector);
+
+	detector->signal = signal;
+	detector->sampling_rate = sampling_rate;
+	detector->channel = channel;
+	detector->window_len = window_len;
+	detector->hop_len = hop_len;
+	detector->bin_power_len = window_len / 2 + 1;
+
+	detector->window = malloc(window_len * sizeof(double));
+	detector->data = malloc(window_len * sizeof(double));
+	detector->ring = malloc(window_len * sizeof(double));
+	detector->bin_power = malloc(detector->bin_power_len * sizeof(double));
+	detector->wavetable = gsl_fft_real_wavetable_alloc(window_len);
+	detector->workspace = gsl_fft_real_workspace_alloc(window_len);
+	igt_assert(detector->window && detector->data && detector->ring &&
+		   detector->bin_power && detector->wavetable &&
+		   detector->workspace);
+
+	/* See https://en.wikipedia.org/wiki/Window_function#Hann_and_Hamming_windows */
+	for (i = 0; i < window_len; i++)
+		detector->window[i] = 0.5 * (1 - cos(2.0 * M_PI * (double) i /
+						     (double) window_len));
+
+	return detector;
 }
 
 /**
- * Checks that frequencies specified in signal, and only those, are included
- * in the input data.
+ * audio_detector_fini:
+ * @detector: The detector to release
  *
- * sampling_rate is given in Hz. samples_len is the number of elements in
- * samples.
+ * Release the detector and all its buffers.
  */
-bool audio_signal_detect(struct audio_signal *signal, int sampling_rate,
-			 int channel, const double *samples, size_t samples_len)
+void audio_detector_fini(struct audio_detector *detector)
 {
-	double *data;
-	size_t data_len = samples_len;
-	size_t bin_power_len = data_len / 2 + 1;
-	double bin_power[bin_power_len];
+	gsl_fft_real_workspace_free(detector->workspace);
+	gsl_fft_real_wavetable_free(detector->wavetable);
+	free(detector->bin_power);
+	free(detector->ring);
+	free(detector->data);
+	free(detector->window);
+	free(detector);
+}
+
+/**
+ * audio_detector_reset:
+ * @detector: The target detector
+ *
+ * Drop the samples previously fed to the detector, so that the next stream
+ * can be analyzed independently.
+ */
+void audio_detector_reset(struct audio_detector *detector)
+{
+	detector->ring_pos = 0;
+	detector->ring_filled = 0;
+	detector->pending = 0;
+	detector->streak = 0;
+}
+
+/**
+ * Checks that frequencies specified in signal, and only those, are included
+ * in the windowed samples of detector->data, which are transformed in place.
+ */
+static bool audio_detector_analyze(struct audio_detector *detector)
+{
+	struct audio_signal *signal = detector->signal;
+	int sampling_rate = detector->sampling_rate;
+	int channel = detector->channel;
+	double *data = detector->data;
+	size_t data_len = detector->window_len;
+	double *bin_power = detector->bin_power;
+	size_t bin_power_len = detector->bin_power_len;
 	bool detected[FREQS_MAX];
 	int ret, freq_accuracy, freq, local_max_freq;
 	double max, local_max, threshold;
 	size_t i, j;
 	bool above, success;
 
-	/* gsl will mutate the array in-place, so make a copy */
-	data = malloc(samples_len * sizeof(double));
-	memcpy(data, samples, samples_len * sizeof(double));
-
-	/* Apply a Hann window to the input signal, to reduce frequency leaks
-	 * due to the endpoints of the signal being discontinuous.
-	 *
-	 * For more info:
-	 * - https://download.ni.com/evaluation/pxi/Understanding%20FFTs%20and%20Windowing.pdf
-	 * - https://en.wikipedia.org/wiki/Window_function
-	 */
-	for (i = 0; i < data_len; i++)
-		data[i] = hann_window(data[i], i, data_len);
-
 	/* Allowed error in Hz due to FFT step */
 	freq_accuracy = sampling_rate / data_len;
 	igt_debug("Allowed freq. error: %d Hz\n", freq_accuracy);
 
-	ret = gsl_fft_real_radix2_transform(data, 1, data_len);
-	if (ret != 0) {
-		free(data);
-		igt_assert(0);
-	}
+	ret = gsl_fft_real_transform(data, 1, data_len, detector->wavetable,
+				     detector->workspace);
+	igt_assert(ret == 0);
 
 	/* Compute the power received by every bin of the FFT.
 	 *
-	 * For i < data_len / 2, the real part of the i-th term is stored at
-	 * data[i] and its imaginary part is stored at data[data_len - i].
-	 * i = 0 and i = data_len / 2 are special cases, they are purely real
-	 * so their imaginary part isn't stored.
+	 * The result is in gsl's half-complex format: for 0 < i < data_len / 2,
+	 * the real part of the i-th term is stored at data[2 * i - 1] and its
+	 * imaginary part is stored at data[2 * i]. i = 0 is purely real, and
+	 * so is i = data_len / 2 for even lengths, so their imaginary part
+	 * isn't stored.
 	 *
 	 * The power is encoded as the magnitude of the complex number and the
 	 * phase is encoded as its angle.
 	 */
 	bin_power[0] = data[0];
-	for (i = 1; i < bin_power_len - 1; i++) {
-		bin_power[i] = hypot(data[i], data[data_len - i]);
+	for (i = 1; i < bin_power_len; i++) {
+		if (2 * i < data_len)
+			bin_power[i] = hypot(data[2 * i - 1], data[2 * i]);
+		else
+			bin_power[i] = data[2 * i - 1];
 	}
-	bin_power[bin_power_len - 1] = data[data_len / 2];
 
 	/* Normalize the power */
 	for (i = 0; i < bin_power_len; i++)
@@ -487,11 +586,201 @@ bool audio_signal_detect(struct audio_signal *signal, int sampling_rate,
 		}
 	}
 
-	free(data);
-
 	return success;
 }
 
+/**
+ * audio_detector_detect:
+ * @detector: The target detector
+ * @samples: The samples to analyze, exactly as many as the detector window
+ *
+ * Checks that the frequencies the detector looks for, and only those, are
+ * included in @samples. The samples are left untouched.
+ *
+ * Returns: A boolean indicating whether the signal was detected
+ */
+bool audio_detector_detect(struct audio_detector *detector,
+			   const double *samples)
+{
+	size_t i;
+
+	/* Apply a Hann window to the input signal, to reduce frequency leaks
+	 * due to the endpoints of the signal being discontinuous.
+	 *
+	 * For more info:
+	 * - https://download.ni.com/evaluation/pxi/Understanding%20FFTs%20and%20Windowing.pdf
+	 * - https://en.wikipedia.org/wiki/Window_function
+	 */
+	for (i = 0; i < detector->window_len; i++)
+		detector->data[i] = samples[i] * detector->window[i];
+
+	return audio_detector_analyze(detector);
+}
+
+/* Number of samples that can be pushed to the ring before the next step. */
+static size_t audio_detector_chunk_len(struct audio_detector *detector,
+				       size_t len)
+{
+	size_t n = detector->window_len - detector->ring_pos;
+
+	if (detector->ring_filled < detector->window_len)
+		n = min(n, detector->window_len - detector->ring_filled);
+	else
+		n = min(n, detector->hop_len - detector->pending);
+
+	return min(n, len);
+}
+
+/* Account for n samples pushed to the ring, and analyze it when due. */
+static bool audio_detector_advance(struct audio_detector *detector, size_t n)
+{
+	size_t head, tail, i;
+	bool detected;
+
+	detector->ring_pos = (detector->ring_pos + n) % detector->window_len;
+
+	if (detector->ring_filled < detector->window_len) {
+		detector->ring_filled += n;
+		if (detector->ring_filled == detector->window_len)
+			detector->pending = detector->hop_len;
+	} else {
+		detector->pending += n;
+	}
+
+	if (detector->pending < detector->hop_len)
+		return false;
+
+	detector->pending = 0;
+
+	/* The oldest sample sits at ring_pos, window the ring in order. */
+	tail = detector->window_len - detector->ring_pos;
+	head = detector->ring_pos;
+	for (i = 0; i < tail; i++)
+		detector->data[i] = detector->ring[head + i] *
+				    detector->window[i];
+	for (i = 0; i < head; i++)
+		detector->data[tail + i] = detector->ring[i] *
+					   detector->window[tail + i];
+
+	detected = audio_detector_analyze(detector);
+	if (detected)
+		detector->streak++;
+	else
+		detector->streak = 0;
+
+	return true;
+}
+
+/**
+ * audio_detector_feed:
+ * @detector: The target detector
+ * @samples: The new samples
+ * @samples_len: The number of elements in @samples
+ *
+ * Stream samples through the detector. Every time the detector has received
+ * enough samples to fill its window, and then every time it has received
+ * another hop worth of samples, the last window of samples is analyzed.
+ * Results are accumulated in the streak of consecutive windows in which the
+ * signal was detected, see audio_detector_streak().
+ *
+ * Returns: The number of windows analyzed
+ */
+size_t audio_detector_feed(struct audio_detector *detector,
+			   const double *samples, size_t samples_len)
+{
+	size_t windows = 0, n;
+
+	while (samples_len > 0) {
+		n = audio_detector_chunk_len(detector, samples_len);
+
+		memcpy(&detector->ring[detector->ring_pos], samples,
+		       n * sizeof(double));
+
+		windows += audio_detector_advance(detector, n);
+		samples += n;
+		samples_len -= n;
+	}
+
+	return windows;
+}
+
+/**
+ * audio_detector_feed_s32_le:
+ * @detector: The target detector
+ * @src: The interleaved S32_LE capture buffer
+ * @src_len: The number of elements in @src
+ * @n_channels: The number of channels in @src
+ * @channel: The channel of @src to analyze
+ *
+ * Same as audio_detector_feed(), but takes the samples of one channel
+ * directly from a multi-channel S32_LE capture buffer.
+ *
+ * Returns: The number of windows analyzed
+ */
+size_t audio_detector_feed_s32_le(struct audio_detector *detector,
+				  const int32_t *src, size_t src_len,
+				  int n_channels, int channel)
+{
+	size_t windows = 0, samples_len, n, i;
+
+	igt_assert(channel < n_channels);
+	igt_assert(src_len % n_channels == 0);
+	samples_len = src_len / n_channels;
+	src += channel;
+
+	while (samples_len > 0) {
+		double *dst;
+
+		n = audio_detector_chunk_len(detector, samples_len);
+
+		dst = &detector->ring[detector->ring_pos];
+		for (i = 0; i < n; i++)
+			dst[i] = (double) src[i * n_channels] / INT32_MAX;
+
+		windows += audio_detector_advance(detector, n);
+		src += n * n_channels;
+		samples_len -= n;
+	}
+
+	return windows;
+}
+
+/**
+ * audio_detector_streak:
+ * @detector: The target detector
+ *
+ * Returns: The number of consecutive windows, up to and including the last
+ * one, in which audio_detector_feed() detected the signal
+ */
+unsigned int audio_detector_streak(struct audio_detector *detector)
+{
+	return detector->streak;
+}
+
+/**
+ * Checks that frequencies specified in signal, and only those, are included
+ * in the input data.
+ *
+ * sampling_rate is given in Hz. samples_len is the number of elements in
+ * samples.
+ *
+ * When analyzing consecutive chunks of a capture, prefer a persistent
+ * #audio_detector, which avoids setting up the FFT for every call.
+ */
+bool audio_signal_detect(struct audio_signal *signal, int sampling_rate,
+			 int channel, const double *samples, size_t samples_len)
+{
+	struct audio_detector *detector;
+	bool detected;
+
+	detector = audio_detector_init(signal, sampling_rate, channel,
+				       samples_len, samples_len);
+	detected = audio_detector_detect(detector, samples);
+	audio_detector_fini(detector);
+
+	return detected;
+}
+
 /**
  * audio_extract_channel_s32_le: extracts a single channel from a multi-channel
  * S32_LE input buffer.
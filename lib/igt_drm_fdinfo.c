@@ -35,135 +35,277 @@
 
 #include "igt_drm_fdinfo.h"
 
-static size_t read_fdinfo(char *buf, const size_t sz, int at, const char *name)
+static ssize_t read_fdinfo(char *buf, const size_t sz, int at, const char *name)
 {
-	size_t count;
+	ssize_t count;
 	int fd;
 
 	fd = openat(at, name, O_RDONLY);
 	if (fd < 0)
 		return 0;
 
-	count = read(fd, buf, sz - 1);
-	if (count > 0)
-		buf[count - 1] = 0;
+	count = read(fd, buf, sz);
 	close(fd);
 
-	return count > 0 ? count : 0;
+	return count;
 }
 
-static int parse_engine(char *line, struct drm_client_fdinfo *info,
-			size_t prefix_len, uint64_t *val)
+enum fdinfo_key {
+	KEY_UNKNOWN = 0,
+	KEY_DRIVER,
+	KEY_PDEV,
+	KEY_CLIENT_ID,
+	KEY_ENGINE, /* Also drm-engine-capacity-<engine>. */
+	KEY_CYCLES,
+	KEY_MEMORY,
+};
+
+/*
+ * Every key starts with "drm-" and the following two characters tell them
+ * apart, so (key[4] ^ key[5]) & 7 is a perfect hash of the keys we know.
+ * A single compare against the table entry then confirms the match.
+ */
+#define fdinfo_key_hash(key) (((key)[4] ^ (key)[5]) & 7)
+#define FDINFO_KEY_MIN_LEN 8
+
+static const struct fdinfo_key_desc {
+	const char *prefix;
+	unsigned int len;
+	bool has_name; /* Prefix of a per engine or region key. */
+	enum fdinfo_key key;
+} fdinfo_keys[8] = {
+	[0] = { "drm-memory-", 11, true, KEY_MEMORY },
+	[2] = { "drm-cycles-", 11, true, KEY_CYCLES },
+	[3] = { "drm-engine-", 11, true, KEY_ENGINE },
+	[4] = { "drm-pdev", 8, false, KEY_PDEV },
+	[6] = { "drm-driver", 10, false, KEY_DRIVER },
+	[7] = { "drm-client-id", 13, false, KEY_CLIENT_ID },
+};
+
+static enum fdinfo_key
+lookup_key(const char *key, size_t len, const char **name, size_t *name_len)
 {
-	static const char *e2class[] = {
-		"render",
-		"copy",
-		"video",
-		"video-enhance",
-	};
-	ssize_t name_len;
-	char *name, *p;
-	int found = -1;
-	unsigned int i;
+	const struct fdinfo_key_desc *d;
 
-	p = index(line, ':');
-	if (!p || p == line)
-		return -1;
+	if (len < FDINFO_KEY_MIN_LEN || key[0] != 'd')
+		return KEY_UNKNOWN;
 
-	name_len = p - line - prefix_len;
-	if (name_len < 1)
-		return -1;
+	d = &fdinfo_keys[fdinfo_key_hash(key)];
+	if (!d->prefix || len < d->len || memcmp(key, d->prefix, d->len))
+		return KEY_UNKNOWN;
 
-	name = line + prefix_len;
+	if (d->has_name) {
+		if (len == d->len)
+			return KEY_UNKNOWN;
 
-	for (i = 0; i < ARRAY_SIZE(e2class); i++) {
-		if (!strncmp(name, e2class[i], name_len)) {
-			found = i;
-			break;
-		}
+		*name = key + d->len;
+		*name_len = len - d->len;
+	} else if (len != d->len) {
+		return KEY_UNKNOWN;
 	}
 
-	if (found >= 0) {
-		while (*++p && isspace(*p));
-		*val = strtoull(p, NULL, 10);
+	return d->key;
+}
+
+static int engine_class(const char *name, size_t len)
+{
+	switch (len) {
+	case 4:
+		return memcmp(name, "copy", 4) ? -1 : 1;
+	case 5:
+		return memcmp(name, "video", 5) ? -1 : 2;
+	case 6:
+		return memcmp(name, "render", 6) ? -1 : 0;
+	case 13:
+		return memcmp(name, "video-enhance", 13) ? -1 : 3;
+	default:
+		return -1;
 	}
+}
+
+static int
+find_region(struct drm_client_fdinfo *info, const char *name, size_t len)
+{
+	unsigned int i;
+
+	if (len >= sizeof(info->region_names[0]))
+		return -1;
 
-	return found;
+	for (i = 0; i < info->num_regions; i++) {
+		if (!strncmp(info->region_names[i], name, len) &&
+		    !info->region_names[i][len])
+			return i;
+	}
+
+	if (info->num_regions == DRM_CLIENT_FDINFO_MAX_REGIONS)
+		return -1;
+
+	memcpy(info->region_names[i], name, len);
+	info->region_names[i][len] = 0;
+	info->num_regions++;
+
+	return i;
 }
 
-static const char *find_kv(const char *buf, const char *key, size_t keylen)
+static uint64_t parse_u64(const char **p, const char *end)
 {
-	const char *p = buf;
+	uint64_t val = 0;
 
-	if (strncmp(buf, key, keylen))
-		return NULL;
+	while (*p < end && isdigit(**p))
+		val = val * 10 + *(*p)++ - '0';
 
-	p = index(buf, ':');
-	if (!p || p == buf)
-		return NULL;
-	if ((p - buf) != keylen)
-		return NULL;
+	return val;
+}
+
+static uint64_t parse_memory(const char *p, const char *end)
+{
+	uint64_t val = parse_u64(&p, end);
 
-	p++;
-	while (*p && isspace(*p))
+	while (p < end && isspace(*p))
 		p++;
 
-	return *p ? p : NULL;
+	if (p < end) {
+		switch (*p) {
+		case 'K':
+			return val << 10;
+		case 'M':
+			return val << 20;
+		case 'G':
+			return val << 30;
+		}
+	}
+
+	return val;
 }
 
-unsigned int
-__igt_parse_drm_fdinfo(int dir, const char *fd, struct drm_client_fdinfo *info)
+static void copy_value(char *dst, size_t sz, const char *p, const char *end)
 {
-	char buf[4096], *_buf = buf;
-	char *l, *ctx = NULL;
-	unsigned int good = 0, num_capacity = 0;
-	size_t count;
+	size_t len = end - p;
 
-	count = read_fdinfo(buf, sizeof(buf), dir, fd);
-	if (!count)
-		return 0;
+	if (len > sz - 1)
+		len = sz - 1;
+
+	memcpy(dst, p, len);
+	dst[len] = 0;
+}
 
-	while ((l = strtok_r(_buf, "\n", &ctx))) {
-		uint64_t val = 0;
-		const char *v;
+/*
+ * Single pass over the buffer, which is not modified. Each line is split at
+ * its first colon and the key dispatched without rescanning the line.
+ */
+static unsigned int
+parse_fdinfo(const char *buf, size_t count, struct drm_client_fdinfo *info)
+{
+	const char *p = buf, *end = buf + count;
+	unsigned int good = 0, num_capacity = 0, num_other = 0;
+
+	while (p < end) {
+		const char *eol, *colon, *v, *name = NULL;
+		size_t name_len = 0;
+		enum fdinfo_key key;
 		int idx;
 
-		_buf = NULL;
+		eol = memchr(p, '\n', end - p);
+		if (!eol)
+			eol = end;
+
+		colon = memchr(p, ':', eol - p);
+		if (!colon)
+			goto next;
 
-		if ((v = find_kv(l, "drm-driver", strlen("drm-driver")))) {
-			strncpy(info->driver, v, sizeof(info->driver) - 1);
+		key = lookup_key(p, colon - p, &name, &name_len);
+		if (key == KEY_UNKNOWN)
+			goto next;
+
+		v = colon + 1;
+		while (v < eol && isspace(*v))
+			v++;
+		if (v == eol)
+			goto next;
+
+		switch (key) {
+		case KEY_DRIVER:
+			copy_value(info->driver, sizeof(info->driver), v, eol);
 			good++;
-		} else if ((v = find_kv(l, "drm-pdev", strlen("drm-pdev")))) {
-			strncpy(info->pdev, v, sizeof(info->pdev) - 1);
-		}  else if ((v = find_kv(l, "drm-client-id",
-					 strlen("drm-client-id")))) {
-			info->id = atol(v);
+			break;
+		case KEY_PDEV:
+			copy_value(info->pdev, sizeof(info->pdev), v, eol);
+			break;
+		case KEY_CLIENT_ID:
+			info->id = parse_u64(&v, eol);
 			good++;
-		} else if (!strncmp(l, "drm-engine-", 11) &&
-			   strncmp(l, "drm-engine-capacity-", 20)) {
-			idx = parse_engine(l, info, strlen("drm-engine-"),
-					   &val);
+			break;
+		case KEY_ENGINE:
+			if (name_len > 9 && !memcmp(name, "capacity-", 9)) {
+				idx = engine_class(name + 9, name_len - 9);
+				if (idx >= 0) {
+					info->capacity[idx] = parse_u64(&v, eol);
+					num_capacity++;
+				}
+				break;
+			}
+
+			idx = engine_class(name, name_len);
 			if (idx >= 0) {
 				if (!info->capacity[idx])
 					info->capacity[idx] = 1;
-				info->busy[idx] = val;
+				info->busy[idx] = parse_u64(&v, eol);
 				info->num_engines++;
 			}
-		} else if (!strncmp(l, "drm-engine-capacity-", 20)) {
-			idx = parse_engine(l, info,
-					   strlen("drm-engine-capacity-"),
-					   &val);
+			break;
+		case KEY_CYCLES:
+			idx = engine_class(name, name_len);
 			if (idx >= 0) {
-				info->capacity[idx] = val;
-				num_capacity++;
+				info->cycles[idx] = parse_u64(&v, eol);
+				num_other++;
 			}
+			break;
+		case KEY_MEMORY:
+			idx = find_region(info, name, name_len);
+			if (idx >= 0) {
+				info->memory[idx] = parse_memory(v, eol);
+				num_other++;
+			}
+			break;
+		default:
+			break;
 		}
+
+next:
+		p = eol + 1;
 	}
 
 	if (good < 2 || !info->num_engines)
 		return 0; /* fdinfo format not as expected */
 
-	return good + info->num_engines + num_capacity;
+	return good + info->num_engines + num_capacity + num_other;
+}
+
+unsigned int
+__igt_parse_drm_fdinfo(int dir, const char *fd, struct drm_client_fdinfo *info)
+{
+	char buf[4096];
+	ssize_t count;
+
+	count = read_fdinfo(buf, sizeof(buf), dir, fd);
+	if (count <= 0)
+		return 0;
+
+	return parse_fdinfo(buf, count, info);
+}
+
+unsigned int
+__igt_parse_drm_fdinfo_fd(int fdinfo, struct drm_client_fdinfo *info)
+{
+	char buf[4096];
+	ssize_t count;
+
+	/* The kernel regenerates the contents on every read from the start. */
+	count = pread(fdinfo, buf, sizeof(buf), 0);
+	if (count <= 0)
+		return 0;
+
+	return parse_fdinfo(buf, count, info);
 }
 
 unsigned int igt_parse_drm_fdinfo(int drm_fd, struct drm_client_fdinfo *info)
@@ -31,6 +31,7 @@
 #include <stdbool.h>
 
 #define DRM_CLIENT_FDINFO_MAX_ENGINES 16
+#define DRM_CLIENT_FDINFO_MAX_REGIONS 16
 
 struct drm_client_fdinfo {
 	char driver[128];
@@ -40,6 +41,12 @@ struct drm_client_fdinfo {
 	unsigned int num_engines;
 	unsigned int capacity[DRM_CLIENT_FDINFO_MAX_ENGINES];
 	uint64_t busy[DRM_CLIENT_FDINFO_MAX_ENGINES];
+	uint64_t cycles[DRM_CLIENT_FDINFO_MAX_ENGINES];
+
+	/* drm-memory-<region>, in bytes */
+	unsigned int num_regions;
+	char region_names[DRM_CLIENT_FDINFO_MAX_REGIONS][32];
+	uint64_t memory[DRM_CLIENT_FDINFO_MAX_REGIONS];
 };
 
 /**
@@ -66,4 +73,19 @@ unsigned int igt_parse_drm_fdinfo(int drm_fd, struct drm_client_fdinfo *info);
 unsigned int __igt_parse_drm_fdinfo(int dir, const char *fd,
 				    struct drm_client_fdinfo *info);
 
+/**
+ * __igt_parse_drm_fdinfo_fd: Parses an open drm fdinfo file
+ *
+ * @fdinfo: File descriptor of an open /proc/pid/fdinfo/fd file
+ * @info: Structure to populate with read data. Must be zeroed.
+ *
+ * The file is read from the start, so it can be kept open and parsed again
+ * to get fresh data without opening it each time.
+ *
+ * Returns the number of valid drm fdinfo keys found or zero if not all
+ * mandatory keys were present or no engines found.
+ */
+unsigned int __igt_parse_drm_fdinfo_fd(int fdinfo,
+				       struct drm_client_fdinfo *info);
+
 #endif /* IGT_DRM_FDINFO_H */
@@ -3018,11 +3018,6 @@ static void igt_fb_destroy_cairo_shadow_buffer(struct igt_fb *shadow,
 	munmap(ptr, shadow->size);
 }
 
-static uint8_t clamprgb(float val)
-{
-	return clamp((int)(val + 0.5f), 0, 255);
-}
-
 static void read_rgb(struct igt_vec4 *rgb, const uint8_t *rgb24)
 {
 	rgb->d[0] = rgb24[2];
@@ -3031,13 +3026,6 @@ static void read_rgb(struct igt_vec4 *rgb, const uint8_t *rgb24)
 	rgb->d[3] = 1.0f;
 }
 
-static void write_rgb(uint8_t *rgb24, const struct igt_vec4 *rgb)
-{
-	rgb24[2] = clamprgb(rgb->d[0]);
-	rgb24[1] = clamprgb(rgb->d[1]);
-	rgb24[0] = clamprgb(rgb->d[2]);
-}
-
 struct fb_convert_buf {
 	void			*ptr;
 	struct igt_fb		*fb;
@@ -3266,12 +3254,29 @@ static void convert_yuv_to_rgb24(struct fb_convert *cvt)
 						    cvt->dst.fb->drm_format,
 						    cvt->src.fb->color_encoding,
 						    cvt->src.fb->color_range);
+	struct igt_matrix_stages stages = igt_matrix_stages_identity();
+	unsigned int width = cvt->dst.fb->width;
+	struct igt_vec4_array row;
+	float *row_buf;
 	uint8_t *buf;
 	struct yuv_parameters params = { };
 
 	igt_assert(cvt->dst.fb->drm_format == DRM_FORMAT_XRGB8888 &&
 		   igt_format_is_yuv(cvt->src.fb->drm_format));
 
+	/* Round and clamp to 8 bits as part of the transform */
+	for (i = 0; i < 3; i++) {
+		stages.out_offset.d[i] = 0.5f;
+		stages.out_min.d[i] = 0.0f;
+		stages.out_max.d[i] = 255.0f;
+	}
+
+	/* One row of each plane, converted in place from YCbCr to RGB */
+	row_buf = malloc(3 * width * sizeof(*row_buf));
+	igt_assert(row_buf);
+	row = igt_vec4_array_planar(row_buf, row_buf + width,
+				    row_buf + 2 * width, NULL);
+
 	buf = convert_src_get(cvt);
 	get_yuv_parameters(cvt->src.fb, &params);
 	y = buf + params.y_offset;
@@ -3284,18 +3289,11 @@ static void convert_yuv_to_rgb24(struct fb_convert *cvt)
 		const uint8_t *v_tmp = v;
 		uint8_t *rgb_tmp = rgb24;
 
-		for (j = 0; j < cvt->dst.fb->width; j++) {
-			struct igt_vec4 rgb, yuv;
-
-			yuv.d[0] = *y_tmp;
-			yuv.d[1] = *u_tmp;
-			yuv.d[2] = *v_tmp;
-			yuv.d[3] = 1.0f;
-
-			rgb = igt_matrix_transform(&m, &yuv);
-			write_rgb(rgb_tmp, &rgb);
+		for (j = 0; j < width; j++) {
+			row.d[0][j] = *y_tmp;
+			row.d[1][j] = *u_tmp;
+			row.d[2][j] = *v_tmp;
 
-			rgb_tmp += bpp;
 			y_tmp += params.ay_inc;
 
 			if ((src_fmt->hsub == 1) || (j % src_fmt->hsub)) {
@@ -3304,6 +3302,16 @@ static void convert_yuv_to_rgb24(struct fb_convert *cvt)
 			}
 		}
 
+		igt_matrix_transform_batch(&m, &stages, &row, &row, width);
+
+		for (j = 0; j < width; j++) {
+			rgb_tmp[2] = row.d[0][j];
+			rgb_tmp[1] = row.d[1][j];
+			rgb_tmp[0] = row.d[2][j];
+
+			rgb_tmp += bpp;
+		}
+
 		rgb24 += rgb24_stride;
 		y += params.ay_stride;
 
@@ -3314,6 +3322,7 @@ static void convert_yuv_to_rgb24(struct fb_convert *cvt)
 	}
 
 	convert_src_put(cvt, buf);
+	free(row_buf);
 }
 
 static void convert_rgb24_to_yuv(struct fb_convert *cvt)
@@ -3410,13 +3419,6 @@ static void read_rgbf(struct igt_vec4 *rgb, const float *rgb24)
 	rgb->d[3] = 1.0f;
 }
 
-static void write_rgbf(float *rgb24, const struct igt_vec4 *rgb)
-{
-	rgb24[0] = rgb->d[0];
-	rgb24[1] = rgb->d[1];
-	rgb24[2] = rgb->d[2];
-}
-
 static void convert_yuv16_to_float(struct fb_convert *cvt, bool alpha)
 {
 	const struct format_desc_struct *src_fmt =
@@ -3430,6 +3432,9 @@ static void convert_yuv16_to_float(struct fb_convert *cvt, bool alpha)
 						    cvt->dst.fb->drm_format,
 						    cvt->src.fb->color_encoding,
 						    cvt->src.fb->color_range);
+	unsigned int width = cvt->dst.fb->width;
+	struct igt_vec4_array row, dst;
+	float *row_buf;
 	uint16_t *buf;
 	struct yuv_parameters params = { };
 
@@ -3442,6 +3447,11 @@ static void convert_yuv16_to_float(struct fb_convert *cvt, bool alpha)
 		   !(params.u_offset % sizeof(*buf)) &&
 		   !(params.v_offset % sizeof(*buf)));
 
+	row_buf = malloc(3 * width * sizeof(*row_buf));
+	igt_assert(row_buf);
+	row = igt_vec4_array_planar(row_buf, row_buf + width,
+				    row_buf + 2 * width, NULL);
+
 	a = buf + params.a_offset / sizeof(*buf);
 	y = buf + params.y_offset / sizeof(*buf);
 	u = buf + params.u_offset / sizeof(*buf);
@@ -3454,16 +3464,10 @@ static void convert_yuv16_to_float(struct fb_convert *cvt, bool alpha)
 		const uint16_t *v_tmp = v;
 		float *rgb_tmp = ptr;
 
-		for (j = 0; j < cvt->dst.fb->width; j++) {
-			struct igt_vec4 rgb, yuv;
-
-			yuv.d[0] = *y_tmp;
-			yuv.d[1] = *u_tmp;
-			yuv.d[2] = *v_tmp;
-			yuv.d[3] = 1.0f;
-
-			rgb = igt_matrix_transform(&m, &yuv);
-			write_rgbf(rgb_tmp, &rgb);
+		for (j = 0; j < width; j++) {
+			row.d[0][j] = *y_tmp;
+			row.d[1][j] = *u_tmp;
+			row.d[2][j] = *v_tmp;
 
 			if (alpha) {
 				rgb_tmp[3] = ((float)*a_tmp) / 65535.f;
@@ -3479,6 +3483,10 @@ static void convert_yuv16_to_float(struct fb_convert *cvt, bool alpha)
 			}
 		}
 
+		dst = igt_vec4_array_interleaved(ptr, fpp);
+		dst.d[3] = NULL;
+		igt_matrix_transform_batch(&m, NULL, &row, &dst, width);
+
 		ptr += float_stride;
 
 		a += params.ay_stride / sizeof(*a);
@@ -3491,6 +3499,7 @@ static void convert_yuv16_to_float(struct fb_convert *cvt, bool alpha)
 	}
 
 	convert_src_put(cvt, buf);
+	free(row_buf);
 }
 
 static void convert_float_to_yuv16(struct fb_convert *cvt, bool alpha)
@@ -3605,36 +3614,41 @@ static void convert_Y410_to_float(struct fb_convert *cvt, bool alpha)
 						    cvt->src.fb->color_encoding,
 						    cvt->src.fb->color_range);
 	unsigned bpp = alpha ? 4 : 3;
+	unsigned int width = cvt->dst.fb->width;
+	struct igt_vec4_array row, dst;
+	float *row_buf;
 
 	igt_assert((cvt->src.fb->drm_format == DRM_FORMAT_Y410 ||
 		    cvt->src.fb->drm_format == DRM_FORMAT_XVYU2101010) &&
 		   cvt->dst.fb->drm_format == IGT_FORMAT_FLOAT);
 
+	row_buf = malloc(3 * width * sizeof(*row_buf));
+	igt_assert(row_buf);
+	row = igt_vec4_array_planar(row_buf, row_buf + width,
+				    row_buf + 2 * width, NULL);
+
 	uyv = buf = convert_src_get(cvt);
 
 	for (i = 0; i < cvt->dst.fb->height; i++) {
-		for (j = 0; j < cvt->dst.fb->width; j++) {
-			/* Convert 2x1 pixel blocks */
-			struct igt_vec4 yuv;
-			struct igt_vec4 rgb;
+		for (j = 0; j < width; j++) {
+			row.d[0][j] = (uyv[j] >> 10) & 0x3ff;
+			row.d[1][j] = uyv[j] & 0x3ff;
+			row.d[2][j] = (uyv[j] >> 20) & 0x3ff;
 
-			yuv.d[0] = (uyv[j] >> 10) & 0x3ff;
-			yuv.d[1] = uyv[j] & 0x3ff;
-			yuv.d[2] = (uyv[j] >> 20) & 0x3ff;
-			yuv.d[3] = 1.f;
-
-			rgb = igt_matrix_transform(&m, &yuv);
-
-			write_rgbf(&ptr[j * bpp], &rgb);
 			if (alpha)
 				ptr[j * bpp + 3] = (float)(uyv[j] >> 30) / 3.f;
 		}
 
+		dst = igt_vec4_array_interleaved(ptr, bpp);
+		dst.d[3] = NULL;
+		igt_matrix_transform_batch(&m, NULL, &row, &dst, width);
+
 		ptr += float_stride;
 		uyv += uyv_stride;
 	}
 
 	convert_src_put(cvt, buf);
+	free(row_buf);
 }
 
 static void convert_float_to_Y410(struct fb_convert *cvt, bool alpha)
@@ -3704,7 +3718,7 @@ static const unsigned char *rgbx_swizzle(uint32_t format)
 
 static void convert_fp16_to_float(struct fb_convert *cvt)
 {
-	int i, j;
+	int i;
 	uint16_t *fp16;
 	float *ptr = cvt->dst.ptr;
 	unsigned int float_stride = cvt->dst.fb->strides[0] / sizeof(*ptr);
@@ -3716,26 +3730,10 @@ static void convert_fp16_to_float(struct fb_convert *cvt)
 	fp16 = buf + cvt->src.fb->offsets[0] / sizeof(*buf);
 
 	for (i = 0; i < cvt->dst.fb->height; i++) {
-		if (needs_reswizzle) {
-			const uint16_t *fp16_tmp = fp16;
-			float *rgb_tmp = ptr;
-
-			for (j = 0; j < cvt->dst.fb->width; j++) {
-				struct igt_vec4 rgb;
-
-				igt_half_to_float(fp16_tmp, rgb.d, 4);
-
-				rgb_tmp[0] = rgb.d[swz[0]];
-				rgb_tmp[1] = rgb.d[swz[1]];
-				rgb_tmp[2] = rgb.d[swz[2]];
-				rgb_tmp[3] = rgb.d[swz[3]];
-
-				rgb_tmp += 4;
-				fp16_tmp += 4;
-			}
-		} else {
+		if (needs_reswizzle)
+			igt_half_to_float_rgbx(fp16, ptr, cvt->dst.fb->width, swz);
+		else
 			igt_half_to_float(fp16, ptr, cvt->dst.fb->width * 4);
-		}
 
 		ptr += float_stride;
 		fp16 += fp16_stride;
@@ -3746,7 +3744,7 @@ static void convert_fp16_to_float(struct fb_convert *cvt)
 
 static void convert_float_to_fp16(struct fb_convert *cvt)
 {
-	int i, j;
+	int i;
 	uint16_t *fp16 = cvt->dst.ptr + cvt->dst.fb->offsets[0];
 	const float *ptr = cvt->src.ptr;
 	unsigned float_stride = cvt->src.fb->strides[0] / sizeof(*ptr);
@@ -3755,78 +3753,30 @@ static void convert_float_to_fp16(struct fb_convert *cvt)
 	bool needs_reswizzle = swz != swizzle_rgbx;
 
 	for (i = 0; i < cvt->dst.fb->height; i++) {
-		if (needs_reswizzle) {
-			const float *rgb_tmp = ptr;
-			uint16_t *fp16_tmp = fp16;
-
-			for (j = 0; j < cvt->dst.fb->width; j++) {
-				struct igt_vec4 rgb;
-
-				rgb.d[0] = rgb_tmp[swz[0]];
-				rgb.d[1] = rgb_tmp[swz[1]];
-				rgb.d[2] = rgb_tmp[swz[2]];
-				rgb.d[3] = rgb_tmp[swz[3]];
-
-				igt_float_to_half(rgb.d, fp16_tmp, 4);
-
-				rgb_tmp += 4;
-				fp16_tmp += 4;
-			}
-		} else {
+		if (needs_reswizzle)
+			igt_float_to_half_rgbx(ptr, fp16, cvt->dst.fb->width, swz);
+		else
 			igt_float_to_half(ptr, fp16, cvt->dst.fb->width * 4);
-		}
 
 		ptr += float_stride;
 		fp16 += fp16_stride;
 	}
 }
 
-static void float_to_uint16(const float *f, uint16_t *h, unsigned int num)
-{
-	for (int i = 0; i < num; i++)
-		h[i] = f[i] * 65535.0f + 0.5f;
-}
-
-static void uint16_to_float(const uint16_t *h, float *f, unsigned int num)
-{
-	for (int i = 0; i < num; i++)
-		f[i] = ((float) h[i]) / 65535.0f;
-}
-
 static void convert_uint16_to_float(struct fb_convert *cvt)
 {
-	int i, j;
+	int i;
 	uint16_t *up16;
 	float *ptr = cvt->dst.ptr;
 	unsigned int float_stride = cvt->dst.fb->strides[0] / sizeof(*ptr);
 	unsigned int up16_stride = cvt->src.fb->strides[0] / sizeof(*up16);
 	const unsigned char *swz = rgbx_swizzle(cvt->src.fb->drm_format);
-	bool needs_reswizzle = swz != swizzle_rgbx;
 
 	uint16_t *buf = convert_src_get(cvt);
 	up16 = buf + cvt->src.fb->offsets[0] / sizeof(*buf);
 
 	for (i = 0; i < cvt->dst.fb->height; i++) {
-		if (needs_reswizzle) {
-			const uint16_t *u16_tmp = up16;
-			float *rgb_tmp = ptr;
-
-			for (j = 0; j < cvt->dst.fb->width; j++) {
-				struct igt_vec4 rgb;
-
-				uint16_to_float(u16_tmp, rgb.d, 4);
-
-				rgb_tmp[0] = rgb.d[swz[0]];
-				rgb_tmp[1] = rgb.d[swz[1]];
-				rgb_tmp[2] = rgb.d[swz[2]];
-				rgb_tmp[3] = rgb.d[swz[3]];
-
-				rgb_tmp += 4;
-				u16_tmp += 4;
-			}
-		} else {
-			uint16_to_float(up16, ptr, cvt->dst.fb->width * 4);
-		}
+		igt_unorm16_to_float_rgbx(up16, ptr, cvt->dst.fb->width, swz);
 
 		ptr += float_stride;
 		up16 += up16_stride;
@@ -3837,35 +3787,15 @@ static void convert_uint16_to_float(struct fb_convert *cvt)
 
 static void convert_float_to_uint16(struct fb_convert *cvt)
 {
-	int i, j;
+	int i;
 	uint16_t *up16 = cvt->dst.ptr + cvt->dst.fb->offsets[0];
 	const float *ptr = cvt->src.ptr;
 	unsigned float_stride = cvt->src.fb->strides[0] / sizeof(*ptr);
 	unsigned up16_stride = cvt->dst.fb->strides[0] / sizeof(*up16);
 	const unsigned char *swz = rgbx_swizzle(cvt->dst.fb->drm_format);
-	bool needs_reswizzle = swz != swizzle_rgbx;
 
 	for (i = 0; i < cvt->dst.fb->height; i++) {
-		if (needs_reswizzle) {
-			const float *rgb_tmp = ptr;
-			uint16_t *u16_tmp = up16;
-
-			for (j = 0; j < cvt->dst.fb->width; j++) {
-				struct igt_vec4 rgb;
-
-				rgb.d[0] = rgb_tmp[swz[0]];
-				rgb.d[1] = rgb_tmp[swz[1]];
-				rgb.d[2] = rgb_tmp[swz[2]];
-				rgb.d[3] = rgb_tmp[swz[3]];
-
-				float_to_uint16(rgb.d, u16_tmp, 4);
-
-				rgb_tmp += 4;
-				u16_tmp += 4;
-			}
-		} else {
-			float_to_uint16(ptr, up16, cvt->dst.fb->width * 4);
-		}
+		igt_float_to_unorm16_rgbx(ptr, up16, cvt->dst.fb->width, swz);
 
 		ptr += float_stride;
 		up16 += up16_stride;
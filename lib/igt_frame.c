@@ -27,12 +27,21 @@
 #include "config.h"
 
 #include <fcntl.h>
-#include <pixman.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <cairo.h>
 #include <gsl/gsl_statistics_double.h>
 #include <gsl/gsl_fit.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "igt_frame.h"
+#include "igt_aux.h"
 #include "igt_core.h"
 
 /**
@@ -139,6 +148,159 @@ void igt_write_compared_frames_to_png(cairo_surface_t *reference,
 	close(fd);
 }
 
+/*
+ * Below this many pixels per tile, spawning threads costs more than the
+ * comparison itself.
+ */
+#define FRAME_TILE_MIN_PIXELS	(512 * 1024)
+#define FRAME_TILES_MAX		16
+
+struct frame_pair {
+	const uint8_t *ref_data;
+	const uint8_t *cap_data;
+	unsigned int ref_stride;
+	unsigned int cap_stride;
+	unsigned int width;
+	unsigned int height;
+};
+
+struct frame_tile {
+	pthread_t thread;
+	bool threaded;
+	unsigned int y_start;
+	unsigned int y_end;
+};
+
+static void frame_pair_init(struct frame_pair *frames,
+			    cairo_surface_t *reference,
+			    cairo_surface_t *capture)
+{
+	frames->width = cairo_image_surface_get_width(reference);
+	frames->height = cairo_image_surface_get_height(reference);
+
+	frames->ref_stride = cairo_image_surface_get_stride(reference);
+	frames->ref_data = cairo_image_surface_get_data(reference);
+	igt_assert(frames->ref_data);
+
+	frames->cap_stride = cairo_image_surface_get_stride(capture);
+	frames->cap_data = cairo_image_surface_get_data(capture);
+	igt_assert(frames->cap_data);
+}
+
+/* Per-byte absolute difference of two rows, out[i] = |a[i] - b[i]|. */
+static void frame_absdiff_row(const uint8_t *a, const uint8_t *b,
+			      uint8_t *out, unsigned int len)
+{
+	unsigned int i = 0;
+
+#if defined(__SSE2__)
+	for (; i + 16 <= len; i += 16) {
+		__m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+
+		_mm_storeu_si128((__m128i *)(out + i),
+				 _mm_or_si128(_mm_subs_epu8(va, vb),
+					      _mm_subs_epu8(vb, va)));
+	}
+#elif defined(__ARM_NEON)
+	for (; i + 16 <= len; i += 16)
+		vst1q_u8(out + i, vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i)));
+#endif
+
+	for (; i < len; i++)
+		out[i] = a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+}
+
+static unsigned int frame_tile_count(unsigned int width, unsigned int height)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	uint64_t count = (uint64_t)width * height / FRAME_TILE_MIN_PIXELS;
+
+	count = min(count, (uint64_t)max(cpus, 1L));
+	count = min(count, (uint64_t)FRAME_TILES_MAX);
+	count = min(count, (uint64_t)height);
+
+	return max(count, (uint64_t)1);
+}
+
+/*
+ * Split the frame in horizontal bands of rows and run @fn on each of them,
+ * using one thread per band. @tiles is an array of @count structures of
+ * @tile_size bytes, each starting with a struct frame_tile. The first band
+ * is processed by the calling thread, and so is any band for which a thread
+ * could not be created.
+ */
+static void frame_run_tiles(void *tiles, size_t tile_size, unsigned int count,
+			    unsigned int height, void *(*fn)(void *))
+{
+	struct frame_tile *tile;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		tile = (struct frame_tile *)((char *)tiles + i * tile_size);
+		tile->y_start = (uint64_t)height * i / count;
+		tile->y_end = (uint64_t)height * (i + 1) / count;
+		tile->threaded = false;
+	}
+
+	for (i = 1; i < count; i++) {
+		tile = (struct frame_tile *)((char *)tiles + i * tile_size);
+		tile->threaded = !pthread_create(&tile->thread, NULL, fn, tile);
+		if (!tile->threaded)
+			fn(tile);
+	}
+
+	fn(tiles);
+
+	for (i = 1; i < count; i++) {
+		tile = (struct frame_tile *)((char *)tiles + i * tile_size);
+		if (tile->threaded)
+			pthread_join(tile->thread, NULL);
+	}
+}
+
+struct analog_tile {
+	struct frame_tile tile;
+	const struct frame_pair *frames;
+	uint64_t error_sum[3][256];
+	unsigned int error_count[3][256];
+};
+
+static void *analog_tile_collect(void *data)
+{
+	struct analog_tile *at = data;
+	const struct frame_pair *frames = at->frames;
+	unsigned int width = frames->width;
+	uint8_t *diff;
+	unsigned int x, y;
+	int i;
+
+	diff = malloc(width * 4);
+	igt_assert(diff);
+
+	for (y = at->tile.y_start; y < at->tile.y_end; y++) {
+		const uint8_t *q = frames->ref_data + y * frames->ref_stride;
+		const uint8_t *p = frames->cap_data + y * frames->cap_stride;
+		const uint8_t *d = diff;
+
+		frame_absdiff_row(p, q, diff, width * 4);
+
+		for (x = 0; x < width; x++) {
+			for (i = 0; i < 3; i++) {
+				at->error_sum[i][q[i]] += d[i];
+				at->error_count[i][q[i]]++;
+			}
+
+			q += 4;
+			d += 4;
+		}
+	}
+
+	free(diff);
+
+	return NULL;
+}
+
 /**
  * igt_check_analog_frame_match:
  * @reference: The reference cairo surface
@@ -169,53 +331,41 @@ void igt_write_compared_frames_to_png(cairo_surface_t *reference,
 bool igt_check_analog_frame_match(cairo_surface_t *reference,
 				  cairo_surface_t *capture)
 {
-	pixman_image_t *reference_src, *capture_src;
-	int w, h;
-	int error_count[3][256][2] = { 0 };
+	struct frame_pair frames;
+	struct analog_tile *tiles;
+	unsigned int tile_count, t;
+	uint64_t error_count[3][256][2] = { 0 };
 	double error_average[4][250];
 	double error_trend[250];
 	double c0, c1, cov00, cov01, cov11, sumsq;
 	double correlation;
-	unsigned char *reference_pixels, *capture_pixels;
-	unsigned char *p;
-	unsigned char *q;
 	bool match = true;
-	int diff;
-	int x, y;
 	int i, j;
 
-	w = cairo_image_surface_get_width(reference);
-	h = cairo_image_surface_get_height(reference);
+	frame_pair_init(&frames, reference, capture);
 
-	reference_src = pixman_image_create_bits(
-	    PIXMAN_x8r8g8b8, w, h,
-	    (void*)cairo_image_surface_get_data(reference),
-	    cairo_image_surface_get_stride(reference));
-	reference_pixels = (unsigned char *) pixman_image_get_data(reference_src);
+	tile_count = frame_tile_count(frames.width, frames.height);
+	tiles = calloc(tile_count, sizeof(*tiles));
+	igt_assert(tiles);
 
-	capture_src = pixman_image_create_bits(
-	    PIXMAN_x8r8g8b8, w, h,
-	    (void*)cairo_image_surface_get_data(capture),
-	    cairo_image_surface_get_stride(capture));
-	capture_pixels = (unsigned char *) pixman_image_get_data(capture_src);
+	for (t = 0; t < tile_count; t++)
+		tiles[t].frames = &frames;
 
-	/* Collect the absolute error for each color value */
-	for (x = 0; x < w; x++) {
-		for (y = 0; y < h; y++) {
-			p = &capture_pixels[(x + y * w) * 4];
-			q = &reference_pixels[(x + y * w) * 4];
+	/* Collect the absolute error for each color value, row by row */
+	frame_run_tiles(tiles, sizeof(*tiles), tile_count, frames.height,
+			analog_tile_collect);
 
-			for (i = 0; i < 3; i++) {
-				diff = (int) p[i] - q[i];
-				if (diff < 0)
-					diff = -diff;
-
-				error_count[i][q[i]][0] += diff;
-				error_count[i][q[i]][1]++;
+	for (t = 0; t < tile_count; t++) {
+		for (i = 0; i < 3; i++) {
+			for (j = 0; j < 256; j++) {
+				error_count[i][j][0] += tiles[t].error_sum[i][j];
+				error_count[i][j][1] += tiles[t].error_count[i][j];
 			}
 		}
 	}
 
+	free(tiles);
+
 	/* Calculate the average absolute error for each color value */
 	for (i = 0; i < 250; i++) {
 		error_average[0][i] = i;
@@ -262,14 +412,120 @@ bool igt_check_analog_frame_match(cairo_surface_t *reference,
 	}
 
 complete:
-	pixman_image_unref(reference_src);
-	pixman_image_unref(capture_src);
-
 	return match;
 }
 
-#define XR24_COLOR_VALUE(data, stride, x, y, c) \
-	*((uint8_t *)(data) + (y) * (stride) + 4 * (x) + (c))
+struct checkerboard_tile {
+	struct frame_tile tile;
+	const struct frame_pair *frames;
+	unsigned char *edges_map;
+	unsigned int span;
+	unsigned int edge_threshold;
+	unsigned int color_error_threshold;
+	unsigned int errors;
+	unsigned int pixels;
+};
+
+static void *checkerboard_tile_edges(void *data)
+{
+	struct checkerboard_tile *ct = data;
+	const struct frame_pair *frames = ct->frames;
+	unsigned int width = frames->width, height = frames->height;
+	unsigned int stride = frames->ref_stride;
+	unsigned int span = ct->span;
+	uint8_t *xdiff_row, *ydiff_row;
+	unsigned int x, y;
+
+	if (width <= 2 * span)
+		return NULL;
+
+	xdiff_row = malloc(width * 4);
+	ydiff_row = malloc(width * 4);
+	igt_assert(xdiff_row && ydiff_row);
+
+	for (y = ct->tile.y_start; y < ct->tile.y_end; y++) {
+		const uint8_t *row = frames->ref_data + y * stride;
+
+		if (y < span || y > (height - span - 1))
+			continue;
+
+		/* xdiff_row[(x - span) * 4 + c] compares x + span to x - span */
+		frame_absdiff_row(row + 2 * span * 4, row, xdiff_row,
+				  (width - 2 * span) * 4);
+		frame_absdiff_row(row + span * stride, row - span * stride,
+				  ydiff_row, width * 4);
+
+		for (x = span; x < width - span; x++) {
+			const uint8_t *xd = &xdiff_row[(x - span) * 4];
+			const uint8_t *yd = &ydiff_row[x * 4];
+			unsigned int xdiff = xd[0] + xd[1] + xd[2];
+			unsigned int ydiff = yd[0] + yd[1] + yd[2];
+
+			ct->edges_map[y * width + x] =
+				(xdiff > ct->edge_threshold ||
+				 ydiff > ct->edge_threshold);
+		}
+	}
+
+	free(ydiff_row);
+	free(xdiff_row);
+
+	return NULL;
+}
+
+static void *checkerboard_tile_errors(void *data)
+{
+	struct checkerboard_tile *ct = data;
+	const struct frame_pair *frames = ct->frames;
+	const unsigned char *edges_map = ct->edges_map;
+	unsigned int width = frames->width, height = frames->height;
+	unsigned int span = ct->span;
+	uint8_t *diff;
+	unsigned int x, y;
+
+	diff = malloc(width * 4);
+	igt_assert(diff);
+
+	for (y = ct->tile.y_start; y < ct->tile.y_end; y++) {
+		frame_absdiff_row(frames->ref_data + y * frames->ref_stride,
+				  frames->cap_data + y * frames->cap_stride,
+				  diff, width * 4);
+
+		for (x = 0; x < width; x++) {
+			const uint8_t *d = &diff[x * 4];
+			bool error;
+
+			if (edges_map[y * width + x])
+				continue;
+
+			/* Compare the reference and capture values. */
+			error = d[0] > ct->color_error_threshold ||
+				d[1] > ct->color_error_threshold ||
+				d[2] > ct->color_error_threshold;
+
+			/* Allow error if coming on or off an edge (on x). */
+			if (error && x >= span && x <= (width - span - 1) &&
+			    edges_map[y * width + (x - span)] !=
+			    edges_map[y * width + (x + span)])
+				continue;
+
+			/* Allow error if coming on or off an edge (on y). */
+			if (error && y >= span && y <= (height - span - 1) &&
+			    edges_map[(y - span) * width + x] !=
+			    edges_map[(y + span) * width + x])
+				continue;
+
+			if (error)
+				ct->errors++;
+
+			ct->pixels++;
+		}
+	}
+
+	free(diff);
+
+	return NULL;
+}
 
 /**
  * igt_check_checkerboard_frame_match:
@@ -303,102 +559,350 @@ complete:
 bool igt_check_checkerboard_frame_match(cairo_surface_t *reference,
 					cairo_surface_t *capture)
 {
-	unsigned int width, height, ref_stride, cap_stride;
-	void *ref_data, *cap_data;
+	struct frame_pair frames;
+	struct checkerboard_tile *tiles;
+	unsigned int tile_count, t;
 	unsigned char *edges_map;
-	unsigned int x, y, c;
 	unsigned int errors = 0, pixels = 0;
-	unsigned int edge_threshold = 100;
-	unsigned int color_error_threshold = 24;
 	double error_rate_threshold = 0.01;
 	double error_rate;
-	unsigned int span = 2;
 	bool match = false;
 
-	width = cairo_image_surface_get_width(reference);
-	height = cairo_image_surface_get_height(reference);
+	frame_pair_init(&frames, reference, capture);
 
-	ref_stride = cairo_image_surface_get_stride(reference);
-	ref_data = cairo_image_surface_get_data(reference);
-	igt_assert(ref_data);
+	edges_map = calloc(1, frames.width * frames.height);
+	igt_assert(edges_map);
 
-	cap_stride = cairo_image_surface_get_stride(capture);
-	cap_data = cairo_image_surface_get_data(capture);
-	igt_assert(cap_data);
+	tile_count = frame_tile_count(frames.width, frames.height);
+	tiles = calloc(tile_count, sizeof(*tiles));
+	igt_assert(tiles);
 
-	edges_map = calloc(1, width * height);
-	igt_assert(edges_map);
+	for (t = 0; t < tile_count; t++) {
+		tiles[t].frames = &frames;
+		tiles[t].edges_map = edges_map;
+		tiles[t].span = 2;
+		tiles[t].edge_threshold = 100;
+		tiles[t].color_error_threshold = 24;
+	}
 
 	/* First pass to detect the pattern edges. */
-	for (y = 0; y < height; y++) {
-		if (y < span || y > (height - span - 1))
-			continue;
+	frame_run_tiles(tiles, sizeof(*tiles), tile_count, frames.height,
+			checkerboard_tile_edges);
 
-		for (x = 0; x < width; x++) {
-			unsigned int xdiff = 0, ydiff = 0;
+	/*
+	 * Second pass to detect errors, which looks at the edges of
+	 * neighbouring rows and thus has to wait for the first one.
+	 */
+	frame_run_tiles(tiles, sizeof(*tiles), tile_count, frames.height,
+			checkerboard_tile_errors);
 
-			if (x < span || x > (width - span - 1))
-				continue;
+	for (t = 0; t < tile_count; t++) {
+		errors += tiles[t].errors;
+		pixels += tiles[t].pixels;
+	}
 
-			for (c = 0; c < 3; c++) {
-				xdiff += abs(XR24_COLOR_VALUE(ref_data, ref_stride, x + span, y, c) -
-					     XR24_COLOR_VALUE(ref_data, ref_stride, x - span, y, c));
-				ydiff += abs(XR24_COLOR_VALUE(ref_data, ref_stride, x, y + span, c) -
-					     XR24_COLOR_VALUE(ref_data, ref_stride, x, y - span, c));
-			}
+	free(tiles);
+	free(edges_map);
 
-			edges_map[y * width + x] = (xdiff > edge_threshold ||
-						    ydiff > edge_threshold);
-		}
+	error_rate = (double) errors / pixels;
+
+	if (error_rate < error_rate_threshold)
+		match = true;
+
+	igt_debug("Checkerboard pattern %s with error rate %f %%\n",
+		  match ? "matched" : "not matched", error_rate * 100);
+
+	return match;
+}
+
+/* Byte offsets of the color channels in a native-endian XRGB8888 pixel. */
+#define FRAME_DIFF_R	2
+#define FRAME_DIFF_G	1
+#define FRAME_DIFF_B	0
+
+/* SSIM is evaluated on non-overlapping windows of this size. */
+#define FRAME_DIFF_BLOCK	8
+
+struct frame_diff_block {
+	uint64_t sum_a, sum_b;
+	uint64_t sum_aa, sum_bb, sum_ab;
+};
+
+static inline unsigned int frame_diff_luma(const uint8_t *px)
+{
+	return (299 * px[FRAME_DIFF_R] + 587 * px[FRAME_DIFF_G] +
+		114 * px[FRAME_DIFF_B] + 500) / 1000;
+}
+
+static double frame_diff_block_ssim(const struct frame_diff_block *block,
+				    unsigned int n)
+{
+	const double c1 = (0.01 * 255) * (0.01 * 255);
+	const double c2 = (0.03 * 255) * (0.03 * 255);
+	double mean_a = (double)block->sum_a / n;
+	double mean_b = (double)block->sum_b / n;
+	double var_a = (double)block->sum_aa / n - mean_a * mean_a;
+	double var_b = (double)block->sum_bb / n - mean_b * mean_b;
+	double cov = (double)block->sum_ab / n - mean_a * mean_b;
+
+	return ((2 * mean_a * mean_b + c1) * (2 * cov + c2)) /
+	       ((mean_a * mean_a + mean_b * mean_b + c1) * (var_a + var_b + c2));
+}
+
+/**
+ * igt_frame_diff:
+ * @reference: The reference cairo surface
+ * @capture: The captured cairo surface
+ * @params: The comparison parameters
+ * @report: Filled with the outcome of the comparison
+ *
+ * Compares two XRGB8888 cairo surfaces of the same size with a per-channel
+ * tolerance. Pixels for which any color channel differs by more than the
+ * tolerance are counted as different, and the frames match if no more than
+ * @params->max_diff_pixels of them are found. For an #igt_fb, the surface
+ * can be obtained with igt_get_cairo_surface().
+ *
+ * The frames are walked in bands of 8 rows. With @params->early_exit, the
+ * comparison stops after the first band that brings the number of different
+ * pixels over the limit, in which case @report is only partially filled in
+ * and its complete field is false.
+ *
+ * With @params->metrics, the PSNR over the three color channels and the mean
+ * SSIM of the luma over 8x8 windows are also computed and, if the respective
+ * @params->min_psnr or @params->min_ssim are non-zero, taken into account to
+ * decide whether the frames match. Otherwise the psnr and ssim fields of
+ * @report are set to NAN.
+ *
+ * Returns: a boolean indicating whether the frames match
+ */
+bool igt_frame_diff(cairo_surface_t *reference, cairo_surface_t *capture,
+		    const struct igt_frame_diff_params *params,
+		    struct igt_frame_diff_report *report)
+{
+	const uint8_t tol_r = params->tolerance[0];
+	const uint8_t tol_g = params->tolerance[1];
+	const uint8_t tol_b = params->tolerance[2];
+	struct frame_diff_block *blocks = NULL;
+	struct frame_pair frames;
+	unsigned int block_count = 0, x, y, band;
+	uint64_t sq_error = 0, pixels = 0;
+	double ssim_sum = 0;
+	uint8_t *diff;
+
+	frame_pair_init(&frames, reference, capture);
+	igt_assert_eq(cairo_image_surface_get_width(capture), frames.width);
+	igt_assert_eq(cairo_image_surface_get_height(capture), frames.height);
+
+	memset(report, 0, sizeof(*report));
+	report->x1 = frames.width;
+	report->y1 = frames.height;
+	report->complete = true;
+
+	diff = malloc(frames.width * 4);
+	igt_assert(diff);
+
+	if (params->metrics) {
+		blocks = calloc(DIV_ROUND_UP(frames.width, FRAME_DIFF_BLOCK),
+				sizeof(*blocks));
+		igt_assert(blocks);
 	}
 
-	/* Second pass to detect errors. */
-	for (y = 0; y < height; y++) {
-		for (x = 0; x < width; x++) {
-			bool error = false;
+	for (band = 0; band < frames.height; band += FRAME_DIFF_BLOCK) {
+		unsigned int band_end = min(band + FRAME_DIFF_BLOCK,
+					    frames.height);
 
-			if (edges_map[y * width + x])
+		if (blocks)
+			memset(blocks, 0,
+			       DIV_ROUND_UP(frames.width, FRAME_DIFF_BLOCK) *
+			       sizeof(*blocks));
+
+		for (y = band; y < band_end; y++) {
+			const uint8_t *ref = frames.ref_data + y * frames.ref_stride;
+			const uint8_t *cap = frames.cap_data + y * frames.cap_stride;
+			const uint8_t *d = diff;
+
+			pixels += frames.width;
+
+			/* Identical rows only matter for the metrics. */
+			if (!blocks && !memcmp(ref, cap, frames.width * 4))
 				continue;
 
-			for (c = 0; c < 3; c++) {
-				unsigned int diff;
+			frame_absdiff_row(ref, cap, diff, frames.width * 4);
+
+			for (x = 0; x < frames.width; x++) {
+				report->max_error[0] = max(report->max_error[0],
+							   d[FRAME_DIFF_R]);
+				report->max_error[1] = max(report->max_error[1],
+							   d[FRAME_DIFF_G]);
+				report->max_error[2] = max(report->max_error[2],
+							   d[FRAME_DIFF_B]);
+
+				if (d[FRAME_DIFF_R] > tol_r ||
+				    d[FRAME_DIFF_G] > tol_g ||
+				    d[FRAME_DIFF_B] > tol_b) {
+					report->diff_pixels++;
+					report->x1 = min(report->x1, x);
+					report->y1 = min(report->y1, y);
+					report->x2 = max(report->x2, x + 1);
+					report->y2 = max(report->y2, y + 1);
+				}
+
+				if (blocks) {
+					struct frame_diff_block *block =
+						&blocks[x / FRAME_DIFF_BLOCK];
+					unsigned int a = frame_diff_luma(ref);
+					unsigned int b = frame_diff_luma(cap);
+
+					sq_error += d[FRAME_DIFF_R] * d[FRAME_DIFF_R] +
+						    d[FRAME_DIFF_G] * d[FRAME_DIFF_G] +
+						    d[FRAME_DIFF_B] * d[FRAME_DIFF_B];
+
+					block->sum_a += a;
+					block->sum_b += b;
+					block->sum_aa += a * a;
+					block->sum_bb += b * b;
+					block->sum_ab += a * b;
+				}
+
+				ref += 4;
+				cap += 4;
+				d += 4;
+			}
+		}
 
-				/* Compare the reference and capture values. */
-				diff = abs(XR24_COLOR_VALUE(ref_data, ref_stride, x, y, c) -
-					   XR24_COLOR_VALUE(cap_data, cap_stride, x, y, c));
+		if (blocks) {
+			for (x = 0; x < frames.width; x += FRAME_DIFF_BLOCK) {
+				unsigned int n = (band_end - band) *
+					min_t(unsigned int, FRAME_DIFF_BLOCK,
+					      frames.width - x);
 
-				if (diff > color_error_threshold)
-					error = true;
+				ssim_sum += frame_diff_block_ssim(&blocks[x / FRAME_DIFF_BLOCK], n);
+				block_count++;
 			}
+		}
 
-			/* Allow error if coming on or off an edge (on x). */
-			if (error && x >= span && x <= (width - span - 1) &&
-			    edges_map[y * width + (x - span)] !=
-			    edges_map[y * width + (x + span)])
-				continue;
+		if (params->early_exit &&
+		    report->diff_pixels > params->max_diff_pixels &&
+		    band_end < frames.height) {
+			report->complete = false;
+			break;
+		}
+	}
 
-			/* Allow error if coming on or off an edge (on y). */
-			if (error && y >= span && y <= (height - span - 1) &&
-			    edges_map[(y - span) * width + x] !=
-			    edges_map[(y + span) * width + x] && error)
-				continue;
+	free(blocks);
+	free(diff);
 
-			if (error)
-				errors++;
+	if (!report->diff_pixels) {
+		report->x1 = 0;
+		report->y1 = 0;
+	}
 
-			pixels++;
-		}
+	if (params->metrics) {
+		double mse = (double)sq_error / (pixels * 3);
+
+		report->psnr = mse ? 10 * log10(255.0 * 255.0 / mse) : INFINITY;
+		report->ssim = block_count ? ssim_sum / block_count : 1.0;
+	} else {
+		report->psnr = NAN;
+		report->ssim = NAN;
 	}
 
-	free(edges_map);
+	report->match = report->diff_pixels <= params->max_diff_pixels;
+	if (params->metrics && params->min_psnr && report->psnr < params->min_psnr)
+		report->match = false;
+	if (params->metrics && params->min_ssim && report->ssim < params->min_ssim)
+		report->match = false;
+
+	igt_debug("Frame diff %s: %u pixels differ%s in [%u,%u]-[%u,%u], "
+		  "max error r=%u g=%u b=%u, psnr %f dB, ssim %f\n",
+		  report->match ? "matched" : "not matched",
+		  report->diff_pixels, report->complete ? "" : " (at least)",
+		  report->x1, report->y1, report->x2, report->y2,
+		  report->max_error[0], report->max_error[1],
+		  report->max_error[2], report->psnr, report->ssim);
+
+	return report->match;
+}
 
-	error_rate = (double) errors / pixels;
+/**
+ * igt_write_frame_diff_to_png:
+ * @reference: The reference cairo surface
+ * @capture: The captured cairo surface
+ * @params: The parameters given to igt_frame_diff()
+ * @report: The report from a previous igt_frame_diff() on those frames
+ * @suffix: The suffix to give to the png file
+ *
+ * Writes a heatmap of the differences between two frames to a png file, if
+ * frame dumping is enabled. Only the bounding box of the differences from
+ * @report is written out, as a dimmed grayscale copy of the reference with
+ * the pixels exceeding the tolerance from @params highlighted in red,
+ * proportionally to their largest per-channel error. Nothing is written if
+ * the frames did not differ.
+ */
+void igt_write_frame_diff_to_png(cairo_surface_t *reference,
+				 cairo_surface_t *capture,
+				 const struct igt_frame_diff_params *params,
+				 const struct igt_frame_diff_report *report,
+				 const char *suffix)
+{
+	cairo_surface_t *heatmap;
+	struct frame_pair frames;
+	unsigned int width, height, stride, x, y;
+	uint8_t *data;
 
-	if (error_rate < error_rate_threshold)
-		match = true;
+	if (!igt_frame_dump_is_enabled() || !report->diff_pixels)
+		return;
 
-	igt_debug("Checkerboard pattern %s with error rate %f %%\n",
-		  match ? "matched" : "not matched", error_rate * 100);
+	frame_pair_init(&frames, reference, capture);
 
-	return match;
+	width = report->x2 - report->x1;
+	height = report->y2 - report->y1;
+
+	heatmap = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+	igt_assert(cairo_surface_status(heatmap) == CAIRO_STATUS_SUCCESS);
+
+	cairo_surface_flush(heatmap);
+	data = cairo_image_surface_get_data(heatmap);
+	stride = cairo_image_surface_get_stride(heatmap);
+
+	for (y = 0; y < height; y++) {
+		const uint8_t *ref = frames.ref_data +
+			(report->y1 + y) * frames.ref_stride + report->x1 * 4;
+		const uint8_t *cap = frames.cap_data +
+			(report->y1 + y) * frames.cap_stride + report->x1 * 4;
+		uint8_t *px = data + y * stride;
+
+		for (x = 0; x < width; x++) {
+			unsigned int d_r, d_g, d_b;
+
+			/* As igt_frame_diff() tells them apart. */
+			d_r = abs(ref[FRAME_DIFF_R] - cap[FRAME_DIFF_R]);
+			d_g = abs(ref[FRAME_DIFF_G] - cap[FRAME_DIFF_G]);
+			d_b = abs(ref[FRAME_DIFF_B] - cap[FRAME_DIFF_B]);
+
+			if (d_r > params->tolerance[0] ||
+			    d_g > params->tolerance[1] ||
+			    d_b > params->tolerance[2]) {
+				unsigned int error = max(d_r, max(d_g, d_b));
+
+				px[FRAME_DIFF_R] = 128 + error / 2;
+				px[FRAME_DIFF_G] = 0;
+				px[FRAME_DIFF_B] = 0;
+			} else {
+				px[FRAME_DIFF_R] = px[FRAME_DIFF_G] =
+					px[FRAME_DIFF_B] = frame_diff_luma(ref) / 4;
+			}
+			px[3] = 0xff;
+
+			ref += 4;
+			cap += 4;
+			px += 4;
+		}
+	}
+
+	cairo_surface_mark_dirty(heatmap);
+
+	igt_write_frame_to_png(heatmap, -1, "diff", suffix);
+
+	cairo_surface_destroy(heatmap);
 }
@@ -30,6 +30,53 @@
 #include "config.h"
 
 #include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * igt_frame_diff_params:
+ * @tolerance: Largest accepted absolute error for the red, green and blue
+ *             channels
+ * @max_diff_pixels: Number of pixels allowed to exceed the tolerance
+ * @early_exit: Stop comparing as soon as the frames are known not to match
+ * @metrics: Compute the PSNR and SSIM of the capture
+ * @min_psnr: Lowest accepted PSNR in dB, 0 to ignore
+ * @min_ssim: Lowest accepted mean SSIM, 0 to ignore
+ *
+ * Parameters for igt_frame_diff().
+ */
+struct igt_frame_diff_params {
+	uint8_t tolerance[3];
+	unsigned int max_diff_pixels;
+	bool early_exit;
+	bool metrics;
+	double min_psnr;
+	double min_ssim;
+};
+
+/**
+ * igt_frame_diff_report:
+ * @match: Whether the frames matched
+ * @complete: Whether the whole frames were compared
+ * @diff_pixels: Number of pixels exceeding the tolerance
+ * @x1: Left edge of the bounding box of those pixels
+ * @y1: Top edge of the bounding box of those pixels
+ * @x2: Right edge (exclusive) of the bounding box of those pixels
+ * @y2: Bottom edge (exclusive) of the bounding box of those pixels
+ * @max_error: Largest absolute error seen on the red, green and blue channels
+ * @psnr: Peak signal-to-noise ratio in dB
+ * @ssim: Mean structural similarity index of the luma
+ *
+ * Outcome of igt_frame_diff().
+ */
+struct igt_frame_diff_report {
+	bool match;
+	bool complete;
+	unsigned int diff_pixels;
+	unsigned int x1, y1, x2, y2;
+	uint8_t max_error[3];
+	double psnr;
+	double ssim;
+};
 
 bool igt_frame_dump_is_enabled(void);
 void igt_write_compared_frames_to_png(cairo_surface_t *reference,
@@ -40,5 +87,13 @@ bool igt_check_analog_frame_match(cairo_surface_t *reference,
 				  cairo_surface_t *capture);
 bool igt_check_checkerboard_frame_match(cairo_surface_t *reference,
 					cairo_surface_t *capture);
+bool igt_frame_diff(cairo_surface_t *reference, cairo_surface_t *capture,
+		    const struct igt_frame_diff_params *params,
+		    struct igt_frame_diff_report *report);
+void igt_write_frame_diff_to_png(cairo_surface_t *reference,
+				 cairo_surface_t *capture,
+				 const struct igt_frame_diff_params *params,
+				 const struct igt_frame_diff_report *report,
+				 const char *suffix);
 
 #endif
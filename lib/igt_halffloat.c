@@ -24,6 +24,7 @@
 
 #include <assert.h>
 #include <math.h>
+#include <stdbool.h>
 
 #include "igt_halffloat.h"
 #include "igt_x86.h"
@@ -162,6 +163,101 @@ static inline float _half_to_float(uint16_t val)
 	return fi.f;
 }
 
+static void float_to_half(const float *f, uint16_t *h, unsigned int num)
+{
+	for (int i = 0; i < num; i++)
+		h[i] = _float_to_half(f[i]);
+}
+
+static void half_to_float(const uint16_t *h, float *f, unsigned int num)
+{
+	for (int i = 0; i < num; i++)
+		f[i] = _half_to_float(h[i]);
+}
+
+static inline uint16_t _float_to_unorm16(float val)
+{
+	/* Saturates as the SIMD variants do, NaN included. */
+	if (!(val > 0.0f))
+		return 0;
+	if (val >= 1.0f)
+		return 65535;
+
+	return val * 65535.0f + 0.5f;
+}
+
+static inline float _unorm16_to_float(uint16_t val)
+{
+	return ((float) val) / 65535.0f;
+}
+
+#ifndef __aarch64__
+/*
+ * The *_rgbx() variants operate on whole 4 channel pixels and reorder the
+ * channels on the fly so that dst[c] = src[swz[c]], which saves callers
+ * from bouncing every pixel through a temporary vector.
+ */
+static void half_to_float_rgbx(const uint16_t *h, float *f,
+			       unsigned int num_pixels,
+			       const unsigned char *swz)
+{
+	for (int i = 0; i < num_pixels; i++) {
+		f[0] = _half_to_float(h[swz[0]]);
+		f[1] = _half_to_float(h[swz[1]]);
+		f[2] = _half_to_float(h[swz[2]]);
+		f[3] = _half_to_float(h[swz[3]]);
+
+		f += 4;
+		h += 4;
+	}
+}
+
+static void float_to_half_rgbx(const float *f, uint16_t *h,
+			       unsigned int num_pixels,
+			       const unsigned char *swz)
+{
+	for (int i = 0; i < num_pixels; i++) {
+		h[0] = _float_to_half(f[swz[0]]);
+		h[1] = _float_to_half(f[swz[1]]);
+		h[2] = _float_to_half(f[swz[2]]);
+		h[3] = _float_to_half(f[swz[3]]);
+
+		f += 4;
+		h += 4;
+	}
+}
+
+static void unorm16_to_float_rgbx(const uint16_t *u, float *f,
+				  unsigned int num_pixels,
+				  const unsigned char *swz)
+{
+	for (int i = 0; i < num_pixels; i++) {
+		f[0] = _unorm16_to_float(u[swz[0]]);
+		f[1] = _unorm16_to_float(u[swz[1]]);
+		f[2] = _unorm16_to_float(u[swz[2]]);
+		f[3] = _unorm16_to_float(u[swz[3]]);
+
+		f += 4;
+		u += 4;
+	}
+}
+
+static void float_to_unorm16_rgbx(const float *f, uint16_t *u,
+				  unsigned int num_pixels,
+				  const unsigned char *swz)
+{
+	for (int i = 0; i < num_pixels; i++) {
+		u[0] = _float_to_unorm16(f[swz[0]]);
+		u[1] = _float_to_unorm16(f[swz[1]]);
+		u[2] = _float_to_unorm16(f[swz[2]]);
+		u[3] = _float_to_unorm16(f[swz[3]]);
+
+		f += 4;
+		u += 4;
+	}
+}
+#endif
+
 #if defined(__x86_64__) && !defined(__clang__)
 #pragma GCC push_options
 #pragma GCC target("f16c")
@@ -182,18 +278,109 @@ static void half_to_float_f16c(const uint16_t *h, float *f, unsigned int num)
 
 #pragma GCC pop_options
 
-static void float_to_half(const float *f, uint16_t *h, unsigned int num)
+#pragma GCC push_options
+#pragma GCC target("avx,f16c")
+
+/*
+ * Two pixels fit in one ymm register, and vpermilps shuffles within each
+ * 128 bit lane, so a single variable permute applies the swizzle to both.
+ */
+static inline __m256i swizzle_idx_avx(const unsigned char *swz)
 {
-	for (int i = 0; i < num; i++)
-		h[i] = _float_to_half(f[i]);
+	return _mm256_setr_epi32(swz[0], swz[1], swz[2], swz[3],
+				 swz[0], swz[1], swz[2], swz[3]);
 }
 
-static void half_to_float(const uint16_t *h, float *f, unsigned int num)
+static void half_to_float_rgbx_avx(const uint16_t *h, float *f,
+				   unsigned int num_pixels,
+				   const unsigned char *swz)
 {
-	for (int i = 0; i < num; i++)
-		f[i] = _half_to_float(h[i]);
+	const __m256i idx = swizzle_idx_avx(swz);
+
+	for (; num_pixels >= 2; num_pixels -= 2) {
+		__m256 v = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)h));
+
+		_mm256_storeu_ps(f, _mm256_permutevar_ps(v, idx));
+
+		h += 8;
+		f += 8;
+	}
+
+	if (num_pixels) {
+		__m128 v = _mm_cvtph_ps(_mm_loadl_epi64((const __m128i *)h));
+
+		_mm_storeu_ps(f, _mm_permutevar_ps(v, _mm256_castsi256_si128(idx)));
+	}
+}
+
+static void float_to_half_rgbx_avx(const float *f, uint16_t *h,
+				   unsigned int num_pixels,
+				   const unsigned char *swz)
+{
+	const __m256i idx = swizzle_idx_avx(swz);
+
+	for (; num_pixels >= 2; num_pixels -= 2) {
+		__m256 v = _mm256_permutevar_ps(_mm256_loadu_ps(f), idx);
+
+		_mm_storeu_si128((__m128i *)h, _mm256_cvtps_ph(v, 0));
+
+		f += 8;
+		h += 8;
+	}
+
+	if (num_pixels) {
+		__m128 v = _mm_permutevar_ps(_mm_loadu_ps(f),
+					     _mm256_castsi256_si128(idx));
+
+		_mm_storel_epi64((__m128i *)h, _mm_cvtps_ph(v, 0));
+	}
+}
+
+static void unorm16_to_float_rgbx_avx(const uint16_t *u, float *f,
+				      unsigned int num_pixels,
+				      const unsigned char *swz)
+{
+	const __m128i idx = _mm256_castsi256_si128(swizzle_idx_avx(swz));
+	const __m128 scale = _mm_set1_ps(65535.0f);
+
+	for (int i = 0; i < num_pixels; i++) {
+		__m128i v = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *)u));
+		__m128 x = _mm_div_ps(_mm_cvtepi32_ps(v), scale);
+
+		_mm_storeu_ps(f, _mm_permutevar_ps(x, idx));
+
+		u += 4;
+		f += 4;
+	}
+}
+
+static void float_to_unorm16_rgbx_avx(const float *f, uint16_t *u,
+				      unsigned int num_pixels,
+				      const unsigned char *swz)
+{
+	const __m128i idx = _mm256_castsi256_si128(swizzle_idx_avx(swz));
+	const __m128 scale = _mm_set1_ps(65535.0f);
+	const __m128 bias = _mm_set1_ps(0.5f);
+	const __m128 zero = _mm_setzero_ps();
+
+	for (int i = 0; i < num_pixels; i++) {
+		__m128 x = _mm_permutevar_ps(_mm_loadu_ps(f), idx);
+		__m128i v;
+
+		/* Out of range values convert to INT_MIN, clamp first (NaN to 0). */
+		x = _mm_add_ps(_mm_mul_ps(x, scale), bias);
+		x = _mm_min_ps(_mm_max_ps(x, zero), scale);
+		v = _mm_cvttps_epi32(x);
+
+		_mm_storel_epi64((__m128i *)u, _mm_packus_epi32(v, v));
+
+		f += 4;
+		u += 4;
+	}
 }
 
+#pragma GCC pop_options
+
 static void (*resolve_float_to_half(void))(const float *f, uint16_t *h, unsigned int num)
 {
 	if (igt_x86_features() & F16C)
@@ -216,19 +403,201 @@ static void (*resolve_half_to_float(void))(const uint16_t *h, float *f, unsigned
 void igt_half_to_float(const uint16_t *h, float *f, unsigned int num)
 	__attribute__((ifunc("resolve_half_to_float")));
 
+static bool has_avx_f16c(void)
+{
+	unsigned int features = igt_x86_features();
+
+	return (features & (AVX | F16C)) == (AVX | F16C);
+}
+
+static void (*resolve_half_to_float_rgbx(void))(const uint16_t *h, float *f,
+						unsigned int num_pixels,
+						const unsigned char *swz)
+{
+	if (has_avx_f16c())
+		return half_to_float_rgbx_avx;
+
+	return half_to_float_rgbx;
+}
+
+void igt_half_to_float_rgbx(const uint16_t *h, float *f,
+			    unsigned int num_pixels, const unsigned char *swz)
+	__attribute__((ifunc("resolve_half_to_float_rgbx")));
+
+static void (*resolve_float_to_half_rgbx(void))(const float *f, uint16_t *h,
+						unsigned int num_pixels,
+						const unsigned char *swz)
+{
+	if (has_avx_f16c())
+		return float_to_half_rgbx_avx;
+
+	return float_to_half_rgbx;
+}
+
+void igt_float_to_half_rgbx(const float *f, uint16_t *h,
+			    unsigned int num_pixels, const unsigned char *swz)
+	__attribute__((ifunc("resolve_float_to_half_rgbx")));
+
+static void (*resolve_unorm16_to_float_rgbx(void))(const uint16_t *u, float *f,
+						   unsigned int num_pixels,
+						   const unsigned char *swz)
+{
+	if (igt_x86_features() & AVX)
+		return unorm16_to_float_rgbx_avx;
+
+	return unorm16_to_float_rgbx;
+}
+
+void igt_unorm16_to_float_rgbx(const uint16_t *u, float *f,
+			       unsigned int num_pixels, const unsigned char *swz)
+	__attribute__((ifunc("resolve_unorm16_to_float_rgbx")));
+
+static void (*resolve_float_to_unorm16_rgbx(void))(const float *f, uint16_t *u,
+						   unsigned int num_pixels,
+						   const unsigned char *swz)
+{
+	if (igt_x86_features() & AVX)
+		return float_to_unorm16_rgbx_avx;
+
+	return float_to_unorm16_rgbx;
+}
+
+void igt_float_to_unorm16_rgbx(const float *f, uint16_t *u,
+			       unsigned int num_pixels, const unsigned char *swz)
+	__attribute__((ifunc("resolve_float_to_unorm16_rgbx")));
+
+#elif defined(__aarch64__)
+
+#include <arm_neon.h>
+
+/*
+ * NEON (and with it the fp16 <-> fp32 conversion instructions) is part of
+ * the aarch64 baseline, so no runtime dispatch is needed here.
+ */
+static inline uint8x16_t swizzle_idx_neon(const unsigned char *swz)
+{
+	uint8_t idx[16];
+
+	for (int c = 0; c < 4; c++)
+		for (int b = 0; b < 4; b++)
+			idx[c * 4 + b] = swz[c] * 4 + b;
+
+	return vld1q_u8(idx);
+}
+
+static inline float32x4_t swizzle_neon(float32x4_t v, uint8x16_t idx)
+{
+	return vreinterpretq_f32_u8(vqtbl1q_u8(vreinterpretq_u8_f32(v), idx));
+}
+
+void igt_float_to_half(const float *f, uint16_t *h, unsigned int num)
+{
+	float_to_half(f, h, num);
+}
+
+void igt_half_to_float(const uint16_t *h, float *f, unsigned int num)
+{
+	half_to_float(h, f, num);
+}
+
+void igt_half_to_float_rgbx(const uint16_t *h, float *f,
+			    unsigned int num_pixels, const unsigned char *swz)
+{
+	const uint8x16_t idx = swizzle_idx_neon(swz);
+
+	for (int i = 0; i < num_pixels; i++) {
+		float32x4_t v = vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(h)));
+
+		vst1q_f32(f, swizzle_neon(v, idx));
+
+		h += 4;
+		f += 4;
+	}
+}
+
+void igt_float_to_half_rgbx(const float *f, uint16_t *h,
+			    unsigned int num_pixels, const unsigned char *swz)
+{
+	const uint8x16_t idx = swizzle_idx_neon(swz);
+
+	for (int i = 0; i < num_pixels; i++) {
+		float32x4_t v = swizzle_neon(vld1q_f32(f), idx);
+
+		vst1_u16(h, vreinterpret_u16_f16(vcvt_f16_f32(v)));
+
+		f += 4;
+		h += 4;
+	}
+}
+
+void igt_unorm16_to_float_rgbx(const uint16_t *u, float *f,
+			       unsigned int num_pixels, const unsigned char *swz)
+{
+	const uint8x16_t idx = swizzle_idx_neon(swz);
+	const float32x4_t scale = vdupq_n_f32(65535.0f);
+
+	for (int i = 0; i < num_pixels; i++) {
+		float32x4_t v = vcvtq_f32_u32(vmovl_u16(vld1_u16(u)));
+
+		vst1q_f32(f, swizzle_neon(vdivq_f32(v, scale), idx));
+
+		u += 4;
+		f += 4;
+	}
+}
+
+void igt_float_to_unorm16_rgbx(const float *f, uint16_t *u,
+			       unsigned int num_pixels, const unsigned char *swz)
+{
+	const uint8x16_t idx = swizzle_idx_neon(swz);
+	const float32x4_t scale = vdupq_n_f32(65535.0f);
+	const float32x4_t bias = vdupq_n_f32(0.5f);
+
+	for (int i = 0; i < num_pixels; i++) {
+		float32x4_t v = swizzle_neon(vld1q_f32(f), idx);
+
+		v = vaddq_f32(vmulq_f32(v, scale), bias);
+		vst1_u16(u, vqmovn_u32(vcvtq_u32_f32(v)));
+
+		f += 4;
+		u += 4;
+	}
+}
+
 #else
 
 void igt_float_to_half(const float *f, uint16_t *h, unsigned int num)
 {
-	for (int i = 0; i < num; i++)
-		h[i] = _float_to_half(f[i]);
+	float_to_half(f, h, num);
 }
 
 void igt_half_to_float(const uint16_t *h, float *f, unsigned int num)
 {
-	for (int i = 0; i < num; i++)
-		f[i] = _half_to_float(h[i]);
+	half_to_float(h, f, num);
 }
 
-#endif
+void igt_half_to_float_rgbx(const uint16_t *h, float *f,
+			    unsigned int num_pixels, const unsigned char *swz)
+{
+	half_to_float_rgbx(h, f, num_pixels, swz);
+}
 
+void igt_float_to_half_rgbx(const float *f, uint16_t *h,
+			    unsigned int num_pixels, const unsigned char *swz)
+{
+	float_to_half_rgbx(f, h, num_pixels, swz);
+}
+
+void igt_unorm16_to_float_rgbx(const uint16_t *u, float *f,
+			       unsigned int num_pixels, const unsigned char *swz)
+{
+	unorm16_to_float_rgbx(u, f, num_pixels, swz);
+}
+
+void igt_float_to_unorm16_rgbx(const float *f, uint16_t *u,
+			       unsigned int num_pixels, const unsigned char *swz)
+{
+	float_to_unorm16_rgbx(f, u, num_pixels, swz);
+}
+
+#endif
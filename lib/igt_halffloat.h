@@ -25,3 +25,12 @@
 void igt_float_to_half(const float *f, uint16_t *h, unsigned int num);
 void igt_half_to_float(const uint16_t *h, float *f, unsigned int num);
 
+void igt_half_to_float_rgbx(const uint16_t *h, float *f,
+			    unsigned int num_pixels, const unsigned char *swz);
+void igt_float_to_half_rgbx(const float *f, uint16_t *h,
+			    unsigned int num_pixels, const unsigned char *swz);
+void igt_unorm16_to_float_rgbx(const uint16_t *u, float *f,
+			       unsigned int num_pixels, const unsigned char *swz);
+void igt_float_to_unorm16_rgbx(const float *f, uint16_t *u,
+			       unsigned int num_pixels, const unsigned char *swz);
+
@@ -21,8 +21,13 @@
  * IN THE SOFTWARE.
  */
 
+#include <math.h>
+#include <string.h>
+
+#include "igt_aux.h"
 #include "igt_core.h"
 #include "igt_matrix.h"
+#include "igt_x86.h"
 
 /**
  * SECTION:igt_matrix
@@ -139,3 +144,386 @@ struct igt_mat4 igt_matrix_multiply(const struct igt_mat4 *a,
 
 	return ret;
 }
+
+/**
+ * igt_matrix_stages_identity:
+ *
+ * Returns:
+ * Conversion stages leaving the vectors untouched, with unit scales, zero
+ * offsets and no clamping.
+ */
+struct igt_matrix_stages igt_matrix_stages_identity(void)
+{
+	static const struct igt_matrix_stages ret = {
+		.in_scale.d = { 1.0f, 1.0f, 1.0f, 1.0f },
+		.out_scale.d = { 1.0f, 1.0f, 1.0f, 1.0f },
+		.out_min.d = { -INFINITY, -INFINITY, -INFINITY, -INFINITY },
+		.out_max.d = { INFINITY, INFINITY, INFINITY, INFINITY },
+	};
+
+	return ret;
+}
+
+/*
+ * The whole pipeline, folded into out = clamp(a * in + b, lo, hi), with
+ * the contribution of missing input components (constant 1.0) in b.
+ */
+struct batch_transform {
+	float a[4][4]; /* [row][col] */
+	float b[4];
+	float lo[4];
+	float hi[4];
+};
+
+/* Elements processed at once when converting from or to planar blocks */
+#define BATCH_BLOCK 64
+
+static void batch_transform_init(struct batch_transform *t,
+				 const struct igt_mat4 *m,
+				 const struct igt_matrix_stages *stages,
+				 const struct igt_vec4_array *src)
+{
+	struct igt_matrix_stages id = igt_matrix_stages_identity();
+
+	if (!stages)
+		stages = &id;
+
+	for (int row = 0; row < 4; row++) {
+		float os = stages->out_scale.d[row];
+		float b = 0.0f;
+
+		for (int col = 0; col < 4; col++) {
+			float mv = m->d[m(row, col)];
+			float in_const = stages->in_offset.d[col];
+
+			if (src->d[col]) {
+				t->a[row][col] = os * mv * stages->in_scale.d[col];
+			} else {
+				t->a[row][col] = 0.0f;
+				in_const += stages->in_scale.d[col];
+			}
+
+			b += mv * in_const;
+		}
+
+		t->b[row] = os * b + stages->out_offset.d[row];
+		t->lo[row] = stages->out_min.d[row];
+		t->hi[row] = stages->out_max.d[row];
+	}
+}
+
+static inline float batch_clamp(float v, float lo, float hi)
+{
+	return v < lo ? lo : v > hi ? hi : v;
+}
+
+static void soa_transform(const struct batch_transform *t,
+			  float *const in[4], float *const out[4],
+			  unsigned int start, unsigned int num)
+{
+	for (unsigned int i = start; i < num; i++) {
+		float v[4];
+
+		for (int c = 0; c < 4; c++)
+			v[c] = in[c] ? in[c][i] : 0.0f;
+
+		for (int row = 0; row < 4; row++) {
+			if (!out[row])
+				continue;
+
+			out[row][i] = batch_clamp(t->b[row] +
+						  t->a[row][0] * v[0] +
+						  t->a[row][1] * v[1] +
+						  t->a[row][2] * v[2] +
+						  t->a[row][3] * v[3],
+						  t->lo[row], t->hi[row]);
+		}
+	}
+}
+
+#if defined(__SSE2__) || defined(__ARM_NEON)
+
+#if defined(__SSE2__)
+#include <xmmintrin.h>
+
+typedef __m128 batch_vec;
+#define batch_set1(x)		_mm_set1_ps(x)
+#define batch_load(p)		_mm_loadu_ps(p)
+#define batch_store(p, v)	_mm_storeu_ps(p, v)
+#define batch_madd(acc, a, b)	_mm_add_ps(acc, _mm_mul_ps(a, b))
+#define batch_clampv(v, lo, hi)	_mm_min_ps(_mm_max_ps(v, lo), hi)
+#define batch_lane(v, i)	_mm_shuffle_ps(v, v, _MM_SHUFFLE(i, i, i, i))
+#else
+#include <arm_neon.h>
+
+typedef float32x4_t batch_vec;
+#define batch_set1(x)		vdupq_n_f32(x)
+#define batch_load(p)		vld1q_f32(p)
+#define batch_store(p, v)	vst1q_f32(p, v)
+#define batch_madd(acc, a, b)	vmlaq_f32(acc, a, b)
+#define batch_clampv(v, lo, hi)	vminq_f32(vmaxq_f32(v, lo), hi)
+#define batch_lane(v, i)	vdupq_n_f32(vgetq_lane_f32(v, i))
+#endif
+
+/* Four elements of every plane at a time. */
+static void soa_transform_simd(const struct batch_transform *t,
+			       float *const in[4], float *const out[4],
+			       unsigned int num)
+{
+	batch_vec a[4][4], b[4], lo[4], hi[4];
+	unsigned int i;
+
+	for (int row = 0; row < 4; row++) {
+		for (int col = 0; col < 4; col++)
+			a[row][col] = batch_set1(t->a[row][col]);
+		b[row] = batch_set1(t->b[row]);
+		lo[row] = batch_set1(t->lo[row]);
+		hi[row] = batch_set1(t->hi[row]);
+	}
+
+	for (i = 0; i + 4 <= num; i += 4) {
+		batch_vec v[4];
+
+		for (int c = 0; c < 4; c++)
+			v[c] = in[c] ? batch_load(&in[c][i]) : batch_set1(0.0f);
+
+		for (int row = 0; row < 4; row++) {
+			batch_vec acc = b[row];
+
+			if (!out[row])
+				continue;
+
+			for (int col = 0; col < 4; col++)
+				acc = batch_madd(acc, a[row][col], v[col]);
+
+			batch_store(&out[row][i],
+				    batch_clampv(acc, lo[row], hi[row]));
+		}
+	}
+
+	soa_transform(t, in, out, i, num);
+}
+
+/* One element at a time, as a 4x4 matrix-vector product. */
+static void aos_transform_simd(const struct batch_transform *t,
+			       const float *in, float *out, unsigned int num)
+{
+	batch_vec col[4], b, lo, hi;
+	float tmp[4];
+	unsigned int i;
+
+	for (int c = 0; c < 4; c++) {
+		for (int row = 0; row < 4; row++)
+			tmp[row] = t->a[row][c];
+		col[c] = batch_load(tmp);
+	}
+	b = batch_load(t->b);
+	lo = batch_load(t->lo);
+	hi = batch_load(t->hi);
+
+	for (i = 0; i < num; i++) {
+		batch_vec v = batch_load(&in[i * 4]);
+		batch_vec acc = b;
+
+		acc = batch_madd(acc, col[0], batch_lane(v, 0));
+		acc = batch_madd(acc, col[1], batch_lane(v, 1));
+		acc = batch_madd(acc, col[2], batch_lane(v, 2));
+		acc = batch_madd(acc, col[3], batch_lane(v, 3));
+
+		batch_store(&out[i * 4], batch_clampv(acc, lo, hi));
+	}
+}
+
+#else
+
+static void soa_transform_simd(const struct batch_transform *t,
+			       float *const in[4], float *const out[4],
+			       unsigned int num)
+{
+	soa_transform(t, in, out, 0, num);
+}
+
+static void aos_transform_simd(const struct batch_transform *t,
+			       const float *in, float *out, unsigned int num)
+{
+	for (unsigned int i = 0; i < num; i++) {
+		const float *v = &in[i * 4];
+		float r[4];
+
+		for (int row = 0; row < 4; row++)
+			r[row] = batch_clamp(t->b[row] +
+					     t->a[row][0] * v[0] +
+					     t->a[row][1] * v[1] +
+					     t->a[row][2] * v[2] +
+					     t->a[row][3] * v[3],
+					     t->lo[row], t->hi[row]);
+
+		memcpy(&out[i * 4], r, sizeof(r));
+	}
+}
+
+#endif
+
+#if defined(__x86_64__) && !defined(__clang__)
+#pragma GCC push_options
+#pragma GCC target("avx")
+
+#include <immintrin.h>
+
+/* Eight elements of every plane at a time. */
+static void soa_transform_avx(const struct batch_transform *t,
+			      float *const in[4], float *const out[4],
+			      unsigned int num)
+{
+	__m256 a[4][4], b[4], lo[4], hi[4];
+	unsigned int i;
+
+	for (int row = 0; row < 4; row++) {
+		for (int col = 0; col < 4; col++)
+			a[row][col] = _mm256_set1_ps(t->a[row][col]);
+		b[row] = _mm256_set1_ps(t->b[row]);
+		lo[row] = _mm256_set1_ps(t->lo[row]);
+		hi[row] = _mm256_set1_ps(t->hi[row]);
+	}
+
+	for (i = 0; i + 8 <= num; i += 8) {
+		__m256 v[4];
+
+		for (int c = 0; c < 4; c++)
+			v[c] = in[c] ? _mm256_loadu_ps(&in[c][i]) :
+				       _mm256_setzero_ps();
+
+		for (int row = 0; row < 4; row++) {
+			__m256 acc = b[row];
+
+			if (!out[row])
+				continue;
+
+			for (int col = 0; col < 4; col++)
+				acc = _mm256_add_ps(acc,
+						    _mm256_mul_ps(a[row][col],
+								  v[col]));
+
+			_mm256_storeu_ps(&out[row][i],
+					 _mm256_min_ps(_mm256_max_ps(acc, lo[row]),
+						       hi[row]));
+		}
+	}
+
+	soa_transform(t, in, out, i, num);
+}
+
+#pragma GCC pop_options
+
+static void (*resolve_soa_transform(void))(const struct batch_transform *t,
+					   float *const in[4],
+					   float *const out[4],
+					   unsigned int num)
+{
+	if (igt_x86_features() & AVX)
+		return soa_transform_avx;
+
+	return soa_transform_simd;
+}
+
+static void soa_transform_best(const struct batch_transform *t,
+			       float *const in[4], float *const out[4],
+			       unsigned int num)
+	__attribute__((ifunc("resolve_soa_transform")));
+
+#else
+
+static void soa_transform_best(const struct batch_transform *t,
+			       float *const in[4], float *const out[4],
+			       unsigned int num)
+{
+	soa_transform_simd(t, in, out, num);
+}
+
+#endif
+
+static bool is_interleaved4(const struct igt_vec4_array *array)
+{
+	if (array->stride != 4)
+		return false;
+
+	for (int c = 0; c < 4; c++)
+		if (array->d[c] != array->d[0] + c)
+			return false;
+
+	return true;
+}
+
+/**
+ * igt_matrix_transform_batch:
+ * @m: The matrix
+ * @stages: Conversion stages fused with the transform, or NULL
+ * @src: The input vectors
+ * @dst: The output vectors
+ * @num: The number of vectors
+ *
+ * Transform @num vectors by the matrix @m, as igt_matrix_transform() would,
+ * applying the optional input and output conversion @stages on the way. The
+ * stages are folded into the matrix, so the whole pipeline costs a single
+ * pass over memory. Input and output can be planar, interleaved or any mix
+ * of both, see #igt_vec4_array. @src and @dst may be the same array.
+ */
+void igt_matrix_transform_batch(const struct igt_mat4 *m,
+				const struct igt_matrix_stages *stages,
+				const struct igt_vec4_array *src,
+				const struct igt_vec4_array *dst,
+				unsigned int num)
+{
+	struct batch_transform t;
+	float block[2][4][BATCH_BLOCK];
+
+	batch_transform_init(&t, m, stages, src);
+
+	if (is_interleaved4(src) && is_interleaved4(dst)) {
+		aos_transform_simd(&t, src->d[0], dst->d[0], num);
+		return;
+	}
+
+	if (src->stride == 1 && dst->stride == 1) {
+		soa_transform_best(&t, src->d, dst->d, num);
+		return;
+	}
+
+	/*
+	 * Otherwise go through cache-resident planar blocks, so that the
+	 * transform itself still runs on full vectors.
+	 */
+	for (unsigned int i = 0; i < num; i += BATCH_BLOCK) {
+		unsigned int n = min_t(unsigned int, num - i, BATCH_BLOCK);
+		float *in[4], *out[4];
+
+		for (int c = 0; c < 4; c++) {
+			in[c] = NULL;
+			out[c] = NULL;
+
+			if (src->d[c]) {
+				const float *s = src->d[c] + i * src->stride;
+
+				in[c] = block[0][c];
+				for (unsigned int j = 0; j < n; j++)
+					in[c][j] = s[j * src->stride];
+			}
+
+			if (dst->d[c])
+				out[c] = block[1][c];
+		}
+
+		soa_transform_best(&t, in, out, n);
+
+		for (int c = 0; c < 4; c++) {
+			float *d;
+
+			if (!out[c])
+				continue;
+
+			d = dst->d[c] + i * dst->stride;
+			for (unsigned int j = 0; j < n; j++)
+				d[j * dst->stride] = out[c][j];
+		}
+	}
+}
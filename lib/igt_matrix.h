@@ -44,6 +44,49 @@ struct igt_mat4 {
 	float d[16];
 };
 
+/**
+ * igt_matrix_stages:
+ * @in_scale: Per component scale applied to the input vectors
+ * @in_offset: Per component offset added to the scaled input vectors
+ * @out_scale: Per component scale applied to the transformed vectors
+ * @out_offset: Per component offset added to the scaled output vectors
+ * @out_min: Per component lower bound of the output vectors
+ * @out_max: Per component upper bound of the output vectors
+ *
+ * Conversion stages fused with a matrix transform by
+ * igt_matrix_transform_batch(), which computes for each vector v:
+ *
+ * clamp(out_scale * (M * (in_scale * v + in_offset)) + out_offset,
+ *       out_min, out_max)
+ *
+ * Start from igt_matrix_stages_identity() and only override the stages
+ * that are needed.
+ */
+struct igt_matrix_stages {
+	struct igt_vec4 in_scale;
+	struct igt_vec4 in_offset;
+	struct igt_vec4 out_scale;
+	struct igt_vec4 out_offset;
+	struct igt_vec4 out_min;
+	struct igt_vec4 out_max;
+};
+
+/**
+ * igt_vec4_array:
+ * @d: Pointers to the first element of each component, or NULL
+ * @stride: Distance in floats between two consecutive elements of a component
+ *
+ * Describes an array of 4 component float vectors for
+ * igt_matrix_transform_batch(). Planar arrays have a stride of 1 and one
+ * pointer per plane, interleaved arrays have a stride equal to the number of
+ * components and pointers to consecutive floats. A missing input component
+ * reads as 1.0, a missing output component is not written.
+ */
+struct igt_vec4_array {
+	float *d[4];
+	unsigned int stride;
+};
+
 #define m(row, col) ((col) * 4 + (row))
 
 void igt_matrix_print(const struct igt_mat4 *m);
@@ -52,6 +95,52 @@ struct igt_mat4 igt_matrix_scale(float x, float y, float z);
 struct igt_mat4 igt_matrix_translate(float x, float y, float z);
 struct igt_mat4 igt_matrix_multiply(const struct igt_mat4 *a,
 				    const struct igt_mat4 *b);
+struct igt_matrix_stages igt_matrix_stages_identity(void);
+void igt_matrix_transform_batch(const struct igt_mat4 *m,
+				const struct igt_matrix_stages *stages,
+				const struct igt_vec4_array *src,
+				const struct igt_vec4_array *dst,
+				unsigned int num);
+
+/**
+ * igt_vec4_array_interleaved:
+ * @ptr: The first element
+ * @components: The number of components per element, between 1 and 4
+ *
+ * Returns:
+ * An array description for interleaved components.
+ */
+static inline struct igt_vec4_array
+igt_vec4_array_interleaved(float *ptr, unsigned int components)
+{
+	struct igt_vec4_array ret = { .stride = components };
+
+	for (unsigned int c = 0; c < components; c++)
+		ret.d[c] = ptr + c;
+
+	return ret;
+}
+
+/**
+ * igt_vec4_array_planar:
+ * @c0: The first plane
+ * @c1: The second plane, or NULL
+ * @c2: The third plane, or NULL
+ * @c3: The fourth plane, or NULL
+ *
+ * Returns:
+ * An array description for planar components.
+ */
+static inline struct igt_vec4_array
+igt_vec4_array_planar(float *c0, float *c1, float *c2, float *c3)
+{
+	struct igt_vec4_array ret = {
+		.d = { c0, c1, c2, c3 },
+		.stride = 1,
+	};
+
+	return ret;
+}
 
 /**
  * igt_matrix_transform:
@@ -0,0 +1,244 @@
+/*
+ * Copyright © 2022 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "igt_core.h"
+
+#include "i915_drm.h"
+#include "i915/perf.h"
+
+#define ARRAY_SIZE(arr) (sizeof(arr)/sizeof(arr[0]))
+
+#define REPORT_SIZE 256
+#define N_REPORTS 4096
+#define BENCH_REPORTS (1 << 20)
+
+/* Every dword of a report grows by this much from one report to the next,
+ * wrapping around every couple of reports.
+ */
+#define DWORD_STEP 0x9e3779b9u
+
+/* Byte offsets of the 40bit A counters of A32u40_A4u32_B8_C8 */
+#define A40_LOW_OFF 16
+#define A40_HIGH_OFF 160
+#define N_A40 32
+
+static const struct {
+	uint32_t graphics_ver;
+	int oa_format;
+	unsigned int n_deltas;
+} formats[] = {
+	{ 7, I915_OA_FORMAT_A13, 14 },
+	{ 7, I915_OA_FORMAT_A29, 30 },
+	{ 7, I915_OA_FORMAT_A13_B8_C8, 30 },
+	{ 7, I915_OA_FORMAT_A45_B8_C8, 62 },
+	{ 7, I915_OA_FORMAT_B4_C8, 13 },
+	{ 7, I915_OA_FORMAT_B4_C8_A16, 29 },
+	{ 7, I915_OA_FORMAT_C4_B8, 13 },
+	{ 8, I915_OA_FORMAT_A12, 14 },
+	{ 8, I915_OA_FORMAT_A12_B8_C8, 30 },
+	{ 8, I915_OA_FORMAT_A32u40_A4u32_B8_C8, 54 },
+	{ 8, I915_OA_FORMAT_C4_B8, 14 },
+	{ 12, I915_OA_FORMAT_A32u40_A4u32_B8_C8, 54 },
+};
+
+struct reports {
+	uint8_t *data;
+	const struct drm_i915_perf_record_header **records;
+	uint32_t n_records;
+};
+
+/*
+ * With random high bytes for the 40bit A counters, which otherwise are the
+ * dwords of other counters.
+ */
+static void create_reports(struct reports *reports, uint32_t n_records,
+			   bool a40)
+{
+	size_t record_size = sizeof(struct drm_i915_perf_record_header) +
+			     REPORT_SIZE;
+
+	reports->data = malloc(n_records * record_size);
+	reports->records = malloc(n_records * sizeof(*reports->records));
+	reports->n_records = n_records;
+	igt_assert(reports->data && reports->records);
+
+	srand(0xdeadbeef);
+	for (uint32_t r = 0; r < n_records; r++) {
+		struct drm_i915_perf_record_header *header =
+			(void *)(reports->data + r * record_size);
+		uint32_t *report = (uint32_t *)(header + 1);
+		uint8_t *high = (uint8_t *)report + A40_HIGH_OFF;
+
+		header->type = DRM_I915_PERF_RECORD_SAMPLE;
+		header->size = record_size;
+
+		for (unsigned int i = 0; i < REPORT_SIZE / 4; i++)
+			report[i] = r * DWORD_STEP + i * 0x01000193u;
+		for (unsigned int i = 0; a40 && i < N_A40; i++)
+			high[i] = rand();
+
+		reports->records[r] = header;
+	}
+}
+
+static void free_reports(struct reports *reports)
+{
+	free(reports->records);
+	free(reports->data);
+}
+
+static uint64_t a40_delta(const struct reports *reports, unsigned int i)
+{
+	uint64_t delta = 0;
+
+	for (uint32_t r = 1; r < reports->n_records; r++) {
+		const uint8_t *report0 = (const uint8_t *)(reports->records[r - 1] + 1);
+		const uint8_t *report1 = (const uint8_t *)(reports->records[r] + 1);
+		uint64_t value0 = ((const uint32_t *)(report0 + A40_LOW_OFF))[i] |
+				  (uint64_t)report0[A40_HIGH_OFF + i] << 32;
+		uint64_t value1 = ((const uint32_t *)(report1 + A40_LOW_OFF))[i] |
+				  (uint64_t)report1[A40_HIGH_OFF + i] << 32;
+
+		delta += (value1 - value0) & ((1ull << 40) - 1);
+	}
+
+	return delta;
+}
+
+static void test_formats(void)
+{
+	uint64_t u32_delta = (uint64_t)(N_REPORTS - 1) * DWORD_STEP;
+	struct reports reports, reports_a40;
+
+	create_reports(&reports, N_REPORTS, false);
+	create_reports(&reports_a40, N_REPORTS, true);
+
+	for (unsigned int f = 0; f < ARRAY_SIZE(formats); f++) {
+		struct intel_perf_devinfo devinfo = {
+			.graphics_ver = formats[f].graphics_ver,
+		};
+		struct intel_perf_accumulator acc = {};
+		unsigned int n_a40 = 0, n_ts = devinfo.graphics_ver >= 8 ? 2 : 1;
+		const struct reports *r = &reports;
+
+		if (formats[f].oa_format == I915_OA_FORMAT_A32u40_A4u32_B8_C8) {
+			n_a40 = N_A40;
+			r = &reports_a40;
+		}
+
+		intel_perf_accumulate_records(&acc, &devinfo, formats[f].oa_format,
+					      r->records, r->n_records);
+
+		for (unsigned int i = 0; i < INTEL_PERF_MAX_RAW_OA_COUNTERS; i++) {
+			uint64_t expected;
+
+			if (i >= formats[f].n_deltas)
+				expected = 0;
+			else if (i >= n_ts && i < n_ts + n_a40)
+				expected = a40_delta(r, i - n_ts);
+			else
+				expected = u32_delta;
+
+			igt_assert_f(acc.deltas[i] == expected,
+				     "format %d, gen%u: delta %u = %"PRIu64", expected %"PRIu64"\n",
+				     formats[f].oa_format, devinfo.graphics_ver,
+				     i, acc.deltas[i], expected);
+		}
+	}
+
+	free_reports(&reports);
+	free_reports(&reports_a40);
+}
+
+static void test_pairs(void)
+{
+	struct intel_perf_devinfo devinfo = { .graphics_ver = 12 };
+	struct intel_perf_accumulator run = {}, pairs = {}, pair;
+	struct reports reports;
+
+	create_reports(&reports, N_REPORTS, true);
+
+	/* A run accumulates the same as each of its pairs. */
+	intel_perf_accumulate_records(&run, &devinfo,
+				      I915_OA_FORMAT_A32u40_A4u32_B8_C8,
+				      reports.records, reports.n_records);
+	for (uint32_t r = 1; r < reports.n_records; r++) {
+		intel_perf_accumulate_reports(&pair, I915_OA_FORMAT_A32u40_A4u32_B8_C8,
+					      reports.records[r - 1],
+					      reports.records[r]);
+		for (unsigned int i = 0; i < INTEL_PERF_MAX_RAW_OA_COUNTERS; i++)
+			pairs.deltas[i] += pair.deltas[i];
+	}
+	igt_assert(!memcmp(&run, &pairs, sizeof(run)));
+
+	free_reports(&reports);
+}
+
+static void test_benchmark(void)
+{
+	struct intel_perf_accumulator acc = {};
+	struct timespec start = {};
+	struct reports reports;
+	uint64_t elapsed;
+
+	create_reports(&reports, BENCH_REPORTS, true);
+
+	for (unsigned int f = 0; f < ARRAY_SIZE(formats); f++) {
+		struct intel_perf_devinfo devinfo = {
+			.graphics_ver = formats[f].graphics_ver,
+		};
+
+		if (formats[f].oa_format != I915_OA_FORMAT_A45_B8_C8 &&
+		    formats[f].oa_format != I915_OA_FORMAT_A32u40_A4u32_B8_C8)
+			continue;
+
+		memset(&start, 0, sizeof(start));
+		igt_nsec_elapsed(&start);
+		intel_perf_accumulate_records(&acc, &devinfo, formats[f].oa_format,
+					      reports.records, reports.n_records);
+		elapsed = igt_nsec_elapsed(&start);
+
+		igt_info("format %d, gen%u: %.1f ns per report, %.1f M reports/s\n",
+			 formats[f].oa_format, devinfo.graphics_ver,
+			 (double)elapsed / BENCH_REPORTS,
+			 BENCH_REPORTS * 1e3 / elapsed);
+	}
+
+	free_reports(&reports);
+}
+
+igt_main
+{
+	igt_subtest("formats")
+		test_formats();
+
+	igt_subtest("pairs")
+		test_pairs();
+
+	igt_subtest("benchmark")
+		test_benchmark();
+}
@@ -36,5 +36,10 @@ igt_main
 		internal_assert(is_aligned(struct intel_perf_record_version));
 		internal_assert(is_aligned(struct intel_perf_record_device_info));
 		internal_assert(is_aligned(struct intel_perf_record_timestamp_correlation));
+		internal_assert(is_aligned(struct intel_perf_record_chunk));
+		internal_assert(is_aligned(struct intel_perf_record_chunk_index));
+		internal_assert(is_aligned(struct intel_perf_record_context_switch));
+		internal_assert(is_aligned(struct intel_perf_record_index));
+		internal_assert(is_aligned(struct intel_perf_record_footer));
 	}
 }
@@ -0,0 +1,363 @@
+/*
+ * Copyright © 2022 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "igt_core.h"
+
+#include "i915/perf_data_reader.h"
+
+/* Synthetic Tigerlake recording, 12.5MHz timestamps */
+#define DEVICE_ID 0x9a49
+#define TS_FREQUENCY 12500000
+#define NS_PER_TICK 80
+#define CPU_BASE 1000000000000ull
+/* Wraps the 36bits timestamp register after 2^33 ticks */
+#define GPU_BASE ((1ull << 36) - (1ull << 33))
+#define REPORT_SPACING 30000
+
+struct recording {
+	unsigned int n_reports;
+	unsigned int ctx_run;
+	unsigned int corr_every;
+	/* Indexed recording, with chunks of that many reports */
+	unsigned int chunk_reports;
+};
+
+static uint64_t report_gpu_ts(unsigned int i)
+{
+	return GPU_BASE + REPORT_SPACING + (uint64_t)i * REPORT_SPACING;
+}
+
+static uint64_t cpu_ts(uint64_t gpu_ts)
+{
+	return CPU_BASE + (gpu_ts - GPU_BASE) * NS_PER_TICK;
+}
+
+static void write_record(FILE *file, uint32_t type,
+			 const void *data, size_t size)
+{
+	struct drm_i915_perf_record_header header = {
+		.type = type,
+		.size = sizeof(header) + size,
+	};
+
+	igt_assert_eq(fwrite(&header, sizeof(header), 1, file), 1);
+	igt_assert_eq(fwrite(data, size, 1, file), 1);
+}
+
+static void write_correlation(FILE *file, uint64_t gpu_ts)
+{
+	struct intel_perf_record_timestamp_correlation corr = {
+		.cpu_timestamp = cpu_ts(gpu_ts),
+		.gpu_timestamp = gpu_ts & ((1ull << 36) - 1),
+	};
+
+	write_record(file, INTEL_PERF_RECORD_TYPE_TIMESTAMP_CORRELATION,
+		     &corr, sizeof(corr));
+}
+
+static void write_report(FILE *file, const struct recording *rec,
+			 unsigned int i)
+{
+	uint32_t report[64] = {};
+
+	report[0] = 1 << 16; /* Context id valid */
+	report[1] = report_gpu_ts(i);
+	report[2] = i / rec->ctx_run;
+	write_record(file, DRM_I915_PERF_RECORD_SAMPLE,
+		     report, sizeof(report));
+}
+
+/* Uncompressed chunks, followed by the index and the footer. */
+static void write_chunks(FILE *file, const struct recording *rec)
+{
+	unsigned int n_chunks = (rec->n_reports + rec->chunk_reports - 1) / rec->chunk_reports;
+	unsigned int n_corrs = (rec->n_reports + rec->corr_every - 1) / rec->corr_every + 1;
+	struct intel_perf_record_chunk_index *chunks;
+	struct intel_perf_record_timestamp_correlation *corrs;
+	struct intel_perf_record_index index = {
+		.n_chunks = n_chunks,
+		.n_correlations = n_corrs,
+	};
+	struct intel_perf_record_footer footer = {
+		.magic = INTEL_PERF_RECORD_FOOTER_MAGIC,
+	};
+	struct drm_i915_perf_record_header header = {};
+	unsigned int c, i;
+
+	chunks = calloc(n_chunks, sizeof(*chunks));
+	corrs = calloc(n_corrs, sizeof(*corrs));
+	igt_assert(chunks && corrs);
+
+	for (c = 0; c < n_chunks; c++) {
+		unsigned int first = c * rec->chunk_reports;
+		unsigned int last = first + rec->chunk_reports;
+		struct intel_perf_record_chunk *chunk = &chunks[c].chunk;
+
+		if (last > rec->n_reports)
+			last = rec->n_reports;
+
+		chunk->gpu_ts_begin = report_gpu_ts(first);
+		chunk->gpu_ts_end = report_gpu_ts(last - 1);
+		chunk->size = (last - first) * (sizeof(header) + 256);
+		chunk->stored = chunk->size;
+		chunk->compression = INTEL_PERF_RECORD_COMPRESSION_NONE;
+		chunk->n_records = last - first;
+
+		chunks[c].offset = ftell(file);
+		write_record(file, INTEL_PERF_RECORD_TYPE_CHUNK,
+			     chunk, sizeof(*chunk));
+		for (i = first; i < last; i++)
+			write_report(file, rec, i);
+	}
+
+	for (i = 0; i < n_corrs - 1; i++) {
+		uint64_t gpu_ts = report_gpu_ts(i * rec->corr_every) -
+				  REPORT_SPACING / 2;
+
+		corrs[i].cpu_timestamp = cpu_ts(gpu_ts);
+		corrs[i].gpu_timestamp = gpu_ts & ((1ull << 36) - 1);
+	}
+	corrs[i].cpu_timestamp = cpu_ts(report_gpu_ts(rec->n_reports));
+	corrs[i].gpu_timestamp = report_gpu_ts(rec->n_reports) & ((1ull << 36) - 1);
+
+	footer.index_offset = ftell(file);
+	header.type = INTEL_PERF_RECORD_TYPE_INDEX;
+	header.size = sizeof(header) + sizeof(index);
+	igt_assert_eq(fwrite(&header, sizeof(header), 1, file), 1);
+	igt_assert_eq(fwrite(&index, sizeof(index), 1, file), 1);
+	igt_assert_eq(fwrite(chunks, sizeof(*chunks), n_chunks, file), n_chunks);
+	igt_assert_eq(fwrite(corrs, sizeof(*corrs), n_corrs, file), n_corrs);
+	write_record(file, INTEL_PERF_RECORD_TYPE_FOOTER,
+		     &footer, sizeof(footer));
+
+	free(corrs);
+	free(chunks);
+}
+
+static int create_recording(const struct recording *rec)
+{
+	struct intel_perf_record_version version = {
+		.version = rec->chunk_reports ?
+			INTEL_PERF_RECORD_VERSION_INDEXED :
+			INTEL_PERF_RECORD_VERSION,
+	};
+	struct intel_perf_record_device_info info = {
+		.timestamp_frequency = TS_FREQUENCY,
+		.device_id = DEVICE_ID,
+		.oa_format = I915_OA_FORMAT_A32u40_A4u32_B8_C8,
+	};
+	struct drm_i915_query_topology_info topology = {};
+	FILE *file = tmpfile();
+	unsigned int i;
+	int fd;
+
+	igt_assert(file);
+
+	write_record(file, INTEL_PERF_RECORD_TYPE_VERSION,
+		     &version, sizeof(version));
+	write_record(file, INTEL_PERF_RECORD_TYPE_DEVICE_INFO,
+		     &info, sizeof(info));
+	write_record(file, INTEL_PERF_RECORD_TYPE_DEVICE_TOPOLOGY,
+		     &topology, sizeof(topology));
+
+	if (rec->chunk_reports) {
+		write_chunks(file, rec);
+	} else {
+		for (i = 0; i < rec->n_reports; i++) {
+			if (i % rec->corr_every == 0)
+				write_correlation(file, report_gpu_ts(i) -
+						  REPORT_SPACING / 2);
+			write_report(file, rec, i);
+		}
+		write_correlation(file, report_gpu_ts(i));
+	}
+
+	igt_assert_eq(fflush(file), 0);
+	fd = dup(fileno(file));
+	fclose(file);
+
+	return fd;
+}
+
+static void check_timelines(const struct intel_perf_data_reader *reader,
+			    const struct recording *rec)
+{
+	uint32_t i;
+
+	igt_assert_eq(reader->n_records, rec->n_reports);
+	igt_assert_eq(reader->n_timelines, rec->n_reports / rec->ctx_run);
+
+	/* The last item does not end on a context switch. */
+	for (i = 0; i + 1 < reader->n_timelines; i++) {
+		const struct intel_perf_timeline_item *item =
+			&reader->timelines[i];
+
+		igt_assert_eq(item->hw_id, i);
+		igt_assert_eq_u64(item->cpu_ts_start,
+				  cpu_ts(report_gpu_ts(item->record_start)));
+		igt_assert_eq_u64(item->cpu_ts_end,
+				  cpu_ts(report_gpu_ts(item->record_end)));
+	}
+}
+
+static void test_correlation(void)
+{
+	/* Several 32bits and one 36bits timestamp wraparounds */
+	const struct recording rec = {
+		.n_reports = 20000,
+		.ctx_run = 10,
+		.corr_every = 1000,
+	};
+	struct intel_perf_data_reader reader;
+	int fd = create_recording(&rec);
+
+	igt_assert_f(intel_perf_data_reader_init(&reader, fd),
+		     "%s\n", reader.error_msg);
+	check_timelines(&reader, &rec);
+
+	intel_perf_data_reader_fini(&reader);
+	close(fd);
+}
+
+/* Windows of a streamed recording add up to the whole recording. */
+static void test_stream(const struct recording *rec, size_t max_size,
+			unsigned int expected_windows)
+{
+	struct intel_perf_data_reader reader;
+	unsigned int n_windows = 0, n_deltas = 0, first_report = 0;
+	int fd = create_recording(rec);
+
+	igt_assert_f(intel_perf_data_reader_init_stream(&reader, fd),
+		     "%s\n", reader.error_msg);
+
+	while (intel_perf_data_reader_next(&reader, max_size)) {
+		for (uint32_t i = 0; i < reader.n_timelines; i++) {
+			const struct intel_perf_timeline_item *item =
+				&reader.timelines[i];
+			unsigned int start = first_report + item->record_start;
+			unsigned int end = first_report + item->record_end;
+
+			igt_assert_eq(item->hw_id, start / rec->ctx_run);
+			igt_assert_eq_u64(item->cpu_ts_start,
+					  cpu_ts(report_gpu_ts(start)));
+			igt_assert_eq_u64(item->cpu_ts_end,
+					  cpu_ts(report_gpu_ts(end)));
+			n_deltas += item->record_end - item->record_start;
+		}
+
+		/* The last record comes again in the next window. */
+		first_report += reader.n_records - 1;
+		n_windows++;
+	}
+	igt_assert_f(!reader.error_msg[0], "%s\n", reader.error_msg);
+
+	igt_assert_eq(n_windows, expected_windows);
+	igt_assert_eq(first_report, rec->n_reports - 1);
+	igt_assert_eq(n_deltas, rec->n_reports - 1);
+
+	intel_perf_data_reader_fini(&reader);
+	close(fd);
+}
+
+static void test_indexed(void)
+{
+	const struct recording rec = {
+		.n_reports = 20000,
+		.ctx_run = 10,
+		.corr_every = 1000,
+		.chunk_reports = 1000,
+	};
+	struct intel_perf_data_reader reader;
+	int fd = create_recording(&rec);
+
+	igt_assert_f(intel_perf_data_reader_init(&reader, fd),
+		     "%s\n", reader.error_msg);
+	igt_assert_eq(reader.n_chunks, 20);
+	check_timelines(&reader, &rec);
+
+	intel_perf_data_reader_fini(&reader);
+	close(fd);
+}
+
+static void test_benchmark(void)
+{
+	/* A context switch every other report, thousands of correlations */
+	const struct recording rec = {
+		.n_reports = 1000000,
+		.ctx_run = 2,
+		.corr_every = 100,
+	};
+	struct intel_perf_data_reader reader;
+	struct timespec start = {};
+	int fd = create_recording(&rec);
+	uint64_t elapsed;
+
+	igt_nsec_elapsed(&start);
+	igt_assert_f(intel_perf_data_reader_init(&reader, fd),
+		     "%s\n", reader.error_msg);
+	elapsed = igt_nsec_elapsed(&start);
+
+	igt_info("%u reports, %u context switches, %u correlations: %.2f ms\n",
+		 reader.n_records, reader.n_timelines, reader.n_correlations,
+		 elapsed / 1e6);
+
+	check_timelines(&reader, &rec);
+
+	intel_perf_data_reader_fini(&reader);
+	close(fd);
+}
+
+igt_main
+{
+	igt_subtest("correlation")
+		test_correlation();
+
+	igt_subtest("indexed")
+		test_indexed();
+
+	igt_subtest("stream") {
+		struct recording rec = {
+			.n_reports = 20000,
+			.ctx_run = 7,
+			.corr_every = 1000,
+		};
+
+		/* Read in full without index. */
+		test_stream(&rec, 0, 1);
+
+		/* 3 chunks of 1000 reports per window, 7 windows. */
+		rec.chunk_reports = 1000;
+		test_stream(&rec, 3 * 1000 * 264, 7);
+
+		/* At least one chunk per window. */
+		test_stream(&rec, 0, 20);
+	}
+
+	igt_subtest("benchmark")
+		test_benchmark();
+}
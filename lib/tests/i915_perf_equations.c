@@ -0,0 +1,202 @@
+/*
+ * Copyright © 2022 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "igt_core.h"
+
+#include "i915_drm.h"
+#include "i915/perf.h"
+
+#include "i915_perf_fixtures.h"
+
+#define ARRAY_SIZE(arr) (sizeof(arr)/sizeof(arr[0]))
+
+#define N_ACCUMULATORS 256
+#define BENCH_LOOPS 64
+
+static void fill_accumulators(struct intel_perf_accumulator *accumulators,
+			      uint32_t n)
+{
+	for (uint32_t i = 0; i < n; i++) {
+		for (uint32_t j = 0; j < INTEL_PERF_MAX_RAW_OA_COUNTERS; j++) {
+			/* Zero deltas exercise the divisions by zero. */
+			accumulators[i].deltas[j] = i % 16 == 0 ? 0 :
+				(uint64_t)rand() << 8 | (rand() & 0xff);
+		}
+	}
+}
+
+static void check_metric_set(const struct intel_perf *perf,
+			     const struct intel_perf_metric_set *metric_set,
+			     const struct intel_perf_accumulator *accumulators,
+			     union intel_perf_logical_counter_value *values)
+{
+	metric_set->evaluate(perf, metric_set, accumulators, N_ACCUMULATORS,
+			     values);
+
+	for (uint32_t i = 0; i < N_ACCUMULATORS; i++) {
+		uint64_t *deltas = (uint64_t *)accumulators[i].deltas;
+
+		for (int c = 0; c < metric_set->n_counters; c++) {
+			const struct intel_perf_logical_counter *counter =
+				&metric_set->counters[c];
+			const union intel_perf_logical_counter_value *value =
+				&values[i * metric_set->n_counters + c];
+			uint64_t u64;
+			double f;
+
+			switch (counter->storage) {
+			case INTEL_PERF_LOGICAL_COUNTER_STORAGE_UINT64:
+			case INTEL_PERF_LOGICAL_COUNTER_STORAGE_UINT32:
+			case INTEL_PERF_LOGICAL_COUNTER_STORAGE_BOOL32:
+				u64 = counter->read_uint64(perf, metric_set, deltas);
+				igt_assert_f(value->u64 == u64,
+					     "%s/%s: %"PRIu64", expected %"PRIu64"\n",
+					     metric_set->symbol_name,
+					     counter->symbol_name, value->u64, u64);
+				break;
+			case INTEL_PERF_LOGICAL_COUNTER_STORAGE_DOUBLE:
+			case INTEL_PERF_LOGICAL_COUNTER_STORAGE_FLOAT:
+				f = counter->read_float(perf, metric_set, deltas);
+				igt_assert_f(value->f == f ||
+					     fabs(value->f - f) <= fabs(f) * 1e-9,
+					     "%s/%s: %f, expected %f\n",
+					     metric_set->symbol_name,
+					     counter->symbol_name, value->f, f);
+				break;
+			}
+		}
+	}
+}
+
+static void test_evaluate(void)
+{
+	struct intel_perf_accumulator *accumulators;
+	union intel_perf_logical_counter_value *values = NULL;
+
+	accumulators = calloc(N_ACCUMULATORS, sizeof(*accumulators));
+	igt_assert(accumulators);
+
+	srand(0xdeadbeef);
+	fill_accumulators(accumulators, N_ACCUMULATORS);
+
+	for (unsigned int d = 0; d < ARRAY_SIZE(intel_perf_fixture_devices); d++) {
+		uint32_t device_id = intel_perf_fixture_devices[d];
+		struct intel_perf *perf = intel_perf_fixture_create(device_id, false);
+		struct intel_perf_metric_set *metric_set;
+		uint32_t n_sets = 0;
+
+		igt_assert_f(perf, "no metrics for device 0x%04x\n", device_id);
+
+		igt_list_for_each_entry(metric_set, &perf->metric_sets, link) {
+			values = realloc(values, N_ACCUMULATORS *
+					 metric_set->n_counters * sizeof(*values));
+			igt_assert(values);
+
+			check_metric_set(perf, metric_set, accumulators, values);
+			n_sets++;
+		}
+
+		igt_debug("0x%04x: %u metric sets\n", device_id, n_sets);
+		intel_perf_free(perf);
+	}
+
+	free(values);
+	free(accumulators);
+}
+
+static void test_benchmark(void)
+{
+	struct intel_perf_accumulator *accumulators;
+	union intel_perf_logical_counter_value *values = NULL;
+	struct intel_perf *perf = intel_perf_fixture_create(0x9a49, false);
+	struct intel_perf_metric_set *metric_set;
+	uint64_t callbacks = 0, evaluate = 0, n_counters = 0;
+	struct timespec start;
+	double sum = 0;
+
+	igt_assert(perf);
+
+	accumulators = calloc(N_ACCUMULATORS, sizeof(*accumulators));
+	igt_assert(accumulators);
+	fill_accumulators(accumulators, N_ACCUMULATORS);
+
+	igt_list_for_each_entry(metric_set, &perf->metric_sets, link) {
+		values = realloc(values, N_ACCUMULATORS *
+				 metric_set->n_counters * sizeof(*values));
+		igt_assert(values);
+		n_counters += metric_set->n_counters;
+
+		memset(&start, 0, sizeof(start));
+		igt_nsec_elapsed(&start);
+		for (int l = 0; l < BENCH_LOOPS; l++) {
+			for (uint32_t i = 0; i < N_ACCUMULATORS; i++) {
+				for (int c = 0; c < metric_set->n_counters; c++) {
+					const struct intel_perf_logical_counter *counter =
+						&metric_set->counters[c];
+
+					if (counter->storage == INTEL_PERF_LOGICAL_COUNTER_STORAGE_DOUBLE ||
+					    counter->storage == INTEL_PERF_LOGICAL_COUNTER_STORAGE_FLOAT)
+						sum += counter->read_float(perf, metric_set,
+									   accumulators[i].deltas);
+					else
+						sum += counter->read_uint64(perf, metric_set,
+									    accumulators[i].deltas);
+				}
+			}
+		}
+		callbacks += igt_nsec_elapsed(&start);
+
+		memset(&start, 0, sizeof(start));
+		igt_nsec_elapsed(&start);
+		for (int l = 0; l < BENCH_LOOPS; l++) {
+			metric_set->evaluate(perf, metric_set, accumulators,
+					     N_ACCUMULATORS, values);
+			sum += values[0].f;
+		}
+		evaluate += igt_nsec_elapsed(&start);
+	}
+
+	igt_info("%"PRIu64" counters: callbacks %.1f ns, evaluate %.1f ns per counter (%g)\n",
+		 n_counters,
+		 (double)callbacks / (n_counters * N_ACCUMULATORS * BENCH_LOOPS),
+		 (double)evaluate / (n_counters * N_ACCUMULATORS * BENCH_LOOPS),
+		 sum);
+
+	free(values);
+	free(accumulators);
+	intel_perf_free(perf);
+}
+
+igt_main
+{
+	igt_subtest("evaluate")
+		test_evaluate();
+
+	igt_subtest("benchmark")
+		test_benchmark();
+}
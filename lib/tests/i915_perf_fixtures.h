@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2019 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef I915_PERF_FIXTURES_H
+#define I915_PERF_FIXTURES_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <i915_drm.h>
+
+#include "i915/perf.h"
+
+/*
+ * Devices and topology shared by the i915-perf lib tests, so they all look
+ * at the same configurations.
+ */
+
+/* One device per set of metrics. */
+static const uint32_t intel_perf_fixture_devices[] = {
+	0x0412, /* HSW GT2 */
+	0x1616, /* BDW GT2 */
+	0x1912, /* SKL GT2 */
+	0x5a84, /* BXT */
+	0x3e92, /* CFL GT2 */
+	0x8a52, /* ICL */
+	0x9a49, /* TGL GT2 */
+	0x4905, /* DG1 */
+	0x4680, /* ADL-S */
+};
+
+/* 1 slice, 8 subslices of 8 EUs, with the last subslice fused off. */
+static const struct {
+	struct drm_i915_query_topology_info info;
+	uint8_t data[2 + 8];
+} intel_perf_fixture_topology = {
+	.info = {
+		.max_slices = 1,
+		.max_subslices = 8,
+		.max_eus_per_subslice = 8,
+		.subslice_offset = 1,
+		.subslice_stride = 1,
+		.eu_offset = 2,
+		.eu_stride = 1,
+	},
+	.data = { 0x1, 0x7f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff },
+};
+
+static inline struct intel_perf *
+intel_perf_fixture_create(uint32_t device_id, bool lazy)
+{
+	if (lazy)
+		return intel_perf_for_devinfo_lazy(device_id, 0, 12000000,
+						   300000000, 1100000000,
+						   &intel_perf_fixture_topology.info);
+
+	return intel_perf_for_devinfo(device_id, 0, 12000000,
+				      300000000, 1100000000,
+				      &intel_perf_fixture_topology.info);
+}
+
+#endif /* I915_PERF_FIXTURES_H */
@@ -0,0 +1,165 @@
+/*
+ * Copyright © 2022 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "igt_core.h"
+
+#include "i915_drm.h"
+#include "i915/perf.h"
+
+#include "i915_perf_fixtures.h"
+
+#define ARRAY_SIZE(arr) (sizeof(arr)/sizeof(arr[0]))
+
+#define BENCH_LOOPS 100
+
+static struct intel_perf *create_perf(uint32_t device_id, bool lazy)
+{
+	struct intel_perf *perf = intel_perf_fixture_create(device_id, lazy);
+
+	igt_assert_f(perf, "no metrics for device 0x%04x\n", device_id);
+
+	return perf;
+}
+
+static uint32_t count_metric_sets(const struct intel_perf *perf)
+{
+	struct intel_perf_metric_set *metric_set;
+	uint32_t n = 0;
+
+	igt_list_for_each_entry(metric_set, &perf->metric_sets, link)
+		n++;
+
+	return n;
+}
+
+static uint32_t count_counters(const struct intel_perf_logical_counter_group *group)
+{
+	const struct intel_perf_logical_counter_group *child;
+	const struct intel_perf_logical_counter *counter;
+	uint32_t n = 0;
+
+	igt_list_for_each_entry(counter, &group->counters, link)
+		n++;
+	igt_list_for_each_entry(child, &group->groups, link)
+		n += count_counters(child);
+
+	return n;
+}
+
+static void test_lazy(void)
+{
+	for (unsigned int d = 0; d < ARRAY_SIZE(intel_perf_fixture_devices); d++) {
+		uint32_t device_id = intel_perf_fixture_devices[d];
+		struct intel_perf *eager = create_perf(device_id, false);
+		struct intel_perf *lazy = create_perf(device_id, true);
+		struct intel_perf_metric_set *metric_set, *lazy_set;
+		uint32_t n_sets = count_metric_sets(eager), n_counters = 0, i = 0;
+
+		igt_assert_eq(lazy->n_metric_set_descs, n_sets);
+		igt_assert_eq(count_metric_sets(lazy), 0);
+		igt_assert_eq(count_counters(lazy->root_group), 0);
+
+		/* Looking a set up only registers that set, once. */
+		metric_set = igt_list_last_entry(&eager->metric_sets, metric_set, link);
+		lazy_set = intel_perf_find_metric_set(lazy, metric_set->symbol_name);
+		igt_assert(lazy_set);
+		igt_assert(intel_perf_find_metric_set(lazy, metric_set->symbol_name) == lazy_set);
+		igt_assert(intel_perf_load_metric_set(lazy, n_sets - 1) == lazy_set);
+		igt_assert_eq(count_metric_sets(lazy), 1);
+		igt_assert_eq(lazy_set->n_counters, metric_set->n_counters);
+		igt_assert_eq(count_counters(lazy->root_group), lazy_set->n_counters);
+
+		igt_assert(!intel_perf_find_metric_set(lazy, "NoSuchMetricSet"));
+		igt_assert(!intel_perf_load_metric_set(lazy, n_sets));
+
+		/* Then the rest, in the order of the index. */
+		intel_perf_load_metric_sets(lazy);
+		igt_assert_eq(count_metric_sets(lazy), n_sets);
+
+		igt_list_for_each_entry(metric_set, &eager->metric_sets, link) {
+			const struct intel_perf_metric_set_desc *desc =
+				&lazy->metric_set_descs[i];
+
+			igt_assert(!strcmp(desc->symbol_name, metric_set->symbol_name));
+			igt_assert(!strcmp(desc->name, metric_set->name));
+			igt_assert(!strcmp(desc->hw_config_guid, metric_set->hw_config_guid));
+
+			lazy_set = intel_perf_load_metric_set(lazy, i++);
+			igt_assert(!strcmp(lazy_set->symbol_name, metric_set->symbol_name));
+			igt_assert_eq(lazy_set->n_counters, metric_set->n_counters);
+			igt_assert_eq(lazy_set->perf_oa_format, metric_set->perf_oa_format);
+			igt_assert_eq(lazy_set->n_mux_regs, metric_set->n_mux_regs);
+			n_counters += metric_set->n_counters;
+		}
+		igt_assert_eq(count_counters(lazy->root_group), n_counters);
+		igt_assert_eq(count_counters(eager->root_group), n_counters);
+
+		intel_perf_free(eager);
+		intel_perf_free(lazy);
+	}
+}
+
+static void test_benchmark(void)
+{
+	const unsigned int n_devices = ARRAY_SIZE(intel_perf_fixture_devices);
+	struct timespec start = {};
+	uint64_t eager = 0, lazy = 0;
+
+	for (int l = 0; l < BENCH_LOOPS; l++) {
+		for (unsigned int d = 0; d < n_devices; d++) {
+			uint32_t device_id = intel_perf_fixture_devices[d];
+			struct intel_perf *perf;
+
+			memset(&start, 0, sizeof(start));
+			igt_nsec_elapsed(&start);
+			perf = create_perf(device_id, false);
+			eager += igt_nsec_elapsed(&start);
+			intel_perf_free(perf);
+
+			/* As the reader does with a recording. */
+			memset(&start, 0, sizeof(start));
+			igt_nsec_elapsed(&start);
+			perf = create_perf(device_id, true);
+			igt_assert(intel_perf_load_metric_set(perf, 0));
+			lazy += igt_nsec_elapsed(&start);
+			intel_perf_free(perf);
+		}
+	}
+
+	igt_info("all metric sets: %.1f us, one metric set: %.1f us per device\n",
+		 eager / 1e3 / (BENCH_LOOPS * n_devices),
+		 lazy / 1e3 / (BENCH_LOOPS * n_devices));
+}
+
+igt_main
+{
+	igt_subtest("lazy")
+		test_lazy();
+
+	igt_subtest("benchmark")
+		test_benchmark();
+}
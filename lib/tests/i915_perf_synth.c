@@ -0,0 +1,307 @@
+/*
+ * Copyright © 2022 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "igt_core.h"
+
+#include "i915/perf_data_reader.h"
+#include "i915/perf_synth.h"
+
+#include "i915_perf_fixtures.h"
+
+#define ARRAY_SIZE(arr) (sizeof(arr)/sizeof(arr[0]))
+
+static const char * const counter_models[] = {
+	[INTEL_PERF_SYNTH_COUNTERS_IDLE] = "idle",
+	[INTEL_PERF_SYNTH_COUNTERS_LINEAR] = "linear",
+	[INTEL_PERF_SYNTH_COUNTERS_RANDOM] = "random",
+};
+
+static int synthesize(const struct intel_perf_synth_params *params,
+		      struct intel_perf_synth_result *result)
+{
+	FILE *file = tmpfile();
+	int fd;
+
+	igt_assert(file);
+	fd = dup(fileno(file));
+	fclose(file);
+
+	igt_assert_f(intel_perf_synth_write(fd, params, result),
+		     "device 0x%04x: %m\n", params->device_id);
+	igt_assert_eq(lseek(fd, 0, SEEK_SET), 0);
+
+	return fd;
+}
+
+/* Within the rounding of the CPU/GPU time ratio of the reader. */
+static void assert_cpu_ts(uint64_t value, uint64_t expected)
+{
+	igt_assert_f(value + 1000 >= expected && value <= expected + 1000,
+		     "cpu timestamp %"PRIu64", expected %"PRIu64"\n",
+		     value, expected);
+}
+
+static void check_recording(const struct intel_perf_synth_params *params)
+{
+	struct intel_perf_accumulator acc = {};
+	struct intel_perf_synth_result result;
+	struct intel_perf_data_reader reader;
+	const struct intel_perf_timeline_item *last;
+	int fd = synthesize(params, &result);
+
+	igt_assert_f(intel_perf_data_reader_init(&reader, fd),
+		     "%s\n", reader.error_msg);
+	igt_assert(reader.metric_set);
+	igt_assert_eq(reader.version, params->flat ?
+		      INTEL_PERF_RECORD_VERSION :
+		      INTEL_PERF_RECORD_VERSION_INDEXED);
+	igt_assert_eq(reader.n_records, result.n_reports);
+	igt_assert_eq(reader.n_correlations, result.n_correlations);
+
+	/* Every pair of reports in a row, across lost reports too. */
+	intel_perf_accumulate_records(&acc, &reader.devinfo,
+				      reader.metric_set->perf_oa_format,
+				      reader.records, reader.n_records);
+	for (uint32_t i = 0; i < result.n_counters; i++)
+		igt_assert_f(acc.deltas[i] == result.deltas.deltas[i],
+			     "device 0x%04x, %s counters, delta %u: %"PRIu64
+			     ", expected %"PRIu64"\n",
+			     params->device_id, counter_models[params->counters],
+			     i, acc.deltas[i], result.deltas.deltas[i]);
+
+	/* The last item only ends on a switch if the last report is one. */
+	igt_assert_f(reader.n_timelines == result.n_context_switches ||
+		     reader.n_timelines == result.n_context_switches + 1,
+		     "%u timeline items, %u context switches\n",
+		     reader.n_timelines, result.n_context_switches);
+	for (uint32_t i = 0; i < reader.n_timelines; i++) {
+		uint32_t hw_id = reader.timelines[i].hw_id;
+
+		if (reader.devinfo.graphics_ver < 8)
+			igt_assert_eq_u32(hw_id, 0xffffffff);
+		else if (params->contexts == INTEL_PERF_SYNTH_CONTEXTS_ROUND_ROBIN)
+			igt_assert(hw_id >= 1 && hw_id <= params->n_contexts);
+	}
+
+	last = &reader.timelines[reader.n_timelines - 1];
+	assert_cpu_ts(reader.timelines[0].cpu_ts_start, result.cpu_ts_begin);
+	if (last->record_end == reader.n_records - 1)
+		assert_cpu_ts(last->cpu_ts_end, result.cpu_ts_end);
+
+	intel_perf_data_reader_fini(&reader);
+	close(fd);
+}
+
+static void test_roundtrip(void)
+{
+	struct intel_perf_synth_params params;
+
+	for (unsigned int d = 0; d < ARRAY_SIZE(intel_perf_fixture_devices); d++) {
+		for (unsigned int c = 0; c < ARRAY_SIZE(counter_models); c++) {
+			intel_perf_synth_params_init(&params,
+						     intel_perf_fixture_devices[d]);
+			params.counters = c;
+			params.contexts = INTEL_PERF_SYNTH_CONTEXTS_RANDOM;
+			params.seed = d * 3 + c;
+
+			params.flat = true;
+			check_recording(&params);
+			params.flat = false;
+			check_recording(&params);
+		}
+	}
+}
+
+static void test_lost(void)
+{
+	struct intel_perf_synth_params params;
+	struct intel_perf_synth_result result;
+
+	/* Counters wrapping around the gap of each lost report. */
+	intel_perf_synth_params_init(&params, 0x9a49);
+	params.counters = INTEL_PERF_SYNTH_COUNTERS_RANDOM;
+	params.lost_every = 10;
+	close(synthesize(&params, &result));
+
+	igt_assert_eq(result.n_reports + result.n_lost, params.n_reports);
+	igt_assert(result.n_lost > params.n_reports / 20);
+	check_recording(&params);
+
+	params.flat = true;
+	check_recording(&params);
+}
+
+static void test_deterministic(void)
+{
+	struct intel_perf_synth_params params;
+	struct stat st;
+	off_t size[3];
+	char *data[3];
+	int fd[3];
+
+	intel_perf_synth_params_init(&params, 0x1912);
+	params.contexts = INTEL_PERF_SYNTH_CONTEXTS_RANDOM;
+	params.counters = INTEL_PERF_SYNTH_COUNTERS_RANDOM;
+	params.lost_every = 100;
+
+	for (int i = 0; i < 3; i++) {
+		params.seed = i < 2 ? 42 : 43;
+		fd[i] = synthesize(&params, NULL);
+
+		igt_assert_eq(fstat(fd[i], &st), 0);
+		size[i] = st.st_size;
+		data[i] = malloc(size[i]);
+		igt_assert(data[i]);
+		igt_assert_eq(read(fd[i], data[i], size[i]), size[i]);
+		close(fd[i]);
+	}
+
+	igt_assert_eq(size[0], size[1]);
+	igt_assert(!memcmp(data[0], data[1], size[0]));
+	igt_assert(size[2] != size[0] ||
+		   memcmp(data[0], data[2], size[0]));
+
+	for (int i = 0; i < 3; i++)
+		free(data[i]);
+}
+
+/* Reader throughput, from the file to evaluated counters. */
+static void benchmark_read(const struct intel_perf_synth_params *params,
+			   bool stream)
+{
+	struct intel_perf_synth_result result;
+	struct intel_perf_data_reader reader;
+	union intel_perf_logical_counter_value *values = NULL;
+	struct intel_perf_accumulator *accs = NULL;
+	struct timespec start = {};
+	uint32_t n_accs = 0, n_windows = 0;
+	uint64_t n_evaluated = 0, elapsed;
+	struct stat st;
+	int fd = synthesize(params, &result);
+
+	igt_assert_eq(fstat(fd, &st), 0);
+
+	igt_nsec_elapsed(&start);
+	if (stream)
+		igt_assert_f(intel_perf_data_reader_init_stream(&reader, fd),
+			     "%s\n", reader.error_msg);
+	else
+		igt_assert_f(intel_perf_data_reader_init(&reader, fd),
+			     "%s\n", reader.error_msg);
+
+	while (!stream || intel_perf_data_reader_next(&reader, 16 << 20)) {
+		const struct intel_perf_metric_set *metric_set = reader.metric_set;
+
+		if (reader.n_timelines > n_accs) {
+			n_accs = reader.n_timelines;
+			accs = realloc(accs, n_accs * sizeof(*accs));
+			values = realloc(values, n_accs * metric_set->n_counters *
+					 sizeof(*values));
+			igt_assert(accs && values);
+		}
+
+		for (uint32_t i = 0; i < reader.n_timelines; i++) {
+			const struct intel_perf_timeline_item *item =
+				&reader.timelines[i];
+
+			memset(&accs[i], 0, sizeof(accs[i]));
+			intel_perf_accumulate_records(&accs[i], &reader.devinfo,
+						      metric_set->perf_oa_format,
+						      reader.records + item->record_start,
+						      item->record_end - item->record_start + 1);
+		}
+		metric_set->evaluate(reader.perf, metric_set, accs,
+				     reader.n_timelines, values);
+		n_evaluated += reader.n_timelines;
+		n_windows++;
+
+		if (!stream)
+			break;
+	}
+	igt_assert_f(!reader.error_msg[0], "%s\n", reader.error_msg);
+	elapsed = igt_nsec_elapsed(&start);
+
+	igt_info("%s %s: %u reports, %"PRIu64" timeline items in %u windows, "
+		 "%.1f MiB/s, %.1f Mreports/s\n",
+		 params->flat ? "flat" : "indexed", stream ? "streamed" : "full",
+		 result.n_reports, n_evaluated, n_windows,
+		 st.st_size / (elapsed / 1e9) / (1 << 20),
+		 result.n_reports / (elapsed / 1e3));
+
+	intel_perf_data_reader_fini(&reader);
+	free(accs);
+	free(values);
+	close(fd);
+}
+
+static void test_benchmark(void)
+{
+	struct intel_perf_synth_params params;
+	struct intel_perf_synth_result result;
+	struct timespec start = {};
+	uint64_t elapsed;
+
+	/* About a second of Tigerlake OA at its highest sampling rate. */
+	intel_perf_synth_params_init(&params, 0x9a49);
+	params.n_reports = 500000;
+	params.report_rate = 500000;
+	params.contexts = INTEL_PERF_SYNTH_CONTEXTS_RANDOM;
+	params.n_contexts = 8;
+	params.context_run = 20;
+	params.counters = INTEL_PERF_SYNTH_COUNTERS_RANDOM;
+	params.lost_every = 10000;
+
+	igt_nsec_elapsed(&start);
+	close(synthesize(&params, &result));
+	elapsed = igt_nsec_elapsed(&start);
+	igt_info("synthesized %u reports in %.2f ms\n",
+		 result.n_reports, elapsed / 1e6);
+
+	for (int flat = 0; flat < 2; flat++) {
+		params.flat = flat;
+		benchmark_read(&params, false);
+		benchmark_read(&params, true);
+	}
+}
+
+igt_main
+{
+	igt_subtest("roundtrip")
+		test_roundtrip();
+
+	igt_subtest("lost")
+		test_lost();
+
+	igt_subtest("deterministic")
+		test_deterministic();
+
+	igt_subtest("benchmark")
+		test_benchmark();
+}
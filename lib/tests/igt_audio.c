@@ -28,6 +28,7 @@
 #include <stdlib.h>
 
 #include "igt_core.h"
+#include "igt_aux.h"
 #include "igt_audio.h"
 
 #define SAMPLING_RATE 44100
@@ -174,6 +175,39 @@ static void test_signal_detect_phaseshift(struct audio_signal *signal)
 	igt_assert(!ok);
 }
 
+static void test_signal_detect_streaming(struct audio_signal *signal)
+{
+	const size_t stream_len = 8 * BUFFER_LEN, chunk_len = 300;
+	struct audio_detector *detector;
+	double *buf;
+	size_t i, n, windows;
+
+	buf = malloc(stream_len * sizeof(double));
+	audio_signal_fill(signal, buf, stream_len / CHANNELS);
+
+	/* Half-overlapping windows, fed in chunks unaligned with them */
+	detector = audio_detector_init(signal, SAMPLING_RATE, 0,
+				       BUFFER_LEN, BUFFER_LEN / 2);
+
+	windows = 0;
+	for (i = 0; i < stream_len; i += n) {
+		n = min(chunk_len, stream_len - i);
+		windows += audio_detector_feed(detector, &buf[i], n);
+	}
+
+	igt_assert_eq(windows, (stream_len - BUFFER_LEN) / (BUFFER_LEN / 2) + 1);
+	igt_assert_eq(audio_detector_streak(detector), windows);
+
+	/* A window of silence breaks the streak */
+	memset(buf, 0, BUFFER_LEN * sizeof(double));
+	windows = audio_detector_feed(detector, buf, BUFFER_LEN);
+	igt_assert_eq(windows, 2);
+	igt_assert_eq(audio_detector_streak(detector), 0);
+
+	audio_detector_fini(detector);
+	free(buf);
+}
+
 igt_main
 {
 	struct audio_signal *signal = NULL;
@@ -215,6 +249,9 @@ igt_main
 		igt_subtest("signal-detect-phaseshift")
 			test_signal_detect_phaseshift(signal);
 
+		igt_subtest("signal-detect-streaming")
+			test_signal_detect_streaming(signal);
+
 		igt_fixture {
 			audio_signal_fini(signal);
 		}
@@ -0,0 +1,232 @@
+/*
+ * Copyright © 2022 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "igt_core.h"
+#include "igt_drm_fdinfo.h"
+
+#define ARRAY_SIZE(arr) (sizeof(arr)/sizeof(arr[0]))
+
+/* Synthetic client files, as a busy desktop would show them */
+#define NUM_FILES 64
+#define BENCH_LOOPS 200
+
+#define FDINFO_FULL \
+	"pos:\t0\n" \
+	"flags:\t02100002\n" \
+	"mnt_id:\t24\n" \
+	"ino:\t1058\n" \
+	"drm-driver:\ti915\n" \
+	"drm-pdev:\t0000:00:02.0\n" \
+	"drm-client-id:\t%u\n" \
+	"drm-engine-render:\t%u ns\n" \
+	"drm-engine-copy:\t1234 ns\n" \
+	"drm-engine-video:\t56789 ns\n" \
+	"drm-engine-capacity-video:\t2\n" \
+	"drm-engine-video-enhance:\t0 ns\n" \
+	"drm-cycles-render:\t987654\n" \
+	"drm-memory-system:\t%u KiB\n" \
+	"drm-memory-local0:\t3 MiB\n" \
+	"drm-memory-stolen:\t42\n"
+
+static int write_file(int dir, const char *name, const char *contents)
+{
+	int fd, len = strlen(contents);
+
+	fd = openat(dir, name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	igt_assert(fd >= 0);
+	igt_assert_eq(write(fd, contents, len), len);
+
+	return fd;
+}
+
+/* Full fdinfo of client i, busy for i us on render with 4 * i KiB. */
+static int write_full(int dir, const char *name, unsigned int i)
+{
+	char buf[4096];
+
+	snprintf(buf, sizeof(buf), FDINFO_FULL, i, i * 1000, i * 4);
+
+	return write_file(dir, name, buf);
+}
+
+static void test_parse(int dir)
+{
+	struct drm_client_fdinfo info = { };
+	unsigned int ret;
+	int fd;
+
+	fd = write_full(dir, "full", 7);
+
+	/* 2 mandatory, 4 engines, 1 capacity, 1 cycles, 3 regions */
+	ret = __igt_parse_drm_fdinfo(dir, "full", &info);
+	igt_assert_eq(ret, 11);
+
+	igt_assert(!strcmp(info.driver, "i915"));
+	igt_assert(!strcmp(info.pdev, "0000:00:02.0"));
+	igt_assert_eq(info.id, 7);
+
+	igt_assert_eq(info.num_engines, 4);
+	igt_assert_eq(info.busy[0], 7000);
+	igt_assert_eq(info.busy[1], 1234);
+	igt_assert_eq(info.busy[2], 56789);
+	igt_assert_eq(info.busy[3], 0);
+	igt_assert_eq(info.capacity[0], 1);
+	igt_assert_eq(info.capacity[2], 2);
+	igt_assert_eq(info.cycles[0], 987654);
+
+	igt_assert_eq(info.num_regions, 3);
+	igt_assert(!strcmp(info.region_names[0], "system"));
+	igt_assert_eq(info.memory[0], 28 << 10);
+	igt_assert(!strcmp(info.region_names[1], "local0"));
+	igt_assert_eq(info.memory[1], 3 << 20);
+	igt_assert(!strcmp(info.region_names[2], "stolen"));
+	igt_assert_eq(info.memory[2], 42);
+
+	/* Same result when parsing an already open file. */
+	memset(&info, 0, sizeof(info));
+	igt_assert_eq(__igt_parse_drm_fdinfo_fd(fd, &info), 11);
+	igt_assert_eq(info.busy[0], 7000);
+
+	close(fd);
+}
+
+static void test_invalid(int dir)
+{
+	static const char * const files[] = {
+		/* No client id */
+		"drm-driver:\ti915\ndrm-engine-render:\t1 ns\n",
+		/* No engines */
+		"drm-driver:\ti915\ndrm-client-id:\t1\n",
+		/* Unknown engine and keys which only share a prefix */
+		"drm-driver:\ti915\ndrm-client-id:\t1\n"
+		"drm-engine-rend:\t1 ns\ndrm-engines-render:\t1 ns\n"
+		"drm-driverx:\ti915\ndrm-engine-:\t1\n",
+		/* Values missing */
+		"drm-driver:\ndrm-client-id:\t1\ndrm-engine-render:\t1 ns\n",
+		/* No trailing new line or colon */
+		"drm-driver:\ti915\ndrm-client-id:\t1\ndrm-engine-render",
+		/* Key shorter than the known one it hashes to, at the end */
+		"drm-driver:\ti915\ndrm-engine-render:\t1 ns\ndrm-clie:",
+	};
+	struct drm_client_fdinfo info;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(files); i++) {
+		memset(&info, 0, sizeof(info));
+		close(write_file(dir, "invalid", files[i]));
+		igt_assert_f(!__igt_parse_drm_fdinfo(dir, "invalid", &info),
+			     "file %u parsed\n", i);
+	}
+
+	/* Last line without a new line still counts. */
+	memset(&info, 0, sizeof(info));
+	close(write_file(dir, "valid",
+			 "drm-client-id:\t3\ndrm-driver:\ti915\n"
+			 "drm-engine-copy:\t5 ns"));
+	igt_assert_eq(__igt_parse_drm_fdinfo(dir, "valid", &info), 3);
+	igt_assert_eq(info.busy[1], 5);
+	igt_assert(!strcmp(info.driver, "i915"));
+}
+
+static void test_benchmark(int dir)
+{
+	struct timespec start = {};
+	int fd[NUM_FILES];
+	uint64_t elapsed;
+	unsigned int i, j;
+	char name[16];
+
+	for (i = 0; i < NUM_FILES; i++) {
+		snprintf(name, sizeof(name), "%u", i);
+		fd[i] = write_full(dir, name, i);
+	}
+
+	igt_nsec_elapsed(&start);
+	for (j = 0; j < BENCH_LOOPS; j++) {
+		for (i = 0; i < NUM_FILES; i++) {
+			struct drm_client_fdinfo info = { };
+
+			snprintf(name, sizeof(name), "%u", i);
+			igt_assert(__igt_parse_drm_fdinfo(dir, name, &info));
+			igt_assert_eq(info.id, i);
+		}
+	}
+	elapsed = igt_nsec_elapsed(&start);
+	igt_info("open and parse: %.0f ns per file\n",
+		 (double)elapsed / (BENCH_LOOPS * NUM_FILES));
+
+	memset(&start, 0, sizeof(start));
+	igt_nsec_elapsed(&start);
+	for (j = 0; j < BENCH_LOOPS; j++) {
+		for (i = 0; i < NUM_FILES; i++) {
+			struct drm_client_fdinfo info = { };
+
+			igt_assert(__igt_parse_drm_fdinfo_fd(fd[i], &info));
+			igt_assert_eq(info.busy[0], i * 1000);
+		}
+	}
+	elapsed = igt_nsec_elapsed(&start);
+	igt_info("parse open file: %.0f ns per file\n",
+		 (double)elapsed / (BENCH_LOOPS * NUM_FILES));
+
+	for (i = 0; i < NUM_FILES; i++) {
+		snprintf(name, sizeof(name), "%u", i);
+		unlinkat(dir, name, 0);
+		close(fd[i]);
+	}
+}
+
+igt_main
+{
+	char path[] = "/tmp/igt_drm_fdinfo.XXXXXX";
+	int dir = -1;
+
+	igt_fixture {
+		igt_assert(mkdtemp(path));
+		dir = open(path, O_DIRECTORY | O_RDONLY);
+		igt_assert(dir >= 0);
+	}
+
+	igt_subtest("parse")
+		test_parse(dir);
+
+	igt_subtest("invalid")
+		test_invalid(dir);
+
+	igt_subtest("benchmark")
+		test_benchmark(dir);
+
+	igt_fixture {
+		unlinkat(dir, "full", 0);
+		unlinkat(dir, "invalid", 0);
+		unlinkat(dir, "valid", 0);
+		close(dir);
+		rmdir(path);
+	}
+}
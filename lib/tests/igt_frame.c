@@ -0,0 +1,293 @@
+/*
+ * Copyright © 2021 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <cairo.h>
+
+#include "igt_core.h"
+#include "igt_frame.h"
+
+/* Synthetic 4K captures, as the Chamelium would hand them to us */
+#define FRAME_WIDTH 3840
+#define FRAME_HEIGHT 2160
+#define CHECKER_SIZE 64
+#define BENCH_LOOPS 4
+#define PATCH_X1 1000
+#define PATCH_Y1 300
+#define PATCH_X2 1200
+#define PATCH_Y2 350
+
+typedef void (*fill_func)(uint8_t *px, int x, int y);
+
+static cairo_surface_t *create_frame(fill_func fill)
+{
+	cairo_surface_t *surface;
+	uint8_t *data;
+	int stride, x, y;
+
+	surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24,
+					     FRAME_WIDTH, FRAME_HEIGHT);
+	igt_assert(cairo_surface_status(surface) == CAIRO_STATUS_SUCCESS);
+
+	cairo_surface_flush(surface);
+	data = cairo_image_surface_get_data(surface);
+	stride = cairo_image_surface_get_stride(surface);
+
+	for (y = 0; y < FRAME_HEIGHT; y++)
+		for (x = 0; x < FRAME_WIDTH; x++)
+			fill(data + y * stride + x * 4, x, y);
+
+	cairo_surface_mark_dirty(surface);
+
+	return surface;
+}
+
+/* Every color value shows up on every channel. */
+static void fill_gradient(uint8_t *px, int x, int y)
+{
+	px[0] = x & 0xff;
+	px[1] = (x + y) & 0xff;
+	px[2] = y & 0xff;
+	px[3] = 0xff;
+}
+
+/* DAC-ADC chain with an error growing linearly with the value. */
+static void fill_gradient_analog(uint8_t *px, int x, int y)
+{
+	int c;
+
+	fill_gradient(px, x, y);
+	for (c = 0; c < 3; c++)
+		px[c] -= px[c] / 16;
+}
+
+static void fill_gradient_inverted(uint8_t *px, int x, int y)
+{
+	int c;
+
+	fill_gradient(px, x, y);
+	for (c = 0; c < 3; c++)
+		px[c] = 0xff - px[c];
+}
+
+static void fill_gradient_patched(uint8_t *px, int x, int y)
+{
+	if (x >= PATCH_X1 && x < PATCH_X2 && y >= PATCH_Y1 && y < PATCH_Y2)
+		fill_gradient_inverted(px, x, y);
+	else
+		fill_gradient(px, x, y);
+}
+
+static void fill_checkerboard(uint8_t *px, int x, int y)
+{
+	bool odd = ((x / CHECKER_SIZE) + (y / CHECKER_SIZE)) & 1;
+
+	px[0] = odd ? 0x20 : 0xe0;
+	px[1] = odd ? 0x40 : 0xc0;
+	px[2] = odd ? 0x80 : 0x10;
+	px[3] = 0xff;
+}
+
+/* Small noise everywhere, larger noise on the square edges. */
+static void fill_checkerboard_noisy(uint8_t *px, int x, int y)
+{
+	bool edge = x % CHECKER_SIZE == 0 || y % CHECKER_SIZE == 0;
+	int c;
+
+	fill_checkerboard(px, x, y);
+	for (c = 0; c < 3; c++)
+		px[c] ^= edge ? 0x3f : (x ^ y) & 0x7;
+}
+
+/* Squares shifted by half their size. */
+static void fill_checkerboard_shifted(uint8_t *px, int x, int y)
+{
+	fill_checkerboard(px, x + CHECKER_SIZE / 2, y);
+}
+
+static bool bench_match(const char *name,
+			bool (*match)(cairo_surface_t *, cairo_surface_t *),
+			cairo_surface_t *reference, cairo_surface_t *capture)
+{
+	struct timespec start = {};
+	uint64_t elapsed;
+	bool ret = false;
+	int i;
+
+	igt_nsec_elapsed(&start);
+	for (i = 0; i < BENCH_LOOPS; i++)
+		ret = match(reference, capture);
+	elapsed = igt_nsec_elapsed(&start);
+
+	igt_info("%s: %.2f ms per %dx%d frame\n", name,
+		 elapsed / BENCH_LOOPS / 1e6, FRAME_WIDTH, FRAME_HEIGHT);
+
+	return ret;
+}
+
+static void test_diff_identical(cairo_surface_t *reference)
+{
+	struct igt_frame_diff_params params = { .metrics = true };
+	struct igt_frame_diff_report report;
+	cairo_surface_t *capture = create_frame(fill_gradient);
+
+	igt_assert(igt_frame_diff(reference, capture, &params, &report));
+	igt_assert(report.complete);
+	igt_assert_eq(report.diff_pixels, 0);
+	igt_assert(isinf(report.psnr));
+	igt_assert(report.ssim > 0.999);
+
+	cairo_surface_destroy(capture);
+}
+
+static void test_diff_tolerance(cairo_surface_t *reference)
+{
+	struct igt_frame_diff_params params = {
+		.tolerance = { 16, 16, 16 },
+		.metrics = true,
+		.min_psnr = 20,
+		.min_ssim = 0.9,
+	};
+	struct igt_frame_diff_report report;
+	cairo_surface_t *capture = create_frame(fill_gradient_analog);
+	struct timespec start = {};
+
+	igt_nsec_elapsed(&start);
+	igt_assert(igt_frame_diff(reference, capture, &params, &report));
+	igt_info("diff with metrics: %.2f ms per %dx%d frame\n",
+		 igt_nsec_elapsed(&start) / 1e6, FRAME_WIDTH, FRAME_HEIGHT);
+
+	igt_assert_eq(report.max_error[0], 15);
+	igt_assert(report.psnr > 20 && report.psnr < 100);
+
+	params.tolerance[1] = 4;
+	igt_assert(!igt_frame_diff(reference, capture, &params, &report));
+	igt_assert(report.diff_pixels > 0);
+
+	cairo_surface_destroy(capture);
+}
+
+static void test_diff_bounding_box(cairo_surface_t *reference)
+{
+	struct igt_frame_diff_params params = {};
+	struct igt_frame_diff_report report;
+	cairo_surface_t *capture = create_frame(fill_gradient_patched);
+	struct timespec start = {};
+
+	igt_nsec_elapsed(&start);
+	igt_assert(!igt_frame_diff(reference, capture, &params, &report));
+	igt_info("diff without metrics: %.2f ms per %dx%d frame\n",
+		 igt_nsec_elapsed(&start) / 1e6, FRAME_WIDTH, FRAME_HEIGHT);
+
+	igt_assert(report.complete);
+	igt_assert_eq(report.x1, PATCH_X1);
+	igt_assert_eq(report.y1, PATCH_Y1);
+	igt_assert_eq(report.x2, PATCH_X2);
+	igt_assert_eq(report.y2, PATCH_Y2);
+
+	igt_write_frame_diff_to_png(reference, capture, &params, &report, NULL);
+
+	/* Stops within the band of rows where the patch starts. */
+	params.early_exit = true;
+	igt_assert(!igt_frame_diff(reference, capture, &params, &report));
+	igt_assert(!report.complete);
+	igt_assert_eq(report.y1, PATCH_Y1);
+	igt_assert(report.y2 < PATCH_Y2);
+
+	cairo_surface_destroy(capture);
+}
+
+igt_main
+{
+	cairo_surface_t *reference = NULL, *capture = NULL;
+
+	igt_subtest_group {
+		igt_fixture
+			reference = create_frame(fill_gradient);
+
+		igt_subtest("analog-match") {
+			capture = create_frame(fill_gradient_analog);
+			igt_assert(igt_check_analog_frame_match(reference, capture));
+			cairo_surface_destroy(capture);
+		}
+
+		igt_subtest("analog-mismatch") {
+			capture = create_frame(fill_gradient_inverted);
+			igt_assert(!igt_check_analog_frame_match(reference, capture));
+			cairo_surface_destroy(capture);
+		}
+
+		igt_subtest("diff-identical")
+			test_diff_identical(reference);
+
+		igt_subtest("diff-tolerance")
+			test_diff_tolerance(reference);
+
+		igt_subtest("diff-bounding-box")
+			test_diff_bounding_box(reference);
+
+		igt_subtest("analog-benchmark") {
+			capture = create_frame(fill_gradient_analog);
+			igt_assert(bench_match("analog", igt_check_analog_frame_match,
+					       reference, capture));
+			cairo_surface_destroy(capture);
+		}
+
+		igt_fixture
+			cairo_surface_destroy(reference);
+	}
+
+	igt_subtest_group {
+		igt_fixture
+			reference = create_frame(fill_checkerboard);
+
+		igt_subtest("checkerboard-match") {
+			capture = create_frame(fill_checkerboard_noisy);
+			igt_assert(igt_check_checkerboard_frame_match(reference,
+								      capture));
+			cairo_surface_destroy(capture);
+		}
+
+		igt_subtest("checkerboard-mismatch") {
+			capture = create_frame(fill_checkerboard_shifted);
+			igt_assert(!igt_check_checkerboard_frame_match(reference,
+								       capture));
+			cairo_surface_destroy(capture);
+		}
+
+		igt_subtest("checkerboard-benchmark") {
+			capture = create_frame(fill_checkerboard_noisy);
+			igt_assert(bench_match("checkerboard",
+					       igt_check_checkerboard_frame_match,
+					       reference, capture));
+			cairo_surface_destroy(capture);
+		}
+
+		igt_fixture
+			cairo_surface_destroy(reference);
+	}
+}
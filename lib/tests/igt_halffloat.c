@@ -0,0 +1,326 @@
+/*
+ * Copyright © 2022 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "igt_core.h"
+#include "igt_halffloat.h"
+
+/*
+ * Bit exact reference conversions, the SIMD kernels picked at runtime
+ * must agree with these for every input, odd pixel counts and swizzles
+ * included.
+ */
+
+/* Enough pixels to leave a tail after any vector width */
+#define NUM_PIXELS 1031
+
+static const unsigned char swz_identity[4] = { 0, 1, 2, 3 };
+static const unsigned char swz_bgrx[4] = { 2, 1, 0, 3 };
+
+static uint32_t f2u(float f)
+{
+	uint32_t u;
+
+	memcpy(&u, &f, sizeof(u));
+	return u;
+}
+
+static float u2f(uint32_t u)
+{
+	float f;
+
+	memcpy(&f, &u, sizeof(f));
+	return f;
+}
+
+static uint16_t ref_float_to_half(float f)
+{
+	uint32_t bits = f2u(f);
+	uint16_t sign = (bits >> 16) & 0x8000;
+	uint32_t abs = bits & 0x7fffffff;
+	uint32_t q, rem, half;
+
+	if (abs > 0x7f800000) /* NaN */
+		return sign | 0x7e00;
+	if (abs >= 0x477ff000) /* 65520 and up round to Inf */
+		return sign | 0x7c00;
+
+	if (abs < 0x38800000) { /* below 2^-14, half denormal */
+		uint32_t e = abs >> 23;
+		uint32_t m = (abs & 0x7fffff) | 0x800000;
+		unsigned int shift = 126 - e;
+
+		if (e < 102) /* below 2^-25 */
+			return sign;
+
+		q = m >> shift;
+		rem = m & ((1u << shift) - 1);
+		half = 1u << (shift - 1);
+	} else {
+		q = (abs - 0x38000000) >> 13;
+		rem = abs & 0x1fff;
+		half = 0x1000;
+	}
+
+	/* Round to nearest even, a carry into the exponent is correct */
+	if (rem > half || (rem == half && (q & 1)))
+		q++;
+
+	return sign | q;
+}
+
+static float ref_half_to_float(uint16_t h)
+{
+	uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+	uint32_t e = (h >> 10) & 0x1f;
+	uint32_t m = h & 0x3ff;
+
+	if (e == 31)
+		return u2f(sign | 0x7f800000 | (m << 13));
+	if (e)
+		return u2f(sign | ((e + 112) << 23) | (m << 13));
+
+	return sign ? -ldexpf(m, -24) : ldexpf(m, -24);
+}
+
+static uint16_t ref_float_to_unorm16(float f)
+{
+	if (!(f > 0.0f))
+		return 0;
+	if (f >= 1.0f)
+		return 65535;
+
+	return lrint((double)f * 65535.0);
+}
+
+static bool half_is_nan(uint16_t h)
+{
+	return (h & 0x7c00) == 0x7c00 && (h & 0x3ff);
+}
+
+static void check_half(uint16_t h, float f)
+{
+	uint16_t ref = ref_float_to_half(f);
+
+	/* NaN payloads are not preserved by every implementation */
+	if (isnan(f))
+		igt_assert_f(half_is_nan(h),
+			     "%a (0x%08x) -> 0x%04x, expected NaN\n",
+			     f, f2u(f), h);
+	else
+		igt_assert_f(h == ref,
+			     "%a (0x%08x) -> 0x%04x, expected 0x%04x\n",
+			     f, f2u(f), h, ref);
+}
+
+static void check_float(float f, uint16_t h)
+{
+	float ref = ref_half_to_float(h);
+
+	if (half_is_nan(h))
+		igt_assert_f(isnan(f), "0x%04x -> %a, expected NaN\n", h, f);
+	else
+		igt_assert_f(f2u(f) == f2u(ref),
+			     "0x%04x -> %a, expected %a\n", h, f, ref);
+}
+
+/*
+ * Every half boundary and midpoint, float denormals, Inf/NaN of both
+ * signs, values around the largest half, and random bit patterns.
+ */
+static unsigned int fill_floats(float *f, unsigned int max)
+{
+	static const uint32_t special[] = {
+		0x00000000, 0x80000000, 0x00000001, 0x807fffff,
+		0x7f800000, 0xff800000, 0x7fc00000, 0xffc00000,
+		0x7f800001, 0x7fffffff, 0x477fe000, 0x477fefff,
+		0x477ff000, 0x47800000, 0x7f7fffff, 0x33000000,
+		0x33000001, 0x32ffffff, 0x387fe000, 0x387ff000,
+	};
+	unsigned int n = 0;
+
+	for (unsigned int i = 0; i < sizeof(special) / sizeof(special[0]); i++)
+		f[n++] = u2f(special[i]);
+
+	for (uint32_t h = 0; h < 0x10000; h++) {
+		uint32_t bits = f2u(ref_half_to_float(h));
+
+		f[n++] = u2f(bits);
+
+		/* Ties and their neighbours, for normals and denormals */
+		if ((h & 0x7c00) == 0x7c00)
+			continue;
+
+		if (h & 0x7c00) {
+			f[n++] = u2f(bits + 0x1000);
+			f[n++] = u2f(bits + 0x1001);
+			f[n++] = u2f(bits + 0x0fff);
+		} else {
+			float mid = ldexpf((h & 0x3ff) * 2 + 1, -25);
+
+			f[n++] = h & 0x8000 ? -mid : mid;
+		}
+	}
+
+	while (n < max)
+		f[n++] = u2f(rand() | (uint32_t)rand() << 16);
+
+	return n;
+}
+
+static void test_float_to_half(void)
+{
+	unsigned int num = 0x10000 * 4 + 64;
+	float *f = malloc(num * sizeof(*f));
+	uint16_t *h = malloc(num * sizeof(*h));
+
+	igt_assert(f && h);
+
+	num = fill_floats(f, num);
+	igt_float_to_half(f, h, num);
+	for (unsigned int i = 0; i < num; i++)
+		check_half(h[i], f[i]);
+
+	/* rgbx: whole pixels only, starting at an unaligned offset */
+	for (unsigned int s = 0; s < 2; s++) {
+		const unsigned char *swz = s ? swz_bgrx : swz_identity;
+
+		for (unsigned int base = 1; base + NUM_PIXELS * 4 <= num;
+		     base += NUM_PIXELS * 4) {
+			igt_float_to_half_rgbx(f + base, h, NUM_PIXELS, swz);
+			for (unsigned int i = 0; i < NUM_PIXELS * 4; i++)
+				check_half(h[i], f[base + i / 4 * 4 + swz[i % 4]]);
+		}
+	}
+
+	free(h);
+	free(f);
+}
+
+static void test_half_to_float(void)
+{
+	unsigned int num = 0x10000;
+	uint16_t *h = malloc((num + 1) * sizeof(*h));
+	float *f = malloc((num + 1) * sizeof(*f));
+
+	igt_assert(f && h);
+
+	for (unsigned int i = 0; i < num; i++)
+		h[i + 1] = i;
+
+	igt_half_to_float(h + 1, f, num);
+	for (unsigned int i = 0; i < num; i++)
+		check_float(f[i], h[i + 1]);
+
+	/* Odd count, so the scalar tail is covered as well */
+	igt_half_to_float(h + 1, f, num - 3);
+	for (unsigned int i = 0; i < num - 3; i++)
+		check_float(f[i], h[i + 1]);
+
+	for (unsigned int s = 0; s < 2; s++) {
+		const unsigned char *swz = s ? swz_bgrx : swz_identity;
+
+		for (unsigned int base = 1; base + NUM_PIXELS * 4 <= num;
+		     base += NUM_PIXELS * 4) {
+			igt_half_to_float_rgbx(h + base, f, NUM_PIXELS, swz);
+			for (unsigned int i = 0; i < NUM_PIXELS * 4; i++)
+				check_float(f[i], h[base + i / 4 * 4 + swz[i % 4]]);
+		}
+	}
+
+	free(f);
+	free(h);
+}
+
+static void test_unorm16(void)
+{
+	static const float special[] = {
+		0.0f, -0.0f, -1.0f, 1.0f, 1.0f + 0x1p-23f, 1.5f, 65535.0f,
+		1e10f, -1e10f, INFINITY, -INFINITY, NAN, -NAN,
+		0x1p-126f, 0x1p-149f, 0.5f / 65535.0f, 65534.5f / 65535.0f,
+	};
+	unsigned int num = NUM_PIXELS * 4;
+	float *f = malloc(num * sizeof(*f));
+	float *g = malloc(num * sizeof(*g));
+	uint16_t *u = malloc(num * sizeof(*u));
+
+	igt_assert(f && g && u);
+
+	for (unsigned int i = 0; i < num; i++) {
+		unsigned int j = i % (sizeof(special) / sizeof(special[0]) + 8);
+
+		if (j < sizeof(special) / sizeof(special[0]))
+			f[i] = special[j];
+		else
+			f[i] = rand() / (float)RAND_MAX * 1.25f - 0.125f;
+	}
+
+	for (unsigned int s = 0; s < 2; s++) {
+		const unsigned char *swz = s ? swz_bgrx : swz_identity;
+
+		igt_float_to_unorm16_rgbx(f, u, NUM_PIXELS, swz);
+		for (unsigned int i = 0; i < num; i++) {
+			float in = f[i / 4 * 4 + swz[i % 4]];
+			int ref = ref_float_to_unorm16(in);
+
+			/*
+			 * The kernels scale and bias in single precision,
+			 * which may round the other way right at a tie.
+			 */
+			igt_assert_f(abs(u[i] - ref) <= (in > 0.0f && in < 1.0f),
+				     "%a -> %u, expected %d\n", in, u[i], ref);
+		}
+
+		for (unsigned int i = 0; i < num; i++)
+			u[i] = i * 61;
+		igt_unorm16_to_float_rgbx(u, g, NUM_PIXELS, swz);
+		for (unsigned int i = 0; i < num; i++) {
+			uint16_t in = u[i / 4 * 4 + swz[i % 4]];
+
+			igt_assert_f(g[i] == in / 65535.0f,
+				     "%u -> %a, expected %a\n",
+				     in, g[i], in / 65535.0f);
+		}
+	}
+
+	free(u);
+	free(g);
+	free(f);
+}
+
+igt_main
+{
+	srand(0x1234);
+
+	igt_subtest("float-to-half")
+		test_float_to_half();
+
+	igt_subtest("half-to-float")
+		test_half_to_float();
+
+	igt_subtest("unorm16")
+		test_unorm16();
+}
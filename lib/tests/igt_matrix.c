@@ -0,0 +1,216 @@
+/*
+ * Copyright © 2022 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "igt_core.h"
+#include "igt_matrix.h"
+
+/*
+ * igt_matrix_transform_batch() folds the stages into the matrix, so its
+ * results only match the per vector igt_matrix_transform() reference up
+ * to float rounding of the terms involved.
+ */
+
+/* Not a multiple of any vector width or of the planar block size */
+#define NUM 1031
+
+static float rnd(float lo, float hi)
+{
+	return lo + (hi - lo) * rand() / (float)RAND_MAX;
+}
+
+static float *rnd_array(unsigned int num)
+{
+	float *f = malloc(num * sizeof(*f));
+
+	igt_assert(f);
+
+	for (unsigned int i = 0; i < num; i++)
+		f[i] = rnd(-1.0f, 1.0f);
+
+	return f;
+}
+
+static struct igt_mat4 rnd_matrix(void)
+{
+	struct igt_mat4 m;
+
+	for (int i = 0; i < 16; i++)
+		m.d[i] = rnd(-1.0f, 1.0f);
+
+	return m;
+}
+
+static struct igt_matrix_stages rnd_stages(bool clamp)
+{
+	struct igt_matrix_stages s = igt_matrix_stages_identity();
+
+	for (int c = 0; c < 4; c++) {
+		s.in_scale.d[c] = rnd(0.5f, 2.0f);
+		s.in_offset.d[c] = rnd(-1.0f, 1.0f);
+		s.out_scale.d[c] = rnd(0.5f, 255.0f);
+		s.out_offset.d[c] = rnd(-1.0f, 1.0f);
+
+		if (clamp) {
+			s.out_min.d[c] = -s.out_scale.d[c];
+			s.out_max.d[c] = s.out_scale.d[c];
+		}
+	}
+
+	return s;
+}
+
+static void reference(const struct igt_mat4 *m,
+		      const struct igt_matrix_stages *s,
+		      const struct igt_vec4_array *src, unsigned int i,
+		      float *out, float *tolerance)
+{
+	struct igt_vec4 v, r;
+
+	for (int c = 0; c < 4; c++) {
+		float x = src->d[c] ? src->d[c][i * src->stride] : 1.0f;
+
+		v.d[c] = s->in_scale.d[c] * x + s->in_offset.d[c];
+	}
+
+	r = igt_matrix_transform(m, &v);
+
+	for (int row = 0; row < 4; row++) {
+		float sum = fabsf(s->out_offset.d[row]);
+		float x;
+
+		for (int col = 0; col < 4; col++)
+			sum += fabsf(s->out_scale.d[row] *
+				     m->d[m(row, col)] * v.d[col]);
+
+		x = s->out_scale.d[row] * r.d[row] + s->out_offset.d[row];
+		out[row] = fminf(fmaxf(x, s->out_min.d[row]), s->out_max.d[row]);
+		tolerance[row] = 1e-5f * (sum + 1.0f);
+	}
+}
+
+static void check_batch(const struct igt_mat4 *m,
+			const struct igt_matrix_stages *stages,
+			const struct igt_vec4_array *src,
+			const struct igt_vec4_array *dst,
+			unsigned int num)
+{
+	struct igt_matrix_stages id = igt_matrix_stages_identity();
+	float *ref = malloc(num * 4 * sizeof(*ref));
+	float *tol = malloc(num * 4 * sizeof(*tol));
+
+	igt_assert(ref && tol);
+
+	/* Before the transform, @src may be overwritten */
+	for (unsigned int i = 0; i < num; i++)
+		reference(m, stages ?: &id, src, i, &ref[i * 4], &tol[i * 4]);
+
+	igt_matrix_transform_batch(m, stages, src, dst, num);
+
+	for (unsigned int i = 0; i < num; i++) {
+		for (int c = 0; c < 4; c++) {
+			float got;
+
+			if (!dst->d[c])
+				continue;
+
+			got = dst->d[c][i * dst->stride];
+			igt_assert_f(fabsf(got - ref[i * 4 + c]) <= tol[i * 4 + c],
+				     "vector %u component %d: %f, expected %f\n",
+				     i, c, got, ref[i * 4 + c]);
+		}
+	}
+
+	free(tol);
+	free(ref);
+}
+
+igt_main
+{
+	srand(0x5eed);
+
+	igt_subtest("interleaved") {
+		float *in = rnd_array(NUM * 4), *out = rnd_array(NUM * 4);
+		struct igt_vec4_array src = igt_vec4_array_interleaved(in, 4);
+		struct igt_vec4_array dst = igt_vec4_array_interleaved(out, 4);
+		struct igt_matrix_stages s = rnd_stages(true);
+		struct igt_mat4 m = rnd_matrix();
+
+		check_batch(&m, NULL, &src, &dst, NUM);
+		check_batch(&m, &s, &src, &dst, NUM);
+		check_batch(&m, &s, &src, &src, NUM);
+
+		free(out);
+		free(in);
+	}
+
+	igt_subtest("planar") {
+		float *in = rnd_array(NUM * 4), *out = rnd_array(NUM * 4);
+		struct igt_vec4_array src =
+			igt_vec4_array_planar(in, in + NUM, in + 2 * NUM,
+					      in + 3 * NUM);
+		struct igt_vec4_array dst =
+			igt_vec4_array_planar(out, out + NUM, out + 2 * NUM,
+					      out + 3 * NUM);
+		struct igt_matrix_stages s = rnd_stages(true);
+		struct igt_mat4 m = rnd_matrix();
+
+		check_batch(&m, NULL, &src, &dst, NUM);
+		check_batch(&m, &s, &src, &dst, NUM);
+
+		/* Three planes in, as igt_fb does for YCbCr, in place */
+		src.d[3] = NULL;
+		dst.d[3] = NULL;
+		check_batch(&m, &s, &src, &src, NUM);
+		check_batch(&m, &s, &src, &dst, 3);
+
+		free(out);
+		free(in);
+	}
+
+	igt_subtest("mixed") {
+		float *in = rnd_array(NUM * 3), *out = rnd_array(NUM * 4);
+		struct igt_vec4_array src = igt_vec4_array_interleaved(in, 3);
+		struct igt_vec4_array dst = igt_vec4_array_interleaved(out, 4);
+		struct igt_matrix_stages s = rnd_stages(false);
+		struct igt_mat4 m = rnd_matrix();
+
+		check_batch(&m, &s, &src, &dst, NUM);
+
+		/* A missing output component is left alone */
+		for (unsigned int i = 0; i < NUM; i++)
+			out[i * 4 + 3] = i;
+		dst.d[3] = NULL;
+		check_batch(&m, &s, &src, &dst, NUM);
+		for (unsigned int i = 0; i < NUM; i++)
+			igt_assert(out[i * 4 + 3] == i);
+
+		dst = igt_vec4_array_planar(out, NULL, out + NUM, NULL);
+		check_batch(&m, NULL, &src, &dst, NUM);
+
+		free(out);
+		free(in);
+	}
+}
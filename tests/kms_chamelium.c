@@ -1503,10 +1503,10 @@ audio_output_frequencies_callback(void *data, void *buffer, int samples)
 static bool test_audio_frequencies(struct audio_state *state)
 {
 	int freq, step;
-	int32_t *recv, *buf;
-	double *channel;
-	size_t i, j, streak;
-	size_t recv_len, buf_len, buf_cap, channel_len;
+	int32_t *recv;
+	struct audio_detector **detectors;
+	size_t i, j, windows;
+	size_t recv_len;
 	bool success;
 	int capture_chan;
 
@@ -1554,59 +1554,49 @@ static bool test_audio_frequencies(struct audio_state *state)
 	 * sines. For lower sampling rates, the capture duration will be
 	 * longer.
 	 */
-	channel_len = CAPTURE_SAMPLES;
-	channel = malloc(sizeof(double) * channel_len);
-
-	buf_cap = state->capture.channels * channel_len;
-	buf = malloc(sizeof(int32_t) * buf_cap);
-	buf_len = 0;
+	detectors = calloc(state->playback.channels, sizeof(*detectors));
+	igt_assert(detectors);
+	for (j = 0; j < state->playback.channels; j++)
+		detectors[j] = audio_detector_init(state->signal,
+						   state->capture.rate, j,
+						   CAPTURE_SAMPLES,
+						   CAPTURE_SAMPLES);
 
 	recv = NULL;
 	recv_len = 0;
 
 	success = false;
-	streak = 0;
 	while (!success && state->msec < AUDIO_TIMEOUT) {
 		audio_state_receive(state, &recv, &recv_len);
 
-		memcpy(&buf[buf_len], recv, recv_len * sizeof(int32_t));
-		buf_len += recv_len;
-
-		if (buf_len < buf_cap)
-			continue;
-		igt_assert(buf_len == buf_cap);
-
-		igt_debug("Detecting audio signal, t=%d msec\n", state->msec);
-
+		success = true;
 		for (j = 0; j < state->playback.channels; j++) {
 			capture_chan = state->channel_mapping[j];
 			igt_assert(capture_chan >= 0);
-			igt_debug("Processing channel %zu (captured as "
-				  "channel %d)\n", j, capture_chan);
 
-			audio_extract_channel_s32_le(channel, channel_len,
-						     buf, buf_len,
-						     state->capture.channels,
-						     capture_chan);
-
-			if (audio_signal_detect(state->signal,
-						state->capture.rate, j,
-						channel, channel_len))
-				streak++;
-			else
-				streak = 0;
+			windows = audio_detector_feed_s32_le(detectors[j],
+							     recv, recv_len,
+							     state->capture.channels,
+							     capture_chan);
+			if (windows)
+				igt_debug("Audio signal on channel %zu (captured "
+					  "as channel %d) detected in the last %u "
+					  "windows, t=%d msec\n",
+					  j, capture_chan,
+					  audio_detector_streak(detectors[j]),
+					  state->msec);
+
+			if (audio_detector_streak(detectors[j]) < MIN_STREAK)
+				success = false;
 		}
-
-		buf_len = 0;
-
-		success = streak == MIN_STREAK * state->playback.channels;
 	}
 
 	audio_state_stop(state, success);
 
+	for (j = 0; j < state->playback.channels; j++)
+		audio_detector_fini(detectors[j]);
+	free(detectors);
 	free(recv);
-	free(buf);
-	free(channel);
 	audio_signal_fini(state->signal);
 
 	check_audio_infoframe(state);
@@ -25,6 +25,8 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -43,6 +45,72 @@
 
 #define MAX(a,b) ((a) > (b) ? (a) : (b))
 #define MIN(a,b) ((a) > (b) ? (b) : (a))
+#define ARRAY_SIZE(arr) (sizeof(arr)/sizeof(arr[0]))
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+
+/* Timeline items evaluated and written at once. */
+#define BATCH_SIZE (4096)
+
+/* OA data decoded at once when streaming. */
+#define STREAM_WINDOW_SIZE (16 * INTEL_PERF_RECORD_CHUNK_SIZE)
+
+enum output_format {
+	OUTPUT_TEXT,
+	OUTPUT_CSV,
+	/* Chrome JSON trace, as loaded by ui.perfetto.dev */
+	OUTPUT_PERFETTO,
+	/* Binary columns, see write_columnar_header() */
+	OUTPUT_COLUMNAR,
+};
+
+static const char *output_formats[] = {
+	[OUTPUT_TEXT] = "text",
+	[OUTPUT_CSV] = "csv",
+	[OUTPUT_PERFETTO] = "perfetto",
+	[OUTPUT_COLUMNAR] = "columnar",
+};
+
+/* Columns before the counters, in the CSV and columnar outputs. */
+static const char *item_columns[] = {
+	"cpu_ts_start", "cpu_ts_end", "gpu_ts_start", "gpu_ts_end", "hw_id",
+};
+
+struct output {
+	enum output_format format;
+	FILE *file;
+
+	const struct intel_perf_data_reader *reader;
+	struct intel_perf_logical_counter **counters;
+	int32_t n_counters;
+};
+
+struct worker {
+	pthread_t thread;
+	struct pool *pool;
+
+	/* Timeline items of the batch */
+	uint32_t first, last;
+
+	struct intel_perf_accumulator *accumulators;
+	union intel_perf_logical_counter_value *values;
+	uint64_t *column;
+
+	/* Output of the batch */
+	FILE *stream;
+	char *buf;
+	size_t size;
+};
+
+struct pool {
+	const struct output *output;
+
+	struct worker *workers;
+	uint32_t n_workers;
+
+	pthread_barrier_t start;
+	pthread_barrier_t done;
+	bool quit;
+};
 
 static void
 usage(void)
@@ -53,7 +121,20 @@ usage(void)
 	       "     --help,    -h             Print this screen\n"
 	       "     --counters, -c c1,c2,...  List of counters to display values for.\n"
 	       "                               Use 'all' to display all counters.\n"
-	       "                               Use 'list' to list available counters.\n");
+	       "                               Use 'list' to list available counters.\n"
+	       "                               Defaults to all counters for formats\n"
+	       "                               other than text.\n"
+	       "     --format,  -f format      Output format, one of:\n"
+	       "                                 text (default)\n"
+	       "                                 csv\n"
+	       "                                 perfetto, JSON trace for ui.perfetto.dev\n"
+	       "                                 columnar, binary columns of 64bit values\n"
+	       "     --output,  -o file        Write counter values to a file instead of\n"
+	       "                               stdout.\n"
+	       "     --jobs,    -j n           Evaluate counters over n threads.\n"
+	       "     --stream,  -s             Decode the recording a window at a time,\n"
+	       "                               bounding memory for indexed recordings.\n"
+	       "                               Context switches are split across windows.\n");
 }
 
 static struct intel_perf_logical_counter *
@@ -165,22 +246,409 @@ get_logical_counters(struct intel_perf_metric_set *metric_set,
 	return counters;
 }
 
+static bool
+counter_is_float(const struct intel_perf_logical_counter *counter)
+{
+	return counter->storage == INTEL_PERF_LOGICAL_COUNTER_STORAGE_DOUBLE ||
+	       counter->storage == INTEL_PERF_LOGICAL_COUNTER_STORAGE_FLOAT;
+}
+
+static uint64_t
+item_column(const struct intel_perf_timeline_item *item, uint32_t column)
+{
+	switch (column) {
+	case 0: return item->cpu_ts_start;
+	case 1: return item->cpu_ts_end;
+	case 2: return item->ts_start;
+	case 3: return item->ts_end;
+	default: return item->hw_id;
+	}
+}
+
+/*
+ * The columnar output starts with:
+ *
+ *   char magic[8] = "i915cols"
+ *   uint32_t n_columns
+ *   n_columns times:
+ *     uint32_t type, 0 for uint64_t values, 1 for double values
+ *     uint32_t name_length
+ *     char name[name_length]
+ *
+ * followed by row groups, each with:
+ *
+ *   uint32_t n_rows
+ *   n_columns arrays of n_rows 64bit values
+ *
+ * All in the byte order of the host.
+ */
+static void
+write_columnar_header(const struct output *output)
+{
+	uint32_t n_columns = ARRAY_SIZE(item_columns) + output->n_counters;
+
+	fwrite("i915cols", 8, 1, output->file);
+	fwrite(&n_columns, sizeof(n_columns), 1, output->file);
+
+	for (uint32_t i = 0; i < n_columns; i++) {
+		const char *name;
+		uint32_t header[2];
+
+		if (i < ARRAY_SIZE(item_columns)) {
+			name = item_columns[i];
+			header[0] = 0;
+		} else {
+			const struct intel_perf_logical_counter *counter =
+				output->counters[i - ARRAY_SIZE(item_columns)];
+
+			name = counter->symbol_name;
+			header[0] = counter_is_float(counter);
+		}
+		header[1] = strlen(name);
+
+		fwrite(header, sizeof(header), 1, output->file);
+		fwrite(name, header[1], 1, output->file);
+	}
+}
+
+static void
+write_header(const struct output *output)
+{
+	switch (output->format) {
+	case OUTPUT_TEXT:
+		break;
+	case OUTPUT_CSV:
+		for (uint32_t i = 0; i < ARRAY_SIZE(item_columns); i++)
+			fprintf(output->file, "%s%s", i ? "," : "", item_columns[i]);
+		for (int32_t c = 0; c < output->n_counters; c++)
+			fprintf(output->file, ",%s", output->counters[c]->symbol_name);
+		fprintf(output->file, "\n");
+		break;
+	case OUTPUT_PERFETTO:
+		fprintf(output->file,
+			"{\"traceEvents\":[\n"
+			"{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,"
+			"\"args\":{\"name\":\"%s\"}}",
+			output->reader->metric_set->symbol_name);
+		break;
+	case OUTPUT_COLUMNAR:
+		write_columnar_header(output);
+		break;
+	}
+}
+
+static void
+write_footer(const struct output *output)
+{
+	if (output->format == OUTPUT_PERFETTO)
+		fprintf(output->file, "\n]}\n");
+}
+
+static void
+write_text(FILE *file, const struct output *output,
+	   const struct intel_perf_timeline_item *item,
+	   const union intel_perf_logical_counter_value *values)
+{
+	fprintf(file, "Time: CPU=0x%016" PRIx64 "-0x%016" PRIx64
+		" GPU=0x%016" PRIx64 "-0x%016" PRIx64"\n",
+		item->cpu_ts_start, item->cpu_ts_end,
+		item->ts_start, item->ts_end);
+	fprintf(file, "hw_id=0x%x %s\n",
+		item->hw_id, item->hw_id == 0xffffffff ? "(idle)" : "");
+
+	for (int32_t c = 0; c < output->n_counters; c++) {
+		const struct intel_perf_logical_counter *counter = output->counters[c];
+		const union intel_perf_logical_counter_value *value =
+			&values[counter - output->reader->metric_set->counters];
+
+		if (counter_is_float(counter))
+			fprintf(file, "   %s: %f\n", counter->symbol_name, value->f);
+		else
+			fprintf(file, "   %s: %" PRIu64 "\n", counter->symbol_name, value->u64);
+	}
+}
+
+static void
+write_csv(FILE *file, const struct output *output,
+	  const struct intel_perf_timeline_item *item,
+	  const union intel_perf_logical_counter_value *values)
+{
+	fprintf(file, "%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%u",
+		item->cpu_ts_start, item->cpu_ts_end,
+		item->ts_start, item->ts_end, item->hw_id);
+
+	for (int32_t c = 0; c < output->n_counters; c++) {
+		const struct intel_perf_logical_counter *counter = output->counters[c];
+		const union intel_perf_logical_counter_value *value =
+			&values[counter - output->reader->metric_set->counters];
+
+		if (counter_is_float(counter))
+			fprintf(file, ",%f", value->f);
+		else
+			fprintf(file, ",%" PRIu64, value->u64);
+	}
+	fprintf(file, "\n");
+}
+
+/* One slice per timeline item, one counter track per counter. */
+static void
+write_perfetto(FILE *file, const struct output *output,
+	       const struct intel_perf_timeline_item *item,
+	       const union intel_perf_logical_counter_value *values)
+{
+	double ts = item->cpu_ts_start / 1000.0;
+
+	if (item->hw_id == 0xffffffff)
+		fprintf(file, ",\n{\"name\":\"idle\"");
+	else
+		fprintf(file, ",\n{\"name\":\"hw_id 0x%x\"", item->hw_id);
+	fprintf(file, ",\"ph\":\"X\",\"pid\":0,\"tid\":0,\"ts\":%.3f,\"dur\":%.3f}",
+		ts, (item->cpu_ts_end - item->cpu_ts_start) / 1000.0);
+
+	for (int32_t c = 0; c < output->n_counters; c++) {
+		const struct intel_perf_logical_counter *counter = output->counters[c];
+		const union intel_perf_logical_counter_value *value =
+			&values[counter - output->reader->metric_set->counters];
+
+		fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"C\",\"pid\":0,\"ts\":%.3f,"
+			"\"args\":{\"value\":",
+			counter->symbol_name, ts);
+		/* No NaN or infinity in JSON. */
+		if (!counter_is_float(counter))
+			fprintf(file, "%" PRIu64 "}}", value->u64);
+		else if (isfinite(value->f))
+			fprintf(file, "%f}}", value->f);
+		else
+			fprintf(file, "0}}");
+	}
+}
+
+/* A row group for the timeline items of the worker. */
+static void
+write_columnar(struct worker *worker)
+{
+	const struct output *output = worker->pool->output;
+	const struct intel_perf_data_reader *reader = output->reader;
+	const struct intel_perf_metric_set *metric_set = reader->metric_set;
+	uint32_t n_rows = worker->last - worker->first;
+
+	fwrite(&n_rows, sizeof(n_rows), 1, worker->stream);
+
+	for (uint32_t i = 0; i < ARRAY_SIZE(item_columns); i++) {
+		for (uint32_t r = 0; r < n_rows; r++)
+			worker->column[r] = item_column(&reader->timelines[worker->first + r], i);
+		fwrite(worker->column, sizeof(uint64_t), n_rows, worker->stream);
+	}
+
+	for (int32_t c = 0; c < output->n_counters; c++) {
+		uint32_t index = output->counters[c] - metric_set->counters;
+
+		/* Both members are 64bits. */
+		for (uint32_t r = 0; r < n_rows; r++)
+			worker->column[r] = worker->values[r * metric_set->n_counters + index].u64;
+		fwrite(worker->column, sizeof(uint64_t), n_rows, worker->stream);
+	}
+}
+
+/* Accumulates, evaluates and writes the timeline items of the worker. */
+static void
+process_items(struct worker *worker)
+{
+	const struct output *output = worker->pool->output;
+	const struct intel_perf_data_reader *reader = output->reader;
+	const struct intel_perf_metric_set *metric_set = reader->metric_set;
+	uint32_t n_items = worker->last - worker->first;
+
+	if (!n_items)
+		return;
+
+	memset(worker->accumulators, 0, n_items * sizeof(*worker->accumulators));
+	for (uint32_t i = 0; i < n_items; i++) {
+		const struct intel_perf_timeline_item *item =
+			&reader->timelines[worker->first + i];
+
+		intel_perf_accumulate_records(&worker->accumulators[i], &reader->devinfo,
+					      metric_set->perf_oa_format,
+					      reader->records + item->record_start,
+					      item->record_end - item->record_start + 1);
+	}
+
+	metric_set->evaluate(reader->perf, metric_set,
+			     worker->accumulators, n_items, worker->values);
+
+	if (output->format == OUTPUT_COLUMNAR) {
+		write_columnar(worker);
+		return;
+	}
+
+	for (uint32_t i = 0; i < n_items; i++) {
+		const struct intel_perf_timeline_item *item =
+			&reader->timelines[worker->first + i];
+		const union intel_perf_logical_counter_value *values =
+			worker->values + (size_t)i * metric_set->n_counters;
+
+		switch (output->format) {
+		case OUTPUT_TEXT:
+			write_text(worker->stream, output, item, values);
+			break;
+		case OUTPUT_CSV:
+			write_csv(worker->stream, output, item, values);
+			break;
+		case OUTPUT_PERFETTO:
+			write_perfetto(worker->stream, output, item, values);
+			break;
+		case OUTPUT_COLUMNAR:
+			break;
+		}
+	}
+}
+
+static void *
+worker_thread(void *data)
+{
+	struct worker *worker = data;
+	struct pool *pool = worker->pool;
+
+	while (true) {
+		pthread_barrier_wait(&pool->start);
+		if (pool->quit)
+			break;
+
+		worker->stream = open_memstream(&worker->buf, &worker->size);
+		assert(worker->stream);
+		process_items(worker);
+		fclose(worker->stream);
+
+		pthread_barrier_wait(&pool->done);
+	}
+
+	return NULL;
+}
+
+static bool
+pool_init(struct pool *pool, const struct output *output, uint32_t n_workers)
+{
+	uint32_t n_items = DIV_ROUND_UP(BATCH_SIZE, n_workers);
+
+	memset(pool, 0, sizeof(*pool));
+	pool->output = output;
+	pool->n_workers = n_workers;
+	pool->workers = calloc(n_workers, sizeof(*pool->workers));
+	if (!pool->workers)
+		return false;
+
+	for (uint32_t i = 0; i < n_workers; i++) {
+		struct worker *worker = &pool->workers[i];
+
+		worker->pool = pool;
+		worker->accumulators = calloc(n_items, sizeof(*worker->accumulators));
+		worker->values = calloc((size_t)n_items * output->reader->metric_set->n_counters,
+					sizeof(*worker->values));
+		worker->column = calloc(n_items, sizeof(*worker->column));
+		if (!worker->accumulators || !worker->values || !worker->column)
+			return false;
+	}
+
+	/* A single worker runs on the main thread, straight to the output. */
+	if (n_workers == 1) {
+		pool->workers[0].stream = output->file;
+		return true;
+	}
+
+	pthread_barrier_init(&pool->start, NULL, n_workers + 1);
+	pthread_barrier_init(&pool->done, NULL, n_workers + 1);
+	for (uint32_t i = 0; i < n_workers; i++) {
+		int ret = pthread_create(&pool->workers[i].thread, NULL,
+					 worker_thread, &pool->workers[i]);
+		assert(ret == 0);
+	}
+
+	return true;
+}
+
+static void
+pool_fini(struct pool *pool)
+{
+	if (pool->n_workers > 1 && pool->workers) {
+		pool->quit = true;
+		pthread_barrier_wait(&pool->start);
+		for (uint32_t i = 0; i < pool->n_workers; i++)
+			pthread_join(pool->workers[i].thread, NULL);
+		pthread_barrier_destroy(&pool->start);
+		pthread_barrier_destroy(&pool->done);
+	}
+
+	for (uint32_t i = 0; pool->workers && i < pool->n_workers; i++) {
+		free(pool->workers[i].accumulators);
+		free(pool->workers[i].values);
+		free(pool->workers[i].column);
+	}
+	free(pool->workers);
+}
+
+/* Writes the timeline items of the reader, in order. */
+static void
+process_timelines(struct pool *pool)
+{
+	const struct intel_perf_data_reader *reader = pool->output->reader;
+
+	for (uint32_t first = 0; first < reader->n_timelines; first += BATCH_SIZE) {
+		uint32_t last = MIN(first + BATCH_SIZE, reader->n_timelines);
+		uint32_t n_items = DIV_ROUND_UP(last - first, pool->n_workers);
+
+		for (uint32_t i = 0; i < pool->n_workers; i++) {
+			struct worker *worker = &pool->workers[i];
+
+			worker->first = MIN(first + i * n_items, last);
+			worker->last = MIN(worker->first + n_items, last);
+		}
+
+		if (pool->n_workers == 1) {
+			process_items(&pool->workers[0]);
+			continue;
+		}
+
+		pthread_barrier_wait(&pool->start);
+		pthread_barrier_wait(&pool->done);
+
+		for (uint32_t i = 0; i < pool->n_workers; i++) {
+			struct worker *worker = &pool->workers[i];
+
+			fwrite(worker->buf, 1, worker->size, pool->output->file);
+			free(worker->buf);
+			worker->buf = NULL;
+		}
+	}
+}
+
 int
 main(int argc, char *argv[])
 {
 	const struct option long_options[] = {
 		{"help",             no_argument, 0, 'h'},
 		{"counters",   required_argument, 0, 'c'},
+		{"format",     required_argument, 0, 'f'},
+		{"output",     required_argument, 0, 'o'},
+		{"jobs",       required_argument, 0, 'j'},
+		{"stream",           no_argument, 0, 's'},
 		{0, 0, 0, 0}
 	};
 	struct intel_perf_data_reader reader;
-	struct intel_perf_logical_counter **counters;
+	struct output output = {
+		.format = OUTPUT_TEXT,
+		.file = stdout,
+		.reader = &reader,
+	};
+	struct pool pool = {};
 	const struct intel_device_info *devinfo;
-	const char *counter_names = NULL;
-	int32_t n_counters;
+	const char *counter_names = NULL, *output_path = NULL;
+	uint32_t n_jobs = 1;
+	bool stream = false;
+	int ret = EXIT_FAILURE;
+	FILE *info;
 	int fd, opt;
 
-	while ((opt = getopt_long(argc, argv, "hc:", long_options, NULL)) != -1) {
+	while ((opt = getopt_long(argc, argv, "hc:f:o:j:s", long_options, NULL)) != -1) {
 		switch (opt) {
 		case 'h':
 			usage();
@@ -188,6 +656,34 @@ main(int argc, char *argv[])
 		case 'c':
 			counter_names = optarg;
 			break;
+		case 'f': {
+			uint32_t i;
+
+			for (i = 0; i < ARRAY_SIZE(output_formats); i++) {
+				if (!strcmp(optarg, output_formats[i]))
+					break;
+			}
+			if (i == ARRAY_SIZE(output_formats)) {
+				fprintf(stderr, "Unknown output format '%s'.\n", optarg);
+				usage();
+				return EXIT_FAILURE;
+			}
+			output.format = i;
+			break;
+		}
+		case 'o':
+			output_path = optarg;
+			break;
+		case 'j':
+			n_jobs = atoi(optarg);
+			if (n_jobs < 1 || n_jobs > 256) {
+				fprintf(stderr, "Invalid number of jobs '%s'.\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 's':
+			stream = true;
+			break;
 		default:
 			fprintf(stderr, "Internal error: "
 				"unexpected getopt value: %d\n", opt);
@@ -208,78 +704,87 @@ main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
-	if (!intel_perf_data_reader_init(&reader, fd)) {
+	if (stream ? !intel_perf_data_reader_init_stream(&reader, fd) :
+	    !intel_perf_data_reader_init(&reader, fd)) {
 		fprintf(stderr, "Unable to parse '%s': %s.\n",
 			argv[optind], reader.error_msg);
 		return EXIT_FAILURE;
 	}
 
-	counters = get_logical_counters(reader.metric_set, counter_names, &n_counters);
-	if (n_counters < 0)
+	if (!counter_names && output.format != OUTPUT_TEXT)
+		counter_names = "all";
+
+	output.counters = get_logical_counters(reader.metric_set, counter_names,
+					       &output.n_counters);
+	if (output.n_counters < 0)
 		goto exit;
 
+	if (output_path) {
+		output.file = fopen(output_path, "w");
+		if (!output.file) {
+			fprintf(stderr, "Cannot open '%s': %s.\n",
+				output_path, strerror(errno));
+			output.file = stdout;
+			goto exit;
+		}
+	}
+
 	devinfo = intel_get_device_info(reader.devinfo.devid);
 
-	fprintf(stdout, "Recorded on device=0x%x(%s) graphics_ver=%i\n",
+	/* Keeps the values alone in the output of the other formats. */
+	info = output.format == OUTPUT_TEXT ? output.file : stderr;
+
+	fprintf(info, "Recorded on device=0x%x(%s) graphics_ver=%i\n",
 		reader.devinfo.devid, devinfo->codename,
 		reader.devinfo.graphics_ver);
-	fprintf(stdout, "Metric used : %s (%s) uuid=%s\n",
+	fprintf(info, "Metric used : %s (%s) uuid=%s\n",
 		reader.metric_set->symbol_name, reader.metric_set->name,
 		reader.metric_set->hw_config_guid);
-	fprintf(stdout, "Reports: %u\n", reader.n_records);
-	fprintf(stdout, "Context switches: %u\n", reader.n_timelines);
-	fprintf(stdout, "Timestamp correlation points: %u\n", reader.n_correlations);
+	if (!stream) {
+		fprintf(info, "Reports: %u\n", reader.n_records);
+		fprintf(info, "Context switches: %u\n", reader.n_timelines);
+	}
+	fprintf(info, "Timestamp correlation points: %u\n", reader.n_correlations);
+	fprintf(info, "Reports dropped by the recorder: %u\n",
+		((const struct intel_perf_record_device_info *)
+		 reader.record_info)->dropped_reports);
 
 	if (strcmp(reader.metric_set_uuid, reader.metric_set->hw_config_guid)) {
-		fprintf(stdout,
+		fprintf(info,
 			"WARNING: Recording used a different HW configuration.\n"
 			"WARNING: This could lead to inconsistent counter values.\n");
 	}
 
-	for (uint32_t i = 0; i < reader.n_timelines; i++) {
-		const struct intel_perf_timeline_item *item = &reader.timelines[i];
-		const struct drm_i915_perf_record_header *i915_report0 =
-			reader.records[item->record_start];
-		const struct drm_i915_perf_record_header *i915_report1 =
-			reader.records[item->record_end];
-		struct intel_perf_accumulator accu;
-
-		fprintf(stdout, "Time: CPU=0x%016" PRIx64 "-0x%016" PRIx64
-			" GPU=0x%016" PRIx64 "-0x%016" PRIx64"\n",
-			item->cpu_ts_start, item->cpu_ts_end,
-			item->ts_start, item->ts_end);
-		fprintf(stdout, "hw_id=0x%x %s\n",
-			item->hw_id, item->hw_id == 0xffffffff ? "(idle)" : "");
-
-		intel_perf_accumulate_reports(&accu, reader.metric_set->perf_oa_format,
-					      i915_report0, i915_report1);
-
-		for (uint32_t c = 0; c < n_counters; c++) {
-			struct intel_perf_logical_counter *counter = counters[c];
-
-			switch (counter->storage) {
-			case INTEL_PERF_LOGICAL_COUNTER_STORAGE_UINT64:
-			case INTEL_PERF_LOGICAL_COUNTER_STORAGE_UINT32:
-			case INTEL_PERF_LOGICAL_COUNTER_STORAGE_BOOL32:
-				fprintf(stdout, "   %s: %" PRIu64 "\n",
-					counter->symbol_name, counter->read_uint64(reader.perf,
-										   reader.metric_set,
-										   accu.deltas));
-				break;
-			case INTEL_PERF_LOGICAL_COUNTER_STORAGE_DOUBLE:
-			case INTEL_PERF_LOGICAL_COUNTER_STORAGE_FLOAT:
-				fprintf(stdout, "   %s: %f\n",
-					counter->symbol_name, counter->read_float(reader.perf,
-										  reader.metric_set,
-										  accu.deltas));
-				break;
-			}
+	if (!pool_init(&pool, &output, n_jobs)) {
+		fprintf(stderr, "Unable to start %u jobs.\n", n_jobs);
+		goto exit;
+	}
+
+	write_header(&output);
+
+	if (stream) {
+		while (intel_perf_data_reader_next(&reader, STREAM_WINDOW_SIZE))
+			process_timelines(&pool);
+
+		if (reader.error_msg[0]) {
+			fprintf(stderr, "Unable to parse '%s': %s.\n",
+				argv[optind], reader.error_msg);
+			goto exit;
 		}
+	} else {
+		process_timelines(&pool);
 	}
 
+	write_footer(&output);
+	ret = EXIT_SUCCESS;
+
  exit:
+	pool_fini(&pool);
+	free(output.counters);
+	if (output.file != stdout && fclose(output.file))
+		ret = EXIT_FAILURE;
 	intel_perf_data_reader_fini(&reader);
 	close(fd);
 
-	return EXIT_SUCCESS;
+	return ret;
 }
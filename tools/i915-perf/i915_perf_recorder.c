@@ -27,13 +27,18 @@
 #include <getopt.h>
 #include <inttypes.h>
 #include <poll.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
 #include <sys/time.h>
@@ -47,6 +52,7 @@
 #include "intel_chipset.h"
 #include "i915/perf.h"
 #include "i915/perf_data.h"
+#include "i915/perf_data_writer.h"
 
 #include "i915_perf_recorder_commands.h"
 
@@ -202,6 +208,301 @@ cookie_io_functions_t circular_buffer_functions = {
 	.close = circular_buffer_close,
 };
 
+/*
+ * Threaded capture: the main thread only moves the OA data from the perf
+ * stream into large buffers, handed over to a writer thread doing the
+ * chunking, compression and file writes.
+ *
+ * The reader always holds the buffer it fills, the writer owns the buffers
+ * [consumed, produced) it has been handed. Should the writer fall behind
+ * on all of them, the OA data still gets read to keep the OA buffer from
+ * overflowing, and the reports dropped are counted.
+ */
+#define CAPTURE_BUFFER_SIZE (4 * 1024 * 1024)
+#define CAPTURE_N_BUFFERS (16)
+
+/* Least room to read OA data into, larger than any record. */
+#define CAPTURE_MIN_READ (64 * 1024)
+
+/* End of the buffers kept for the correlation records. */
+#define CAPTURE_RESERVE (4096)
+
+struct capture {
+	uint8_t *data;
+	size_t used[CAPTURE_N_BUFFERS];
+
+	_Atomic uint32_t produced;
+	_Atomic uint32_t consumed;
+
+	/* Buffers handed over, buffers written. */
+	int produced_fd;
+	int consumed_fd;
+
+	atomic_bool quit;
+	atomic_bool failed;
+
+	/* Reports being dropped, since the last buffer handed over. */
+	bool dropping;
+
+	FILE *output;
+	pthread_t writer;
+
+	uint8_t scratch[CAPTURE_MIN_READ];
+};
+
+static uint8_t *
+capture_buffer(struct capture *capture, uint32_t index)
+{
+	return capture->data + (size_t) (index % CAPTURE_N_BUFFERS) * CAPTURE_BUFFER_SIZE;
+}
+
+static void *
+capture_writer(void *data)
+{
+	struct capture *capture = data;
+	uint32_t consumed = atomic_load(&capture->consumed);
+	uint64_t value;
+
+	while (true) {
+		uint32_t produced = atomic_load_explicit(&capture->produced,
+							 memory_order_acquire);
+		uint32_t slot = consumed % CAPTURE_N_BUFFERS;
+
+		if (consumed == produced) {
+			if (atomic_load(&capture->quit))
+				break;
+			if (read(capture->produced_fd, &value, sizeof(value)) < 0 &&
+			    errno != EINTR) {
+				fprintf(stderr, "Failed to wait for i915-perf data: %s\n",
+					strerror(errno));
+				break;
+			}
+			continue;
+		}
+
+		if (!atomic_load(&capture->failed) &&
+		    fwrite(capture_buffer(capture, consumed),
+			   capture->used[slot], 1, capture->output) != 1) {
+			fprintf(stderr, "Failed to write i915-perf data: %s\n",
+				strerror(errno));
+			atomic_store(&capture->failed, true);
+		}
+
+		capture->used[slot] = 0;
+		atomic_store_explicit(&capture->consumed, ++consumed,
+				      memory_order_release);
+
+		value = 1;
+		igt_ignore_warn(write(capture->consumed_fd, &value, sizeof(value)));
+	}
+
+	/* Nothing gets written anymore, wake up anyone waiting on us. */
+	if (!atomic_load(&capture->quit)) {
+		atomic_store(&capture->failed, true);
+		atomic_store(&capture->quit, true);
+
+		value = 1;
+		igt_ignore_warn(write(capture->consumed_fd, &value, sizeof(value)));
+	}
+
+	return NULL;
+}
+
+/* Backed by huge pages when possible, prefaulted either way. */
+static void *
+capture_alloc(size_t size)
+{
+	void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE | MAP_HUGETLB,
+			 -1, 0);
+
+	if (ptr != MAP_FAILED)
+		return ptr;
+
+	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED)
+		return NULL;
+
+	/* No hugetlbfs pages reserved, transparent huge pages then. */
+	madvise(ptr, size, MADV_HUGEPAGE);
+	memset(ptr, 0, size);
+
+	return ptr;
+}
+
+static struct capture *
+capture_start(FILE *output)
+{
+	struct capture *capture = calloc(1, sizeof(*capture));
+
+	if (!capture)
+		return NULL;
+
+	capture->output = output;
+	capture->produced_fd = eventfd(0, EFD_CLOEXEC);
+	capture->consumed_fd = eventfd(0, EFD_CLOEXEC);
+	capture->data = capture_alloc((size_t) CAPTURE_N_BUFFERS * CAPTURE_BUFFER_SIZE);
+
+	if (capture->produced_fd < 0 || capture->consumed_fd < 0 ||
+	    !capture->data ||
+	    pthread_create(&capture->writer, NULL, capture_writer, capture)) {
+		if (capture->data)
+			munmap(capture->data, (size_t) CAPTURE_N_BUFFERS * CAPTURE_BUFFER_SIZE);
+		if (capture->produced_fd >= 0)
+			close(capture->produced_fd);
+		if (capture->consumed_fd >= 0)
+			close(capture->consumed_fd);
+		free(capture);
+		return NULL;
+	}
+
+	return capture;
+}
+
+/* Hands the buffer being filled over to the writer, if another one is free. */
+static bool
+capture_submit(struct capture *capture)
+{
+	uint32_t produced = atomic_load_explicit(&capture->produced,
+						 memory_order_relaxed);
+	uint32_t consumed = atomic_load_explicit(&capture->consumed,
+						 memory_order_acquire);
+	uint64_t value = 1;
+
+	if (!capture->used[produced % CAPTURE_N_BUFFERS])
+		return true;
+	if (produced + 1 - consumed >= CAPTURE_N_BUFFERS)
+		return false;
+
+	capture->dropping = false;
+	atomic_store_explicit(&capture->produced, produced + 1,
+			      memory_order_release);
+	igt_ignore_warn(write(capture->produced_fd, &value, sizeof(value)));
+
+	return true;
+}
+
+/*
+ * Waits for the writer to have written everything handed over so far, or
+ * to have given up.
+ */
+static void
+capture_drain(struct capture *capture)
+{
+	uint64_t value;
+
+	while (!capture_submit(capture) && !atomic_load(&capture->quit))
+		igt_ignore_warn(read(capture->consumed_fd, &value, sizeof(value)));
+
+	while (atomic_load_explicit(&capture->consumed, memory_order_acquire) !=
+	       atomic_load_explicit(&capture->produced, memory_order_relaxed) &&
+	       !atomic_load(&capture->quit))
+		igt_ignore_warn(read(capture->consumed_fd, &value, sizeof(value)));
+}
+
+static bool
+capture_stop(struct capture *capture)
+{
+	uint64_t value = 1;
+	bool ok;
+
+	capture_drain(capture);
+
+	atomic_store(&capture->quit, true);
+	igt_ignore_warn(write(capture->produced_fd, &value, sizeof(value)));
+	pthread_join(capture->writer, NULL);
+
+	ok = !atomic_load(&capture->failed);
+
+	munmap(capture->data, (size_t) CAPTURE_N_BUFFERS * CAPTURE_BUFFER_SIZE);
+	close(capture->produced_fd);
+	close(capture->consumed_fd);
+	free(capture);
+
+	return ok;
+}
+
+static uint32_t
+count_reports(const uint8_t *data, size_t size)
+{
+	const struct drm_i915_perf_record_header *header;
+	uint32_t n_reports = 0;
+
+	for (size_t offset = 0; offset + sizeof(*header) <= size;
+	     offset += header->size) {
+		header = (const struct drm_i915_perf_record_header *) (data + offset);
+		if (header->size < sizeof(*header))
+			break;
+		if (header->type == DRM_I915_PERF_RECORD_SAMPLE)
+			n_reports++;
+	}
+
+	return n_reports;
+}
+
+/* Appends a record built by the recorder to the buffer being filled. */
+static bool
+capture_record(struct capture *capture, uint32_t type,
+	       const void *data, size_t size)
+{
+	uint32_t slot = atomic_load_explicit(&capture->produced,
+					     memory_order_relaxed) % CAPTURE_N_BUFFERS;
+	struct drm_i915_perf_record_header header = {
+		.type = type,
+		.size = sizeof(header) + size,
+	};
+	uint8_t *ptr = capture_buffer(capture, slot) + capture->used[slot];
+
+	if (capture->used[slot] + header.size > CAPTURE_BUFFER_SIZE)
+		return false;
+
+	memcpy(ptr, &header, sizeof(header));
+	if (size)
+		memcpy(ptr + sizeof(header), data, size);
+	capture->used[slot] += header.size;
+
+	return true;
+}
+
+/* Reads all the available OA data. */
+static bool
+capture_read(struct capture *capture, int perf_fd, uint32_t *dropped_reports)
+{
+	while (true) {
+		uint32_t slot = atomic_load_explicit(&capture->produced,
+						     memory_order_relaxed) % CAPTURE_N_BUFFERS;
+		size_t room = CAPTURE_BUFFER_SIZE - CAPTURE_RESERVE - capture->used[slot];
+		ssize_t ret;
+
+		if (room < CAPTURE_MIN_READ && capture_submit(capture))
+			continue;
+
+		if (room >= CAPTURE_MIN_READ) {
+			ret = read(perf_fd,
+				   capture_buffer(capture, slot) + capture->used[slot],
+				   room);
+			if (ret > 0)
+				capture->used[slot] += ret;
+		} else {
+			/* Marks the gap, like the kernel does when it drops reports. */
+			if (!capture->dropping)
+				capture->dropping =
+					capture_record(capture,
+						       DRM_I915_PERF_RECORD_OA_REPORT_LOST,
+						       NULL, 0);
+
+			ret = read(perf_fd, capture->scratch, sizeof(capture->scratch));
+			if (ret > 0)
+				*dropped_reports += count_reports(capture->scratch, ret);
+		}
+
+		if (ret == 0 || (ret < 0 && errno == EAGAIN))
+			return true;
+		if (ret < 0 && errno != EINTR)
+			return false;
+	}
+}
 
 static bool
 read_file_uint64(const char *file, uint64_t *value)
@@ -351,6 +652,9 @@ struct recording_context {
 	struct circular_buffer circular_buffer;
 	FILE *output_stream;
 
+	struct capture *capture;
+	uint32_t dropped_reports;
+
 	const char *command_fifo;
 	int command_fifo_fd;
 
@@ -415,10 +719,10 @@ sigint_handler(int val)
 }
 
 static bool
-write_version(FILE *output, struct recording_context *ctx)
+write_version(FILE *output, uint32_t format_version)
 {
 	struct intel_perf_record_version version = {
-		.version = INTEL_PERF_RECORD_VERSION,
+		.version = format_version,
 	};
 	struct drm_i915_perf_record_header header = {
 		.type = INTEL_PERF_RECORD_TYPE_VERSION,
@@ -446,6 +750,7 @@ write_header(FILE *output, struct recording_context *ctx)
 		.oa_format = ctx->metric_set->perf_oa_format,
 		.engine_class = I915_ENGINE_CLASS_RENDER,
 		.engine_instance = 0,
+		.dropped_reports = ctx->dropped_reports,
 	};
 	struct drm_i915_perf_record_header header = {
 		.type = INTEL_PERF_RECORD_TYPE_DEVICE_INFO,
@@ -608,6 +913,60 @@ write_correlation_timestamps(FILE *output, int drm_fd)
 	return write_saved_correlation_timestamps(output, &corr);
 }
 
+static bool
+record_i915_perf_data(struct recording_context *ctx)
+{
+	if (ctx->capture)
+		return capture_read(ctx->capture, ctx->perf_fd,
+				    &ctx->dropped_reports);
+
+	return write_i915_perf_data(ctx->output_stream, ctx->perf_fd);
+}
+
+static bool
+record_correlation_timestamps(struct recording_context *ctx)
+{
+	struct intel_perf_record_timestamp_correlation corr;
+
+	if (!ctx->capture)
+		return write_correlation_timestamps(ctx->output_stream,
+						    ctx->drm_fd);
+
+	if (!get_correlation_timestamps(&corr, ctx->drm_fd))
+		return false;
+
+	/* Only lost with a writer stuck for minutes, not worth stopping. */
+	if (!capture_record(ctx->capture,
+			    INTEL_PERF_RECORD_TYPE_TIMESTAMP_CORRELATION,
+			    &corr, sizeof(corr)))
+		fprintf(stderr, "Dropped timestamp correlation\n");
+
+	/* Keeps the writer busy at regular intervals. */
+	capture_submit(ctx->capture);
+
+	return true;
+}
+
+/* The number of dropped reports is only known once the recording is over. */
+static bool
+write_dropped_reports(const char *path, uint32_t dropped_reports)
+{
+	off_t offset = 2 * sizeof(struct drm_i915_perf_record_header) +
+		sizeof(struct intel_perf_record_version) +
+		offsetof(struct intel_perf_record_device_info, dropped_reports);
+	int fd = open(path, O_WRONLY);
+	bool ok;
+
+	if (fd < 0)
+		return false;
+
+	ok = pwrite(fd, &dropped_reports, sizeof(dropped_reports), offset) ==
+		sizeof(dropped_reports);
+	close(fd);
+
+	return ok;
+}
+
 static void
 read_command_file(struct recording_context *ctx)
 {
@@ -637,11 +996,13 @@ read_command_file(struct recording_context *ctx)
 		if (file) {
 			struct chunk chunks[2];
 
+			if (ctx->capture)
+				capture_drain(ctx->capture);
 			fflush(ctx->output_stream);
 			get_chunks(chunks, &ctx->circular_buffer,
 				   false, ctx->circular_buffer.size);
 
-			if (!write_version(file, ctx) ||
+			if (!write_version(file, INTEL_PERF_RECORD_VERSION) ||
 			    !write_header(file, ctx) ||
 			    !write_topology(file, ctx) ||
 			    fwrite(chunks[0].data, chunks[0].len, 1, file) != 1 ||
@@ -670,18 +1031,19 @@ read_command_file(struct recording_context *ctx)
 static void
 print_metric_sets(const struct intel_perf *perf)
 {
-	struct intel_perf_metric_set *metric_set;
+	const struct intel_perf_metric_set_desc *descs = perf->metric_set_descs;
 	uint32_t longest_name = 0;
 
-	igt_list_for_each_entry(metric_set, &perf->metric_sets, link) {
-		longest_name = MAX(longest_name, strlen(metric_set->symbol_name));
+	/* From the index, without building the metric sets. */
+	for (uint32_t i = 0; i < perf->n_metric_set_descs; i++) {
+		longest_name = MAX(longest_name, strlen(descs[i].symbol_name));
 	}
 
-	igt_list_for_each_entry(metric_set, &perf->metric_sets, link) {
+	for (uint32_t i = 0; i < perf->n_metric_set_descs; i++) {
 		fprintf(stdout, "%s:%*s%s\n",
-			metric_set->symbol_name,
-			(int) (longest_name - strlen(metric_set->symbol_name) + 1), " ",
-			metric_set->name);
+			descs[i].symbol_name,
+			(int) (longest_name - strlen(descs[i].symbol_name) + 1), " ",
+			descs[i].name);
 	}
 }
 
@@ -710,6 +1072,7 @@ print_metric_sets_counters(struct intel_perf *perf)
 {
 	struct intel_perf_metric_set *metric_set;
 
+	intel_perf_load_metric_sets(perf);
 	igt_list_for_each_entry(metric_set, &perf->metric_sets, link)
 		print_metric_set_counters(metric_set);
 }
@@ -738,7 +1101,11 @@ usage(const char *name)
 		"                                       Values: boot, mono, mono_raw (default = mono)\n"
 		"     --poll-period         -P <value>  Polling interval in microseconds used by a timer in the driver to query\n"
 		"                                       for OA reports periodically\n"
-		"                                       (default = 5000), Minimum = 100.\n",
+		"                                       (default = 5000), Minimum = 100.\n"
+		"     --flat,               -F          Write a flat recording, without compressed chunks\n"
+		"                                       nor index (version 1 format)\n"
+		"     --threaded,           -T          Read the i915-perf stream and write the recording\n"
+		"                                       from separate threads, for high sampling rates\n",
 		name);
 }
 
@@ -756,8 +1123,12 @@ teardown_recording_context(struct recording_context *ctx)
 	if (ctx->command_fifo_fd != -1)
 		close(ctx->command_fifo_fd);
 
-	if (ctx->output_stream)
-		fclose(ctx->output_stream);
+	if (ctx->capture && !capture_stop(ctx->capture))
+		fprintf(stderr, "Failed to write the recording\n");
+
+	if (ctx->output_stream && fclose(ctx->output_stream))
+		fprintf(stderr, "Failed to finish the recording: %s\n",
+			strerror(errno));
 
 	free(ctx->circular_buffer.data);
 
@@ -781,6 +1152,8 @@ main(int argc, char *argv[])
 		{"command-fifo",         required_argument, 0, 'f'},
 		{"cpu-clock",            required_argument, 0, 'k'},
 		{"poll-period",          required_argument, 0, 'P'},
+		{"flat",                       no_argument, 0, 'F'},
+		{"threaded",                   no_argument, 0, 'T'},
 		{0, 0, 0, 0}
 	};
 	const struct {
@@ -793,13 +1166,12 @@ main(int argc, char *argv[])
 	};
 	double corr_period = 1.0, perf_period = 0.001;
 	const char *metric_name = NULL, *output_file = "i915_perf.record";
-	struct intel_perf_metric_set *metric_set;
 	struct intel_perf_record_timestamp_correlation initial_correlation;
 	struct timespec now;
 	uint64_t corr_period_ns, poll_time_ns;
 	uint32_t circular_size = 0;
 	int opt;
-	bool list_counters = false;
+	bool list_counters = false, flat = false, threaded = false;
 	FILE *output = NULL;
 	struct recording_context ctx = {
 		.drm_fd = -1,
@@ -812,7 +1184,7 @@ main(int argc, char *argv[])
 		.poll_period = 5 * 1000 * 1000,
 	};
 
-	while ((opt = getopt_long(argc, argv, "hc:p:m:Co:s:f:k:P:", long_options, NULL)) != -1) {
+	while ((opt = getopt_long(argc, argv, "hc:p:m:Co:s:f:k:P:FT", long_options, NULL)) != -1) {
 		switch (opt) {
 		case 'h':
 			usage(argv[0]);
@@ -857,6 +1229,12 @@ main(int argc, char *argv[])
 		case 'P':
 			ctx.poll_period = MAX(100, atol(optarg)) * 1000;
 			break;
+		case 'F':
+			flat = true;
+			break;
+		case 'T':
+			threaded = true;
+			break;
 		default:
 			fprintf(stderr, "Internal error: "
 				"unexpected getopt value: %d\n", opt);
@@ -886,23 +1264,23 @@ main(int argc, char *argv[])
 		goto fail;
 	}
 
-	ctx.perf = intel_perf_for_fd(ctx.drm_fd);
+	/* Only the metric set recorded gets built and configured. */
+	ctx.perf = intel_perf_for_fd_lazy(ctx.drm_fd);
 	if (!ctx.perf) {
 		fprintf(stderr, "No perf data found.\n");
 		goto fail;
 	}
 
-	intel_perf_load_perf_configs(ctx.perf, ctx.drm_fd);
-
 	if (metric_name) {
 		if (!strcmp(metric_name, "list")) {
 			print_metric_sets(ctx.perf);
 			return EXIT_SUCCESS;
 		}
 
-		igt_list_for_each_entry(metric_set, &ctx.perf->metric_sets, link) {
-			if (!strcasecmp(metric_set->symbol_name, metric_name)) {
-				ctx.metric_set = metric_set;
+		for (uint32_t i = 0; i < ctx.perf->n_metric_set_descs; i++) {
+			if (!strcasecmp(ctx.perf->metric_set_descs[i].symbol_name,
+					metric_name)) {
+				ctx.metric_set = intel_perf_load_metric_set(ctx.perf, i);
 				break;
 			}
 		}
@@ -980,16 +1358,29 @@ main(int argc, char *argv[])
 			goto fail;
 		}
 
-		if (!write_version(output, &ctx) ||
-		    !write_header(output, &ctx) ||
-		    !write_topology(output, &ctx) ||
-		    !write_correlation_timestamps(output, ctx.drm_fd)) {
+		if (!flat) {
+			ctx.output_stream =
+				intel_perf_data_writer_open(output, ctx.devinfo->graphics_ver);
+			if (!ctx.output_stream) {
+				fprintf(stderr, "Unable to create indexed output\n");
+				fclose(output);
+				goto fail;
+			}
+		} else {
+			ctx.output_stream = output;
+		}
+
+		if (!write_version(ctx.output_stream,
+				   flat ? INTEL_PERF_RECORD_VERSION :
+					  INTEL_PERF_RECORD_VERSION_INDEXED) ||
+		    !write_header(ctx.output_stream, &ctx) ||
+		    !write_topology(ctx.output_stream, &ctx) ||
+		    !write_correlation_timestamps(ctx.output_stream, ctx.drm_fd)) {
 			fprintf(stderr, "Unable to write header in file '%s'\n",
 				output_file);
 			goto fail;
 		}
 
-		ctx.output_stream = output;
 		fprintf(stdout, "Writing recoding to %s\n", output_file);
 	}
 
@@ -1005,6 +1396,14 @@ main(int argc, char *argv[])
 		ctx.metric_set->perf_oa_metrics_set, ctx.oa_exponent,
 		ctx.metric_set->perf_oa_format);
 
+	if (threaded) {
+		ctx.capture = capture_start(ctx.output_stream);
+		if (!ctx.capture) {
+			fprintf(stderr, "Unable to start capture thread\n");
+			goto fail;
+		}
+	}
+
 	ctx.perf_fd = perf_open(&ctx);
 	if (ctx.perf_fd < 0) {
 		fprintf(stderr, "Unable to open i915 perf stream: %s\n",
@@ -1033,7 +1432,7 @@ main(int argc, char *argv[])
 
 		if (ret > 0) {
 			if (pollfd[0].revents & POLLIN) {
-				if (!write_i915_perf_data(ctx.output_stream, ctx.perf_fd)) {
+				if (!record_i915_perf_data(&ctx)) {
 					fprintf(stderr, "Failed to write i915-perf data: %s\n",
 						strerror(errno));
 					break;
@@ -1048,7 +1447,7 @@ main(int argc, char *argv[])
 		elapsed_ns = igt_nsec_elapsed(&now);
 		if (elapsed_ns > poll_time_ns) {
 			poll_time_ns = corr_period_ns;
-			if (!write_correlation_timestamps(ctx.output_stream, ctx.drm_fd)) {
+			if (!record_correlation_timestamps(&ctx)) {
 				fprintf(stderr,
 					"Failed to write i915 timestamp correlation data: %s\n",
 					strerror(errno));
@@ -1061,7 +1460,7 @@ main(int argc, char *argv[])
 
 	fprintf(stdout, "Exiting...\n");
 
-	if (!write_correlation_timestamps(ctx.output_stream, ctx.drm_fd)) {
+	if (!record_correlation_timestamps(&ctx)) {
 		fprintf(stderr,
 			"Failed to write final i915 timestamp correlation data: %s\n",
 			strerror(errno));
@@ -1069,6 +1468,14 @@ main(int argc, char *argv[])
 
 	teardown_recording_context(&ctx);
 
+	if (ctx.dropped_reports) {
+		fprintf(stderr, "Dropped %u reports\n", ctx.dropped_reports);
+		if (!circular_size &&
+		    !write_dropped_reports(output_file, ctx.dropped_reports))
+			fprintf(stderr, "Unable to write dropped reports in file '%s'\n",
+				output_file);
+	}
+
 	return EXIT_SUCCESS;
 
  fail:
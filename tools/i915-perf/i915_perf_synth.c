@@ -0,0 +1,223 @@
+/*
+ * Copyright (C) 2022 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "i915/perf_synth.h"
+
+#define ARRAY_SIZE(arr) (sizeof(arr)/sizeof(arr[0]))
+
+static const char *context_patterns[] = {
+	[INTEL_PERF_SYNTH_CONTEXTS_SINGLE] = "single",
+	[INTEL_PERF_SYNTH_CONTEXTS_ROUND_ROBIN] = "round-robin",
+	[INTEL_PERF_SYNTH_CONTEXTS_RANDOM] = "random",
+};
+
+static const char *counter_models[] = {
+	[INTEL_PERF_SYNTH_COUNTERS_IDLE] = "idle",
+	[INTEL_PERF_SYNTH_COUNTERS_LINEAR] = "linear",
+	[INTEL_PERF_SYNTH_COUNTERS_RANDOM] = "random",
+};
+
+static void
+usage(void)
+{
+	printf("Usage: i915-perf-synth [options] file\n"
+	       "Writes a synthetic i915-perf recording, for testing and\n"
+	       "benchmarking the perf tools without a GPU.\n"
+	       "\n"
+	       "     --help,              -h           Print this screen\n"
+	       "     --device,            -d id        PCI ID of the device (required)\n"
+	       "     --metric,            -m name      Metric set, defaults to the\n"
+	       "                                       first one of the device\n"
+	       "     --reports,           -n count     Number of OA reports (10000)\n"
+	       "     --rate,              -r hz        OA reports per second (100000)\n"
+	       "     --contexts,          -c pattern   Contexts the reports come from:\n"
+	       "                                         single\n"
+	       "                                         round-robin (default)\n"
+	       "                                         random, with idle periods\n"
+	       "     --context-count,     -x count     Number of contexts (4)\n"
+	       "     --context-run,       -R count     Average reports per context\n"
+	       "                                       run (100)\n"
+	       "     --counters,          -C model     Counter values:\n"
+	       "                                         idle\n"
+	       "                                         linear (default)\n"
+	       "                                         random, wrapping often\n"
+	       "     --lost-every,        -l count     Drop a report in count on\n"
+	       "                                       average (none)\n"
+	       "     --correlation-every, -t count     Timestamp correlation every\n"
+	       "                                       count reports (1000)\n"
+	       "     --flat,              -F           Write a version 1 recording\n"
+	       "     --seed,              -s seed      Random seed (1)\n");
+}
+
+static bool
+parse_name(const char *name, const char **names, uint32_t n_names,
+	   uint32_t *value)
+{
+	for (uint32_t i = 0; i < n_names; i++) {
+		if (!strcmp(name, names[i])) {
+			*value = i;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+int
+main(int argc, char *argv[])
+{
+	const struct option long_options[] = {
+		{"help",                    no_argument, 0, 'h'},
+		{"device",            required_argument, 0, 'd'},
+		{"metric",            required_argument, 0, 'm'},
+		{"reports",           required_argument, 0, 'n'},
+		{"rate",              required_argument, 0, 'r'},
+		{"contexts",          required_argument, 0, 'c'},
+		{"context-count",     required_argument, 0, 'x'},
+		{"context-run",       required_argument, 0, 'R'},
+		{"counters",          required_argument, 0, 'C'},
+		{"lost-every",        required_argument, 0, 'l'},
+		{"correlation-every", required_argument, 0, 't'},
+		{"flat",                    no_argument, 0, 'F'},
+		{"seed",              required_argument, 0, 's'},
+		{0, 0, 0, 0}
+	};
+	struct intel_perf_synth_params params;
+	struct intel_perf_synth_result result;
+	uint32_t device_id = 0, value;
+	int fd, opt;
+
+	intel_perf_synth_params_init(&params, 0);
+
+	while ((opt = getopt_long(argc, argv, "hd:m:n:r:c:x:R:C:l:t:Fs:",
+				  long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'h':
+			usage();
+			return EXIT_SUCCESS;
+		case 'd':
+			device_id = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			params.metric_set = optarg;
+			break;
+		case 'n':
+			params.n_reports = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			params.report_rate = strtoull(optarg, NULL, 0);
+			break;
+		case 'c':
+			if (!parse_name(optarg, context_patterns,
+					ARRAY_SIZE(context_patterns), &value)) {
+				fprintf(stderr, "Unknown context pattern '%s'.\n", optarg);
+				usage();
+				return EXIT_FAILURE;
+			}
+			params.contexts = value;
+			break;
+		case 'x':
+			params.n_contexts = strtoul(optarg, NULL, 0);
+			break;
+		case 'R':
+			params.context_run = strtoul(optarg, NULL, 0);
+			break;
+		case 'C':
+			if (!parse_name(optarg, counter_models,
+					ARRAY_SIZE(counter_models), &value)) {
+				fprintf(stderr, "Unknown counter model '%s'.\n", optarg);
+				usage();
+				return EXIT_FAILURE;
+			}
+			params.counters = value;
+			break;
+		case 'l':
+			params.lost_every = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			params.correlation_every = strtoul(optarg, NULL, 0);
+			break;
+		case 'F':
+			params.flat = true;
+			break;
+		case 's':
+			params.seed = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "Internal error: "
+				"unexpected getopt value: %d\n", opt);
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (!device_id) {
+		fprintf(stderr, "No device specified.\n");
+		return EXIT_FAILURE;
+	}
+	params.device_id = device_id;
+
+	if (optind >= argc) {
+		fprintf(stderr, "No recording file specified.\n");
+		return EXIT_FAILURE;
+	}
+
+	fd = open(argv[optind], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Cannot open '%s': %s.\n",
+			argv[optind], strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	if (!intel_perf_synth_write(fd, &params, &result)) {
+		fprintf(stderr, "Unable to synthesize recording: %s.\n",
+			errno == ENODEV ? "unsupported device" :
+			errno == ENOENT ? "unknown metric set" :
+			strerror(errno));
+		close(fd);
+		unlink(argv[optind]);
+		return EXIT_FAILURE;
+	}
+	close(fd);
+
+	printf("Reports: %u\n", result.n_reports);
+	printf("Lost reports: %u\n", result.n_lost);
+	printf("Context switches: %u\n", result.n_context_switches);
+	printf("Timestamp correlations: %u\n", result.n_correlations);
+	printf("GPU timestamps: %"PRIu64" - %"PRIu64"\n",
+	       result.gpu_ts_begin, result.gpu_ts_end);
+	printf("CPU timestamps: %"PRIu64" - %"PRIu64"\n",
+	       result.cpu_ts_begin, result.cpu_ts_end);
+
+	return EXIT_SUCCESS;
+}
@@ -46,6 +46,9 @@
 #include <unistd.h>
 #include <inttypes.h>
 #include <errno.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <err.h>
 #include <assert.h>
@@ -53,6 +56,8 @@
 #include <zlib.h>
 #include <ctype.h>
 
+#include "igt_aux.h"
+#include "igt_x86.h"
 #include "intel_chipset.h"
 #include "intel_io.h"
 #include "instdone.h"
@@ -66,10 +71,16 @@ print_head(unsigned int reg)
 	return reg & (0x7ffff<<2);
 }
 
+static uint32_t
+ctl_ring_length(unsigned int reg)
+{
+	return (((reg & (0x1ff << 12)) >> 12) + 1) * 4096;
+}
+
 static uint32_t
 print_ctl(unsigned int reg)
 {
-	uint32_t ring_length = 	(((reg & (0x1ff << 12)) >> 12) + 1) * 4096;
+	uint32_t ring_length = ctl_ring_length(reg);
 
 #define BIT_STR(reg, x, on, off) ((1 << (x)) & reg) ? on : off
 
@@ -433,7 +444,57 @@ print_fault_data(unsigned devid, uint32_t data1, uint32_t data0)
 	       data1 & (1 << 4) ? "GGTT" : "PPGTT");
 }
 
-#define MAX_RINGS 10 /* I really hope this never... */
+#define MAX_RINGS 64 /* one per engine, dGPUs have a fair few */
+
+/*
+ * Buffers are decoded by a pool of workers while the error state is still
+ * being read, and printed in file order by the main thread. libdrm's batch
+ * decoder keeps its state in globals, so the batches going through it are
+ * only inflated by the workers, the decoding itself happens when printing.
+ */
+struct buffer {
+	struct buffer *next;
+
+	struct drm_intel_decode *ctx;
+	const char *buffer_name;
+	char *ring_name;
+	uint64_t gtt_offset;
+	uint32_t head_offset;
+	int decode;
+
+	/* ascii85 encoded contents, within the line read from the file */
+	char *line;
+	const char *ascii85;
+	size_t ascii85_len;
+	bool compressed;
+
+	/* Size of the contents once inflated, 0 if unknown */
+	size_t size;
+
+	uint32_t *data;
+	int count;
+
+	/* Printed contents, when not decoded by libdrm */
+	char *text;
+	size_t text_size;
+
+	bool done;
+};
+
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t queued;
+	pthread_cond_t done;
+
+	/* Buffers in file order, next being the first one left to decode */
+	struct buffer *first, *next, **last;
+	unsigned int n_pending;
+	unsigned int max_pending;
+
+	pthread_t *threads;
+	unsigned int n_threads;
+	bool quit;
+} pool;
 
 static bool maybe_ascii(const void *data, int check)
 {
@@ -445,41 +506,39 @@ static bool maybe_ascii(const void *data, int check)
 	return true;
 }
 
-static void decode(struct drm_intel_decode *ctx,
-		   const char *buffer_name,
-		   const char *ring_name,
-		   uint64_t gtt_offset,
-		   uint32_t head_offset,
-		   uint32_t *data, int *count,
-		   int decode)
+static void print_buffer_header(FILE *out, const struct buffer *b)
 {
-	if (!*count)
-		return;
+	fprintf(out, "%s (%s) at 0x%08x_%08x", b->buffer_name, b->ring_name,
+		(unsigned)(b->gtt_offset >> 32),
+		(unsigned)(b->gtt_offset & 0xffffffff));
+	if (b->head_offset != -1)
+		fprintf(out, "; HEAD points to: 0x%08x_%08x",
+			(unsigned)((b->head_offset + b->gtt_offset) >> 32),
+			(unsigned)((b->head_offset + b->gtt_offset) & 0xffffffff));
+	fprintf(out, "\n");
+}
 
-	printf("%s (%s) at 0x%08x_%08x", buffer_name, ring_name,
-	       (unsigned)(gtt_offset >> 32),
-	       (unsigned)(gtt_offset & 0xffffffff));
-	if (head_offset != -1)
-		printf("; HEAD points to: 0x%08x_%08x",
-		       (unsigned)((head_offset + gtt_offset) >> 32),
-		       (unsigned)((head_offset + gtt_offset) & 0xffffffff));
-	printf("\n");
+static bool use_libdrm(const struct buffer *b)
+{
+	return b->decode && b->ctx;
+}
+
+static void write_buffer(FILE *out, const struct buffer *b)
+{
+	const uint32_t *data = b->data;
 
-	if (decode && ctx) {
-		drm_intel_decode_set_batch_pointer(ctx, data, gtt_offset,
-						   *count);
-		drm_intel_decode(ctx);
-	} else if (maybe_ascii(data, 16)) {
-		printf("%*s\n", 4 * *count, (char *)data);
+	print_buffer_header(out, b);
+
+	if (maybe_ascii(data, 16)) {
+		fprintf(out, "%.*s\n", 4 * b->count, (const char *)data);
 	} else {
-		for (int i = 0; i + 4 <= *count; i += 4)
-			printf("[%04x] %08x %08x %08x %08x\n",
-			       4*i, data[i], data[i+1], data[i+2], data[i+3]);
+		for (int i = 0; i + 4 <= b->count; i += 4)
+			fprintf(out, "[%04x] %08x %08x %08x %08x\n",
+				4*i, data[i], data[i+1], data[i+2], data[i+3]);
 	}
-	*count = 0;
 }
 
-static int zlib_inflate(uint32_t **ptr, int len)
+static int zlib_inflate(uint32_t **ptr, int len, size_t size)
 {
 	struct z_stream_s zstream;
 	void *out;
@@ -492,9 +551,16 @@ static int zlib_inflate(uint32_t **ptr, int len)
 	if (inflateInit(&zstream) != Z_OK)
 		return 0;
 
-	out = malloc(128*4096); /* approximate obj size */
+	if (!size)
+		size = 128*4096; /* approximate obj size */
+
+	out = malloc(size);
+	if (out == NULL) {
+		inflateEnd(&zstream);
+		return 0;
+	}
 	zstream.next_out = out;
-	zstream.avail_out = 128*4096;
+	zstream.avail_out = size;
 
 	do {
 		switch (inflate(&zstream, Z_SYNC_FLUSH)) {
@@ -503,6 +569,7 @@ static int zlib_inflate(uint32_t **ptr, int len)
 		case Z_OK:
 			break;
 		default:
+			free(out);
 			inflateEnd(&zstream);
 			return 0;
 		}
@@ -510,6 +577,7 @@ static int zlib_inflate(uint32_t **ptr, int len)
 		if (zstream.avail_out)
 			break;
 
+		/* The size was only a guess, or the object was not a ring */
 		out = realloc(out, 2*zstream.total_out);
 		if (out == NULL) {
 			inflateEnd(&zstream);
@@ -526,41 +594,483 @@ end:
 	return zstream.total_out / 4;
 }
 
-static int ascii85_decode(const char *in, uint32_t **out, bool inflate)
+static const char *
+ascii85_decode_group(const char *in, const char *end, uint32_t *out)
 {
-	int len = 0, size = 1024;
+	uint32_t v = 0;
 
-	*out = realloc(*out, sizeof(uint32_t)*size);
-	if (*out == NULL)
-		return 0;
+	if (*in == 'z') {
+		*out = 0;
+		return in + 1;
+	}
+
+	if (end - in < 5)
+		return NULL;
 
-	while (*in >= '!' && *in <= 'z') {
-		uint32_t v = 0;
+	v += in[0] - 33; v *= 85;
+	v += in[1] - 33; v *= 85;
+	v += in[2] - 33; v *= 85;
+	v += in[3] - 33; v *= 85;
+	v += in[4] - 33;
+	*out = v;
+
+	return in + 5;
+}
+
+static uint32_t *
+ascii85_decode_scalar(const char *in, const char *end, uint32_t *out)
+{
+	while (in < end) {
+		in = ascii85_decode_group(in, end, out);
+		if (!in)
+			break;
+		out++;
+	}
 
-		if (len == size) {
-			size *= 2;
-			*out = realloc(*out, sizeof(uint32_t)*size);
-			if (*out == NULL)
-				return 0;
+	return out;
+}
+
+#if defined(__x86_64__) && !defined(__clang__)
+#pragma GCC push_options
+#pragma GCC target("sse4.1")
+
+#include <smmintrin.h>
+
+/*
+ * Shuffles gathering characters of 4 consecutive groups into each 32bit lane,
+ * from the first 16 characters (lo) and the 16 characters starting at the
+ * 5th one (hi): the first and second characters as 16bit pairs, the third and
+ * fourth likewise, and the fifth one into the high half.
+ */
+#define LO(x) ((x) < 16 ? (x) : 0x80)
+#define HI(x) ((x) < 16 ? 0x80 : (x) - 4)
+#define PAIR(M, i, a, b) M(5 * (i) + (a)), 0x80, M(5 * (i) + (b)), 0x80
+#define LAST(M, i) 0x80, 0x80, M(5 * (i) + 4), 0x80
+#define PAIRS(M, a, b) \
+	{ PAIR(M, 0, a, b), PAIR(M, 1, a, b), PAIR(M, 2, a, b), PAIR(M, 3, a, b) }
+#define LASTS(M) { LAST(M, 0), LAST(M, 1), LAST(M, 2), LAST(M, 3) }
+
+static const uint8_t ascii85_lo[3][16] __attribute__((aligned(16))) = {
+	PAIRS(LO, 0, 1), PAIRS(LO, 2, 3), LASTS(LO),
+};
+
+static const uint8_t ascii85_hi[3][16] __attribute__((aligned(16))) = {
+	PAIRS(HI, 0, 1), PAIRS(HI, 2, 3), LASTS(HI),
+};
+
+#undef LASTS
+#undef PAIRS
+#undef LAST
+#undef PAIR
+#undef HI
+#undef LO
+
+static uint32_t *
+ascii85_decode_sse41(const char *in, const char *end, uint32_t *out)
+{
+	const __m128i *mask_lo = (const __m128i *)ascii85_lo;
+	const __m128i *mask_hi = (const __m128i *)ascii85_hi;
+	const __m128i zero = _mm_set1_epi8('z');
+	const __m128i bias = _mm_set1_epi8(33);
+	const __m128i base = _mm_set1_epi32(85 | 1 << 16);
+	const __m128i base3 = _mm_set1_epi32(85 * 85 * 85);
+
+	while (in < end) {
+		/* 4 groups at a time, as long as none of them is a 'z' */
+		if (end - in >= 20) {
+			__m128i lo = _mm_loadu_si128((const __m128i *)in);
+			__m128i hi = _mm_loadu_si128((const __m128i *)(in + 4));
+			__m128i z = _mm_or_si128(_mm_cmpeq_epi8(lo, zero),
+						 _mm_cmpeq_epi8(hi, zero));
+
+			if (!_mm_movemask_epi8(z)) {
+				__m128i c01, c23, c4, v;
+
+				lo = _mm_sub_epi8(lo, bias);
+				hi = _mm_sub_epi8(hi, bias);
+
+				c01 = _mm_or_si128(_mm_shuffle_epi8(lo, mask_lo[0]),
+						   _mm_shuffle_epi8(hi, mask_hi[0]));
+				c23 = _mm_or_si128(_mm_shuffle_epi8(lo, mask_lo[1]),
+						   _mm_shuffle_epi8(hi, mask_hi[1]));
+				c4 = _mm_or_si128(_mm_shuffle_epi8(lo, mask_lo[2]),
+						  _mm_shuffle_epi8(hi, mask_hi[2]));
+
+				/* c0 * 85 + c1 and c2 * 85 + c3 */
+				c01 = _mm_madd_epi16(c01, base);
+				c23 = _mm_madd_epi16(c23, base);
+
+				/* (c2 * 85 + c3) * 85 + c4 */
+				c23 = _mm_madd_epi16(_mm_or_si128(c23, c4), base);
+
+				v = _mm_add_epi32(_mm_mullo_epi32(c01, base3), c23);
+
+				_mm_storeu_si128((__m128i *)out, v);
+				in += 20;
+				out += 4;
+				continue;
+			}
 		}
 
-		if (*in == 'z') {
-			in++;
-		} else {
-			v += in[0] - 33; v *= 85;
-			v += in[1] - 33; v *= 85;
-			v += in[2] - 33; v *= 85;
-			v += in[3] - 33; v *= 85;
-			v += in[4] - 33;
-			in += 5;
+		in = ascii85_decode_group(in, end, out);
+		if (!in)
+			break;
+		out++;
+	}
+
+	return out;
+}
+
+#pragma GCC pop_options
+#endif
+
+static uint32_t *
+(*ascii85_decode_groups)(const char *in, const char *end, uint32_t *out) =
+	ascii85_decode_scalar;
+
+static void ascii85_decode(struct buffer *b)
+{
+	const char *in = b->ascii85, *end = in;
+	size_t zeros = 0;
+	uint32_t *data;
+	int count;
+
+	/* Size the output exactly, 'z' stands for a whole dword of zeroes */
+	while (end < in + b->ascii85_len && *end >= '!' && *end <= 'z')
+		zeros += *end++ == 'z';
+
+	count = zeros + (end - in - zeros) / 5;
+	if (!count)
+		return;
+
+	data = malloc(sizeof(uint32_t) * count);
+	if (data == NULL)
+		return;
+
+	count = ascii85_decode_groups(in, end, data) - data;
+
+	free(b->line);
+	b->line = NULL;
+
+	if (b->compressed)
+		count = zlib_inflate(&data, count, b->size);
+
+	if (!count) {
+		free(data);
+		return;
+	}
+
+	b->data = data;
+	b->count = count;
+}
+
+static void process_buffer(struct buffer *b)
+{
+	FILE *out;
+
+	if (b->ascii85)
+		ascii85_decode(b);
+
+	if (!b->count || use_libdrm(b))
+		return;
+
+	out = open_memstream(&b->text, &b->text_size);
+	if (out == NULL)
+		return;
+
+	write_buffer(out, b);
+	fclose(out);
+}
+
+static void print_buffer(struct buffer *b)
+{
+	if (b->ascii85 && !b->count)
+		fprintf(stderr, "ASCII85 decode failed (%s - %s).\n",
+			b->ring_name, b->buffer_name);
+
+	if (!b->count)
+		return;
+
+	if (use_libdrm(b)) {
+		print_buffer_header(stdout, b);
+		drm_intel_decode_set_batch_pointer(b->ctx, b->data,
+						   b->gtt_offset, b->count);
+		drm_intel_decode(b->ctx);
+	} else if (b->text) {
+		fwrite(b->text, 1, b->text_size, stdout);
+	} else {
+		write_buffer(stdout, b);
+	}
+}
+
+static void free_buffer(struct buffer *b)
+{
+	free(b->ring_name);
+	free(b->line);
+	free(b->data);
+	free(b->text);
+	free(b);
+}
+
+static void *buffer_worker(void *arg)
+{
+	pthread_mutex_lock(&pool.mutex);
+	while (true) {
+		struct buffer *b = pool.next;
+
+		if (!b) {
+			if (pool.quit)
+				break;
+			pthread_cond_wait(&pool.queued, &pool.mutex);
+			continue;
+		}
+
+		pool.next = b->next;
+		pthread_mutex_unlock(&pool.mutex);
+
+		process_buffer(b);
+
+		pthread_mutex_lock(&pool.mutex);
+		b->done = true;
+		pthread_cond_signal(&pool.done);
+	}
+	pthread_mutex_unlock(&pool.mutex);
+
+	return NULL;
+}
+
+static void pool_init(void)
+{
+	long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+#if defined(__x86_64__) && !defined(__clang__)
+	if (igt_x86_features() & SSE4_1)
+		ascii85_decode_groups = ascii85_decode_sse41;
+#endif
+
+	pool.first = pool.next = NULL;
+	pool.last = &pool.first;
+	pool.n_pending = 0;
+	pool.quit = false;
+
+	/* A single cpu decodes the buffers as they are read. */
+	pool.n_threads = 0;
+	if (n_cpus <= 1)
+		return;
+
+	pool.threads = calloc(n_cpus, sizeof(*pool.threads));
+	if (!pool.threads)
+		return;
+
+	pthread_mutex_init(&pool.mutex, NULL);
+	pthread_cond_init(&pool.queued, NULL);
+	pthread_cond_init(&pool.done, NULL);
+
+	for (; pool.n_threads < n_cpus; pool.n_threads++) {
+		if (pthread_create(&pool.threads[pool.n_threads], NULL,
+				   buffer_worker, NULL))
+			break;
+	}
+
+	/* Bounds the memory held by the buffers read ahead. */
+	pool.max_pending = 4 * pool.n_threads;
+}
+
+static void pool_fini(void)
+{
+	if (!pool.n_threads)
+		return;
+
+	pthread_mutex_lock(&pool.mutex);
+	pool.quit = true;
+	pthread_cond_broadcast(&pool.queued);
+	pthread_mutex_unlock(&pool.mutex);
+
+	for (unsigned int i = 0; i < pool.n_threads; i++)
+		pthread_join(pool.threads[i], NULL);
+
+	pthread_cond_destroy(&pool.done);
+	pthread_cond_destroy(&pool.queued);
+	pthread_mutex_destroy(&pool.mutex);
+	free(pool.threads);
+	pool.threads = NULL;
+	pool.n_threads = 0;
+}
+
+/*
+ * Prints the decoded buffers in file order, waiting on the workers until at
+ * most max_pending buffers are left.
+ */
+static void flush_buffers(unsigned int max_pending)
+{
+	if (!pool.n_threads)
+		return;
+
+	pthread_mutex_lock(&pool.mutex);
+	while (pool.first && (pool.first->done || pool.n_pending > max_pending)) {
+		struct buffer *b = pool.first;
+
+		if (!b->done) {
+			pthread_cond_wait(&pool.done, &pool.mutex);
+			continue;
+		}
+
+		pool.first = b->next;
+		if (!pool.first)
+			pool.last = &pool.first;
+		pool.n_pending--;
+		pthread_mutex_unlock(&pool.mutex);
+
+		print_buffer(b);
+		free_buffer(b);
+
+		pthread_mutex_lock(&pool.mutex);
+	}
+	pthread_mutex_unlock(&pool.mutex);
+}
+
+static void queue_buffer(struct buffer *b)
+{
+	if (!pool.n_threads) {
+		process_buffer(b);
+		print_buffer(b);
+		free_buffer(b);
+		return;
+	}
+
+	pthread_mutex_lock(&pool.mutex);
+	*pool.last = b;
+	pool.last = &b->next;
+	if (!pool.next)
+		pool.next = b;
+	pool.n_pending++;
+	pthread_cond_signal(&pool.queued);
+	pthread_mutex_unlock(&pool.mutex);
+
+	flush_buffers(pool.max_pending);
+}
+
+static struct buffer *
+new_buffer(struct drm_intel_decode *ctx,
+	   const char *buffer_name,
+	   const char *ring_name,
+	   uint64_t gtt_offset,
+	   uint32_t head_offset,
+	   int decode)
+{
+	struct buffer *b = calloc(1, sizeof(*b));
+
+	if (b == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+
+	b->ctx = ctx;
+	b->buffer_name = buffer_name;
+	b->ring_name = ring_name ? strdup(ring_name) : NULL;
+	b->gtt_offset = gtt_offset;
+	b->head_offset = head_offset;
+	b->decode = decode;
+
+	return b;
+}
+
+static void decode(struct drm_intel_decode *ctx,
+		   const char *buffer_name,
+		   const char *ring_name,
+		   uint64_t gtt_offset,
+		   uint32_t head_offset,
+		   uint32_t **data, int *data_size, int *count,
+		   int decode)
+{
+	struct buffer *b;
+
+	if (!*count)
+		return;
+
+	b = new_buffer(ctx, buffer_name, ring_name,
+		       gtt_offset, head_offset, decode);
+	b->data = *data;
+	b->count = *count;
+	queue_buffer(b);
+
+	*data = NULL;
+	*data_size = 0;
+	*count = 0;
+}
+
+static const struct buffer_type {
+	const char *match;
+	const char *name;
+	int do_decode;
+} buffer_types[] = {
+	{ "ring", "ring", 1 },
+	{ "batch", "batch", 1 },
+	{ "ringbuffer", "ring", 1 },
+	{ "gtt_offset", "batch", 1 },
+	{ "NULL context", "NULL context", 0 },
+	{ "hw context", "HW context", 1 },
+	{ "hw status", "HW status", 0 },
+	{ "wa context", "WA context", 1 },
+	{ "wa batchbuffer", "WA batch", 1 },
+	{ "user", "user", 0 },
+	{ "semaphores", "semaphores", 0 },
+	{ "guc log buffer", "GuC log", 0 },
+	{ },
+};
+
+/*
+ * Parses a "<ring> --- <buffer> = 0x<hi> <lo>" line, dashes pointing to the
+ * "---". Returns the type of the buffer, NULL if not recognised.
+ */
+static const struct buffer_type *
+parse_buffer_header(const char *line, const char *dashes,
+		    char **ring_name, uint64_t *gtt_offset)
+{
+	const struct buffer_type *b;
+
+	*ring_name = malloc(dashes - line);
+	strncpy(*ring_name, line, dashes - line);
+	(*ring_name)[dashes - line - 1] = '\0';
+
+	dashes += 4;
+	for (b = buffer_types; b->match; b++) {
+		uint32_t lo, hi;
+		int matched;
+
+		if (strncasecmp(dashes, b->match, strlen(b->match)))
+			continue;
+
+		dashes = strchr(dashes, '=');
+		if (!dashes)
+			return NULL;
+
+		matched = sscanf(dashes, "= 0x%08x %08x\n", &hi, &lo);
+		if (matched > 0) {
+			*gtt_offset = hi;
+			if (matched == 2) {
+				*gtt_offset <<= 32;
+				*gtt_offset |= lo;
+			}
 		}
-		(*out)[len++] = v;
+
+		return b;
 	}
 
-	if (!inflate)
-		return len;
+	return NULL;
+}
+
+static bool parse_pci_id(const char *line, unsigned int *reg)
+{
+	const char *pci_id_start;
+
+	if (sscanf(line, "PCI ID: 0x%04x\n", reg) == 1 ||
+	    sscanf(line, " PCI ID: 0x%04x\n", reg) == 1)
+		return true;
 
-	return zlib_inflate(out, len);
+	pci_id_start = strstr(line, "PCI ID");
+	return pci_id_start &&
+		sscanf(pci_id_start, "PCI ID: 0x%04x\n", reg) == 1;
 }
 
 static void
@@ -570,98 +1080,76 @@ read_data_file(FILE *file)
 	uint32_t devid = PCI_CHIP_I855_GM;
 	uint32_t *data = NULL;
 	uint32_t head[MAX_RINGS];
+	uint32_t ring_lengths[MAX_RINGS];
 	int head_idx = 0;
 	int num_rings = 0;
+	int num_ctls = 0;
 	long long unsigned fence;
 	int data_size = 0, count = 0, matched;
 	char *line = NULL;
-	size_t line_size;
+	size_t line_size = 0;
+	ssize_t len;
 	uint32_t offset, value, ring_length = 0;
 	uint64_t gtt_offset = 0;
 	uint32_t head_offset = -1;
+	size_t size = 0;
 	const char *buffer_name = "batch buffer";
 	char *ring_name = NULL;
 	int do_decode = 1;
 
-	while (getline(&line, &line_size, file) > 0) {
+	pool_init();
+
+	while ((len = getline(&line, &line_size, file)) > 0) {
 		char *dashes;
 
 		if (line[0] == ':' || line[0] == '~') {
-			count = ascii85_decode(line+1, &data, line[0] == ':');
-			if (count == 0)
-				fprintf(stderr, "ASCII85 decode failed (%s - %s).\n",
-					ring_name, buffer_name);
-			decode(decode_ctx,
-			       buffer_name, ring_name,
-			       gtt_offset, head_offset,
-			       data, &count, do_decode);
+			struct buffer *b;
+
+			b = new_buffer(decode_ctx,
+				       buffer_name, ring_name,
+				       gtt_offset, head_offset, do_decode);
+
+			/* Hand the line over, getline() allocates a new one. */
+			b->line = line;
+			b->ascii85 = line + 1;
+			b->ascii85_len = len - 1;
+			b->compressed = line[0] == ':';
+			b->size = size;
+			line = NULL;
+			line_size = 0;
+
+			count = 0;
+			queue_buffer(b);
 			continue;
 		}
 
 		dashes = strstr(line, "---");
 		if (dashes) {
-			const struct {
-				const char *match;
-				const char *name;
-				int do_decode;
-			} buffers[] = {
-				{ "ring", "ring", 1 },
-				{ "batch", "batch", 1 },
-				{ "ringbuffer", "ring", 1 },
-				{ "gtt_offset", "batch", 1 },
-				{ "NULL context", "NULL context", 0 },
-				{ "hw context", "HW context", 1 },
-				{ "hw status", "HW status", 0 },
-				{ "wa context", "WA context", 1 },
-				{ "wa batchbuffer", "WA batch", 1 },
-				{ "user", "user", 0 },
-				{ "semaphores", "semaphores", 0 },
-				{ "guc log buffer", "GuC log", 0 },
-				{ },
-			}, *b;
+			const struct buffer_type *b;
 			char *new_ring_name;
 
-			new_ring_name = malloc(dashes - line);
-			strncpy(new_ring_name, line, dashes - line);
-			new_ring_name[dashes - line - 1] = '\0';
-
 			decode(decode_ctx,
 			       buffer_name, ring_name,
 			       gtt_offset, head_offset,
-			       data, &count, do_decode);
+			       &data, &data_size, &count, do_decode);
 			gtt_offset = 0;
 			head_offset = -1;
+			size = 0;
 
+			b = parse_buffer_header(line, dashes,
+						&new_ring_name, &gtt_offset);
 			free(ring_name);
 			ring_name = new_ring_name;
 
-			dashes += 4;
-			for (b = buffers; b->match; b++) {
-				uint32_t lo, hi;
-
-				if (strncasecmp(dashes, b->match,
-						strlen(b->match)))
-					continue;
-
-				dashes = strchr(dashes, '=');
-				if (!dashes)
-					break;
-
-				matched = sscanf(dashes, "= 0x%08x %08x\n",
-						 &hi, &lo);
-				if (matched > 0) {
-					gtt_offset = hi;
-					if (matched == 2) {
-						gtt_offset <<= 32;
-						gtt_offset |= lo;
-					}
-				}
-
+			if (b) {
 				do_decode = b->do_decode;
 				buffer_name = b->name;
-				if (b == buffers)
+				if (b == buffer_types && head_idx < num_rings) {
+					/* The ring object is as large as the ring */
+					if (head_idx < num_ctls)
+						size = ring_lengths[head_idx];
 					head_offset = head[head_idx++];
-				break;
+				}
 			}
 
 			continue;
@@ -675,19 +1163,12 @@ read_data_file(FILE *file)
 			decode(decode_ctx,
 			       buffer_name, ring_name,
 			       gtt_offset, head_offset,
-			       data, &count, do_decode);
+			       &data, &data_size, &count, do_decode);
+			flush_buffers(0);
 
 			printf("%s", line);
 
-			matched = sscanf(line, "PCI ID: 0x%04x\n", &reg);
-			if (matched == 0)
-				matched = sscanf(line, " PCI ID: 0x%04x\n", &reg);
-			if (matched == 0) {
-				const char *pci_id_start = strstr(line, "PCI ID");
-				if (pci_id_start)
-					matched = sscanf(pci_id_start, "PCI ID: 0x%04x\n", &reg);
-			}
-			if (matched == 1) {
+			if (parse_pci_id(line, &reg)) {
 				devid = reg;
 				printf("Detected GEN%i chipset\n",
 						intel_gen(devid));
@@ -696,12 +1177,17 @@ read_data_file(FILE *file)
 			}
 
 			matched = sscanf(line, "  CTL: 0x%08x\n", &reg);
-			if (matched == 1)
+			if (matched == 1) {
 				ring_length = print_ctl(reg);
+				if (num_ctls < MAX_RINGS)
+					ring_lengths[num_ctls++] = ring_length;
+			}
 
 			matched = sscanf(line, "  HEAD: 0x%08x\n", &reg);
 			if (matched == 1) {
-				head[num_rings++] = print_head(reg);
+				reg = print_head(reg);
+				if (num_rings < MAX_RINGS)
+					head[num_rings++] = reg;
 			}
 
 			matched = sscanf(line, "  ACTHD: 0x%08x\n", &reg);
@@ -761,13 +1247,466 @@ read_data_file(FILE *file)
 	decode(decode_ctx,
 	       buffer_name, ring_name,
 	       gtt_offset, head_offset,
-	       data, &count, do_decode);
+	       &data, &data_size, &count, do_decode);
+	flush_buffers(0);
+	pool_fini();
 
 	free(data);
 	free(line);
 	free(ring_name);
 }
 
+/*
+ * Targeted lookups index the error state first, recording the engines and
+ * where each buffer's ascii85 data lives in the file, and then only decode
+ * the buffers asked for.
+ */
+
+/* Dwords printed before and after the address looked up */
+#define AROUND_DWORDS 64
+
+enum around {
+	AROUND_NONE,
+	AROUND_ACTHD,
+	AROUND_HEAD,
+	AROUND_ADDRESS,
+};
+
+struct query {
+	const char *engine;
+	const char *buffer;
+	enum around around;
+	uint64_t address;
+	bool list;
+};
+
+struct engine_info {
+	char *name;
+	uint32_t head;
+	uint32_t ring_length;
+	uint64_t acthd;
+	bool has_head;
+	bool has_acthd;
+};
+
+struct blob_info {
+	char *ring_name;
+	const char *buffer_name;
+	int decode;
+	uint64_t gtt_offset;
+
+	/* ascii85 data in the file */
+	size_t offset;
+	size_t len;
+	bool compressed;
+};
+
+struct error_index {
+	char *data;
+	size_t size;
+	bool mapped;
+
+	unsigned int devid;
+	bool has_devid;
+
+	struct engine_info *engines;
+	unsigned int n_engines, max_engines;
+
+	struct blob_info *blobs;
+	unsigned int n_blobs, max_blobs;
+};
+
+static bool load_error_state(FILE *file, struct error_index *idx)
+{
+	struct stat st;
+	size_t max = 0;
+
+	memset(idx, 0, sizeof(*idx));
+
+	/* debugfs and sysfs files can't be mapped, nor can pipes */
+	if (fstat(fileno(file), &st) == 0 && S_ISREG(st.st_mode) && st.st_size) {
+		idx->data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+				 fileno(file), 0);
+		if (idx->data != MAP_FAILED) {
+			idx->size = st.st_size;
+			idx->mapped = true;
+			return true;
+		}
+		idx->data = NULL;
+	}
+
+	do {
+		if (idx->size == max) {
+			char *data;
+
+			max = max ? 2 * max : 1 << 20;
+			data = realloc(idx->data, max);
+			if (data == NULL) {
+				free(idx->data);
+				return false;
+			}
+			idx->data = data;
+		}
+
+		idx->size += fread(idx->data + idx->size, 1,
+				   max - idx->size, file);
+	} while (!feof(file) && !ferror(file));
+
+	return !ferror(file);
+}
+
+static struct engine_info *
+add_engine(struct error_index *idx, const char *name, size_t len)
+{
+	struct engine_info *engine;
+
+	if (idx->n_engines == idx->max_engines) {
+		idx->max_engines = idx->max_engines ? 2 * idx->max_engines : 16;
+		idx->engines = realloc(idx->engines,
+				       idx->max_engines * sizeof(*idx->engines));
+		if (idx->engines == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			exit(1);
+		}
+	}
+
+	engine = &idx->engines[idx->n_engines++];
+	memset(engine, 0, sizeof(*engine));
+	engine->name = strndup(name, len);
+
+	return engine;
+}
+
+static struct blob_info *add_blob(struct error_index *idx)
+{
+	struct blob_info *blob;
+
+	if (idx->n_blobs == idx->max_blobs) {
+		idx->max_blobs = idx->max_blobs ? 2 * idx->max_blobs : 64;
+		idx->blobs = realloc(idx->blobs,
+				     idx->max_blobs * sizeof(*idx->blobs));
+		if (idx->blobs == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			exit(1);
+		}
+	}
+
+	blob = &idx->blobs[idx->n_blobs++];
+	memset(blob, 0, sizeof(*blob));
+
+	return blob;
+}
+
+static void index_error_state(struct error_index *idx)
+{
+	struct engine_info *engine = NULL;
+	const char *buffer_name = "batch buffer";
+	char *ring_name = NULL;
+	uint64_t gtt_offset = 0;
+	int do_decode = 1;
+	size_t pos, next;
+
+	for (pos = 0; pos < idx->size; pos = next) {
+		const char *line = idx->data + pos;
+		const char *eol = memchr(line, '\n', idx->size - pos);
+		unsigned int reg, hi, lo;
+		char buf[256], *dashes, *name;
+		size_t len;
+
+		len = eol ? eol - line : idx->size - pos;
+		next = pos + len + 1;
+
+		/* The blobs are only located, not decoded. */
+		if (line[0] == ':' || line[0] == '~') {
+			struct blob_info *blob = add_blob(idx);
+
+			blob->ring_name = ring_name ? strdup(ring_name) : NULL;
+			blob->buffer_name = buffer_name;
+			blob->decode = do_decode;
+			blob->gtt_offset = gtt_offset;
+			blob->offset = pos + 1;
+			blob->len = len - 1;
+			blob->compressed = line[0] == ':';
+			continue;
+		}
+
+		len = min(len, sizeof(buf) - 1);
+		memcpy(buf, line, len);
+		buf[len] = '\0';
+
+		dashes = strstr(buf, "---");
+		if (dashes) {
+			const struct buffer_type *b;
+			char *new_ring_name;
+
+			gtt_offset = 0;
+			b = parse_buffer_header(buf, dashes,
+						&new_ring_name, &gtt_offset);
+			free(ring_name);
+			ring_name = new_ring_name;
+
+			if (b) {
+				do_decode = b->do_decode;
+				buffer_name = b->name;
+			}
+			continue;
+		}
+
+		if (parse_pci_id(buf, &reg)) {
+			idx->devid = reg;
+			idx->has_devid = true;
+			continue;
+		}
+
+		name = strstr(buf, " command stream:");
+		if (name) {
+			const char *start = buf;
+
+			while (*start == ' ')
+				start++;
+			engine = add_engine(idx, start, name - start);
+			continue;
+		}
+
+		if (!engine)
+			continue;
+
+		if (sscanf(buf, "  HEAD: 0x%08x", &reg) == 1) {
+			engine->head = reg & (0x7ffff << 2);
+			engine->has_head = true;
+		} else if (sscanf(buf, "  CTL: 0x%08x", &reg) == 1) {
+			engine->ring_length = ctl_ring_length(reg);
+		} else if (sscanf(buf, "  ACTHD: 0x%08x_%08x", &hi, &lo) == 2) {
+			engine->acthd = (uint64_t)hi << 32 | lo;
+			engine->has_acthd = true;
+		} else if (sscanf(buf, "  ACTHD: 0x%08x", &reg) == 1) {
+			engine->acthd = reg;
+			engine->has_acthd = true;
+		}
+	}
+
+	free(ring_name);
+}
+
+static void free_error_index(struct error_index *idx)
+{
+	for (unsigned int i = 0; i < idx->n_engines; i++)
+		free(idx->engines[i].name);
+	free(idx->engines);
+
+	for (unsigned int i = 0; i < idx->n_blobs; i++)
+		free(idx->blobs[i].ring_name);
+	free(idx->blobs);
+
+	if (idx->mapped)
+		munmap(idx->data, idx->size);
+	else
+		free(idx->data);
+}
+
+static const struct engine_info *
+find_engine(const struct error_index *idx, const char *name)
+{
+	if (!name)
+		return NULL;
+
+	for (unsigned int i = 0; i < idx->n_engines; i++) {
+		if (!strcmp(idx->engines[i].name, name))
+			return &idx->engines[i];
+	}
+
+	return NULL;
+}
+
+static bool is_ring(const struct blob_info *blob)
+{
+	return !strcmp(blob->buffer_name, "ring");
+}
+
+/* Byte offset within the buffer of the address looked up. */
+static bool around_offset(const struct query *q,
+			  const struct blob_info *blob,
+			  const struct engine_info *engine,
+			  uint64_t size, uint64_t *offset)
+{
+	uint64_t address = q->address;
+
+	switch (q->around) {
+	case AROUND_NONE:
+		return false;
+	case AROUND_HEAD:
+		if (!is_ring(blob) || !engine || !engine->has_head)
+			return false;
+		*offset = engine->head;
+		return *offset < size;
+	case AROUND_ACTHD:
+		if (!engine || !engine->has_acthd)
+			return false;
+		address = engine->acthd;
+		break;
+	case AROUND_ADDRESS:
+		break;
+	}
+
+	if (address >= blob->gtt_offset && address - blob->gtt_offset < size) {
+		*offset = address - blob->gtt_offset;
+		return true;
+	}
+
+	/* Older parts report ACTHD within the ring, see print_acthd() */
+	if (q->around == AROUND_ACTHD && is_ring(blob) &&
+	    (address & (0x7ffff << 2)) < engine->ring_length &&
+	    (address & (0x7ffff << 2)) < size) {
+		*offset = address & (0x7ffff << 2);
+		return true;
+	}
+
+	return false;
+}
+
+static void print_around(struct buffer *b, uint64_t offset)
+{
+	int target = offset / 4;
+	int first = max(target - AROUND_DWORDS, 0) & ~3;
+	int last = min(target + AROUND_DWORDS, b->count);
+
+	print_buffer_header(stdout, b);
+	printf("around 0x%08x_%08x\n",
+	       (unsigned)((b->gtt_offset + offset) >> 32),
+	       (unsigned)((b->gtt_offset + offset) & 0xffffffff));
+
+	if (use_libdrm(b)) {
+		drm_intel_decode_set_head_tail(b->ctx, b->gtt_offset + offset,
+					       0xffffffff);
+		drm_intel_decode_set_batch_pointer(b->ctx, b->data + first,
+						   b->gtt_offset + 4 * first,
+						   last - first);
+		drm_intel_decode(b->ctx);
+		return;
+	}
+
+	for (int i = first; i + 4 <= last; i += 4)
+		printf("[%04x] %08x %08x %08x %08x%s\n",
+		       4*i, b->data[i], b->data[i+1], b->data[i+2], b->data[i+3],
+		       target >= i && target < i + 4 ? " <-" : "");
+}
+
+static bool query_blob(const struct error_index *idx,
+		       const struct blob_info *blob,
+		       struct drm_intel_decode *ctx,
+		       const struct query *q)
+{
+	const struct engine_info *engine = find_engine(idx, blob->ring_name);
+	uint32_t head_offset = -1;
+	uint64_t offset = 0;
+	struct buffer *b;
+	bool found = true;
+
+	if (is_ring(blob) && engine && engine->has_head)
+		head_offset = engine->head;
+
+	b = new_buffer(ctx, blob->buffer_name, blob->ring_name,
+		       blob->gtt_offset, head_offset, blob->decode);
+	b->ascii85 = idx->data + blob->offset;
+	b->ascii85_len = blob->len;
+	b->compressed = blob->compressed;
+	if (is_ring(blob) && engine)
+		b->size = engine->ring_length;
+
+	ascii85_decode(b);
+
+	/* libdrm only sees the low dword, so only mark acthd in its buffer. */
+	if (ctx) {
+		uint32_t acthd = 0xffffffff;
+
+		if (engine && engine->has_acthd &&
+		    engine->acthd >= blob->gtt_offset &&
+		    engine->acthd - blob->gtt_offset < 4ull * b->count)
+			acthd = engine->acthd;
+
+		drm_intel_decode_set_head_tail(ctx, acthd, 0xffffffff);
+	}
+
+	if (q->around == AROUND_NONE) {
+		print_buffer(b);
+	} else if (b->count &&
+		   around_offset(q, blob, engine, 4ull * b->count, &offset)) {
+		print_around(b, offset);
+	} else {
+		found = false;
+	}
+
+	free_buffer(b);
+	return found;
+}
+
+static void list_blob(const struct error_index *idx,
+		      const struct blob_info *blob)
+{
+	const struct engine_info *engine = find_engine(idx, blob->ring_name);
+
+	printf("%-16s %-16s 0x%08x_%08x %10zu encoded bytes%s",
+	       blob->ring_name ?: "-", blob->buffer_name,
+	       (unsigned)(blob->gtt_offset >> 32),
+	       (unsigned)(blob->gtt_offset & 0xffffffff),
+	       blob->len, blob->compressed ? ", compressed" : "");
+	if (engine && engine->has_acthd)
+		printf(", ACTHD 0x%08x_%08x",
+		       (unsigned)(engine->acthd >> 32),
+		       (unsigned)(engine->acthd & 0xffffffff));
+	printf("\n");
+}
+
+static int query_data_file(FILE *file, const struct query *q)
+{
+	struct drm_intel_decode *ctx = NULL;
+	struct error_index idx;
+	unsigned int found = 0;
+
+	if (!load_error_state(file, &idx)) {
+		fprintf(stderr, "Failed to read the error state: %s\n",
+			strerror(errno));
+		return 1;
+	}
+
+	index_error_state(&idx);
+
+#if defined(__x86_64__) && !defined(__clang__)
+	if (igt_x86_features() & SSE4_1)
+		ascii85_decode_groups = ascii85_decode_sse41;
+#endif
+
+	if (idx.has_devid && !q->list)
+		ctx = drm_intel_decode_context_alloc(idx.devid);
+
+	for (unsigned int i = 0; i < idx.n_blobs; i++) {
+		const struct blob_info *blob = &idx.blobs[i];
+
+		if (q->engine &&
+		    (!blob->ring_name || strcasecmp(blob->ring_name, q->engine)))
+			continue;
+
+		if (q->buffer && strcasecmp(blob->buffer_name, q->buffer))
+			continue;
+
+		if (q->list) {
+			list_blob(&idx, blob);
+			found++;
+		} else if (query_blob(&idx, blob, ctx, q)) {
+			found++;
+		}
+	}
+
+	if (!found)
+		fprintf(stderr, "No buffer matches the query.\n");
+
+	if (ctx)
+		drm_intel_decode_context_free(ctx);
+	free_error_index(&idx);
+
+	return found ? 0 : 1;
+}
+
 static void setup_pager(void)
 {
 	int fds[2];
@@ -792,35 +1731,104 @@ static void setup_pager(void)
 	}
 }
 
+static void usage(const char *name)
+{
+	fprintf(stderr,
+			"intel_gpu_decode: Parse an Intel GPU i915_error_state\n"
+			"Usage:\n"
+			"\t%s [options] [<file>]\n"
+			"\n"
+			"With no arguments, debugfs-dri-directory is probed for in "
+			"/debug and \n"
+			"/sys/kernel/debug.  Otherwise, it may be "
+			"specified.  If a file is given,\n"
+			"it is parsed as an GPU dump in the format of "
+			"/debug/dri/0/i915_error_state.\n"
+			"\n"
+			"The options below only decode the buffers they select:\n"
+			"\t--engine, -e <name>     Buffers of an engine, e.g. rcs0\n"
+			"\t--buffer, -b <name>     Buffers of a kind, e.g. batch, ring\n"
+			"\t--around, -a <where>    Only the dwords around acthd, head\n"
+			"\t                        (of the ring) or an address\n"
+			"\t--list, -l              List the buffers instead\n",
+			name);
+}
+
+static int process_data_file(FILE *file, const struct query *q)
+{
+	if (!q->engine && !q->buffer && q->around == AROUND_NONE && !q->list) {
+		read_data_file(file);
+		return 0;
+	}
+
+	return query_data_file(file, q);
+}
+
 int
 main(int argc, char *argv[])
 {
+	const struct option long_options[] = {
+		{"engine", required_argument, 0, 'e'},
+		{"buffer", required_argument, 0, 'b'},
+		{"around", required_argument, 0, 'a'},
+		{"list",         no_argument, 0, 'l'},
+		{"help",         no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+	struct query query = {};
 	FILE *file;
 	const char *path;
 	char *filename = NULL;
 	struct stat st;
-	int error;
-
-	if (argc > 2) {
-		fprintf(stderr,
-				"intel_gpu_decode: Parse an Intel GPU i915_error_state\n"
-				"Usage:\n"
-				"\t%s [<file>]\n"
-				"\n"
-				"With no arguments, debugfs-dri-directory is probed for in "
-				"/debug and \n"
-				"/sys/kernel/debug.  Otherwise, it may be "
-				"specified.  If a file is given,\n"
-				"it is parsed as an GPU dump in the format of "
-				"/debug/dri/0/i915_error_state.\n",
-				argv[0]);
+	int error, opt;
+
+	while ((opt = getopt_long(argc, argv, "e:b:a:lh",
+				  long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'e':
+			query.engine = optarg;
+			break;
+		case 'b':
+			query.buffer = optarg;
+			break;
+		case 'a':
+			if (!strcasecmp(optarg, "acthd")) {
+				query.around = AROUND_ACTHD;
+			} else if (!strcasecmp(optarg, "head")) {
+				query.around = AROUND_HEAD;
+			} else {
+				char *end;
+
+				query.around = AROUND_ADDRESS;
+				query.address = strtoull(optarg, &end, 0);
+				if (*end) {
+					fprintf(stderr, "Invalid address: %s\n",
+						optarg);
+					return 1;
+				}
+			}
+			break;
+		case 'l':
+			query.list = true;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (argc - optind > 1) {
+		usage(argv[0]);
 		return 1;
 	}
 
 	if (isatty(1))
 		setup_pager();
 
-	if (argc == 1) {
+	if (optind == argc) {
 		if (isatty(0)) {
 			path = "/sys/class/drm/card0/error";
 			error = stat(path, &st);
@@ -839,11 +1847,10 @@ main(int argc, char *argv[])
 				     "\tsudo mount -t debugfs debugfs /sys/kernel/debug\n");
 			}
 		} else {
-			read_data_file(stdin);
-			exit(0);
+			exit(process_data_file(stdin, &query));
 		}
 	} else {
-		path = argv[1];
+		path = argv[optind];
 		error = stat(path, &st);
 		if (error != 0) {
 			fprintf(stderr, "Error opening %s: %s\n",
@@ -884,13 +1891,13 @@ main(int argc, char *argv[])
 		}
 	}
 
-	read_data_file(file);
+	error = process_data_file(file, &query);
 	fclose(file);
 
 	if (filename != path)
 		free(filename);
 
-	return 0;
+	return error;
 }
 
 /* vim: set ts=8 sw=8 tw=0 cino=:0,(0 noet :*/
@@ -39,6 +39,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -47,6 +48,7 @@
 
 #include "igt_perf.h"
 #include "igt_drm_fdinfo.h"
+#include "igt_map.h"
 
 #define ARRAY_SIZE(arr) (sizeof(arr)/sizeof(arr[0]))
 
@@ -112,6 +114,9 @@ struct engines {
 	bool discrete;
 	char *device;
 
+	/* Per class view of the engines above, built on first use. */
+	struct engines *class_engines;
+
 	/* Do not edit below this line.
 	 * This structure is reallocated every time a new engine is
 	 * found and size is increased by sizeof (engine).
@@ -461,7 +466,20 @@ static void free_engines(struct engines *engines)
 		free((char *)engine->display_name);
 	}
 
-	closedir(engines->root);
+	if (engines->root)
+		closedir(engines->root);
+
+	if (engines->class_engines) {
+		struct engines *classes = engines->class_engines;
+
+		for (i = 0; i < classes->num_engines; i++) {
+			struct engine *engine = engine_ptr(classes, i);
+
+			free(engine->short_name);
+			free(engine->display_name);
+		}
+		free(classes);
+	}
 
 	free(engines->class);
 	free(engines);
@@ -668,6 +686,517 @@ static void pmu_sample(struct engines *engines)
 	}
 }
 
+/*
+ * Session recordings hold the raw values behind every refresh so any view
+ * can be rendered again later, without the GPU. A header describing the
+ * device, its engines and counters is followed by one record per sample:
+ * the PMU timestamp, the values of the counters which were present and the
+ * fdinfo busyness of every client.
+ */
+#define SESSION_MAGIC "IGPUTOP\n"
+#define SESSION_VERSION 1
+#define SESSION_MAX_ENGINES 64 /* Sanity limit when replaying. */
+
+struct session_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t num_engines;
+	uint32_t num_classes; /* Of client busyness, zero without clients. */
+	uint32_t discrete;
+	char card[256];
+	char codename[128];
+	char pci_slot[64];
+};
+
+struct session_engine {
+	char name[32];
+	uint32_t class;
+	uint32_t instance;
+};
+
+struct session_counter {
+	double scale;
+	char units[16];
+	uint32_t present;
+	uint32_t pad;
+};
+
+struct session_sample {
+	uint32_t size; /* Including the values and clients which follow. */
+	uint32_t num_clients;
+	uint64_t ts;
+};
+
+struct session_client {
+	uint64_t id;
+	uint32_t pid;
+	char name[28];
+	uint64_t busy[];
+};
+
+#define session_client_size(num_classes) \
+	(sizeof(struct session_client) + (num_classes) * sizeof(uint64_t))
+
+static struct session {
+	FILE *file;
+	bool record;
+	bool replay;
+	double speed;
+	struct session_header header;
+
+	/* Every counter, the present ones have a value in each sample. */
+	unsigned int num_counters;
+	struct pmu_counter **counter;
+
+	/* Clients of the sample being recorded or replayed. */
+	unsigned int num_clients;
+	char *clients;
+
+	char *buf;
+	size_t size, used;
+
+	/* Shared memory ring of daemon mode. */
+	struct daemon_ring *ring;
+	size_t ring_size;
+} session = {
+	.speed = 1.0,
+};
+
+static void *session_reserve(size_t sz)
+{
+	void *ptr;
+
+	if (session.used + sz > session.size) {
+		session.size = 2 * session.size + sz;
+		session.buf = realloc(session.buf, session.size);
+		assert(session.buf);
+	}
+
+	ptr = session.buf + session.used;
+	session.used += sz;
+
+	return ptr;
+}
+
+static void session_init_counters(struct engines *engines)
+{
+	struct pmu_counter *global[] = {
+		&engines->freq_req,
+		&engines->freq_act,
+		&engines->irq,
+		&engines->rc6,
+		&engines->r_gpu,
+		&engines->r_pkg,
+		&engines->imc_reads,
+		&engines->imc_writes,
+	};
+	unsigned int i, n = 0;
+
+	session.counter = calloc(ARRAY_SIZE(global) + 3 * engines->num_engines,
+				 sizeof(*session.counter));
+	assert(session.counter);
+
+	for (i = 0; i < ARRAY_SIZE(global); i++)
+		session.counter[n++] = global[i];
+
+	for (i = 0; i < engines->num_engines; i++) {
+		struct engine *engine = engine_ptr(engines, i);
+
+		session.counter[n++] = &engine->busy;
+		session.counter[n++] = &engine->wait;
+		session.counter[n++] = &engine->sema;
+	}
+
+	session.num_counters = n;
+}
+
+/* Builds the header, engine and counter descriptions into the buffer. */
+static size_t
+session_describe(const struct igt_device_card *card, const char *codename,
+		 struct engines *engines, unsigned int num_classes,
+		 const char *pci_slot)
+{
+	struct session_header *hdr = &session.header;
+	unsigned int i;
+
+	memcpy(hdr->magic, SESSION_MAGIC, sizeof(hdr->magic));
+	hdr->version = SESSION_VERSION;
+	hdr->num_engines = engines->num_engines;
+	hdr->num_classes = num_classes;
+	hdr->discrete = engines->discrete;
+	snprintf(hdr->card, sizeof(hdr->card), "%s", card->card);
+	snprintf(hdr->codename, sizeof(hdr->codename), "%s", codename);
+	snprintf(hdr->pci_slot, sizeof(hdr->pci_slot), "%s", pci_slot);
+
+	session.used = 0;
+	memcpy(session_reserve(sizeof(*hdr)), hdr, sizeof(*hdr));
+
+	for (i = 0; i < engines->num_engines; i++) {
+		struct engine *engine = engine_ptr(engines, i);
+		struct session_engine *e = session_reserve(sizeof(*e));
+
+		memset(e, 0, sizeof(*e));
+		snprintf(e->name, sizeof(e->name), "%s", engine->name);
+		e->class = engine->class;
+		e->instance = engine->instance;
+	}
+
+	session_init_counters(engines);
+	for (i = 0; i < session.num_counters; i++) {
+		struct pmu_counter *pmu = session.counter[i];
+		struct session_counter *c = session_reserve(sizeof(*c));
+
+		memset(c, 0, sizeof(*c));
+		c->scale = pmu->scale;
+		c->present = pmu->present;
+		if (pmu->units)
+			snprintf(c->units, sizeof(c->units), "%s", pmu->units);
+	}
+
+	session.record = true;
+
+	return session.used;
+}
+
+static int
+session_record_open(const char *path, const struct igt_device_card *card,
+		    const char *codename, struct engines *engines,
+		    unsigned int num_classes, const char *pci_slot)
+{
+	size_t sz;
+
+	session.file = fopen(path, "w");
+	if (!session.file)
+		return -errno;
+
+	sz = session_describe(card, codename, engines, num_classes, pci_slot);
+	fwrite(session.buf, 1, sz, session.file);
+	session.used = 0;
+
+	return fflush(session.file) ? -errno : 0;
+}
+
+static void
+session_add_client(const struct drm_client_fdinfo *info, unsigned int pid,
+		   const char *name)
+{
+	const unsigned int num_classes = session.header.num_classes;
+	struct session_client *c;
+
+	c = session_reserve(session_client_size(num_classes));
+	memset(c, 0, session_client_size(num_classes));
+
+	c->id = info->id;
+	c->pid = pid;
+	strncpy(c->name, name, sizeof(c->name) - 1);
+	memcpy(c->busy, info->busy, num_classes * sizeof(c->busy[0]));
+
+	session.num_clients++;
+}
+
+/* Values of the present counters, in the order they are described. */
+static unsigned int session_values(uint64_t *val)
+{
+	unsigned int i, n = 0;
+
+	for (i = 0; i < session.num_counters; i++) {
+		if (session.counter[i]->present)
+			val[n++] = session.counter[i]->val.cur;
+	}
+
+	return n;
+}
+
+static int session_record_sample(struct engines *engines)
+{
+	struct session_sample s = {
+		.num_clients = session.num_clients,
+		.ts = engines->ts.cur,
+	};
+	uint64_t val[session.num_counters];
+	unsigned int n = session_values(val);
+
+	s.size = sizeof(s) + n * sizeof(val[0]) + session.used;
+
+	fwrite(&s, sizeof(s), 1, session.file);
+	fwrite(val, sizeof(val[0]), n, session.file);
+	fwrite(session.buf, 1, session.used, session.file);
+
+	session.used = 0;
+	session.num_clients = 0;
+
+	/*
+	 * Flush every sample so the recorder can be stopped at any point,
+	 * the reader drops a trailing partial sample.
+	 */
+	return fflush(session.file) ? -errno : 0;
+}
+
+/*
+ * Daemon mode publishes every sample to a ring in a shared memory file,
+ * using the same description and sample layout as session recordings:
+ *
+ *   struct daemon_ring
+ *   session description (header, engines and counters), desc_size bytes
+ *   num_slots slots of slot_size bytes each, starting at slot_offset:
+ *     uint64_t seq
+ *     struct session_sample, counter values and up to max_clients clients
+ *
+ * Sample n, counting from one, goes to slot (n - 1) % num_slots. While a
+ * slot is written its seq is zero, it is then set to n before head is
+ * advanced to n. Readers copy the slot at head and keep the copy only if
+ * its seq was n both before and after copying.
+ */
+#define DAEMON_MAGIC "IGPUTOPD"
+#define DAEMON_VERSION 1
+#define DAEMON_SLOTS 256
+#define DAEMON_MAX_CLIENTS 64
+#define DAEMON_DISCOVERY_US 1000000 /* Walk /proc for new clients once a second. */
+#define DAEMON_ALIGN(x) (((x) + 63) & ~(size_t)63)
+
+struct daemon_ring {
+	char magic[8];
+	uint32_t version;
+	uint32_t num_slots;
+	uint32_t slot_size;
+	uint32_t max_clients;
+	uint32_t desc_size;
+	uint32_t slot_offset;
+	uint64_t head;
+};
+
+static int
+daemon_open(const char *path, const struct igt_device_card *card,
+	    const char *codename, struct engines *engines,
+	    unsigned int num_classes, const char *pci_slot)
+{
+	size_t desc_size, slot_size, slot_offset, size;
+	struct daemon_ring *ring;
+	char tmp[PATH_MAX];
+	int fd, ret = 0;
+
+	desc_size = session_describe(card, codename, engines, num_classes,
+				     pci_slot);
+	slot_size = DAEMON_ALIGN(sizeof(uint64_t) +
+				 sizeof(struct session_sample) +
+				 session.num_counters * sizeof(uint64_t) +
+				 DAEMON_MAX_CLIENTS *
+				 session_client_size(num_classes));
+	slot_offset = DAEMON_ALIGN(sizeof(*ring) + desc_size);
+	size = slot_offset + DAEMON_SLOTS * slot_size;
+
+	/* Readers must never map a file which is not fully set up. */
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= sizeof(tmp))
+		return -ENAMETOOLONG;
+
+	fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -errno;
+
+	if (ftruncate(fd, size)) {
+		ret = -errno;
+		goto out;
+	}
+
+	ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ring == MAP_FAILED) {
+		ret = -errno;
+		goto out;
+	}
+
+	memcpy(ring->magic, DAEMON_MAGIC, sizeof(ring->magic));
+	ring->version = DAEMON_VERSION;
+	ring->num_slots = DAEMON_SLOTS;
+	ring->slot_size = slot_size;
+	ring->max_clients = DAEMON_MAX_CLIENTS;
+	ring->desc_size = desc_size;
+	ring->slot_offset = slot_offset;
+	memcpy(ring + 1, session.buf, desc_size);
+	session.used = 0;
+
+	if (rename(tmp, path)) {
+		ret = -errno;
+		munmap(ring, size);
+		goto out;
+	}
+
+	session.ring = ring;
+	session.ring_size = size;
+
+out:
+	if (ret)
+		unlink(tmp);
+	close(fd);
+	return ret;
+}
+
+static void daemon_publish(struct engines *engines)
+{
+	struct daemon_ring *ring = session.ring;
+	const uint64_t seq = ring->head + 1;
+	const unsigned int num_clients =
+		session.num_clients < ring->max_clients ?
+		session.num_clients : ring->max_clients;
+	const size_t clients_sz =
+		num_clients * session_client_size(session.header.num_classes);
+	char *slot = (char *)ring + ring->slot_offset +
+		     (seq - 1) % ring->num_slots * ring->slot_size;
+	struct session_sample *s = (void *)(slot + sizeof(uint64_t));
+	uint64_t *val = (void *)(s + 1);
+	unsigned int n;
+
+	__atomic_store_n((uint64_t *)slot, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	n = session_values(val);
+	memcpy(val + n, session.buf, clients_sz);
+	s->num_clients = num_clients;
+	s->ts = engines->ts.cur;
+	s->size = sizeof(*s) + n * sizeof(*val) + clients_sz;
+
+	__atomic_store_n((uint64_t *)slot, seq, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->head, seq, __ATOMIC_RELEASE);
+
+	session.used = 0;
+	session.num_clients = 0;
+}
+
+static struct engines *session_replay_open(const char *path)
+{
+	struct session_header *hdr = &session.header;
+	struct engines *engines;
+	unsigned int i;
+	int ret;
+
+	session.file = fopen(path, "r");
+	if (!session.file)
+		return NULL;
+
+	session.replay = true;
+
+	if (fread(hdr, sizeof(*hdr), 1, session.file) != 1 ||
+	    memcmp(hdr->magic, SESSION_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != SESSION_VERSION ||
+	    !hdr->num_engines || hdr->num_engines > SESSION_MAX_ENGINES ||
+	    hdr->num_classes > DRM_CLIENT_FDINFO_MAX_ENGINES) {
+		fclose(session.file);
+		session.file = NULL;
+		errno = EINVAL;
+		return NULL;
+	}
+
+	hdr->card[sizeof(hdr->card) - 1] = 0;
+	hdr->codename[sizeof(hdr->codename) - 1] = 0;
+	hdr->pci_slot[sizeof(hdr->pci_slot) - 1] = 0;
+
+	engines = calloc(1, sizeof(*engines) +
+			    hdr->num_engines * sizeof(struct engine));
+	assert(engines);
+
+	engines->num_engines = hdr->num_engines;
+	engines->discrete = hdr->discrete;
+	engines->fd = -1;
+	engines->rapl_fd = -1;
+	engines->imc_fd = -1;
+
+	for (i = 0; i < engines->num_engines; i++) {
+		struct engine *engine = engine_ptr(engines, i);
+		struct session_engine e;
+
+		if (fread(&e, sizeof(e), 1, session.file) != 1)
+			goto err;
+
+		e.name[sizeof(e.name) - 1] = 0;
+		engine->name = strdup(e.name);
+		engine->class = e.class;
+		engine->instance = e.instance;
+
+		ret = asprintf(&engine->display_name, "%s/%u",
+			       class_display_name(engine->class),
+			       engine->instance);
+		assert(ret > 0);
+
+		ret = asprintf(&engine->short_name, "%s/%u",
+			       class_short_name(engine->class),
+			       engine->instance);
+		assert(ret > 0);
+	}
+
+	session_init_counters(engines);
+	for (i = 0; i < session.num_counters; i++) {
+		struct pmu_counter *pmu = session.counter[i];
+		struct session_counter c;
+
+		if (fread(&c, sizeof(c), 1, session.file) != 1)
+			goto err;
+
+		c.units[sizeof(c.units) - 1] = 0;
+		pmu->present = c.present;
+		pmu->scale = c.scale;
+		if (c.present && c.units[0])
+			pmu->units = strdup(c.units);
+	}
+
+	for (i = 0; i < engines->num_engines; i++) {
+		struct engine *engine = engine_ptr(engines, i);
+
+		engine->num_counters = engine->busy.present +
+				       engine->wait.present +
+				       engine->sema.present;
+	}
+
+	return engines;
+
+err:
+	free_engines(engines);
+	free(session.counter);
+	session.counter = NULL;
+	fclose(session.file);
+	session.file = NULL;
+	errno = EINVAL;
+	return NULL;
+}
+
+static bool session_replay_sample(struct engines *engines)
+{
+	const size_t client_sz =
+		session_client_size(session.header.num_classes);
+	struct session_sample s;
+	unsigned int i, n = 0;
+	uint64_t *val;
+	size_t sz;
+
+	if (fread(&s, sizeof(s), 1, session.file) != 1 || s.size < sizeof(s))
+		return false;
+
+	sz = s.size - sizeof(s);
+	session.used = 0;
+	val = session_reserve(sz);
+	if (fread(val, 1, sz, session.file) != sz)
+		return false; /* Recording was interrupted. */
+
+	for (i = 0; i < session.num_counters; i++) {
+		if (session.counter[i]->present)
+			n++;
+	}
+
+	if (sz != n * sizeof(*val) + s.num_clients * client_sz)
+		return false;
+
+	engines->ts.prev = engines->ts.cur;
+	engines->ts.cur = s.ts;
+
+	for (i = 0; i < session.num_counters; i++) {
+		if (session.counter[i]->present)
+			__update_sample(session.counter[i], *val++);
+	}
+
+	session.num_clients = s.num_clients;
+	session.clients = (char *)val;
+
+	return true;
+}
+
 enum client_status {
 	FREE = 0, /* mbz */
 	ALIVE,
@@ -701,8 +1230,73 @@ struct clients {
 	char pci_slot[64];
 
 	struct client *client;
+
+	/* Client array index by id, rebuilt on every scan. */
+	struct igt_map *index;
+
+	/* DRM fds and processes remembered between scans. */
+	struct igt_map *drm_fds;
+	struct igt_map *tasks;
+	unsigned int generation;
+
+	/* Further devices whose clients are found by the same scan. */
+	struct clients *next;
 };
 
+struct drm_fd {
+	struct drm_fd_key {
+		unsigned int pid;
+		unsigned int fd;
+	} key;
+	int fdinfo; /* Kept open, re-read on every scan. */
+	char name[64];
+};
+
+struct task {
+	unsigned int pid;
+	unsigned int generation; /* of the last scan which saw it */
+};
+
+static uint32_t hash_u32(uint32_t v)
+{
+	return v * 0x9e3779b9;
+}
+
+static uint32_t client_id_hash(const void *key)
+{
+	return hash_u32(*(const unsigned int *)key);
+}
+
+static int client_id_equal(const void *a, const void *b)
+{
+	return *(const unsigned int *)a == *(const unsigned int *)b;
+}
+
+static uint32_t drm_fd_hash(const void *key)
+{
+	const struct drm_fd_key *k = key;
+
+	return hash_u32(k->pid) ^ hash_u32(k->fd + 0x7f4a7c15);
+}
+
+static int drm_fd_equal(const void *a, const void *b)
+{
+	return !memcmp(a, b, sizeof(struct drm_fd_key));
+}
+
+static void free_entry_data(struct igt_map_entry *entry)
+{
+	free(entry->data);
+}
+
+static void free_drm_fd(struct igt_map_entry *entry)
+{
+	struct drm_fd *f = entry->data;
+
+	close(f->fdinfo);
+	free(f);
+}
+
 #define for_each_client(clients, c, tmp) \
 	for ((tmp) = (clients)->num_clients, c = (clients)->client; \
 	     (tmp > 0); (tmp)--, (c)++)
@@ -719,15 +1313,45 @@ static struct clients *init_clients(const char *pci_slot)
 
 	strncpy(clients->pci_slot, pci_slot, sizeof(clients->pci_slot));
 
+	clients->drm_fds = igt_map_create(drm_fd_hash, drm_fd_equal);
+	clients->tasks = igt_map_create(client_id_hash, client_id_equal);
+
 	return clients;
 }
 
+static void index_clients(struct clients *clients)
+{
+	struct client *c;
+	unsigned int i;
+
+	if (clients->index)
+		igt_map_destroy(clients->index, NULL);
+	clients->index = igt_map_create(client_id_hash, client_id_equal);
+
+	for (i = 0, c = clients->client; i < clients->num_clients; i++, c++) {
+		if (c->status != FREE)
+			igt_map_insert(clients->index, &c->id,
+				       (void *)(uintptr_t)(i + 1));
+	}
+}
+
 static struct client *
 find_client(struct clients *clients, enum client_status status, unsigned int id)
 {
 	unsigned int start, num;
 	struct client *c;
 
+	if (status != FREE && clients->index) {
+		void *entry = igt_map_search(clients->index, &id);
+		uintptr_t idx = (uintptr_t)entry;
+
+		if (!idx)
+			return NULL;
+
+		c = &clients->client[idx - 1];
+		return c->status == status && c->id == id ? c : NULL;
+	}
+
 	start = status == FREE ? clients->active_clients : 0; /* Free block at the end. */
 	num = clients->num_clients - start;
 
@@ -803,9 +1427,16 @@ add_client(struct clients *clients, const struct drm_client_fdinfo *info,
 
 		c = &clients->client[idx];
 		memset(c, 0, (clients->num_clients - idx) * sizeof(*c));
+
+		/* The index points into the old array. */
+		if (clients->index)
+			index_clients(clients);
 	}
 
 	c->id = info->id;
+	if (clients->index)
+		igt_map_insert(clients->index, &c->id,
+			       (void *)(uintptr_t)(c - clients->client + 1));
 	c->clients = clients;
 	c->val = calloc(clients->num_classes, sizeof(c->val));
 	c->last = calloc(clients->num_classes, sizeof(c->last));
@@ -1018,6 +1649,13 @@ static void free_clients(struct clients *clients)
 		free(c->last);
 	}
 
+	if (clients->index)
+		igt_map_destroy(clients->index, NULL);
+	if (clients->drm_fds)
+		igt_map_destroy(clients->drm_fds, free_drm_fd);
+	if (clients->tasks)
+		igt_map_destroy(clients->tasks, free_entry_data);
+
 	free(clients->client);
 	free(clients);
 }
@@ -1093,117 +1731,297 @@ static size_t readat2buf(int at, const char *name, char *buf, const size_t sz)
 	}
 }
 
-static struct clients *scan_clients(struct clients *clients, bool display)
+static void
+account_client(struct clients *clients, const struct drm_client_fdinfo *info,
+	       unsigned int pid, char *name)
 {
-	struct dirent *proc_dent;
 	struct client *c;
-	DIR *proc_dir;
-	int tmp;
 
-	if (!clients)
-		return clients;
+	if (find_client(clients, ALIVE, info->id))
+		return; /* Skip duplicate fds. */
 
-	for_each_client(clients, c, tmp) {
-		assert(c->status != PROBE);
-		if (c->status == ALIVE)
-			c->status = PROBE;
-		else
-			break; /* Free block at the end of array. */
-	}
+	if (session.record)
+		session_add_client(info, pid, name);
 
-	proc_dir = opendir("/proc");
-	if (!proc_dir)
-		return clients;
+	c = find_client(clients, PROBE, info->id);
+	if (!c)
+		add_client(clients, info, pid, name);
+	else
+		update_client(c, pid, name, info);
+}
 
-	while ((proc_dent = readdir(proc_dir)) != NULL) {
-		int pid_dir = -1, fd_dir = -1;
-		struct dirent *fdinfo_dent;
-		char client_name[64] = { };
-		unsigned int client_pid;
-		DIR *fdinfo_dir = NULL;
-		char buf[4096];
-		size_t count;
+/* Returns the clients of the device, sharing the scan, the fd belongs to. */
+static struct clients *
+read_client_fdinfo(struct clients *clients, int fdinfo,
+		   struct drm_client_fdinfo *info)
+{
+	if (!__igt_parse_drm_fdinfo_fd(fdinfo, info))
+		return NULL;
 
-		if (proc_dent->d_type != DT_DIR)
+	if (strcmp(info->driver, "i915"))
+		return NULL;
+
+	for (; clients; clients = clients->next) {
+		if (!strcmp(info->pdev, clients->pci_slot))
+			return clients;
+	}
+
+	return NULL;
+}
+
+/* Looks for DRM fds of a process which are not tracked yet. */
+static void probe_task(struct clients *clients, int proc_dir, const char *pid)
+{
+	int pid_dir = -1, fd_dir = -1;
+	struct dirent *fdinfo_dent;
+	char client_name[64] = { };
+	unsigned int client_pid;
+	DIR *fdinfo_dir = NULL;
+	char buf[4096];
+	size_t count;
+
+	pid_dir = openat(proc_dir, pid, O_DIRECTORY | O_RDONLY);
+	if (pid_dir < 0)
+		return;
+
+	count = readat2buf(pid_dir, "stat", buf, sizeof(buf));
+	if (!count)
+		goto next;
+
+	client_pid = atoi(buf);
+	if (!client_pid)
+		goto next;
+
+	if (!get_task_name(buf, client_name, sizeof(client_name)))
+		goto next;
+
+	fd_dir = openat(pid_dir, "fd", O_DIRECTORY | O_RDONLY);
+	if (fd_dir < 0)
+		goto next;
+
+	fdinfo_dir = opendirat(pid_dir, "fdinfo");
+	if (!fdinfo_dir)
+		goto next;
+
+	while ((fdinfo_dent = readdir(fdinfo_dir)) != NULL) {
+		struct drm_client_fdinfo info = { };
+		struct clients *owner;
+		struct drm_fd_key key;
+		struct drm_fd *f;
+		int fdinfo;
+
+		if (fdinfo_dent->d_type != DT_REG)
 			continue;
-		if (!isdigit(proc_dent->d_name[0]))
+		if (!isdigit(fdinfo_dent->d_name[0]))
 			continue;
 
-		pid_dir = openat(dirfd(proc_dir), proc_dent->d_name,
-				 O_DIRECTORY | O_RDONLY);
-		if (pid_dir < 0)
+		key.pid = client_pid;
+		key.fd = atoi(fdinfo_dent->d_name);
+		f = igt_map_search(clients->drm_fds, &key);
+		if (f) {
+			/* Already read this scan, only pick up a new name. */
+			strcpy(f->name, client_name);
 			continue;
+		}
 
-		count = readat2buf(pid_dir, "stat", buf, sizeof(buf));
-		if (!count)
-			goto next;
+		if (!is_drm_fd(fd_dir, fdinfo_dent->d_name))
+			continue;
 
-		client_pid = atoi(buf);
-		if (!client_pid)
-			goto next;
+		fdinfo = openat(dirfd(fdinfo_dir), fdinfo_dent->d_name,
+				O_RDONLY);
+		if (fdinfo < 0)
+			continue;
 
-		if (!get_task_name(buf, client_name, sizeof(client_name)))
-			goto next;
+		owner = read_client_fdinfo(clients, fdinfo, &info);
+		if (!owner) {
+			close(fdinfo);
+			continue;
+		}
 
-		fd_dir = openat(pid_dir, "fd", O_DIRECTORY | O_RDONLY);
-		if (fd_dir < 0)
-			goto next;
+		f = malloc(sizeof(*f));
+		assert(f);
+		f->key = key;
+		f->fdinfo = fdinfo;
+		strcpy(f->name, client_name);
+		igt_map_insert(clients->drm_fds, &f->key, f);
 
-		fdinfo_dir = opendirat(pid_dir, "fdinfo");
-		if (!fdinfo_dir)
-			goto next;
+		account_client(owner, &info, client_pid, client_name);
+	}
 
-		while ((fdinfo_dent = readdir(fdinfo_dir)) != NULL) {
-			struct drm_client_fdinfo info = { };
+next:
+	if (fdinfo_dir)
+		closedir(fdinfo_dir);
+	if (fd_dir >= 0)
+		close(fd_dir);
+	if (pid_dir >= 0)
+		close(pid_dir);
+}
 
-			if (fdinfo_dent->d_type != DT_REG)
-				continue;
-			if (!isdigit(fdinfo_dent->d_name[0]))
-				continue;
+static void begin_scan(struct clients *clients)
+{
+	struct clients *dev;
+	struct client *c;
+	int tmp;
 
-			if (!is_drm_fd(fd_dir, fdinfo_dent->d_name))
-				continue;
+	for (dev = clients; dev; dev = dev->next) {
+		for_each_client(dev, c, tmp) {
+			assert(c->status != PROBE);
+			if (c->status == ALIVE)
+				c->status = PROBE;
+			else
+				break; /* Free block at the end of array. */
+		}
 
-			if (!__igt_parse_drm_fdinfo(dirfd(fdinfo_dir),
-						    fdinfo_dent->d_name,
-						    &info))
-				continue;
+		index_clients(dev);
+	}
+}
 
-			if (strcmp(info.driver, "i915"))
-				continue;
-			if (strcmp(info.pdev, clients->pci_slot))
-				continue;
-			if (find_client(clients, ALIVE, info.id))
-				continue; /* Skip duplicate fds. */
+static struct clients *end_scan(struct clients *clients, bool display)
+{
+	struct clients *dev;
+	struct client *c;
+	int tmp;
 
-			c = find_client(clients, PROBE, info.id);
-			if (!c)
-				add_client(clients, &info, client_pid,
-					   client_name);
-			else
-				update_client(c, client_pid, client_name,
-					      &info);
+	for (dev = clients; dev; dev = dev->next) {
+		for_each_client(dev, c, tmp) {
+			if (c->status == PROBE)
+				free_client(c);
+			else if (c->status == FREE)
+				break;
 		}
+	}
 
-next:
-		if (fdinfo_dir)
-			closedir(fdinfo_dir);
-		if (fd_dir >= 0)
-			close(fd_dir);
-		if (pid_dir >= 0)
-			close(pid_dir);
+	return display ? display_clients(clients) : clients;
+}
+
+/* Known DRM fds are all it takes to update the existing clients. */
+static void refresh_clients(struct clients *clients)
+{
+	struct igt_map_entry *entry;
+
+	igt_map_foreach(clients->drm_fds, entry) {
+		struct drm_client_fdinfo info = { };
+		struct drm_fd *f = entry->data;
+		struct clients *owner;
+
+		/* Closed, or reused for something else. */
+		owner = read_client_fdinfo(clients, f->fdinfo, &info);
+		if (!owner) {
+			igt_map_remove_entry(clients->drm_fds, entry);
+			close(f->fdinfo);
+			free(f);
+			continue;
+		}
+
+		account_client(owner, &info, f->key.pid, f->name);
+	}
+}
+
+/*
+ * To find new clients, processes not seen before are probed straight away,
+ * while every known process is only probed once every TASK_PROBE_ROTATION
+ * passes, so a pass costs a fraction of walking every fd of every process.
+ */
+#define TASK_PROBE_ROTATION 8
+
+static void discover_clients(struct clients *clients)
+{
+	struct igt_map_entry *entry;
+	struct dirent *proc_dent;
+	DIR *proc_dir;
+
+	clients->generation++;
+
+	proc_dir = opendir("/proc");
+	if (!proc_dir)
+		return;
+
+	while ((proc_dent = readdir(proc_dir)) != NULL) {
+		unsigned int pid;
+		struct task *t;
+
+		if (proc_dent->d_type != DT_DIR)
+			continue;
+		if (!isdigit(proc_dent->d_name[0]))
+			continue;
+
+		pid = atoi(proc_dent->d_name);
+		t = igt_map_search(clients->tasks, &pid);
+		if (!t) {
+			t = malloc(sizeof(*t));
+			assert(t);
+			t->pid = pid;
+			igt_map_insert(clients->tasks, &t->pid, t);
+		} else if ((pid + clients->generation) % TASK_PROBE_ROTATION) {
+			t->generation = clients->generation;
+			continue;
+		}
+
+		t->generation = clients->generation;
+		probe_task(clients, dirfd(proc_dir), proc_dent->d_name);
 	}
 
 	closedir(proc_dir);
 
-	for_each_client(clients, c, tmp) {
-		if (c->status == PROBE)
-			free_client(c);
-		else if (c->status == FREE)
-			break;
+	/* Forget exited processes, their fds have already gone. */
+	igt_map_foreach(clients->tasks, entry) {
+		struct task *t = entry->data;
+
+		if (t->generation != clients->generation) {
+			igt_map_remove_entry(clients->tasks, entry);
+			free(t);
+		}
 	}
+}
 
-	return display ? display_clients(clients) : clients;
+static struct clients *
+__scan_clients(struct clients *clients, bool discover, bool display)
+{
+	if (!clients)
+		return clients;
+
+	begin_scan(clients);
+	refresh_clients(clients);
+	if (discover)
+		discover_clients(clients);
+
+	return end_scan(clients, display);
+}
+
+static struct clients *scan_clients(struct clients *clients, bool display)
+{
+	return __scan_clients(clients, true, display);
+}
+
+/* Accounts the fdinfo stored with the last replayed sample. */
+static struct clients *replay_clients(struct clients *clients, bool display)
+{
+	const size_t sz = session_client_size(session.header.num_classes);
+	unsigned int i;
+
+	if (!clients)
+		return clients;
+
+	begin_scan(clients);
+
+	for (i = 0; i < session.num_clients; i++) {
+		const struct session_client *sc =
+			(const void *)(session.clients + i * sz);
+		struct drm_client_fdinfo info = {
+			.id = sc->id,
+			.num_engines = session.header.num_classes,
+		};
+		char name[sizeof(sc->name)];
+
+		memcpy(info.busy, sc->busy,
+		       info.num_engines * sizeof(info.busy[0]));
+		memcpy(name, sc->name, sizeof(name));
+		name[sizeof(name) - 1] = 0;
+
+		account_client(clients, &info, sc->pid, name);
+	}
+
+	return end_scan(clients, display);
 }
 
 static const char *bars[] = { " ", "▏", "▎", "▍", "▌", "▋", "▊", "▉", "█" };
@@ -1268,6 +2086,11 @@ usage(const char *appname)
 		"\t[-s <ms>]       Refresh period in milliseconds (default %ums).\n"
 		"\t[-L]            List all cards.\n"
 		"\t[-d <device>]   Device filter, please check manual page for more details.\n"
+		"\t[-R <file>]     Record raw counters to file instead of displaying them.\n"
+		"\t[-p <file>]     Replay a recording instead of sampling the GPU.\n"
+		"\t[-x <factor>]   Replay speed factor, 0 for as fast as possible (default 1).\n"
+		"\t[-D <file>]     Run as a daemon publishing samples to a shared memory file.\n"
+		"\t[-A]            Monitor all devices, or all matching the -d filter.\n"
 		"\n",
 		appname, DEFAULT_PERIOD_MS);
 	igt_device_print_filter_types();
@@ -1308,6 +2131,7 @@ static const char *json_indent[] = {
 	"\t\t\t",
 	"\t\t\t\t",
 	"\t\t\t\t\t",
+	"\t\t\t\t\t\t",
 };
 
 static unsigned int json_prev_struct_members;
@@ -1343,6 +2167,9 @@ json_close_struct(void)
 
 	fprintf(out, "\n%s}", json_indent[--json_indent_level]);
 
+	/* The closed struct is a member of its parent. */
+	json_struct_members = 1;
+
 	if (json_indent_level == 0)
 		fflush(stdout);
 }
@@ -1703,7 +2530,9 @@ print_header(const struct igt_device_card *card,
 	if (output_mode == INTERACTIVE) {
 		int rem = con_w;
 
-		printf("\033[H\033[J");
+		/* Further devices continue below the first one. */
+		if (!lines)
+			printf("\033[H\033[J");
 
 		lines = print_header_token(NULL, lines, con_w, con_h, &rem,
 					   "intel-gpu-top:");
@@ -2029,11 +2858,12 @@ static struct engines *init_class_engines(struct engines *engines)
 
 static struct engines *update_class_engines(struct engines *engines)
 {
-	static struct engines *classes;
+	struct engines *classes;
 	unsigned int i, j;
 
-	if (!classes)
-		classes = init_class_engines(engines);
+	if (!engines->class_engines)
+		engines->class_engines = init_class_engines(engines);
+	classes = engines->class_engines;
 
 	for (i = 0; i < classes->num_engines; i++) {
 		struct engine *engine = engine_ptr(classes, i);
@@ -2064,16 +2894,151 @@ static struct engines *update_class_engines(struct engines *engines)
 	return classes;
 }
 
-static int
-print_engines(struct engines *engines, double t, int lines, int w, int h)
+/* One of the cards monitored by a single process. */
+struct device {
+	struct igt_device_card card;
+	char *codename;
+	char *pmu_device;
+	struct engines *engines;
+	struct clients *clients;
+};
+
+/*
+ * Builds one engine per class found on any of the devices, later used for the
+ * busyness averaged over all the engines of that class on all the devices.
+ */
+static struct engines *init_total_engines(struct device *devs, unsigned int num)
 {
-	struct engines *show;
+	unsigned int num_classes = 0, num_present = 0;
+	struct engine_class *classes;
+	struct engines *total;
+	unsigned int i, j, k;
 
-	if (class_view)
-		show = update_class_engines(engines);
-	else
-		show = engines;
+	for (i = 0; i < num; i++) {
+		init_engine_classes(devs[i].engines);
+		if (devs[i].engines->num_classes > num_classes)
+			num_classes = devs[i].engines->num_classes;
+	}
+
+	classes = calloc(num_classes, sizeof(*classes));
+	assert(classes);
+
+	for (i = 0; i < num_classes; i++) {
+		classes[i].class = i;
+		classes[i].name = class_display_name(i);
+	}
+
+	for (i = 0; i < num; i++) {
+		struct engines *engines = devs[i].engines;
+
+		for (j = 0; j < engines->num_classes; j++)
+			classes[j].num_engines += engines->class[j].num_engines;
+	}
+
+	for (i = 0; i < num_classes; i++) {
+		if (classes[i].num_engines)
+			num_present++;
+	}
+
+	total = calloc(1, sizeof(struct engines) +
+			  num_present * sizeof(struct engine));
+	assert(total);
+
+	total->num_engines = num_present;
+	total->num_classes = num_classes;
+	total->class = classes;
+
+	j = 0;
+	for (i = 0; i < num_classes; i++) {
+		struct engine *engine = engine_ptr(total, j);
+
+		if (!classes[i].num_engines)
+			continue;
+
+		engine->class = i;
+		engine->instance = -1;
+
+		engine->display_name = strdup(class_display_name(i));
+		assert(engine->display_name);
+		engine->short_name = strdup(class_short_name(i));
+		assert(engine->short_name);
+
+		/* Pmu metadata from the first real engine of the class. */
+		for (k = 0; k < num && !engine->num_counters; k++) {
+			struct engines *engines = devs[k].engines;
+			unsigned int l;
+
+			for (l = 0; l < engines->num_engines; l++) {
+				struct engine *e = engine_ptr(engines, l);
+
+				if (e->class == i) {
+					engine->num_counters = e->num_counters;
+					engine->busy = e->busy;
+					engine->sema = e->sema;
+					engine->wait = e->wait;
+					break;
+				}
+			}
+		}
+
+		j++;
+	}
+
+	return total;
+}
+
+static void
+update_total_engines(struct engines *total, struct device *devs,
+		     unsigned int num)
+{
+	unsigned int i, j, k;
+
+	for (i = 0; i < total->num_engines; i++) {
+		struct engine *engine = engine_ptr(total, i);
+
+		memset(&engine->busy.val, 0, sizeof(engine->busy.val));
+		memset(&engine->sema.val, 0, sizeof(engine->sema.val));
+		memset(&engine->wait.val, 0, sizeof(engine->wait.val));
+
+		for (j = 0; j < num; j++) {
+			struct engines *engines = devs[j].engines;
+
+			for (k = 0; k < engines->num_engines; k++) {
+				struct engine *e = engine_ptr(engines, k);
+
+				if (e->class == engine->class) {
+					__pmu_sum(&engine->busy.val, &e->busy.val);
+					__pmu_sum(&engine->sema.val, &e->sema.val);
+					__pmu_sum(&engine->wait.val, &e->wait.val);
+				}
+			}
+		}
+
+		k = total->class[engine->class].num_engines;
+		__pmu_normalize(&engine->busy.val, k);
+		__pmu_normalize(&engine->sema.val, k);
+		__pmu_normalize(&engine->wait.val, k);
+	}
+}
+
+static void free_total_engines(struct engines *total)
+{
+	unsigned int i;
+
+	for (i = 0; i < total->num_engines; i++) {
+		struct engine *engine = engine_ptr(total, i);
+
+		free(engine->short_name);
+		free(engine->display_name);
+	}
+
+	free(total->class);
+	free(total);
+}
 
+static int
+__print_engines(struct engines *show, double t, int lines, int w, int h)
+{
 	lines = print_engines_header(show, t, lines, w,  h);
 
 	for (unsigned int i = 0; i < show->num_engines && lines < h; i++)
@@ -2084,6 +3049,19 @@ print_engines(struct engines *engines, double t, int lines, int w, int h)
 	return lines;
 }
 
+static int
+print_engines(struct engines *engines, double t, int lines, int w, int h)
+{
+	struct engines *show;
+
+	if (class_view)
+		show = update_class_engines(engines);
+	else
+		show = engines;
+
+	return __print_engines(show, t, lines, w, h);
+}
+
 static int
 print_clients_header(struct clients *clients, int lines,
 		     int con_w, int con_h, int *class_w)
@@ -2442,31 +3420,327 @@ static void show_help_screen(void)
 "\n");
 }
 
+static void update_console_size(int *con_w, int *con_h)
+{
+	struct winsize ws;
+
+	if (output_mode != INTERACTIVE) {
+		*con_w = *con_h = INT_MAX;
+	} else if (ioctl(0, TIOCGWINSZ, &ws) != -1) {
+		*con_w = ws.ws_col;
+		*con_h = ws.ws_row;
+		if (*con_w == 0 && *con_h == 0) {
+			/* Serial console. */
+			*con_w = 80;
+			*con_h = 24;
+		}
+	}
+}
+
+static struct engines *
+open_engines(struct igt_device_card *card, char **pmu_device)
+{
+	struct engines *engines;
+
+	if (card->pci_slot_name[0] && !is_igpu_pci(card->pci_slot_name))
+		*pmu_device = tr_pmu_name(card);
+	else
+		*pmu_device = strdup("i915");
+
+	engines = discover_engines(*pmu_device);
+	if (!engines) {
+		fprintf(stderr,
+			"Failed to detect engines! (%s)\n(Kernel 4.16 or newer is required for i915 PMU support.)\n",
+			strerror(errno));
+		return NULL;
+	}
+
+	if (pmu_init(engines)) {
+		fprintf(stderr,
+			"Failed to initialize PMU! (%s)\n", strerror(errno));
+		if (errno == EACCES && geteuid())
+			fprintf(stderr,
+"\n"
+"When running as a normal user CAP_PERFMON is required to access performance\n"
+"monitoring. See \"man 7 capabilities\", \"man 8 setcap\", or contact your\n"
+"distribution vendor for assistance.\n"
+"\n"
+"More information can be found at 'Perf events and tool security' document:\n"
+"https://www.kernel.org/doc/html/latest/admin-guide/perf-security.html\n");
+		free_engines(engines);
+		return NULL;
+	}
+
+	return engines;
+}
+
+static int
+print_device(const struct igt_device_card *card, const char *codename,
+	     struct engines *engines, struct clients *disp_clients,
+	     int lines, int con_w, int con_h, unsigned int period_us,
+	     bool *consumed)
+{
+	double t = (double)(engines->ts.cur - engines->ts.prev) / 1e9;
+	struct client *c;
+	int j;
+
+	lines = print_header(card, codename, engines, t, lines, con_w, con_h,
+			     consumed);
+
+	if (in_help)
+		return lines;
+
+	lines = print_imc(engines, t, lines, con_w, con_h);
+
+	lines = print_engines(engines, t, lines, con_w, con_h);
+
+	if (disp_clients) {
+		int class_w;
+
+		lines = print_clients_header(disp_clients, lines,
+					     con_w, con_h, &class_w);
+
+		for_each_client(disp_clients, c, j) {
+			assert(c->status != PROBE);
+			if (c->status != ALIVE)
+				break; /* Active clients are first in the array. */
+
+			if (lines >= con_h)
+				break;
+
+			lines = print_client(c, engines, t, lines, con_w,
+					     con_h, period_us, &class_w);
+		}
+
+		lines = print_clients_footer(disp_clients, t, lines, con_w,
+					     con_h);
+	}
+
+	return lines;
+}
+
+#define MAX_DEVICES 64
+
+/*
+ * Opens every card matching the filter, or all Intel cards without one.
+ * Cards which can not be monitored are skipped.
+ */
+static unsigned int find_devices(const char *filter, struct device *devs)
+{
+	unsigned int i, num = 0;
+
+	for (i = 0; i < MAX_DEVICES; i++) {
+		struct device *dev = &devs[num];
+		char buf[256];
+
+		snprintf(buf, sizeof(buf), "%s,card=%u",
+			 filter ?: "pci:vendor=intel", i);
+		if (!igt_device_card_match_pci(buf, &dev->card))
+			break;
+
+		dev->engines = open_engines(&dev->card, &dev->pmu_device);
+		if (!dev->engines) {
+			fprintf(stderr, "Skipping %s.\n", dev->card.card);
+			free(dev->pmu_device);
+			memset(dev, 0, sizeof(*dev));
+			continue;
+		}
+
+		init_engine_classes(dev->engines);
+
+		if (has_drm_fdinfo(&dev->card)) {
+			dev->clients = init_clients(dev->card.pci_slot_name[0] ?
+						    dev->card.pci_slot_name :
+						    IGPU_PCI);
+			if (dev->clients) {
+				dev->clients->num_classes =
+					dev->engines->num_classes;
+				dev->clients->class = dev->engines->class;
+			}
+		}
+
+		dev->codename = igt_device_get_pretty_name(&dev->card, false);
+
+		num++;
+	}
+
+	return num;
+}
+
+/*
+ * Monitors all the devices from one process. Clients of all the devices are
+ * found by a single scan of /proc, chained behind the first device with
+ * clients, while each device keeps its own PMU group read once per period.
+ */
+static int monitor_devices(const char *filter, unsigned int period_us)
+{
+	struct device *devs;
+	struct clients *clients = NULL, **link = &clients;
+	struct engines *total;
+	int con_w = -1, con_h = -1;
+	unsigned int i, num;
+
+	devs = calloc(MAX_DEVICES, sizeof(*devs));
+	assert(devs);
+
+	num = find_devices(filter, devs);
+	if (!num) {
+		fprintf(stderr, "No devices to monitor found!\n");
+		free(devs);
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < num; i++) {
+		if (devs[i].clients) {
+			*link = devs[i].clients;
+			link = &devs[i].clients->next;
+		}
+	}
+
+	total = init_total_engines(devs, num);
+
+	for (i = 0; i < num; i++)
+		pmu_sample(devs[i].engines);
+	__scan_clients(clients, true, false);
+
+	while (!stop_top) {
+		struct engines *first = devs[0].engines;
+		bool consumed = false, ignored;
+		int lines = 0;
+		double t;
+
+		update_console_size(&con_w, &con_h);
+
+		for (i = 0; i < num; i++)
+			pmu_sample(devs[i].engines);
+		__scan_clients(clients, true, false);
+
+		update_total_engines(total, devs, num);
+		t = (double)(first->ts.cur - first->ts.prev) / 1e9;
+
+		if (stop_top)
+			break;
+
+		while (!consumed) {
+			lines = 0;
+
+			pops->open_struct(NULL);
+
+			for (i = 0; i < num; i++) {
+				struct device *dev = &devs[i];
+				struct clients *disp_clients = NULL;
+
+				if (dev->clients)
+					disp_clients = display_clients(dev->clients);
+
+				if (output_mode == JSON)
+					pops->open_struct(dev->card.pci_slot_name[0] ?
+							  dev->card.pci_slot_name :
+							  dev->card.card);
+
+				lines = print_device(&dev->card, dev->codename,
+						     dev->engines, disp_clients,
+						     lines, con_w, con_h,
+						     period_us,
+						     i ? &ignored : &consumed);
+
+				if (output_mode == JSON)
+					pops->close_struct();
+
+				if (disp_clients && disp_clients != dev->clients)
+					free_clients(disp_clients);
+
+				if (in_help)
+					break;
+			}
+
+			if (in_help) {
+				show_help_screen();
+				break;
+			}
+
+			if (output_mode == INTERACTIVE && lines++ < con_h)
+				printf("intel-gpu-top: %u devices\n", num);
+
+			pops->open_struct("total");
+			lines = __print_engines(total, t, lines, con_w, con_h);
+			pops->close_struct();
+
+			pops->close_struct();
+		}
+
+		if (stop_top)
+			break;
+
+		if (output_mode == INTERACTIVE)
+			process_stdin(period_us);
+		else
+			usleep(period_us);
+	}
+
+	free_total_engines(total);
+
+	for (i = 0; i < num; i++) {
+		struct device *dev = &devs[i];
+
+		if (dev->clients)
+			free_clients(dev->clients);
+		free(dev->codename);
+		free_engines(dev->engines);
+		free(dev->pmu_device);
+	}
+	free(devs);
+
+	return EXIT_SUCCESS;
+}
+
 int main(int argc, char **argv)
 {
 	unsigned int period_us = DEFAULT_PERIOD_MS * 1000;
 	struct clients *clients = NULL;
 	int con_w = -1, con_h = -1;
 	char *output_path = NULL;
-	struct engines *engines;
+	char *record_path = NULL, *replay_path = NULL, *daemon_path = NULL;
+	unsigned int discover_every = 1, samples = 0;
+	struct engines *engines = NULL;
 	int ret = 0, ch;
-	bool list_device = false;
-	char *pmu_device, *opt_device = NULL;
-	struct igt_device_card card;
+	bool list_device = false, all_devices = false;
+	char *pmu_device = NULL, *opt_device = NULL;
+	struct igt_device_card card = { };
 	char *codename = NULL;
 
 	/* Parse options */
-	while ((ch = getopt(argc, argv, "o:s:d:JLlh")) != -1) {
+	while ((ch = getopt(argc, argv, "o:s:d:R:p:x:D:AJLlh")) != -1) {
 		switch (ch) {
 		case 'o':
 			output_path = optarg;
 			break;
 		case 's':
+			if (atoi(optarg) <= 0) {
+				fprintf(stderr, "Invalid sample period %s!\n",
+					optarg);
+				exit(1);
+			}
 			period_us = atoi(optarg) * 1000;
 			break;
 		case 'd':
 			opt_device = strdup(optarg);
 			break;
+		case 'R':
+			record_path = optarg;
+			break;
+		case 'p':
+			replay_path = optarg;
+			break;
+		case 'x':
+			session.speed = atof(optarg);
+			break;
+		case 'D':
+			daemon_path = optarg;
+			break;
+		case 'A':
+			all_devices = true;
+			break;
 		case 'J':
 			output_mode = JSON;
 			break;
@@ -2486,7 +3760,25 @@ int main(int argc, char **argv)
 		}
 	}
 
-	if (output_mode == INTERACTIVE && (output_path || isatty(1) != 1))
+	if (!!record_path + !!replay_path + !!daemon_path > 1) {
+		fprintf(stderr, "Only one of -R, -p and -D can be used!\n");
+		exit(1);
+	}
+
+	if (all_devices && (record_path || replay_path || daemon_path)) {
+		fprintf(stderr, "-A can not be combined with -R, -p or -D!\n");
+		exit(1);
+	}
+
+	if (all_devices && opt_device &&
+	    (strncmp(opt_device, "pci:", 4) || strstr(opt_device, "card="))) {
+		fprintf(stderr, "-A needs a pci: device filter without card=!\n");
+		exit(1);
+	}
+
+	/* Recording and daemon mode display nothing, keep the terminal alone. */
+	if (output_mode == INTERACTIVE &&
+	    (output_path || record_path || daemon_path || isatty(1) != 1))
 		output_mode = STDOUT;
 
 	if (output_path && strcmp(output_path, "-")) {
@@ -2521,6 +3813,25 @@ int main(int argc, char **argv)
 		break;
 	};
 
+	if (replay_path) {
+		engines = session_replay_open(replay_path);
+		if (!engines) {
+			fprintf(stderr, "Failed to open recording '%s'! (%s)\n",
+				replay_path, strerror(errno));
+			ret = EXIT_FAILURE;
+			goto exit;
+		}
+
+		snprintf(card.card, sizeof(card.card), "%s",
+			 session.header.card);
+		codename = strdup(session.header.codename);
+
+		if (session.header.num_classes)
+			clients = init_clients(session.header.pci_slot);
+
+		goto start;
+	}
+
 	igt_devices_scan(false);
 
 	if (list_device) {
@@ -2533,6 +3844,12 @@ int main(int argc, char **argv)
 		goto exit;
 	}
 
+	if (all_devices) {
+		ret = monitor_devices(opt_device, period_us);
+		free(opt_device);
+		goto exit;
+	}
+
 	if (opt_device != NULL) {
 		ret = igt_device_card_match_pci(opt_device, &card);
 		if (!ret)
@@ -2551,121 +3868,134 @@ int main(int argc, char **argv)
 		goto exit;
 	}
 
-	if (card.pci_slot_name[0] && !is_igpu_pci(card.pci_slot_name))
-		pmu_device = tr_pmu_name(&card);
-	else
-		pmu_device = strdup("i915");
-
-	engines = discover_engines(pmu_device);
+	engines = open_engines(&card, &pmu_device);
 	if (!engines) {
-		fprintf(stderr,
-			"Failed to detect engines! (%s)\n(Kernel 4.16 or newer is required for i915 PMU support.)\n",
-			strerror(errno));
-		ret = EXIT_FAILURE;
-		goto err;
-	}
-
-	ret = pmu_init(engines);
-	if (ret) {
-		fprintf(stderr,
-			"Failed to initialize PMU! (%s)\n", strerror(errno));
-		if (errno == EACCES && geteuid())
-			fprintf(stderr,
-"\n"
-"When running as a normal user CAP_PERFMON is required to access performance\n"
-"monitoring. See \"man 7 capabilities\", \"man 8 setcap\", or contact your\n"
-"distribution vendor for assistance.\n"
-"\n"
-"More information can be found at 'Perf events and tool security' document:\n"
-"https://www.kernel.org/doc/html/latest/admin-guide/perf-security.html\n");
 		ret = EXIT_FAILURE;
 		goto err;
 	}
 
-	ret = EXIT_SUCCESS;
-
 	if (has_drm_fdinfo(&card))
 		clients = init_clients(card.pci_slot_name[0] ?
 				       card.pci_slot_name : IGPU_PCI);
+	codename = igt_device_get_pretty_name(&card, false);
+
+start:
+	ret = EXIT_SUCCESS;
+
 	init_engine_classes(engines);
 	if (clients) {
 		clients->num_classes = engines->num_classes;
 		clients->class = engines->class;
 	}
 
-	pmu_sample(engines);
-	scan_clients(clients, false);
-	codename = igt_device_get_pretty_name(&card, false);
+	if (replay_path) {
+		if (clients &&
+		    clients->num_classes != session.header.num_classes) {
+			fprintf(stderr, "Corrupt recording '%s'!\n",
+				replay_path);
+			ret = EXIT_FAILURE;
+			goto err;
+		}
+
+		if (!session_replay_sample(engines)) {
+			fprintf(stderr, "Empty recording '%s'!\n", replay_path);
+			ret = EXIT_FAILURE;
+			goto err;
+		}
+		replay_clients(clients, false);
+	} else {
+		if (record_path &&
+		    session_record_open(record_path, &card, codename, engines,
+					clients ? clients->num_classes : 0,
+					clients ? clients->pci_slot : "")) {
+			fprintf(stderr, "Failed to create recording '%s'! (%s)\n",
+				record_path, strerror(errno));
+			ret = EXIT_FAILURE;
+			goto err;
+		}
+
+		if (daemon_path &&
+		    daemon_open(daemon_path, &card, codename, engines,
+				clients ? clients->num_classes : 0,
+				clients ? clients->pci_slot : "")) {
+			fprintf(stderr, "Failed to create '%s'! (%s)\n",
+				daemon_path, strerror(errno));
+			ret = EXIT_FAILURE;
+			goto err;
+		}
+
+		pmu_sample(engines);
+		scan_clients(clients, false);
+		if (record_path)
+			session_record_sample(engines);
+		else if (daemon_path)
+			daemon_publish(engines);
+
+		/* Known clients are refreshed every period, new ones found less often. */
+		if (daemon_path && period_us < DAEMON_DISCOVERY_US)
+			discover_every = DAEMON_DISCOVERY_US / period_us;
+	}
 
 	while (!stop_top) {
 		struct clients *disp_clients;
+		unsigned int sleep_us;
 		bool consumed = false;
-		int j, lines = 0;
-		struct winsize ws;
-		struct client *c;
+		int lines = 0;
 		double t;
 
-		/* Update terminal size. */
-		if (output_mode != INTERACTIVE) {
-			con_w = con_h = INT_MAX;
-		} else if (ioctl(0, TIOCGWINSZ, &ws) != -1) {
-			con_w = ws.ws_col;
-			con_h = ws.ws_row;
-			if (con_w == 0 && con_h == 0) {
-				/* Serial console. */
-				con_w = 80;
-				con_h = 24;
-			}
+		update_console_size(&con_w, &con_h);
+
+		if (replay_path) {
+			if (!session_replay_sample(engines))
+				break;
+			disp_clients = replay_clients(clients, true);
+		} else if (daemon_path) {
+			pmu_sample(engines);
+			disp_clients = __scan_clients(clients,
+						      !(++samples % discover_every),
+						      false);
+		} else {
+			pmu_sample(engines);
+			disp_clients = scan_clients(clients, !record_path);
 		}
 
-		pmu_sample(engines);
 		t = (double)(engines->ts.cur - engines->ts.prev) / 1e9;
 
-		disp_clients = scan_clients(clients, true);
-
 		if (stop_top)
 			break;
 
-		while (!consumed) {
-			pops->open_struct(NULL);
-
-			lines = print_header(&card, codename, engines,
-					     t, lines, con_w, con_h,
-					     &consumed);
-
-			if (in_help) {
-				show_help_screen();
+		if (record_path) {
+			if (session_record_sample(engines)) {
+				fprintf(stderr, "Failed to write recording! (%s)\n",
+					strerror(errno));
+				ret = EXIT_FAILURE;
 				break;
 			}
 
-			lines = print_imc(engines, t, lines, con_w, con_h);
-
-			lines = print_engines(engines, t, lines, con_w, con_h);
-
-			if (disp_clients) {
-				int class_w;
+			usleep(period_us);
+			continue;
+		}
 
-				lines = print_clients_header(disp_clients, lines,
-							     con_w, con_h,
-							     &class_w);
+		if (daemon_path) {
+			daemon_publish(engines);
+			usleep(period_us);
+			continue;
+		}
 
-				for_each_client(disp_clients, c, j) {
-					assert(c->status != PROBE);
-					if (c->status != ALIVE)
-						break; /* Active clients are first in the array. */
+		/* Clients busyness is relative to the recorded period. */
+		if (replay_path)
+			period_us = t * 1e6;
 
-					if (lines >= con_h)
-						break;
+		while (!consumed) {
+			pops->open_struct(NULL);
 
-					lines = print_client(c, engines, t,
-							     lines, con_w,
-							     con_h, period_us,
-							     &class_w);
-				}
+			lines = print_device(&card, codename, engines,
+					     disp_clients, lines, con_w, con_h,
+					     period_us, &consumed);
 
-				lines = print_clients_footer(disp_clients, t,
-							     lines, con_w,
-							     con_h);
+			if (in_help) {
+				show_help_screen();
+				break;
 			}
 
 			pops->close_struct();
@@ -2677,20 +4007,33 @@ int main(int argc, char **argv)
 		if (stop_top)
 			break;
 
-		if (output_mode == INTERACTIVE)
-			process_stdin(period_us);
+		if (replay_path)
+			sleep_us = session.speed > 0 ? period_us / session.speed : 0;
 		else
-			usleep(period_us);
+			sleep_us = period_us;
+
+		if (output_mode == INTERACTIVE)
+			process_stdin(sleep_us);
+		else if (sleep_us)
+			usleep(sleep_us);
 	}
 
 	if (clients)
 		free_clients(clients);
 
-	free(codename);
 err:
-	free_engines(engines);
+	free(codename);
+	if (engines)
+		free_engines(engines);
 	free(pmu_device);
+	if (session.file)
+		fclose(session.file);
+	if (session.ring)
+		munmap(session.ring, session.ring_size);
+	free(session.counter);
+	free(session.buf);
 exit:
-	igt_devices_free();
+	if (!replay_path)
+		igt_devices_free();
 	return ret;
 }